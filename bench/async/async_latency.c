@@ -0,0 +1,286 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures how long an event loop is kept from running while it talks
+ * to mcsd through the daemon backend, first through the synchronous API
+ * and then through the asynchronous one.
+ *
+ * A ticker thread writes a timestamp into a pipe every millisecond and
+ * the event loop records how late it reads each one. Every get asks for
+ * a key the handle has not cached, so each one is a round trip to mcsd,
+ * and every commit makes mcsd write and fsync its keyfile. mcsd must
+ * already be listening; run-async-bench.sh starts a private one.
+ */
+
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "libmcs/mcs.h"
+#include "libmcs/mcs_config.h"
+
+#ifdef HAVE_MOWGLI_EVENTLOOP
+
+#include "libmcs/mcs_async.h"
+
+static int ticker_pipe[2];
+static volatile int ticker_stop;
+
+static double *stalls;
+static size_t nstalls, stalls_alloc;
+
+static unsigned int completed;
+static int in_flight;
+
+/* ***************************************************************** */
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+ticker(void *arg)
+{
+	struct timespec ms = { 0, 1000000 };
+
+	while (!ticker_stop)
+	{
+		double t = now();
+
+		if (write(ticker_pipe[1], &t, sizeof t) < 0)
+			break;
+
+		nanosleep(&ms, NULL);
+	}
+
+	return NULL;
+}
+
+static void
+ticker_read(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io,
+	    mowgli_eventloop_io_dir_t dir, void *userdata)
+{
+	double ticks[64], t = now();
+	ssize_t n;
+	int i;
+
+	while ((n = read(ticker_pipe[0], ticks, sizeof ticks)) > 0)
+	{
+		for (i = 0; i < n / (ssize_t) sizeof(double); i++)
+		{
+			if (nstalls == stalls_alloc)
+			{
+				stalls_alloc = stalls_alloc ? stalls_alloc * 2 : 1024;
+				stalls = realloc(stalls, stalls_alloc * sizeof(double));
+			}
+
+			stalls[nstalls++] = (t - ticks[i]) * 1e6;
+		}
+	}
+}
+
+static void
+request_done(mcs_handle_t *handle, mcs_response_t response,
+	     const char *value, void *privdata)
+{
+	completed++;
+	in_flight = 0;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(double p)
+{
+	size_t i = (size_t) (p * (nstalls - 1));
+
+	return nstalls ? stalls[i] : 0;
+}
+
+static void
+run(mowgli_eventloop_t *eventloop, mcs_handle_t *h, const char *op, int async,
+    unsigned int requests, int last)
+{
+	double started, elapsed;
+	int commit = !strcmp(op, "commit");
+	char key[32];
+
+	nstalls = 0;
+	completed = 0;
+	in_flight = 0;
+	started = now();
+
+	while (completed < requests)
+	{
+		if (in_flight)
+			;
+		else if (commit)
+		{
+			snprintf(key, sizeof key, "%u", completed);
+			mcs_set_string(h, "commit", "key", key);
+
+			if (!async)
+			{
+				mcs_commit(h);
+				completed++;
+			}
+			else
+			{
+				in_flight = 1;
+				mcs_commit_async(eventloop, h, request_done, NULL);
+			}
+		}
+		else
+		{
+			/* a key of its own for every get, so that none is cached */
+			snprintf(key, sizeof key, "%s-%u", async ? "async" : "sync", completed);
+
+			if (!async)
+			{
+				char *value;
+
+				if (mcs_get_string(h, "bench", key, &value))
+					free(value);
+
+				completed++;
+			}
+			else
+			{
+				in_flight = 1;
+				mcs_get_string_async(eventloop, h, "bench", key, request_done, NULL);
+			}
+		}
+
+		mowgli_eventloop_run_once(eventloop);
+	}
+
+	elapsed = now() - started;
+	qsort(stalls, nstalls, sizeof(double), cmp_double);
+
+	printf("    {\"op\": \"%s\", \"mode\": \"%s\", \"requests\": %u, \"seconds\": %.3f, \"ticks\": %lu, "
+	       "\"stall_p50_us\": %.1f, \"stall_p99_us\": %.1f, \"stall_max_us\": %.1f}%s\n",
+	       op, async ? "async" : "sync", requests, elapsed, (unsigned long) nstalls,
+	       percentile(0.5), percentile(0.99), percentile(1.0), last ? "" : ",");
+}
+
+int
+main(int argc, char *argv[])
+{
+	mowgli_eventloop_t *eventloop;
+	mowgli_eventloop_pollable_t *pollable;
+	mcs_handle_t *h;
+	pthread_t thread;
+	unsigned int requests = 200;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			requests = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n requests]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	mcs_init();
+
+	if ((h = mcs_new_with_backend("daemon", "bench")) == NULL)
+	{
+		fprintf(stderr, "%s: the daemon backend is not available\n", argv[0]);
+		return 1;
+	}
+
+	eventloop = mowgli_eventloop_create();
+
+	if (pipe(ticker_pipe) < 0)
+	{
+		perror("pipe");
+		return 1;
+	}
+
+	fcntl(ticker_pipe[0], F_SETFL, fcntl(ticker_pipe[0], F_GETFL) | O_NONBLOCK);
+	pollable = mowgli_pollable_create(eventloop, ticker_pipe[0], NULL);
+	mowgli_pollable_setselect(eventloop, pollable, MOWGLI_EVENTLOOP_IO_READ, ticker_read);
+
+	pthread_create(&thread, NULL, ticker, NULL);
+
+	printf("{\n  \"benchmark\": \"async-latency\",\n  \"backend\": \"daemon\",\n  \"results\": [\n");
+	run(eventloop, h, "get", 0, requests, 0);
+	run(eventloop, h, "get", 1, requests, 0);
+	run(eventloop, h, "commit", 0, requests, 0);
+	run(eventloop, h, "commit", 1, requests, 1);
+	printf("  ]\n}\n");
+
+	ticker_stop = 1;
+	pthread_join(thread, NULL);
+
+	mcs_async_detach(eventloop);
+	mowgli_pollable_destroy(eventloop, pollable);
+	mowgli_eventloop_destroy(eventloop);
+	close(ticker_pipe[0]);
+	close(ticker_pipe[1]);
+	free(stalls);
+
+	mowgli_object_unref(h);
+	mcs_fini();
+
+	return 0;
+}
+
+#else
+
+int
+main(int argc, char *argv[])
+{
+	fprintf(stderr, "%s: libmcs was built without the mowgli event loop\n", argv[0]);
+
+	return 0;
+}
+
+#endif
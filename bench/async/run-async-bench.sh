@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Runs mcs-bench-async against a private mcsd serving the keyfile
+# backend. Nothing outside a fresh temporary directory is touched. Run
+# from the top of the build tree, with the library on LD_LIBRARY_PATH;
+# "make bench-async" does both. Arguments are passed to mcs-bench-async.
+
+mcsd=src/tools/mcsd/mcsd
+bench=bench/async/mcs-bench-async
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/mcsd-bench.XXXXXX") || exit 1
+pid=
+
+cleanup() {
+	[ -n "$pid" ] && kill $pid 2>/dev/null && wait $pid 2>/dev/null
+	rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+XDG_CONFIG_HOME="$dir/config"
+MCSD_SOCKET="$dir/mcsd.sock"
+export XDG_CONFIG_HOME MCSD_SOCKET
+mkdir -p "$XDG_CONFIG_HOME"
+
+$mcsd -b default &
+pid=$!
+
+i=0
+while [ ! -S "$MCSD_SOCKET" ]; do
+	i=$((i + 1))
+	if [ $i -gt 100 ] || ! kill -0 $pid 2>/dev/null; then
+		echo "mcsd -b default did not start" >&2
+		exit 1
+	fi
+	sleep 0.05
+done
+
+$bench "$@"
@@ -0,0 +1,525 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the public API, run against any registered backend
+ * and a range of configuration sizes.
+ *
+ * Each size runs in its own child process, so that peak RSS is per size,
+ * inside a scratch XDG_CONFIG_HOME. The memory backend keeps nothing
+ * between handles, so its reads are measured on the populated handle
+ * itself; the cdb backend is read-only, so its database is compiled from
+ * a populated memory handle. Every operation is timed on its own;
+ * the results are printed as JSON with throughput, latency percentiles
+ * and, under glibc, the number of heap allocations per operation.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "libmcs/mcs.h"
+
+/*
+ * Allocation counting wraps the glibc allocator. Sanitizers replace the
+ * allocator themselves, so counting is off under them.
+ */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+# define COUNT_ALLOCS
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long alloc_count;
+
+void *
+malloc(size_t size)
+{
+	alloc_count++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return __libc_realloc(ptr, size);
+}
+#else
+static unsigned long alloc_count;
+#endif
+
+#define KEYS_PER_SECTION	64
+
+typedef struct {
+	const char *name;
+	double *ns;
+	size_t n;
+	size_t alloc;
+	unsigned long allocs;
+	double total;
+} bench_result_t;
+
+static const char *backend = "default";
+static unsigned long nops;
+static int first_result;
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+record(bench_result_t *r, double ns)
+{
+	if (r->n == r->alloc)
+	{
+		r->alloc = r->alloc ? r->alloc * 2 : 1024;
+		r->ns = realloc(r->ns, r->alloc * sizeof(double));
+	}
+
+	r->ns[r->n++] = ns;
+	r->total += ns;
+}
+
+/* times one operation, and counts what it allocates */
+#define TIMED(r, expr)							\
+	do {								\
+		unsigned long a0_ = alloc_count;			\
+		double t0_ = now_ns();					\
+		expr;							\
+		record((r), now_ns() - t0_);				\
+		(r)->allocs += alloc_count - a0_;			\
+	} while (0)
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(bench_result_t *r, double p)
+{
+	return r->ns[(size_t) (p * (r->n - 1))];
+}
+
+static void
+report(bench_result_t *r)
+{
+	if (r->n == 0)
+		return;
+
+	qsort(r->ns, r->n, sizeof(double), cmp_double);
+
+	printf("%s\n        \"%s\": {\"ops\": %lu, \"ops_per_sec\": %.0f, "
+	       "\"p50_ns\": %.0f, \"p90_ns\": %.0f, \"p99_ns\": %.0f, \"max_ns\": %.0f, ",
+	       first_result ? "" : ",", r->name, (unsigned long) r->n,
+	       r->n / (r->total / 1e9), percentile(r, 0.5), percentile(r, 0.9),
+	       percentile(r, 0.99), percentile(r, 1.0));
+
+#ifdef COUNT_ALLOCS
+	printf("\"allocs_per_op\": %.2f}", (double) r->allocs / r->n);
+#else
+	printf("\"allocs_per_op\": null}");
+#endif
+
+	first_result = 0;
+
+	free(r->ns);
+	memset(r, 0, sizeof *r);
+}
+
+/* xorshift, so that runs are repeatable */
+static uint32_t
+next_random(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
+}
+
+static void
+pick(uint32_t *state, unsigned long nkeys, char *section, char *key)
+{
+	unsigned long i = next_random(state) % nkeys;
+
+	sprintf(section, "section%lu", i / KEYS_PER_SECTION);
+	sprintf(key, "key%lu", i % KEYS_PER_SECTION);
+}
+
+static void
+free_queue(mowgli_queue_t *q)
+{
+	mowgli_queue_t *n;
+
+	for (n = q; n != NULL; n = n->next)
+		free(n->data);
+
+	if (q != NULL)
+		mowgli_queue_destroy(q);
+}
+
+static void
+run_size(unsigned long nkeys)
+{
+	bench_result_t r;
+	mcs_handle_t *h = NULL;
+	mowgli_queue_t *q;
+	struct rusage ru;
+	char domain[64], section[64], key[64], value[64], path[PATH_MAX];
+	int persistent = strcasecmp(backend, "memory") != 0;
+	int compiled = !strcasecmp(backend, "cdb");
+	unsigned long i, ops, reps, nsections;
+	uint32_t state = 2463534242U;
+	char *s;
+	int iv;
+	float fv;
+	double dv;
+
+	memset(&r, 0, sizeof r);
+	snprintf(domain, sizeof domain, "mcs-bench-%lu", nkeys);
+	nsections = (nkeys + KEYS_PER_SECTION - 1) / KEYS_PER_SECTION;
+	ops = nops ? nops : (nkeys > 100000 ? nkeys : 100000);
+	reps = nkeys >= 100000 ? 3 : 1000000 / nkeys > 50 ? 50 : 1000000 / nkeys;
+
+	printf("    {\"keys\": %lu, \"results\": {", nkeys);
+	first_result = 1;
+
+	/* populate, then write it all out */
+	h = mcs_new_with_backend(compiled ? "memory" : backend, domain);
+
+	r.name = "populate";
+	for (i = 0; i < nkeys; i++)
+	{
+		sprintf(section, "section%lu", i / KEYS_PER_SECTION);
+		sprintf(key, "key%lu", i % KEYS_PER_SECTION);
+		sprintf(value, "%lu", i);
+		TIMED(&r, mcs_set_string(h, section, key, value));
+	}
+	report(&r);
+
+	if (compiled)
+	{
+		mcs_domain_path(path, sizeof path, domain, NULL);
+		mcs_create_directory(path, 0755);
+		mcs_domain_path(path, sizeof path, domain, "config.cdb");
+
+		r.name = "compile";
+		TIMED(&r, mcs_cdb_compile(h, path));
+		report(&r);
+	}
+
+	if (persistent)
+	{
+		r.name = "destroy_dirty";
+		TIMED(&r, mowgli_object_unref(h));
+		report(&r);
+
+		/* open and parse */
+		r.name = "open";
+		for (i = 0; i < reps; i++)
+		{
+			TIMED(&r, h = mcs_new_with_backend(backend, domain));
+
+			if (i + 1 < reps)
+				mowgli_object_unref(h);
+		}
+		report(&r);
+	}
+
+	r.name = "get_string";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, if (mcs_get_string(h, section, key, &s)) free(s));
+	}
+	report(&r);
+
+	r.name = "get_int";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, mcs_get_int(h, section, key, &iv));
+	}
+	report(&r);
+
+	r.name = "get_bool";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, mcs_get_bool(h, section, key, &iv));
+	}
+	report(&r);
+
+	r.name = "get_float";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, mcs_get_float(h, section, key, &fv));
+	}
+	report(&r);
+
+	r.name = "get_double";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, mcs_get_double(h, section, key, &dv));
+	}
+	report(&r);
+
+	r.name = "get_missing";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		key[0] = 'K';
+		TIMED(&r, mcs_get_int(h, section, key, &iv));
+	}
+	report(&r);
+
+	r.name = "get_keys";
+	for (i = 0; i < nsections; i++)
+	{
+		sprintf(section, "section%lu", i);
+		TIMED(&r, q = mcs_get_keys(h, section));
+		free_queue(q);
+	}
+	report(&r);
+
+	r.name = "get_sections";
+	for (i = 0; i < reps; i++)
+	{
+		TIMED(&r, q = mcs_get_sections(h));
+		free_queue(q);
+	}
+	report(&r);
+
+	if (persistent)
+	{
+		r.name = "destroy";
+		TIMED(&r, mowgli_object_unref(h));
+		report(&r);
+
+		h = mcs_new_with_backend(backend, domain);
+	}
+
+	r.name = "set_string";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, mcs_set_string(h, section, key, "value"));
+	}
+	report(&r);
+
+	r.name = "set_int";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, mcs_set_int(h, section, key, (int) i));
+	}
+	report(&r);
+
+	r.name = "set_bool";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, mcs_set_bool(h, section, key, i & 1));
+	}
+	report(&r);
+
+	r.name = "set_float";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, mcs_set_float(h, section, key, i / 3.0f));
+	}
+	report(&r);
+
+	r.name = "set_double";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, mcs_set_double(h, section, key, i / 3.0));
+	}
+	report(&r);
+
+	r.name = "unset";
+	for (i = 0; i < ops; i++)
+	{
+		pick(&state, nkeys, section, key);
+		TIMED(&r, mcs_unset_key(h, section, key));
+	}
+	report(&r);
+
+	r.name = "commit";
+	TIMED(&r, mcs_commit(h));
+	report(&r);
+
+	mowgli_object_unref(h);
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("\n      },\n      \"peak_rss_kb\": %ld}", ru.ru_maxrss);
+}
+
+static int
+backend_exists(const char *name)
+{
+	mowgli_queue_t *l, *n;
+	int found = 0;
+
+	l = mcs_backend_get_list();
+
+	for (n = l; n != NULL; n = n->next)
+	{
+		if (!strcasecmp(((mcs_backend_t *) n->data)->name, name))
+			found = 1;
+	}
+
+	if (l != NULL)
+		mowgli_queue_destroy(l);
+
+	return found;
+}
+
+static int
+remove_cb(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const unsigned long default_sizes[] = { 10, 1000, 100000 };
+	unsigned long sizes[32];
+	char tmpdir[] = "/tmp/mcs-bench.XXXXXX";
+	size_t nsizes = 0, i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:n:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			backend = optarg;
+			break;
+		case 'n':
+		{
+			char *tok;
+
+			for (tok = strtok(optarg, ","); tok != NULL && nsizes < 32; tok = strtok(NULL, ","))
+			{
+				if (strtoul(tok, NULL, 10) > 0)
+					sizes[nsizes++] = strtoul(tok, NULL, 10);
+			}
+			break;
+		}
+		case 'o':
+			nops = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b backend] [-n size,size,...] [-o ops]\n"
+					"sizes are numbers of keys, 10 to 1000000 is sensible.\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (nsizes == 0)
+	{
+		memcpy(sizes, default_sizes, sizeof default_sizes);
+		nsizes = sizeof default_sizes / sizeof default_sizes[0];
+	}
+
+	if (mkdtemp(tmpdir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	setenv("XDG_CONFIG_HOME", tmpdir, 1);
+
+	mcs_init();
+
+	if (!backend_exists(backend))
+	{
+		fprintf(stderr, "%s: unknown backend `%s'\n", argv[0], backend);
+		mcs_fini();
+		rmdir(tmpdir);
+		return 1;
+	}
+
+	printf("{\n  \"benchmark\": \"mcs-bench\",\n  \"backend\": \"%s\",\n  \"sizes\": [\n", backend);
+	fflush(stdout);
+
+	for (i = 0; i < nsizes; i++)
+	{
+		pid_t pid;
+
+		if ((pid = fork()) == 0)
+		{
+			run_size(sizes[i]);
+			printf("%s\n", i + 1 < nsizes ? "," : "");
+			fflush(stdout);
+			_exit(0);
+		}
+
+		waitpid(pid, NULL, 0);
+	}
+
+	printf("  ]\n}\n");
+
+	mcs_fini();
+	nftw(tmpdir, remove_cb, 16, FTW_DEPTH | FTW_PHYS);
+
+	return 0;
+}
@@ -0,0 +1,797 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The cache backend wraps another backend, selected with
+ * MCS_CACHE_BACKEND, and keeps a bounded cache of the values read
+ * through it, including keys which turned out not to exist.
+ *
+ * Entries remember the type they were read or written as; a get of
+ * another type goes to the inner backend, since only it knows how its
+ * values convert. Eviction uses the CLOCK algorithm over a fixed ring of
+ * MCS_CACHE_SIZE entries. With MCS_CACHE_TTL set, clean entries older
+ * than that many seconds are refetched. With MCS_CACHE_MODE=writeback,
+ * sets only mark the entry dirty and reach the inner backend when the
+ * entry is evicted, when the handle is committed or destroyed, or before
+ * keys and sections are listed.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "libmcs/mcs.h"
+
+typedef enum {
+	CACHE_NONE,	/* the key does not exist */
+	CACHE_STRING,
+	CACHE_INT,
+	CACHE_BOOL,
+	CACHE_FLOAT,
+	CACHE_DOUBLE
+} cache_type_t;
+
+typedef struct {
+	char *ckey;
+	char *section;
+	char *key;
+	cache_type_t type;
+	union {
+		char *s;
+		int i;
+		float f;
+		double d;
+	} u;
+	uint64_t expires;	/* 0 if the entry never expires */
+	size_t slot;
+	unsigned int referenced : 1;
+	unsigned int dirty : 1;
+} cache_entry_t;
+
+typedef struct {
+	mcs_handle_t *inner;
+	mowgli_patricia_t *index;
+	cache_entry_t **ring;
+	size_t size;
+	size_t count;
+	size_t hand;
+	uint64_t ttl;
+	int writeback;
+	mcs_cache_stats_t stats;
+} mcs_cache_handle_t;
+
+extern mcs_backend_t cache_backend;
+
+static void nocanon(char *str) {}
+
+static uint64_t
+cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Index keys are the section length, the section and the key, so that
+ * no choice of separator can make two pairs collide. The result is buf
+ * if it fits, otherwise it must be freed.
+ */
+static char *
+cache_key(char *buf, size_t len, const char *section, const char *key)
+{
+	size_t need = strlen(section) + strlen(key) + 24;
+
+	if (need > len)
+		buf = malloc(need);
+
+	snprintf(buf, need, "%lu:%s%s", (unsigned long) strlen(section), section, key);
+
+	return buf;
+}
+
+static void
+cache_value_clear(cache_entry_t *e)
+{
+	if (e->type == CACHE_STRING)
+		free(e->u.s);
+
+	e->type = CACHE_NONE;
+}
+
+/*
+ * Writes a dirty entry to the inner backend.
+ */
+static mcs_response_t
+cache_flush_entry(mcs_cache_handle_t *h, cache_entry_t *e)
+{
+	mcs_response_t ret = MCS_FAIL;
+
+	if (!e->dirty)
+		return MCS_OK;
+
+	switch (e->type)
+	{
+	case CACHE_NONE:
+		ret = mcs_unset_key(h->inner, e->section, e->key);
+		break;
+	case CACHE_STRING:
+		ret = mcs_set_string(h->inner, e->section, e->key, e->u.s);
+		break;
+	case CACHE_INT:
+		ret = mcs_set_int(h->inner, e->section, e->key, e->u.i);
+		break;
+	case CACHE_BOOL:
+		ret = mcs_set_bool(h->inner, e->section, e->key, e->u.i);
+		break;
+	case CACHE_FLOAT:
+		ret = mcs_set_float(h->inner, e->section, e->key, e->u.f);
+		break;
+	case CACHE_DOUBLE:
+		ret = mcs_set_double(h->inner, e->section, e->key, e->u.d);
+		break;
+	}
+
+	e->dirty = 0;
+
+	if (h->writeback)
+		h->stats.writebacks++;
+
+	if (ret != MCS_OK && h->writeback)
+		mowgli_log("cache: failed to write back %s/%s", e->section, e->key);
+
+	return ret;
+}
+
+static void
+cache_flush(mcs_cache_handle_t *h)
+{
+	size_t i;
+
+	for (i = 0; i < h->count; i++)
+		cache_flush_entry(h, h->ring[i]);
+}
+
+static void
+cache_entry_free(cache_entry_t *e)
+{
+	cache_value_clear(e);
+	free(e->ckey);
+	free(e->section);
+	free(e->key);
+	mowgli_free(e);
+}
+
+/*
+ * Drops an entry, filling its slot with the last one in the ring.
+ */
+static void
+cache_remove(mcs_cache_handle_t *h, cache_entry_t *e)
+{
+	cache_entry_t *last = h->ring[--h->count];
+
+	cache_flush_entry(h, e);
+
+	h->ring[e->slot] = last;
+	last->slot = e->slot;
+
+	if (h->hand >= h->count)
+		h->hand = 0;
+
+	mowgli_patricia_delete(h->index, e->ckey);
+	cache_entry_free(e);
+}
+
+/*
+ * Returns a slot for a new entry, evicting the first entry the clock
+ * hand finds which has not been referenced since it last passed.
+ */
+static size_t
+cache_slot(mcs_cache_handle_t *h)
+{
+	cache_entry_t *e;
+	size_t slot;
+
+	if (h->count < h->size)
+		return h->count++;
+
+	for (;;)
+	{
+		e = h->ring[h->hand];
+
+		if (!e->referenced)
+			break;
+
+		e->referenced = 0;
+		h->hand = (h->hand + 1) % h->size;
+	}
+
+	cache_flush_entry(h, e);
+	mowgli_patricia_delete(h->index, e->ckey);
+	cache_entry_free(e);
+	h->stats.evictions++;
+
+	slot = h->hand;
+	h->hand = (h->hand + 1) % h->size;
+
+	return slot;
+}
+
+/*
+ * Looks up an entry, dropping it if it has expired.
+ */
+static cache_entry_t *
+cache_lookup(mcs_cache_handle_t *h, const char *section, const char *key)
+{
+	cache_entry_t *e;
+	char buf[256], *ckey;
+
+	ckey = cache_key(buf, sizeof buf, section, key);
+	e = mowgli_patricia_retrieve(h->index, ckey);
+
+	if (ckey != buf)
+		free(ckey);
+
+	if (e != NULL && e->expires != 0 && !e->dirty && cache_now() >= e->expires)
+	{
+		cache_remove(h, e);
+		h->stats.expirations++;
+		return NULL;
+	}
+
+	return e;
+}
+
+/*
+ * Returns the entry for section/key, creating it if needed. Any previous
+ * value is cleared and the caller fills in the new one.
+ */
+static cache_entry_t *
+cache_store(mcs_cache_handle_t *h, const char *section, const char *key)
+{
+	cache_entry_t *e;
+	char buf[256], *ckey;
+
+	ckey = cache_key(buf, sizeof buf, section, key);
+
+	if ((e = mowgli_patricia_retrieve(h->index, ckey)) != NULL)
+		cache_value_clear(e);
+	else
+	{
+		e = mowgli_alloc(sizeof(cache_entry_t));
+		e->ckey = strdup(ckey);
+		e->section = strdup(section);
+		e->key = strdup(key);
+		e->slot = cache_slot(h);
+
+		h->ring[e->slot] = e;
+		mowgli_patricia_add(h->index, ckey, e);
+	}
+
+	if (ckey != buf)
+		free(ckey);
+
+	e->referenced = 1;
+	e->expires = h->ttl != 0 ? cache_now() + h->ttl : 0;
+
+	return e;
+}
+
+/*
+ * Checks the cache for a value of the given type. Returns 1 on a hit,
+ * with *ret set to the result to give the caller, and 0 if the inner
+ * backend has to be asked.
+ */
+static int
+cache_hit(mcs_cache_handle_t *h, const char *section, const char *key,
+	  cache_type_t type, cache_entry_t **entry, mcs_response_t *ret)
+{
+	cache_entry_t *e;
+
+	if ((e = cache_lookup(h, section, key)) == NULL)
+	{
+		h->stats.misses++;
+		return 0;
+	}
+
+	if (e->type == CACHE_NONE)
+	{
+		e->referenced = 1;
+		h->stats.negative_hits++;
+		*ret = MCS_FAIL;
+		return 1;
+	}
+
+	if (e->type != type)
+	{
+		/* the inner backend must see the value before converting it */
+		cache_flush_entry(h, e);
+		h->stats.misses++;
+		return 0;
+	}
+
+	e->referenced = 1;
+	h->stats.hits++;
+	*entry = e;
+	*ret = MCS_OK;
+
+	return 1;
+}
+
+/*
+ * Records the outcome of a fetch from the inner backend. Returns the
+ * entry to fill in, or NULL if the key was missing.
+ */
+static cache_entry_t *
+cache_fill(mcs_cache_handle_t *h, const char *section, const char *key,
+	   cache_type_t type, mcs_response_t ret, uint64_t started)
+{
+	cache_entry_t *e;
+
+	h->stats.miss_ns += cache_now() - started;
+
+	e = cache_store(h, section, key);
+	e->type = ret == MCS_OK ? type : CACHE_NONE;
+
+	return ret == MCS_OK ? e : NULL;
+}
+
+/*
+ * Records a set or unset as a dirty entry; cache_write_done() then
+ * passes it on unless the handle is in write-back mode.
+ */
+static cache_entry_t *
+cache_write(mcs_cache_handle_t *h, const char *section, const char *key,
+	    cache_type_t type)
+{
+	cache_entry_t *e = cache_store(h, section, key);
+
+	e->type = type;
+	e->dirty = 1;
+
+	/* dirty entries never expire */
+	e->expires = 0;
+
+	return e;
+}
+
+static mcs_response_t
+cache_write_done(mcs_cache_handle_t *h, cache_entry_t *e)
+{
+	if (h->writeback)
+		return MCS_OK;
+
+	/* a rejected write must not linger in the cache */
+	if (cache_flush_entry(h, e) != MCS_OK)
+	{
+		cache_remove(h, e);
+		return MCS_FAIL;
+	}
+
+	e->expires = h->ttl != 0 ? cache_now() + h->ttl : 0;
+
+	return MCS_OK;
+}
+
+/* ***************************************************************** */
+
+static mcs_handle_t *
+mcs_cache_new(char *domain)
+{
+	mcs_cache_handle_t *h = calloc(sizeof(mcs_cache_handle_t), 1);
+	mcs_handle_t *out = calloc(sizeof(mcs_handle_t), 1);
+	const char *magic;
+
+	out->base = &cache_backend;
+	out->mcs_priv_handle = h;
+
+	if ((magic = getenv("MCS_CACHE_BACKEND")) == NULL || *magic == '\0')
+		magic = mcs_backend_select();
+
+	if (!strcasecmp(magic, cache_backend.name))
+		magic = "default";
+
+	if ((h->inner = mcs_new_with_backend(magic, domain)) == NULL)
+	{
+		mowgli_log("cache: unknown backend `%s', using the default one", magic);
+		h->inner = mcs_new_with_backend("default", domain);
+	}
+
+	h->size = 4096;
+	if ((magic = getenv("MCS_CACHE_SIZE")) != NULL && atoi(magic) > 0)
+		h->size = atoi(magic);
+
+	if ((magic = getenv("MCS_CACHE_TTL")) != NULL && mcs_strtod_c(magic, NULL) > 0)
+		h->ttl = (uint64_t) (mcs_strtod_c(magic, NULL) * 1e9);
+
+	if ((magic = getenv("MCS_CACHE_MODE")) != NULL && !strcasecmp(magic, "writeback"))
+		h->writeback = 1;
+
+	h->ring = calloc(h->size, sizeof(cache_entry_t *));
+	h->index = mowgli_patricia_create(nocanon);
+
+	return out;
+}
+
+static mcs_response_t
+mcs_cache_commit(mcs_handle_t *self)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+
+	cache_flush(h);
+
+	return mcs_commit(h->inner);
+}
+
+static void
+mcs_cache_destroy(mcs_handle_t *self)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	size_t i;
+
+	cache_flush(h);
+
+	for (i = 0; i < h->count; i++)
+		cache_entry_free(h->ring[i]);
+
+	mowgli_patricia_destroy(h->index, NULL, NULL);
+	mowgli_object_unref(h->inner);
+
+	free(h->ring);
+	free(h);
+	free(self);
+}
+
+static mcs_response_t
+mcs_cache_get_string(mcs_handle_t *self, const char *section,
+		     const char *key, char **value)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	cache_entry_t *e;
+	mcs_response_t ret;
+	uint64_t started;
+
+	if (cache_hit(h, section, key, CACHE_STRING, &e, &ret))
+	{
+		if (ret == MCS_OK)
+			*value = strdup(e->u.s);
+
+		return ret;
+	}
+
+	started = cache_now();
+	ret = mcs_get_string(h->inner, section, key, value);
+
+	if ((e = cache_fill(h, section, key, CACHE_STRING, ret, started)) != NULL)
+		e->u.s = strdup(*value);
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_cache_get_int(mcs_handle_t *self, const char *section,
+		  const char *key, int *value)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	cache_entry_t *e;
+	mcs_response_t ret;
+	uint64_t started;
+
+	if (cache_hit(h, section, key, CACHE_INT, &e, &ret))
+	{
+		if (ret == MCS_OK)
+			*value = e->u.i;
+
+		return ret;
+	}
+
+	started = cache_now();
+	ret = mcs_get_int(h->inner, section, key, value);
+
+	if ((e = cache_fill(h, section, key, CACHE_INT, ret, started)) != NULL)
+		e->u.i = *value;
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_cache_get_bool(mcs_handle_t *self, const char *section,
+		   const char *key, int *value)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	cache_entry_t *e;
+	mcs_response_t ret;
+	uint64_t started;
+
+	if (cache_hit(h, section, key, CACHE_BOOL, &e, &ret))
+	{
+		if (ret == MCS_OK)
+			*value = e->u.i;
+
+		return ret;
+	}
+
+	started = cache_now();
+	ret = mcs_get_bool(h->inner, section, key, value);
+
+	if ((e = cache_fill(h, section, key, CACHE_BOOL, ret, started)) != NULL)
+		e->u.i = *value;
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_cache_get_float(mcs_handle_t *self, const char *section,
+		    const char *key, float *value)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	cache_entry_t *e;
+	mcs_response_t ret;
+	uint64_t started;
+
+	if (cache_hit(h, section, key, CACHE_FLOAT, &e, &ret))
+	{
+		if (ret == MCS_OK)
+			*value = e->u.f;
+
+		return ret;
+	}
+
+	started = cache_now();
+	ret = mcs_get_float(h->inner, section, key, value);
+
+	if ((e = cache_fill(h, section, key, CACHE_FLOAT, ret, started)) != NULL)
+		e->u.f = *value;
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_cache_get_double(mcs_handle_t *self, const char *section,
+		     const char *key, double *value)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	cache_entry_t *e;
+	mcs_response_t ret;
+	uint64_t started;
+
+	if (cache_hit(h, section, key, CACHE_DOUBLE, &e, &ret))
+	{
+		if (ret == MCS_OK)
+			*value = e->u.d;
+
+		return ret;
+	}
+
+	started = cache_now();
+	ret = mcs_get_double(h->inner, section, key, value);
+
+	if ((e = cache_fill(h, section, key, CACHE_DOUBLE, ret, started)) != NULL)
+		e->u.d = *value;
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_cache_set_string(mcs_handle_t *self, const char *section,
+		     const char *key, const char *value)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	cache_entry_t *e = cache_write(h, section, key, CACHE_STRING);
+
+	e->u.s = strdup(value);
+
+	return cache_write_done(h, e);
+}
+
+static mcs_response_t
+mcs_cache_set_int(mcs_handle_t *self, const char *section,
+		  const char *key, int value)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	cache_entry_t *e = cache_write(h, section, key, CACHE_INT);
+
+	e->u.i = value;
+
+	return cache_write_done(h, e);
+}
+
+static mcs_response_t
+mcs_cache_set_bool(mcs_handle_t *self, const char *section,
+		   const char *key, int value)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	cache_entry_t *e = cache_write(h, section, key, CACHE_BOOL);
+
+	e->u.i = value ? 1 : 0;
+
+	return cache_write_done(h, e);
+}
+
+static mcs_response_t
+mcs_cache_set_float(mcs_handle_t *self, const char *section,
+		    const char *key, float value)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	cache_entry_t *e = cache_write(h, section, key, CACHE_FLOAT);
+
+	e->u.f = value;
+
+	return cache_write_done(h, e);
+}
+
+static mcs_response_t
+mcs_cache_set_double(mcs_handle_t *self, const char *section,
+		     const char *key, double value)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+	cache_entry_t *e = cache_write(h, section, key, CACHE_DOUBLE);
+
+	e->u.d = value;
+
+	return cache_write_done(h, e);
+}
+
+static mcs_response_t
+mcs_cache_unset_key(mcs_handle_t *self, const char *section,
+		    const char *key)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+
+	return cache_write_done(h, cache_write(h, section, key, CACHE_NONE));
+}
+
+static mowgli_queue_t *
+mcs_cache_get_keys(mcs_handle_t *self, const char *section)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+
+	cache_flush(h);
+
+	return mcs_get_keys(h->inner, section);
+}
+
+static mowgli_queue_t *
+mcs_cache_get_sections(mcs_handle_t *self)
+{
+	mcs_cache_handle_t *h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+
+	cache_flush(h);
+
+	return mcs_get_sections(h->inner);
+}
+
+/* ***************************************************************** */
+
+/**
+ * \brief Drops cached values so that they are fetched again.
+ *
+ * This is the hook for whoever knows that the backend below a cache
+ * handle has changed behind its back. Pending write-back values are
+ * written out before they are dropped. Handles of other backends are
+ * left alone.
+ *
+ * \param handle A cache mcs.handle object.
+ * \param section The section to drop, or NULL for everything.
+ * \param key The key to drop, or NULL for the whole section.
+ */
+void
+mcs_cache_invalidate(mcs_handle_t *self, const char *section, const char *key)
+{
+	mcs_cache_handle_t *h;
+	cache_entry_t *e;
+	size_t i;
+
+	return_if_fail(self != NULL);
+
+	if (self->base != &cache_backend)
+		return;
+
+	h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+
+	if (section != NULL && key != NULL)
+	{
+		if ((e = cache_lookup(h, section, key)) != NULL)
+			cache_remove(h, e);
+
+		return;
+	}
+
+	/* removal moves the last entry into the freed slot */
+	for (i = 0; i < h->count; )
+	{
+		e = h->ring[i];
+
+		if (section == NULL || !strcmp(e->section, section))
+			cache_remove(h, e);
+		else
+			i++;
+	}
+}
+
+/**
+ * \brief Retrieves the hit and miss counters of a cache handle.
+ *
+ * time_saved_ns estimates the time the hits would have cost had they
+ * gone to the inner backend, from the average cost of a miss.
+ *
+ * \param handle A cache mcs.handle object.
+ * \param stats Where to store the counters.
+ * \return MCS_OK, or MCS_FAIL if the handle is not a cache handle.
+ */
+mcs_response_t
+mcs_cache_get_stats(mcs_handle_t *self, mcs_cache_stats_t *stats)
+{
+	mcs_cache_handle_t *h;
+
+	return_val_if_fail(self != NULL, MCS_FAIL);
+	return_val_if_fail(stats != NULL, MCS_FAIL);
+
+	if (self->base != &cache_backend)
+		return MCS_FAIL;
+
+	h = (mcs_cache_handle_t *) self->mcs_priv_handle;
+
+	*stats = h->stats;
+	stats->entries = h->count;
+	stats->time_saved_ns = h->stats.misses == 0 ? 0 :
+		(h->stats.miss_ns / h->stats.misses) * (h->stats.hits + h->stats.negative_hits);
+
+	return MCS_OK;
+}
+
+mcs_backend_t cache_backend = {
+	NULL,
+	"cache",
+	mcs_cache_new,
+	mcs_cache_destroy,
+
+	mcs_cache_get_string,
+	mcs_cache_get_int,
+	mcs_cache_get_bool,
+	mcs_cache_get_float,
+	mcs_cache_get_double,
+
+	mcs_cache_set_string,
+	mcs_cache_set_int,
+	mcs_cache_set_bool,
+	mcs_cache_set_float,
+	mcs_cache_set_double,
+
+	mcs_cache_unset_key,
+
+	mcs_cache_get_keys,
+	mcs_cache_get_sections,
+
+	mcs_cache_commit
+};
@@ -0,0 +1,1123 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The cdb backend serves a domain from an immutable, precompiled database
+ * (config.cdb in the domain directory) which is mapped into memory as-is.
+ * Opening a domain costs an open, an fstat, an mmap and a scan of the
+ * displacement table to validate it; nothing is parsed.
+ *
+ * File layout, all integers in host byte order, each table starting on a
+ * 64-byte boundary:
+ *
+ *   cdb_header_t
+ *   int32_t  displacements[nrecords]      hash-and-displace seeds
+ *   cdb_record_t records[nrecords]        in perfect hash slot order
+ *   uint32_t order[nrecords]              record indices sorted by name
+ *   cdb_section_t sections[nsections]     sorted by name
+ *   strings                               NUL-terminated names and values
+ *
+ * A lookup hashes section and key once, reads one displacement and one
+ * record, and compares the names. Typed values are resolved when the
+ * database is compiled, so typed gets are plain loads.
+ *
+ * The database is read-only; sets and unsets fail. It is (re)built from
+ * another backend with mcs_cdb_compile(), usually through mcs-compile.
+ * mcs_cdb_new_from_handle() builds the same image in memory instead, which
+ * is what mcs_freeze() serves frozen handles from.
+ */
+
+#include <stdint.h>
+#ifndef _WIN32
+# include <sys/mman.h>
+#endif
+#include <fcntl.h>
+
+#include "libmcs/mcs.h"
+
+#define CDB_MAGIC		"MCSCDB\0\1"
+#define CDB_BYTEORDER		0x01020304
+#define CDB_FILENAME		"config.cdb"
+#define CDB_LINE		64	/* tables start on cache line boundaries */
+
+typedef struct {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t nrecords;
+	uint32_t nsections;
+	uint32_t reserved;
+	uint64_t displacements_off;
+	uint64_t records_off;
+	uint64_t order_off;
+	uint64_t sections_off;
+	uint64_t strings_off;
+	uint64_t size;
+} cdb_header_t;
+
+typedef struct {
+	uint64_t hash;
+	uint32_t section;	/* offsets into the string table */
+	uint32_t key;
+	uint32_t value;
+	int32_t ival;
+	int32_t bval;
+	uint32_t reserved;
+	double dval;
+} cdb_record_t;
+
+typedef struct {
+	uint32_t name;
+	uint32_t first;		/* index into the order table */
+	uint32_t count;
+	uint32_t reserved;
+} cdb_section_t;
+
+typedef struct {
+	unsigned char *map;
+	size_t len;
+	int mapped;
+	unsigned char *alloc;	/* built in memory, map points into it */
+	int warned;
+
+	const cdb_header_t *hdr;
+	const int32_t *displacements;
+	const cdb_record_t *records;
+	const uint32_t *order;
+	const cdb_section_t *sections;
+	const char *strings;
+	size_t strings_len;
+} mcs_cdb_handle_t;
+
+extern mcs_backend_t cdb_backend;
+
+/* ***************************************************************** */
+
+static uint64_t
+cdb_hash(const char *section, const char *key)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *) section; *p != '\0'; p++)
+		h = (h ^ *p) * 0x100000001b3ULL;
+
+	h *= 0x100000001b3ULL;
+
+	for (p = (const unsigned char *) key; *p != '\0'; p++)
+		h = (h ^ *p) * 0x100000001b3ULL;
+
+	return h;
+}
+
+static uint32_t
+cdb_slot(uint64_t hash, int32_t disp, uint32_t n)
+{
+	uint64_t x;
+
+	if (disp < 0)
+		return (uint32_t) -(disp + 1);
+
+	x = hash ^ ((uint64_t) disp * 0x9e3779b97f4a7c15ULL);
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return (uint32_t) (x % n);
+}
+
+static const char *
+cdb_string(mcs_cdb_handle_t *h, uint32_t off)
+{
+	return off < h->strings_len ? h->strings + off : "";
+}
+
+static const cdb_record_t *
+cdb_lookup(mcs_handle_t *self, const char *section, const char *key)
+{
+	mcs_cdb_handle_t *h = (mcs_cdb_handle_t *) self->mcs_priv_handle;
+	const cdb_record_t *rec;
+	uint32_t n;
+	uint64_t hash;
+
+	if (h->hdr == NULL || (n = h->hdr->nrecords) == 0)
+		return NULL;
+
+	hash = cdb_hash(section, key);
+	rec = &h->records[cdb_slot(hash, h->displacements[hash % n], n)];
+
+	if (rec->hash != hash || strcmp(cdb_string(h, rec->key), key) ||
+	    strcmp(cdb_string(h, rec->section), section))
+		return NULL;
+
+	return rec;
+}
+
+static const cdb_section_t *
+cdb_find_section(mcs_cdb_handle_t *h, const char *section)
+{
+	uint32_t lo = 0, hi;
+
+	if (h->hdr == NULL)
+		return NULL;
+
+	hi = h->hdr->nsections;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		int ret = strcmp(section, cdb_string(h, h->sections[mid].name));
+
+		if (ret == 0)
+			return &h->sections[mid];
+		else if (ret < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+static int
+cdb_in_bounds(size_t len, uint64_t off, uint64_t count, size_t size)
+{
+	return off <= len && count <= (len - off) / size;
+}
+
+/*
+ * Validates the mapped file and sets up the table pointers. Besides the
+ * header, the displacements and the sections are checked, as lookups
+ * index the records and the order table with them unchecked, and every
+ * name and value must lie inside the NUL-terminated string table.
+ */
+static int
+cdb_attach(mcs_cdb_handle_t *h)
+{
+	const cdb_header_t *hdr = (const cdb_header_t *) h->map;
+	const int32_t *disp;
+	const cdb_record_t *rec;
+	const cdb_section_t *sec;
+	size_t strings_len;
+	uint32_t i;
+
+	if (h->len < sizeof(cdb_header_t) || memcmp(hdr->magic, CDB_MAGIC, 8) ||
+	    hdr->byteorder != CDB_BYTEORDER || hdr->size != h->len)
+		return 0;
+
+	if (!cdb_in_bounds(h->len, hdr->displacements_off, hdr->nrecords, sizeof(int32_t)) ||
+	    !cdb_in_bounds(h->len, hdr->records_off, hdr->nrecords, sizeof(cdb_record_t)) ||
+	    !cdb_in_bounds(h->len, hdr->order_off, hdr->nrecords, sizeof(uint32_t)) ||
+	    !cdb_in_bounds(h->len, hdr->sections_off, hdr->nsections, sizeof(cdb_section_t)) ||
+	    hdr->strings_off > h->len)
+		return 0;
+
+	strings_len = h->len - hdr->strings_off;
+	if (strings_len == 0 ? hdr->nrecords != 0 || hdr->nsections != 0 : h->map[h->len - 1] != '\0')
+		return 0;
+
+	disp = (const int32_t *) (h->map + hdr->displacements_off);
+	for (i = 0; i < hdr->nrecords; i++)
+	{
+		if (disp[i] < 0 && (uint32_t) -(disp[i] + 1) >= hdr->nrecords)
+			return 0;
+	}
+
+	rec = (const cdb_record_t *) (h->map + hdr->records_off);
+	for (i = 0; i < hdr->nrecords; i++)
+	{
+		if (rec[i].section >= strings_len || rec[i].key >= strings_len ||
+		    rec[i].value >= strings_len)
+			return 0;
+	}
+
+	sec = (const cdb_section_t *) (h->map + hdr->sections_off);
+	for (i = 0; i < hdr->nsections; i++)
+	{
+		if (sec[i].first > hdr->nrecords || sec[i].count > hdr->nrecords - sec[i].first ||
+		    sec[i].name >= strings_len)
+			return 0;
+	}
+
+	h->hdr = hdr;
+	h->displacements = (const int32_t *) (h->map + hdr->displacements_off);
+	h->records = (const cdb_record_t *) (h->map + hdr->records_off);
+	h->order = (const uint32_t *) (h->map + hdr->order_off);
+	h->sections = (const cdb_section_t *) (h->map + hdr->sections_off);
+	h->strings = (const char *) (h->map + hdr->strings_off);
+	h->strings_len = strings_len;
+
+	return 1;
+}
+
+static void
+cdb_map(mcs_cdb_handle_t *h, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		close(fd);
+		return;
+	}
+
+	h->len = (size_t) st.st_size;
+
+#ifndef _WIN32
+	h->map = mmap(NULL, h->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (h->map == MAP_FAILED)
+		h->map = NULL;
+	else
+		h->mapped = 1;
+#else
+	h->map = malloc(h->len);
+	if (h->map != NULL && read(fd, h->map, h->len) != (ssize_t) h->len)
+	{
+		free(h->map);
+		h->map = NULL;
+	}
+#endif
+
+	close(fd);
+
+	if (h->map != NULL && !cdb_attach(h))
+		mowgli_log("cdb: `%s' is not a valid mcs database, ignoring it", path);
+}
+
+/* ***************************************************************** */
+
+static mcs_handle_t *
+mcs_cdb_new(char *domain)
+{
+	char scratch[PATH_MAX];
+	mcs_cdb_handle_t *h = calloc(sizeof(mcs_cdb_handle_t), 1);
+	mcs_handle_t *out = calloc(sizeof(mcs_handle_t), 1);
+
+	out->base = &cdb_backend;
+	out->mcs_priv_handle = h;
+
+	/* mcs_cdb_new_from_handle() fills in the image itself */
+	if (domain == NULL)
+		return out;
+
+	mcs_domain_path(scratch, PATH_MAX, domain, CDB_FILENAME);
+	cdb_map(h, scratch);
+
+	return out;
+}
+
+static void
+mcs_cdb_destroy(mcs_handle_t *self)
+{
+	mcs_cdb_handle_t *h = (mcs_cdb_handle_t *) self->mcs_priv_handle;
+
+	if (h->alloc != NULL)
+		free(h->alloc);
+	else if (h->map != NULL)
+	{
+#ifndef _WIN32
+		if (h->mapped)
+			munmap(h->map, h->len);
+		else
+#endif
+			free(h->map);
+	}
+
+	free(h);
+	free(self);
+}
+
+static mcs_response_t
+mcs_cdb_get_string(mcs_handle_t *self, const char *section,
+		   const char *key, char **value)
+{
+	mcs_cdb_handle_t *h = (mcs_cdb_handle_t *) self->mcs_priv_handle;
+	const cdb_record_t *rec;
+
+	if ((rec = cdb_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = strdup(cdb_string(h, rec->value));
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_cdb_get_int(mcs_handle_t *self, const char *section,
+		const char *key, int *value)
+{
+	const cdb_record_t *rec;
+
+	if ((rec = cdb_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = rec->ival;
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_cdb_get_bool(mcs_handle_t *self, const char *section,
+		 const char *key, int *value)
+{
+	const cdb_record_t *rec;
+
+	if ((rec = cdb_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = rec->bval;
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_cdb_get_float(mcs_handle_t *self, const char *section,
+		  const char *key, float *value)
+{
+	const cdb_record_t *rec;
+
+	if ((rec = cdb_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = (float) rec->dval;
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_cdb_get_double(mcs_handle_t *self, const char *section,
+		   const char *key, double *value)
+{
+	const cdb_record_t *rec;
+
+	if ((rec = cdb_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = rec->dval;
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+cdb_read_only(mcs_handle_t *self)
+{
+	mcs_cdb_handle_t *h = (mcs_cdb_handle_t *) self->mcs_priv_handle;
+
+	if (!h->warned)
+	{
+		mowgli_log("cdb: databases are read-only, rebuild them with mcs-compile");
+		h->warned = 1;
+	}
+
+	return MCS_FAIL;
+}
+
+static mcs_response_t
+mcs_cdb_set_string(mcs_handle_t *self, const char *section,
+		   const char *key, const char *value)
+{
+	return cdb_read_only(self);
+}
+
+static mcs_response_t
+mcs_cdb_set_int(mcs_handle_t *self, const char *section,
+		const char *key, int value)
+{
+	return cdb_read_only(self);
+}
+
+static mcs_response_t
+mcs_cdb_set_bool(mcs_handle_t *self, const char *section,
+		 const char *key, int value)
+{
+	return cdb_read_only(self);
+}
+
+static mcs_response_t
+mcs_cdb_set_float(mcs_handle_t *self, const char *section,
+		  const char *key, float value)
+{
+	return cdb_read_only(self);
+}
+
+static mcs_response_t
+mcs_cdb_set_double(mcs_handle_t *self, const char *section,
+		   const char *key, double value)
+{
+	return cdb_read_only(self);
+}
+
+static mcs_response_t
+mcs_cdb_unset_key(mcs_handle_t *self, const char *section,
+		  const char *key)
+{
+	return cdb_read_only(self);
+}
+
+static mowgli_queue_t *
+mcs_cdb_get_keys(mcs_handle_t *self, const char *section)
+{
+	mcs_cdb_handle_t *h = (mcs_cdb_handle_t *) self->mcs_priv_handle;
+	const cdb_section_t *sec;
+	mowgli_queue_t *out = NULL;
+	uint32_t i;
+
+	if ((sec = cdb_find_section(h, section)) == NULL)
+		return NULL;
+
+	for (i = sec->count; i > 0; i--)
+	{
+		uint32_t idx = h->order[sec->first + i - 1];
+
+		if (idx < h->hdr->nrecords)
+			out = mowgli_queue_shift(out, strdup(cdb_string(h, h->records[idx].key)));
+	}
+
+	return out;
+}
+
+static mowgli_queue_t *
+mcs_cdb_get_sections(mcs_handle_t *self)
+{
+	mcs_cdb_handle_t *h = (mcs_cdb_handle_t *) self->mcs_priv_handle;
+	mowgli_queue_t *out = NULL;
+	uint32_t i;
+
+	if (h->hdr == NULL)
+		return NULL;
+
+	for (i = h->hdr->nsections; i > 0; i--)
+		out = mowgli_queue_shift(out, strdup(cdb_string(h, h->sections[i - 1].name)));
+
+	return out;
+}
+
+/* walks one section in name order; returns nonzero once func stops */
+static int
+cdb_iterate_section(mcs_cdb_handle_t *h, const cdb_section_t *sec,
+		    mcs_iterate_func_t func, void *privdata)
+{
+	const char *section = cdb_string(h, sec->name);
+	uint32_t i;
+
+	for (i = 0; i < sec->count; i++)
+	{
+		uint32_t idx = h->order[sec->first + i];
+		const cdb_record_t *rec;
+
+		if (idx >= h->hdr->nrecords)
+			continue;
+
+		rec = &h->records[idx];
+
+		if (func(section, cdb_string(h, rec->key), cdb_string(h, rec->value), privdata))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* the name table is already sorted, so nothing is copied or allocated */
+static mcs_response_t
+mcs_cdb_iterate(mcs_handle_t *self, const char *section,
+		mcs_iterate_func_t func, void *privdata)
+{
+	mcs_cdb_handle_t *h = (mcs_cdb_handle_t *) self->mcs_priv_handle;
+	const cdb_section_t *sec;
+	uint32_t i;
+
+	if (section != NULL)
+	{
+		if ((sec = cdb_find_section(h, section)) == NULL)
+			return MCS_FAIL;
+
+		cdb_iterate_section(h, sec, func, privdata);
+		return MCS_OK;
+	}
+
+	if (h->hdr == NULL)
+		return MCS_OK;
+
+	for (i = 0; i < h->hdr->nsections; i++)
+	{
+		if (cdb_iterate_section(h, &h->sections[i], func, privdata))
+			break;
+	}
+
+	return MCS_OK;
+}
+
+/* a mapped file is held by the page cache, only built images count */
+static size_t
+mcs_cdb_memory_usage(mcs_handle_t *self)
+{
+	mcs_cdb_handle_t *h = (mcs_cdb_handle_t *) self->mcs_priv_handle;
+
+	if (h->alloc == NULL)
+		return 0;
+
+	return sizeof(mcs_cdb_handle_t) + h->len + CDB_LINE;
+}
+
+/* ***************************************************************** */
+
+typedef struct {
+	char *section;
+	char *key;
+	uint64_t hash;
+	uint32_t section_off;
+	uint32_t key_off;
+	uint32_t value_off;
+	int32_t ival;
+	int32_t bval;
+	double dval;
+} cdb_build_entry_t;
+
+typedef struct {
+	cdb_build_entry_t *entries;
+	size_t nentries;
+	size_t entries_alloc;
+
+	char *strings;
+	size_t strings_len;
+	size_t strings_alloc;
+} cdb_builder_t;
+
+static uint32_t
+cdb_builder_string(cdb_builder_t *b, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	uint32_t off = (uint32_t) b->strings_len;
+
+	if (b->strings_len + len > b->strings_alloc)
+	{
+		while (b->strings_len + len > b->strings_alloc)
+			b->strings_alloc = b->strings_alloc ? b->strings_alloc * 2 : 4096;
+
+		b->strings = realloc(b->strings, b->strings_alloc);
+	}
+
+	memcpy(b->strings + b->strings_len, str, len);
+	b->strings_len += len;
+
+	return off;
+}
+
+static void
+cdb_builder_add(cdb_builder_t *b, mcs_handle_t *src, const char *section,
+		const char *key, uint32_t section_off)
+{
+	cdb_build_entry_t *e;
+	char *value;
+	int ival = 0, bval = 0;
+	double dval = 0.0;
+
+	if (!mcs_get_string(src, section, key, &value))
+		return;
+
+	mcs_get_int(src, section, key, &ival);
+	mcs_get_bool(src, section, key, &bval);
+	mcs_get_double(src, section, key, &dval);
+
+	if (b->nentries == b->entries_alloc)
+	{
+		b->entries_alloc = b->entries_alloc ? b->entries_alloc * 2 : 256;
+		b->entries = realloc(b->entries, b->entries_alloc * sizeof(cdb_build_entry_t));
+	}
+
+	e = &b->entries[b->nentries++];
+	e->section = strdup(section);
+	e->key = strdup(key);
+	e->hash = cdb_hash(section, key);
+	e->section_off = section_off;
+	e->key_off = cdb_builder_string(b, key);
+	e->value_off = cdb_builder_string(b, value);
+	e->ival = ival;
+	e->bval = bval;
+	e->dval = dval;
+
+	free(value);
+}
+
+static int
+cdb_entry_name_cmp(const void *a, const void *b)
+{
+	const cdb_build_entry_t *ea = a, *eb = b;
+	int ret;
+
+	if ((ret = strcmp(ea->section, eb->section)) != 0)
+		return ret;
+
+	return strcmp(ea->key, eb->key);
+}
+
+typedef struct {
+	uint32_t bucket;
+	uint32_t count;
+	uint32_t first;		/* index into the bucket-sorted entry list */
+} cdb_bucket_t;
+
+static int
+cdb_bucket_cmp(const void *a, const void *b)
+{
+	const cdb_bucket_t *ba = a, *bb = b;
+
+	if (ba->count != bb->count)
+		return ba->count > bb->count ? -1 : 1;
+
+	return ba->bucket < bb->bucket ? -1 : ba->bucket > bb->bucket;
+}
+
+/*
+ * Builds the displacement table and the slot of each entry with the
+ * hash-and-displace method: buckets are placed largest first, searching
+ * for a seed which maps all of their keys to free slots. Single-key
+ * buckets are stored directly as (-slot - 1).
+ */
+static int
+cdb_build_hash(cdb_builder_t *b, int32_t *disp, uint32_t *slots)
+{
+	uint32_t n = (uint32_t) b->nentries, i, j, k;
+	uint32_t *members = malloc(n * sizeof(uint32_t));
+	uint32_t *bucket_of = malloc(n * sizeof(uint32_t));
+	uint32_t *trial = malloc(n * sizeof(uint32_t));
+	unsigned char *taken = calloc(n, 1);
+	cdb_bucket_t *buckets = calloc(n, sizeof(cdb_bucket_t));
+	uint64_t *hashes = malloc(n * sizeof(uint64_t));
+	uint32_t free_slot = 0;
+	int ret = 1;
+
+	for (i = 0; i < n; i++)
+	{
+		hashes[i] = b->entries[i].hash;
+		members[i] = i;
+		buckets[i].bucket = i;
+	}
+
+	/* group the entries by bucket */
+	for (i = 0; i < n; i++)
+	{
+		bucket_of[i] = (uint32_t) (hashes[i] % n);
+		buckets[bucket_of[i]].count++;
+	}
+
+	for (i = 0, k = 0; i < n; i++)
+	{
+		buckets[i].first = k;
+		k += buckets[i].count;
+		buckets[i].count = 0;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		cdb_bucket_t *bk = &buckets[bucket_of[i]];
+		members[bk->first + bk->count++] = i;
+	}
+
+	/* identical hashes can never be separated by any seed */
+	for (i = 0; i < n && ret; i++)
+	{
+		for (j = 0; j < buckets[i].count; j++)
+		{
+			for (k = j + 1; k < buckets[i].count; k++)
+			{
+				if (hashes[members[buckets[i].first + j]] ==
+				    hashes[members[buckets[i].first + k]])
+				{
+					cdb_build_entry_t *e = &b->entries[members[buckets[i].first + j]];
+
+					mowgli_log("cdb: hash collision on %s/%s, cannot build database",
+						e->section, e->key);
+					ret = 0;
+				}
+			}
+		}
+	}
+
+	qsort(buckets, n, sizeof(cdb_bucket_t), cdb_bucket_cmp);
+
+	for (i = 0; i < n && ret && buckets[i].count > 1; i++)
+	{
+		cdb_bucket_t *bk = &buckets[i];
+		int32_t d;
+
+		for (d = 0; d < INT32_MAX; d++)
+		{
+			for (j = 0; j < bk->count; j++)
+			{
+				uint32_t s = cdb_slot(hashes[members[bk->first + j]], d, n);
+
+				if (taken[s])
+					break;
+
+				for (k = 0; k < j; k++)
+					if (trial[k] == s)
+						break;
+
+				if (k < j)
+					break;
+
+				trial[j] = s;
+			}
+
+			if (j == bk->count)
+				break;
+		}
+
+		disp[bk->bucket] = d;
+
+		for (j = 0; j < bk->count; j++)
+		{
+			taken[trial[j]] = 1;
+			slots[members[bk->first + j]] = trial[j];
+		}
+	}
+
+	for (; i < n && ret; i++)
+	{
+		cdb_bucket_t *bk = &buckets[i];
+
+		if (bk->count == 0)
+		{
+			disp[bk->bucket] = 0;
+			continue;
+		}
+
+		while (taken[free_slot])
+			free_slot++;
+
+		taken[free_slot] = 1;
+		disp[bk->bucket] = -(int32_t) free_slot - 1;
+		slots[members[bk->first]] = free_slot;
+	}
+
+	free(members);
+	free(bucket_of);
+	free(trial);
+	free(taken);
+	free(buckets);
+	free(hashes);
+
+	return ret;
+}
+
+static size_t
+cdb_align(size_t off)
+{
+	return (off + CDB_LINE - 1) & ~(size_t) (CDB_LINE - 1);
+}
+
+/*
+ * Builds a database image holding every value visible through src. The
+ * image is laid out exactly as the file is and starts on a cache line
+ * boundary within the returned allocation, which the caller frees.
+ */
+static unsigned char *
+cdb_build(mcs_handle_t *src, const char *what, unsigned char **image, size_t *len)
+{
+	cdb_builder_t b;
+	cdb_header_t hdr;
+	cdb_section_t *sections = NULL;
+	cdb_record_t *records;
+	int32_t *disp = NULL;
+	uint32_t *slots = NULL, *order;
+	uint32_t nsections = 0, i;
+	mowgli_queue_t *secl, *keyl, *n, *n2;
+	unsigned char *alloc = NULL, *p = NULL;
+
+	memset(&b, 0, sizeof b);
+
+	secl = mcs_get_sections(src);
+
+	for (n = secl; n != NULL; n = n->next)
+	{
+		uint32_t section_off = cdb_builder_string(&b, n->data);
+
+		keyl = mcs_get_keys(src, n->data);
+
+		for (n2 = keyl; n2 != NULL; n2 = n2->next)
+		{
+			cdb_builder_add(&b, src, n->data, n2->data, section_off);
+			free(n2->data);
+		}
+
+		mowgli_queue_destroy(keyl);
+		free(n->data);
+	}
+
+	mowgli_queue_destroy(secl);
+
+	if (b.nentries > INT32_MAX || b.strings_len > UINT32_MAX)
+	{
+		mowgli_log("cdb: too many keys to build %s", what);
+		goto out;
+	}
+
+	/* name order: entries are sorted by name, slots are assigned after */
+	if (b.nentries != 0)
+		qsort(b.entries, b.nentries, sizeof(cdb_build_entry_t), cdb_entry_name_cmp);
+
+	disp = calloc(b.nentries + 1, sizeof(int32_t));
+	slots = calloc(b.nentries + 1, sizeof(uint32_t));
+	sections = calloc(b.nentries + 1, sizeof(cdb_section_t));
+
+	if (b.nentries != 0 && !cdb_build_hash(&b, disp, slots))
+		goto out;
+
+	for (i = 0; i < b.nentries; i++)
+	{
+		if (nsections == 0 || strcmp(b.entries[i].section,
+					     b.entries[sections[nsections - 1].first].section))
+		{
+			sections[nsections].name = b.entries[i].section_off;
+			sections[nsections].first = i;
+			nsections++;
+		}
+
+		sections[nsections - 1].count++;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, CDB_MAGIC, 8);
+	hdr.byteorder = CDB_BYTEORDER;
+	hdr.nrecords = (uint32_t) b.nentries;
+	hdr.nsections = nsections;
+	hdr.displacements_off = cdb_align(sizeof hdr);
+	hdr.records_off = cdb_align(hdr.displacements_off + b.nentries * sizeof(int32_t));
+	hdr.order_off = cdb_align(hdr.records_off + b.nentries * sizeof(cdb_record_t));
+	hdr.sections_off = cdb_align(hdr.order_off + b.nentries * sizeof(uint32_t));
+	hdr.strings_off = cdb_align(hdr.sections_off + nsections * sizeof(cdb_section_t));
+	hdr.size = hdr.strings_off + b.strings_len;
+
+	if ((alloc = calloc(hdr.size + CDB_LINE, 1)) == NULL)
+	{
+		mowgli_log("cdb: out of memory building %s", what);
+		goto out;
+	}
+
+	p = (unsigned char *) (((uintptr_t) alloc + CDB_LINE - 1) & ~(uintptr_t) (CDB_LINE - 1));
+	records = (cdb_record_t *) (p + hdr.records_off);
+	order = (uint32_t *) (p + hdr.order_off);
+
+	for (i = 0; i < b.nentries; i++)
+	{
+		cdb_build_entry_t *e = &b.entries[i];
+		cdb_record_t *rec = &records[slots[i]];
+
+		rec->hash = e->hash;
+		rec->section = e->section_off;
+		rec->key = e->key_off;
+		rec->value = e->value_off;
+		rec->ival = e->ival;
+		rec->bval = e->bval;
+		rec->dval = e->dval;
+
+		order[i] = slots[i];
+	}
+
+	memcpy(p, &hdr, sizeof hdr);
+	if (b.nentries != 0)
+		memcpy(p + hdr.displacements_off, disp, b.nentries * sizeof(int32_t));
+	if (nsections != 0)
+		memcpy(p + hdr.sections_off, sections, nsections * sizeof(cdb_section_t));
+	if (b.strings_len != 0)
+		memcpy(p + hdr.strings_off, b.strings, b.strings_len);
+
+	*image = p;
+	*len = hdr.size;
+
+out:
+	for (i = 0; i < b.nentries; i++)
+	{
+		free(b.entries[i].section);
+		free(b.entries[i].key);
+	}
+
+	free(b.entries);
+	free(b.strings);
+	free(disp);
+	free(slots);
+	free(sections);
+
+	return alloc;
+}
+
+/**
+ * \brief Compiles the contents of an mcs.handle into a cdb database.
+ *
+ * Every section and key visible through the source handle is written to
+ * an immutable database at the given path, replacing any existing file
+ * atomically. Typed values are resolved through the source handle, so
+ * the database answers typed gets exactly as the source backend would.
+ *
+ * \param src The mcs.handle object to read the configuration from.
+ * \param path The path of the database to write.
+ * \return A mcs_response_t value representing the success or failure of
+ *         the compilation.
+ */
+mcs_response_t
+mcs_cdb_compile(mcs_handle_t *src, const char *path)
+{
+	char tfile[PATH_MAX], what[PATH_MAX + 2];
+	unsigned char *alloc, *image;
+	size_t len;
+	FILE *f;
+	mcs_response_t ret = MCS_FAIL;
+
+	snprintf(what, sizeof what, "`%s'", path);
+
+	if ((alloc = cdb_build(src, what, &image, &len)) == NULL)
+		return MCS_FAIL;
+
+	mcs_strlcpy(tfile, path, PATH_MAX);
+	mcs_strlcat(tfile, ".tmp", PATH_MAX);
+
+	if ((f = fopen(tfile, "w+b")) == NULL)
+	{
+		mowgli_log("cdb: failed to open `%s' for writing: %s", tfile, strerror(errno));
+		goto out;
+	}
+
+	/* a database cut short by a full disk must never replace the old one */
+	if (fwrite(image, len, 1, f) != 1 || fflush(f) != 0)
+		goto fail;
+
+#ifdef _WIN32
+	if (_commit(fileno(f)) != 0)
+		goto fail;
+#else
+	if (fsync(fileno(f)) != 0)
+		goto fail;
+#endif
+
+	if (fclose(f) != 0)
+	{
+		f = NULL;
+		goto fail;
+	}
+
+	if (rename(tfile, path) < 0)
+	{
+		mowgli_log("cdb: rename(%s, %s) failed: %s", tfile, path, strerror(errno));
+		unlink(tfile);
+		goto out;
+	}
+
+	ret = MCS_OK;
+	goto out;
+
+fail:
+	mowgli_log("cdb: failed to write `%s': %s", tfile, strerror(errno));
+
+	if (f != NULL)
+		fclose(f);
+	unlink(tfile);
+
+out:
+	free(alloc);
+
+	return ret;
+}
+
+/**
+ * \brief Creates an in-memory cdb database from an existing mcs.handle.
+ *
+ * This builds the same image mcs_cdb_compile() writes, without touching
+ * the filesystem, and returns a read-only handle serving it. Nothing in
+ * the handle changes after it is built, so gets and mcs_iterate() may
+ * run on any number of threads at once. mcs_get_keys() and
+ * mcs_get_sections() build their lists with mowgli, which is not
+ * thread safe.
+ *
+ * \param src The mcs.handle object to read the configuration from.
+ * \return A new mcs.handle object, or NULL on failure.
+ */
+mcs_handle_t *
+mcs_cdb_new_from_handle(mcs_handle_t *src)
+{
+	mcs_handle_t *out;
+	mcs_cdb_handle_t *h;
+	unsigned char *alloc, *image;
+	size_t len;
+
+	if ((alloc = cdb_build(src, "an in-memory database", &image, &len)) == NULL)
+		return NULL;
+
+	if ((out = mcs_new_with_backend(cdb_backend.name, NULL)) == NULL)
+	{
+		free(alloc);
+		return NULL;
+	}
+
+	h = (mcs_cdb_handle_t *) out->mcs_priv_handle;
+	h->alloc = alloc;
+	h->map = image;
+	h->len = len;
+	cdb_attach(h);
+
+	return out;
+}
+
+mcs_backend_t cdb_backend = {
+	NULL,
+	"cdb",
+	mcs_cdb_new,
+	mcs_cdb_destroy,
+
+	mcs_cdb_get_string,
+	mcs_cdb_get_int,
+	mcs_cdb_get_bool,
+	mcs_cdb_get_float,
+	mcs_cdb_get_double,
+
+	mcs_cdb_set_string,
+	mcs_cdb_set_int,
+	mcs_cdb_set_bool,
+	mcs_cdb_set_float,
+	mcs_cdb_set_double,
+
+	mcs_cdb_unset_key,
+
+	mcs_cdb_get_keys,
+	mcs_cdb_get_sections,
+
+	NULL,
+
+	NULL,
+
+	mcs_cdb_iterate,
+
+	mcs_cdb_memory_usage
+};
@@ -0,0 +1,1133 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The daemon backend is a client for mcsd(1), which keeps the parsed
+ * configuration of every domain in one long-lived process so that short
+ * lived programs do not each pay for parsing it.
+ *
+ * Every handle has its own connection. Values are cached locally once
+ * they have been fetched, including misses; mcsd pushes an invalidation
+ * to every other connection of the domain whenever a key changes, and
+ * those are drained without blocking before the cache is consulted.
+ * Writes are pipelined: they are sent without waiting for the reply,
+ * which is collected along with the next reply that is actually needed.
+ * A written key is dropped from the cache when it is sent and cached
+ * again only once mcsd has accepted the write, so a rejected write never
+ * shows up locally.
+ *
+ * Asynchronous gets which miss the cache, and commits, are pipelined in
+ * the same way, and completed from the event loop once their reply has
+ * been read.
+ *
+ * The socket may live in a directory anyone can write to, so the client
+ * refuses to talk to a process run by another user.
+ */
+
+/* struct ucred */
+#define _GNU_SOURCE
+
+#include "libmcs/mcs.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "backends/daemon/mcsd_proto.h"
+
+/* pipelined writes allowed in flight before waiting for their replies */
+#define DAEMON_MAX_PENDING	1024
+
+typedef struct {
+	char *value;		/* NULL if the key is known not to exist */
+	int valid;		/* value is what mcsd has */
+	unsigned int writes;	/* pipelined writes to the key in flight */
+} daemon_entry_t;
+
+/*
+ * A pipelined write, cached once mcsd accepts it, or an asynchronous
+ * request completed by its reply.
+ */
+typedef struct daemon_write_ {
+	struct daemon_write_ *next;
+	char *section;
+	char *key;
+	char *value;	/* NULL for unsets */
+	mcs_async_request_t *request;
+	mcs_handle_t *handle;	/* the handle of request */
+} daemon_write_t;
+
+typedef struct {
+	int fd;
+	uint32_t seq;
+	uint32_t pending;
+	daemon_write_t *writes;		/* awaiting replies, in request order */
+	daemon_write_t **writes_tail;
+	size_t reply_len;
+	mcsd_buf_t in;
+	mcsd_buf_t out;
+	mowgli_patricia_t *cache;
+	int dirty;
+	int watched;	/* fd was passed to mcs_async_watch() */
+} mcs_daemon_handle_t;
+
+extern mcs_backend_t daemon_backend;
+
+static void nocanon(char *str) {}
+
+static void
+daemon_entry_free_cb(const char *key, void *data, void *privdata)
+{
+	daemon_entry_t *e = data;
+
+	free(e->value);
+	mowgli_free(e);
+}
+
+/*
+ * Cache keys are the section length, the section and the key, so that
+ * no choice of separator can make two pairs collide. Pairs too long for
+ * the buffer are simply never cached.
+ */
+static const char *
+daemon_cache_key(char *buf, size_t len, const char *section, const char *key)
+{
+	if ((size_t) snprintf(buf, len, "%lu:%s%s", (unsigned long) strlen(section), section, key) >= len)
+		return NULL;
+
+	return buf;
+}
+
+static daemon_entry_t *
+daemon_cache_entry(mcs_daemon_handle_t *h, const char *section,
+		   const char *key, int create)
+{
+	daemon_entry_t *e;
+	const char *ckey;
+	char buf[512];
+
+	if ((ckey = daemon_cache_key(buf, sizeof buf, section, key)) == NULL)
+		return NULL;
+
+	if ((e = mowgli_patricia_retrieve(h->cache, ckey)) == NULL && create)
+	{
+		e = mowgli_alloc(sizeof(daemon_entry_t));
+		mowgli_patricia_add(h->cache, ckey, e);
+	}
+
+	return e;
+}
+
+static void
+daemon_cache_drop(mcs_daemon_handle_t *h, const char *section,
+		  const char *key)
+{
+	daemon_entry_t *e;
+	const char *ckey;
+	char buf[512];
+
+	if ((ckey = daemon_cache_key(buf, sizeof buf, section, key)) == NULL)
+		return;
+
+	if ((e = mowgli_patricia_delete(h->cache, ckey)) != NULL)
+		daemon_entry_free_cb(NULL, e, NULL);
+}
+
+/*
+ * Caches a value mcsd has answered with. While writes to the key are in
+ * flight, the value may already be stale, so it is not kept.
+ */
+static void
+daemon_cache_store(mcs_daemon_handle_t *h, const char *section,
+		   const char *key, const char *value)
+{
+	daemon_entry_t *e;
+
+	if ((e = daemon_cache_entry(h, section, key, 1)) == NULL || e->writes > 0)
+		return;
+
+	free(e->value);
+	e->value = value != NULL ? strdup(value) : NULL;
+	e->valid = 1;
+}
+
+static void
+daemon_cache_invalidate(mcs_daemon_handle_t *h, const char *section,
+			const char *key)
+{
+	daemon_entry_t *e;
+
+	if ((e = daemon_cache_entry(h, section, key, 0)) == NULL)
+		return;
+
+	if (e->writes > 0)
+		e->valid = 0;
+	else
+		daemon_cache_drop(h, section, key);
+}
+
+/* returns the cached entry of section/key, if its value is current */
+static daemon_entry_t *
+daemon_cache_lookup(mcs_daemon_handle_t *h, const char *section,
+		    const char *key)
+{
+	daemon_entry_t *e = daemon_cache_entry(h, section, key, 0);
+
+	return e != NULL && e->valid ? e : NULL;
+}
+
+/* a write to section/key has been sent; gets go to mcsd until it is answered */
+static void
+daemon_cache_write_sent(mcs_daemon_handle_t *h, const char *section,
+			const char *key)
+{
+	daemon_entry_t *e;
+
+	if ((e = daemon_cache_entry(h, section, key, 1)) == NULL)
+		return;
+
+	e->writes++;
+	e->valid = 0;
+}
+
+/*
+ * mcsd has answered a write. Only the last write in flight to a key
+ * tells what mcsd now holds, and only if it was accepted.
+ */
+static void
+daemon_cache_write_done(mcs_daemon_handle_t *h, const char *section,
+			const char *key, const char *value, int accepted)
+{
+	daemon_entry_t *e;
+
+	if ((e = daemon_cache_entry(h, section, key, 0)) == NULL || e->writes == 0)
+		return;
+
+	if (--e->writes > 0)
+		return;
+
+	if (accepted)
+		daemon_cache_store(h, section, key, value);
+	else
+		daemon_cache_drop(h, section, key);
+}
+
+static daemon_write_t *
+daemon_write_pop(mcs_daemon_handle_t *h)
+{
+	daemon_write_t *w = h->writes;
+
+	if (w != NULL && (h->writes = w->next) == NULL)
+		h->writes_tail = &h->writes;
+
+	return w;
+}
+
+static void
+daemon_write_free(daemon_write_t *w)
+{
+	free(w->section);
+	free(w->key);
+	free(w->value);
+	free(w);
+}
+
+static void
+daemon_writes_clear(mcs_daemon_handle_t *h)
+{
+	daemon_write_t *w;
+
+	while ((w = daemon_write_pop(h)) != NULL)
+	{
+		if (w->request != NULL)
+		{
+			w->request->response = MCS_FAIL;
+			mcs_async_complete(w->request);
+		}
+		else
+			daemon_cache_write_done(h, w->section, w->key, NULL, 0);
+
+		daemon_write_free(w);
+	}
+}
+
+static void
+daemon_close(mcs_daemon_handle_t *h)
+{
+	if (h->watched)
+		mcs_async_forget(h->fd);
+
+	h->watched = 0;
+	close(h->fd);
+}
+
+static void
+daemon_disconnect(mcs_daemon_handle_t *h)
+{
+	if (h->fd < 0)
+		return;
+
+	mowgli_log("daemon: lost connection to mcsd");
+
+	daemon_close(h);
+	h->fd = -1;
+	h->pending = 0;
+	daemon_writes_clear(h);
+	h->reply_len = 0;
+	h->in.len = 0;
+	h->out.len = 0;
+}
+
+static int
+daemon_flush(mcs_daemon_handle_t *h)
+{
+	size_t off = 0;
+
+	while (off < h->out.len)
+	{
+		ssize_t n = send(h->fd, h->out.data + off, h->out.len - off, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+		{
+			daemon_disconnect(h);
+			return 0;
+		}
+
+		off += n;
+	}
+
+	h->out.len = 0;
+
+	return 1;
+}
+
+/*
+ * Reads whatever is available into the input buffer. Returns 1 if data
+ * was read, 0 if a non-blocking read found nothing and -1 on error.
+ */
+static int
+daemon_fill(mcs_daemon_handle_t *h, int block)
+{
+	ssize_t n;
+
+	mcsd_buf_reserve(&h->in, 65536);
+
+	do {
+		n = recv(h->fd, h->in.data + h->in.len, h->in.alloc - h->in.len,
+			 block ? 0 : MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+
+	if (n <= 0)
+	{
+		daemon_disconnect(h);
+		return -1;
+	}
+
+	h->in.len += n;
+
+	return 1;
+}
+
+/* completes an asynchronous request with its reply */
+static void
+daemon_async_reply(mcs_daemon_handle_t *h, daemon_write_t *w, uint8_t status,
+		   mcsd_reader_t *r)
+{
+	mcs_async_request_t *req = w->request;
+	const char *value = NULL;
+
+	switch (req->op)
+	{
+	case MCS_ASYNC_GET_STRING:
+		if (status != MCSD_STATUS_OK || !mcsd_getstr(r, &value))
+			value = NULL;
+
+		daemon_cache_store(h, w->section, w->key, value);
+
+		req->value = value != NULL ? strdup(value) : NULL;
+		req->response = value != NULL ? MCS_OK : MCS_FAIL;
+		mcs_stat_get(w->handle, MCS_STAT_STRING, req->response);
+		break;
+	case MCS_ASYNC_COMMIT:
+		req->response = status == MCSD_STATUS_OK ? MCS_OK : MCS_FAIL;
+
+		if (req->response == MCS_OK)
+			h->dirty = 0;
+		break;
+	default:
+		req->response = MCS_FAIL;
+		break;
+	}
+
+	mcs_async_complete(req);
+}
+
+/*
+ * Consumes invalidations and replies to pipelined writes from the head
+ * of the input buffer. Returns the length of the reply to seq once it is
+ * at the head, or 0 if it has not arrived yet.
+ */
+static size_t
+daemon_process(mcs_daemon_handle_t *h, uint32_t seq)
+{
+	long flen;
+
+	if (h->reply_len != 0)
+	{
+		mcsd_buf_consume(&h->in, h->reply_len);
+		h->reply_len = 0;
+	}
+
+	while ((flen = mcsd_frame_complete(&h->in)) != 0)
+	{
+		mcsd_reader_t r;
+		uint32_t fseq;
+		uint8_t status;
+
+		if (flen < 0)
+		{
+			daemon_disconnect(h);
+			return 0;
+		}
+
+		mcsd_reader_init(&r, h->in.data, flen, &fseq, &status);
+
+		if (status == MCSD_STATUS_INVALIDATE)
+		{
+			const char *section, *key;
+
+			if (mcsd_getstr(&r, &section) && mcsd_getstr(&r, &key))
+				daemon_cache_invalidate(h, section, key);
+		}
+		else if (seq != 0 && fseq == seq)
+			return (size_t) flen;
+		else if (h->pending > 0)
+		{
+			daemon_write_t *w = daemon_write_pop(h);
+
+			h->pending--;
+
+			if (w->request != NULL)
+				daemon_async_reply(h, w, status, &r);
+			else
+			{
+				if (status != MCSD_STATUS_OK)
+					mowgli_log("daemon: mcsd rejected a write to %s/%s", w->section, w->key);
+
+				daemon_cache_write_done(h, w->section, w->key, w->value,
+							status == MCSD_STATUS_OK);
+			}
+
+			daemon_write_free(w);
+		}
+
+		mcsd_buf_consume(&h->in, flen);
+	}
+
+	return 0;
+}
+
+/*
+ * Picks up any invalidations mcsd has pushed since we last looked,
+ * without blocking. Called before every cache lookup.
+ */
+static void
+daemon_poll(mcs_daemon_handle_t *h)
+{
+	if (h->fd < 0)
+		return;
+
+	while (daemon_fill(h, 0) > 0)
+		;
+
+	daemon_process(h, 0);
+}
+
+static size_t
+daemon_begin(mcs_daemon_handle_t *h, uint8_t op, uint32_t *seq)
+{
+	if (++h->seq == 0)
+		++h->seq;
+
+	*seq = h->seq;
+
+	return mcsd_frame_begin(&h->out, h->seq, op);
+}
+
+/*
+ * Sends a request and waits for its reply, which stays valid in the
+ * input buffer until the next request.
+ */
+static mcs_response_t
+daemon_call(mcs_daemon_handle_t *h, size_t start, uint32_t seq, mcsd_reader_t *r)
+{
+	size_t flen;
+	uint32_t fseq;
+	uint8_t status;
+
+	mcsd_frame_end(&h->out, start);
+
+	if (h->fd < 0)
+	{
+		h->out.len = 0;
+		return MCS_FAIL;
+	}
+
+	if (!daemon_flush(h))
+		return MCS_FAIL;
+
+	while ((flen = daemon_process(h, seq)) == 0)
+	{
+		if (daemon_fill(h, 1) < 0)
+			return MCS_FAIL;
+	}
+
+	h->reply_len = flen;
+	mcsd_reader_init(r, h->in.data, flen, &fseq, &status);
+
+	return status == MCSD_STATUS_OK ? MCS_OK : MCS_FAIL;
+}
+
+/*
+ * Queues a write without waiting for its reply; w is applied to the
+ * cache when the reply says it was accepted. An asynchronous request is
+ * always completed, if only with a failure.
+ */
+static mcs_response_t
+daemon_send(mcs_daemon_handle_t *h, size_t start, daemon_write_t *w)
+{
+	mcsd_frame_end(&h->out, start);
+
+	if (h->fd < 0 || !daemon_flush(h))
+	{
+		h->out.len = 0;
+
+		if (w->request != NULL)
+		{
+			w->request->response = MCS_FAIL;
+			mcs_async_complete(w->request);
+		}
+
+		daemon_write_free(w);
+		return MCS_FAIL;
+	}
+
+	w->next = NULL;
+	*h->writes_tail = w;
+	h->writes_tail = &w->next;
+	h->pending++;
+
+	/* until mcsd answers, gets of the key go to mcsd, after the write */
+	if (w->request == NULL)
+		daemon_cache_write_sent(h, w->section, w->key);
+
+	while (h->pending > DAEMON_MAX_PENDING)
+	{
+		daemon_process(h, 0);
+
+		if (h->pending > DAEMON_MAX_PENDING && daemon_fill(h, 1) < 0)
+			return MCS_FAIL;
+	}
+
+	return MCS_OK;
+}
+
+/* only an mcsd run by the same user, or by root, is trusted */
+static int
+daemon_peer_trusted(int fd)
+{
+	uid_t uid;
+#if defined(HAVE_GETPEEREID)
+	gid_t gid;
+
+	if (getpeereid(fd, &uid, &gid) < 0)
+		return 0;
+#elif defined(HAVE_STRUCT_UCRED_UID)
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return 0;
+
+	uid = cred.uid;
+#else
+	return 0;
+#endif
+
+	return uid == getuid() || uid == 0;
+}
+
+static int
+daemon_connect(mcs_daemon_handle_t *h, const char *domain)
+{
+	struct sockaddr_un sun;
+	mcsd_reader_t r;
+	uint32_t seq;
+	size_t start;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	mcsd_socket_path(sun.sun_path, sizeof sun.sun_path);
+
+	if ((h->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return 0;
+
+	if (connect(h->fd, (struct sockaddr *) &sun, sizeof sun) < 0)
+	{
+		mowgli_log("daemon: cannot connect to mcsd at `%s': %s", sun.sun_path, strerror(errno));
+		close(h->fd);
+		h->fd = -1;
+		return 0;
+	}
+
+	if (!daemon_peer_trusted(h->fd))
+	{
+		mowgli_log("daemon: `%s' is not served by an mcsd of this user, not connecting", sun.sun_path);
+		close(h->fd);
+		h->fd = -1;
+		return 0;
+	}
+
+	start = daemon_begin(h, MCSD_OP_OPEN, &seq);
+	mcsd_putstr(&h->out, domain);
+	mcsd_put8(&h->out, 1);
+
+	if (!daemon_call(h, start, seq, &r))
+	{
+		mowgli_log("daemon: mcsd refused to open domain `%s'", domain);
+		daemon_disconnect(h);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Returns the value of section/key, from the cache if possible. The
+ * result is only valid until the next operation on the handle; NULL
+ * means the key does not exist or mcsd could not be reached.
+ */
+static const char *
+daemon_lookup(mcs_handle_t *self, const char *section, const char *key)
+{
+	mcs_daemon_handle_t *h = (mcs_daemon_handle_t *) self->mcs_priv_handle;
+	daemon_entry_t *e;
+	mcsd_reader_t r;
+	const char *value;
+	uint32_t seq;
+	size_t start;
+
+	daemon_poll(h);
+
+	if ((e = daemon_cache_lookup(h, section, key)) != NULL)
+		return e->value;
+
+	if (h->fd < 0)
+		return NULL;
+
+	start = daemon_begin(h, MCSD_OP_GET, &seq);
+	mcsd_putstr(&h->out, section);
+	mcsd_putstr(&h->out, key);
+
+	if (!daemon_call(h, start, seq, &r) || !mcsd_getstr(&r, &value))
+		value = NULL;
+
+	/* a dropped connection is not a miss */
+	if (h->fd >= 0)
+		daemon_cache_store(h, section, key, value);
+
+	return value;
+}
+
+static mcs_response_t
+daemon_store(mcs_handle_t *self, const char *section, const char *key,
+	     const char *value)
+{
+	mcs_daemon_handle_t *h = (mcs_daemon_handle_t *) self->mcs_priv_handle;
+	daemon_write_t *w;
+	size_t start;
+	uint32_t seq;
+
+	if (h->fd < 0)
+		return MCS_FAIL;
+
+	start = daemon_begin(h, value != NULL ? MCSD_OP_SET : MCSD_OP_UNSET, &seq);
+	mcsd_putstr(&h->out, section);
+	mcsd_putstr(&h->out, key);
+
+	if (value != NULL)
+		mcsd_putstr(&h->out, value);
+
+	w = calloc(sizeof(daemon_write_t), 1);
+	w->section = strdup(section);
+	w->key = strdup(key);
+	w->value = value != NULL ? strdup(value) : NULL;
+
+	h->dirty = 1;
+
+	return daemon_send(h, start, w);
+}
+
+static mowgli_queue_t *
+daemon_list(mcs_daemon_handle_t *h, size_t start, uint32_t seq)
+{
+	mowgli_queue_t *out = NULL;
+	mcsd_reader_t r;
+	uint32_t n;
+
+	if (!daemon_call(h, start, seq, &r) || !mcsd_get32(&r, &n))
+		return NULL;
+
+	while (n-- > 0)
+	{
+		const char *name;
+
+		if (!mcsd_getstr(&r, &name))
+			break;
+
+		out = mowgli_queue_shift(out, strdup(name));
+	}
+
+	return out;
+}
+
+/* ***************************************************************** */
+
+static mcs_handle_t *
+mcs_daemon_new(char *domain)
+{
+	mcs_daemon_handle_t *h = calloc(sizeof(mcs_daemon_handle_t), 1);
+	mcs_handle_t *out = calloc(sizeof(mcs_handle_t), 1);
+
+	out->base = &daemon_backend;
+	out->mcs_priv_handle = h;
+
+	h->cache = mowgli_patricia_create(nocanon);
+	h->fd = -1;
+	h->writes_tail = &h->writes;
+
+	daemon_connect(h, domain);
+
+	return out;
+}
+
+static mcs_response_t
+mcs_daemon_commit(mcs_handle_t *self)
+{
+	mcs_daemon_handle_t *h = (mcs_daemon_handle_t *) self->mcs_priv_handle;
+	mcsd_reader_t r;
+	uint32_t seq;
+	size_t start;
+
+	if (h->fd < 0)
+		return MCS_FAIL;
+
+	start = daemon_begin(h, MCSD_OP_COMMIT, &seq);
+
+	if (!daemon_call(h, start, seq, &r))
+		return MCS_FAIL;
+
+	h->dirty = 0;
+
+	return MCS_OK;
+}
+
+static void
+mcs_daemon_destroy(mcs_handle_t *self)
+{
+	mcs_daemon_handle_t *h = (mcs_daemon_handle_t *) self->mcs_priv_handle;
+
+	/* like the keyfile backend, changes are written back on destroy */
+	if (h->dirty)
+		mcs_daemon_commit(self);
+
+	if (h->fd >= 0)
+		daemon_close(h);
+
+	daemon_writes_clear(h);
+	mowgli_patricia_destroy(h->cache, daemon_entry_free_cb, NULL);
+
+	free(h->in.data);
+	free(h->out.data);
+	free(h);
+	free(self);
+}
+
+static mcs_response_t
+mcs_daemon_get_string(mcs_handle_t *self, const char *section,
+		      const char *key, char **value)
+{
+	const char *str;
+
+	if ((str = daemon_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = strdup(str);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_daemon_get_int(mcs_handle_t *self, const char *section,
+		   const char *key, int *value)
+{
+	const char *str;
+
+	if ((str = daemon_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = atoi(str);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_daemon_get_bool(mcs_handle_t *self, const char *section,
+		    const char *key, int *value)
+{
+	const char *str;
+
+	if ((str = daemon_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = !strcasecmp(str, "TRUE");
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_daemon_get_float(mcs_handle_t *self, const char *section,
+		     const char *key, float *value)
+{
+	const char *str;
+
+	if ((str = daemon_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = mcs_strtod_c(str, NULL);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_daemon_get_double(mcs_handle_t *self, const char *section,
+		      const char *key, double *value)
+{
+	const char *str;
+
+	if ((str = daemon_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = mcs_strtod_c(str, NULL);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_daemon_set_string(mcs_handle_t *self, const char *section,
+		      const char *key, const char *value)
+{
+	return daemon_store(self, section, key, value);
+}
+
+static mcs_response_t
+mcs_daemon_set_int(mcs_handle_t *self, const char *section,
+		   const char *key, int value)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof buf, "%d", value);
+
+	return daemon_store(self, section, key, buf);
+}
+
+static mcs_response_t
+mcs_daemon_set_bool(mcs_handle_t *self, const char *section,
+		    const char *key, int value)
+{
+	return daemon_store(self, section, key, value ? "TRUE" : "FALSE");
+}
+
+static mcs_response_t
+mcs_daemon_set_float(mcs_handle_t *self, const char *section,
+		     const char *key, float value)
+{
+	char buf[64];
+
+	mcs_dtostr_c(buf, sizeof buf, value);
+
+	return daemon_store(self, section, key, buf);
+}
+
+static mcs_response_t
+mcs_daemon_set_double(mcs_handle_t *self, const char *section,
+		      const char *key, double value)
+{
+	char buf[64];
+
+	mcs_dtostr_c(buf, sizeof buf, value);
+
+	return daemon_store(self, section, key, buf);
+}
+
+static mcs_response_t
+mcs_daemon_unset_key(mcs_handle_t *self, const char *section,
+		     const char *key)
+{
+	return daemon_store(self, section, key, NULL);
+}
+
+static mowgli_queue_t *
+mcs_daemon_get_keys(mcs_handle_t *self, const char *section)
+{
+	mcs_daemon_handle_t *h = (mcs_daemon_handle_t *) self->mcs_priv_handle;
+	uint32_t seq;
+	size_t start;
+
+	start = daemon_begin(h, MCSD_OP_KEYS, &seq);
+	mcsd_putstr(&h->out, section);
+
+	return daemon_list(h, start, seq);
+}
+
+static mowgli_queue_t *
+mcs_daemon_get_sections(mcs_handle_t *self)
+{
+	mcs_daemon_handle_t *h = (mcs_daemon_handle_t *) self->mcs_priv_handle;
+	uint32_t seq;
+	size_t start;
+
+	start = daemon_begin(h, MCSD_OP_SECTIONS, &seq);
+
+	return daemon_list(h, start, seq);
+}
+
+/* ***************************************************************** */
+
+/* called from the event loop when mcsd has sent something */
+static void
+daemon_async_ready(int fd, void *privdata)
+{
+	mcs_handle_t *self = privdata;
+
+	daemon_poll((mcs_daemon_handle_t *) self->mcs_priv_handle);
+}
+
+/*
+ * Gets which the cache answers and sets, which are pipelined anyway,
+ * complete at once. Other gets and commits are sent, and completed by
+ * daemon_async_reply() once the event loop sees their reply.
+ */
+static mcs_response_t
+mcs_daemon_async_submit(mcs_handle_t *self, mcs_async_request_t *req)
+{
+	mcs_daemon_handle_t *h = (mcs_daemon_handle_t *) self->mcs_priv_handle;
+	daemon_write_t *w;
+	uint32_t seq;
+	size_t start;
+
+	/* a frozen handle answers gets from its image */
+	if (self->frozen != NULL)
+		return MCS_FAIL;
+
+	daemon_poll(h);
+
+	switch (req->op)
+	{
+	case MCS_ASYNC_SET_STRING:
+		req->response = mcs_set_string(self, req->section, req->key, req->value);
+		mcs_async_complete(req);
+		return MCS_OK;
+	case MCS_ASYNC_GET_STRING:
+		if (h->fd < 0 || daemon_cache_lookup(h, req->section, req->key) != NULL)
+		{
+			req->response = mcs_get_string(self, req->section, req->key, &req->value);
+			mcs_async_complete(req);
+			return MCS_OK;
+		}
+
+		start = daemon_begin(h, MCSD_OP_GET, &seq);
+		mcsd_putstr(&h->out, req->section);
+		mcsd_putstr(&h->out, req->key);
+		break;
+	case MCS_ASYNC_COMMIT:
+		if (h->fd < 0)
+		{
+			req->response = MCS_FAIL;
+			mcs_async_complete(req);
+			return MCS_OK;
+		}
+
+		start = daemon_begin(h, MCSD_OP_COMMIT, &seq);
+		break;
+	default:
+		return MCS_FAIL;
+	}
+
+	w = calloc(sizeof(daemon_write_t), 1);
+	w->section = req->section != NULL ? strdup(req->section) : NULL;
+	w->key = req->key != NULL ? strdup(req->key) : NULL;
+	w->request = req;
+	w->handle = self;
+
+	mcs_async_watch(req, h->fd, daemon_async_ready, self);
+	h->watched = 1;
+
+	daemon_send(h, start, w);
+
+	return MCS_OK;
+}
+
+/* ***************************************************************** */
+
+/**
+ * \brief Fetches several keys from mcsd in a single round trip.
+ *
+ * Each section/key pair which is not already cached is requested in one
+ * batched MGET, and the results, including misses, are stored in the
+ * handle's cache so that the following gets are answered locally. This
+ * is useful when a program knows up front which keys it is going to read.
+ *
+ * Handles of other backends are left alone.
+ *
+ * \param handle A daemon mcs.handle object.
+ * \param sections An array of section names.
+ * \param keys An array of key names, paired with sections.
+ * \param count The number of pairs.
+ * \return MCS_OK if the keys were fetched, MCS_FAIL otherwise.
+ */
+mcs_response_t
+mcs_daemon_prefetch(mcs_handle_t *self, const char **sections,
+		    const char **keys, size_t count)
+{
+	mcs_daemon_handle_t *h;
+	mcsd_reader_t r;
+	unsigned char *idx;
+	size_t start, i;
+	uint32_t seq, n = 0;
+	char buf[512];
+
+	return_val_if_fail(self != NULL, MCS_FAIL);
+
+	if (self->base != &daemon_backend)
+		return MCS_OK;
+
+	h = (mcs_daemon_handle_t *) self->mcs_priv_handle;
+	daemon_poll(h);
+
+	if (h->fd < 0)
+		return MCS_FAIL;
+
+	idx = calloc(count ? count : 1, 1);
+	start = daemon_begin(h, MCSD_OP_MGET, &seq);
+	mcsd_put32(&h->out, 0);
+
+	for (i = 0; i < count; i++)
+	{
+		const char *ckey = daemon_cache_key(buf, sizeof buf, sections[i], keys[i]);
+
+		if (ckey == NULL || daemon_cache_lookup(h, sections[i], keys[i]) != NULL)
+			continue;
+
+		mcsd_putstr(&h->out, sections[i]);
+		mcsd_putstr(&h->out, keys[i]);
+		idx[i] = 1;
+		n++;
+	}
+
+	if (n == 0)
+	{
+		h->out.len = start;
+		free(idx);
+		return MCS_OK;
+	}
+
+	memcpy(h->out.data + start + MCSD_FRAME_HEADER, &n, 4);
+
+	if (!daemon_call(h, start, seq, &r) || !mcsd_get32(&r, &seq) || seq != n)
+	{
+		free(idx);
+		return MCS_FAIL;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		const char *value = NULL;
+		uint8_t found;
+
+		if (!idx[i])
+			continue;
+
+		if (!mcsd_get8(&r, &found) || (found && !mcsd_getstr(&r, &value)))
+			break;
+
+		daemon_cache_store(h, sections[i], keys[i], value);
+	}
+
+	free(idx);
+
+	return i == count ? MCS_OK : MCS_FAIL;
+}
+
+mcs_backend_t daemon_backend = {
+	NULL,
+	"daemon",
+	mcs_daemon_new,
+	mcs_daemon_destroy,
+
+	mcs_daemon_get_string,
+	mcs_daemon_get_int,
+	mcs_daemon_get_bool,
+	mcs_daemon_get_float,
+	mcs_daemon_get_double,
+
+	mcs_daemon_set_string,
+	mcs_daemon_set_int,
+	mcs_daemon_set_bool,
+	mcs_daemon_set_float,
+	mcs_daemon_set_double,
+
+	mcs_daemon_unset_key,
+
+	mcs_daemon_get_keys,
+	mcs_daemon_get_sections,
+
+	mcs_daemon_commit,
+
+	mcs_daemon_async_submit
+};
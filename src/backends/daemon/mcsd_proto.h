@@ -0,0 +1,240 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Wire protocol shared by mcsd(1) and the daemon backend.
+ *
+ * Every message is a frame: a uint32 length counting the bytes which
+ * follow it, a uint32 sequence number and a uint8 opcode (requests) or
+ * status (replies), followed by the payload. Integers are in host byte
+ * order, as both ends live on the same host. Strings are a uint32 length
+ * followed by the bytes and a terminating NUL, which is included in the
+ * length so that they can be used in place.
+ *
+ * Replies carry the sequence number of their request and are sent in
+ * request order, so a client may pipeline any number of requests.
+ * Invalidation events are pushed with sequence number 0.
+ */
+
+#ifndef __MCSD_PROTO_H__
+#define __MCSD_PROTO_H__
+
+#include <stdint.h>
+
+#define MCSD_MAX_FRAME		(16 * 1024 * 1024)
+#define MCSD_FRAME_HEADER	9
+
+typedef enum {
+	MCSD_OP_OPEN = 1,	/* str domain, u8 subscribe */
+	MCSD_OP_GET,		/* str section, str key -> str value */
+	MCSD_OP_MGET,		/* u32 n, n * (str section, str key) -> u32 n, n * (u8 found, [str value]) */
+	MCSD_OP_SET,		/* str section, str key, str value */
+	MCSD_OP_UNSET,		/* str section, str key */
+	MCSD_OP_KEYS,		/* str section -> u32 n, n * str */
+	MCSD_OP_SECTIONS,	/* -> u32 n, n * str */
+	MCSD_OP_COMMIT
+} mcsd_op_t;
+
+typedef enum {
+	MCSD_STATUS_FAIL,
+	MCSD_STATUS_OK,
+	MCSD_STATUS_INVALIDATE	/* str section, str key */
+} mcsd_status_t;
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t alloc;
+} mcsd_buf_t;
+
+typedef struct {
+	const unsigned char *p;
+	const unsigned char *end;
+} mcsd_reader_t;
+
+static inline void
+mcsd_buf_reserve(mcsd_buf_t *buf, size_t len)
+{
+	if (buf->len + len <= buf->alloc)
+		return;
+
+	while (buf->len + len > buf->alloc)
+		buf->alloc = buf->alloc ? buf->alloc * 2 : 4096;
+
+	buf->data = realloc(buf->data, buf->alloc);
+}
+
+static inline void
+mcsd_buf_consume(mcsd_buf_t *buf, size_t len)
+{
+	memmove(buf->data, buf->data + len, buf->len - len);
+	buf->len -= len;
+}
+
+static inline void
+mcsd_put8(mcsd_buf_t *buf, uint8_t v)
+{
+	mcsd_buf_reserve(buf, 1);
+	buf->data[buf->len++] = v;
+}
+
+static inline void
+mcsd_put32(mcsd_buf_t *buf, uint32_t v)
+{
+	mcsd_buf_reserve(buf, 4);
+	memcpy(buf->data + buf->len, &v, 4);
+	buf->len += 4;
+}
+
+static inline void
+mcsd_putstr(mcsd_buf_t *buf, const char *str)
+{
+	uint32_t len = (uint32_t) strlen(str) + 1;
+
+	mcsd_put32(buf, len);
+	mcsd_buf_reserve(buf, len);
+	memcpy(buf->data + buf->len, str, len);
+	buf->len += len;
+}
+
+/*
+ * Starts a frame and returns its offset, to be passed to
+ * mcsd_frame_end() once the payload has been appended.
+ */
+static inline size_t
+mcsd_frame_begin(mcsd_buf_t *buf, uint32_t seq, uint8_t op)
+{
+	size_t start = buf->len;
+
+	mcsd_put32(buf, 0);
+	mcsd_put32(buf, seq);
+	mcsd_put8(buf, op);
+
+	return start;
+}
+
+static inline void
+mcsd_frame_end(mcsd_buf_t *buf, size_t start)
+{
+	uint32_t len = (uint32_t) (buf->len - start - 4);
+
+	memcpy(buf->data + start, &len, 4);
+}
+
+/*
+ * Returns the total size of the first frame in buf if it is complete,
+ * 0 if more data is needed and -1 if the frame is malformed.
+ */
+static inline long
+mcsd_frame_complete(const mcsd_buf_t *buf)
+{
+	uint32_t len;
+
+	if (buf->len < 4)
+		return 0;
+
+	memcpy(&len, buf->data, 4);
+
+	if (len < MCSD_FRAME_HEADER - 4 || len > MCSD_MAX_FRAME)
+		return -1;
+
+	return buf->len >= (size_t) len + 4 ? (long) len + 4 : 0;
+}
+
+static inline void
+mcsd_reader_init(mcsd_reader_t *r, const unsigned char *frame, size_t len,
+		 uint32_t *seq, uint8_t *code)
+{
+	memcpy(seq, frame + 4, 4);
+	*code = frame[8];
+
+	r->p = frame + MCSD_FRAME_HEADER;
+	r->end = frame + len;
+}
+
+static inline int
+mcsd_get8(mcsd_reader_t *r, uint8_t *v)
+{
+	if (r->end - r->p < 1)
+		return 0;
+
+	*v = *r->p++;
+
+	return 1;
+}
+
+static inline int
+mcsd_get32(mcsd_reader_t *r, uint32_t *v)
+{
+	if (r->end - r->p < 4)
+		return 0;
+
+	memcpy(v, r->p, 4);
+	r->p += 4;
+
+	return 1;
+}
+
+static inline int
+mcsd_getstr(mcsd_reader_t *r, const char **str)
+{
+	uint32_t len;
+
+	if (!mcsd_get32(r, &len) || len == 0 || (size_t) (r->end - r->p) < len ||
+	    r->p[len - 1] != '\0')
+		return 0;
+
+	*str = (const char *) r->p;
+	r->p += len;
+
+	return 1;
+}
+
+/*
+ * The socket is $MCSD_SOCKET, or mcsd.sock in $XDG_RUNTIME_DIR, or a
+ * per-user path in /tmp. Anyone could create the latter first, so the
+ * client checks who is listening before it sends anything.
+ */
+static inline void
+mcsd_socket_path(char *buf, size_t len)
+{
+	const char *magic;
+
+	if ((magic = getenv("MCSD_SOCKET")) != NULL && *magic != '\0')
+		mcs_strlcpy(buf, magic, len);
+	else if ((magic = getenv("XDG_RUNTIME_DIR")) != NULL && *magic != '\0')
+		snprintf(buf, len, "%s/mcsd.sock", magic);
+	else
+		snprintf(buf, len, "/tmp/mcsd-%lu.sock", (unsigned long) getuid());
+}
+
+#endif
@@ -30,371 +30,2186 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <locale.h>
+#include <fcntl.h>
 
 #include "libmcs/mcs.h"
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+/*
+ * Sections keep their values in blocks of a few dozen entries at most,
+ * sorted by key. Within a block each key is stored as the length of the
+ * prefix it shares with the key before it, then the rest of the key and
+ * the value, both NUL-terminated:
+ *
+ *   varint prefix | key suffix | '\0' | value | '\0'
+ *
+ * The first key of a block shares nothing and so is stored whole; the
+ * blocks are bisected on their first keys, and a lookup then scans one
+ * block, comparing suffixes without rebuilding any key. Values live in
+ * the block too, so an entry costs little more than the bytes of its
+ * key suffix and value. Values are collected unsorted while a file is
+ * loaded and built into blocks once it has been read.
+ *
+ * Parsed files, sections and block buffers are reference counted and
+ * never changed while shared, which makes snapshots and clones cheap: a
+ * snapshot takes a reference to the whole file, and a handle changing a
+ * shared file first copies the section index, then the block list of
+ * the section it changes, sharing everything else, before rebuilding
+ * the one block it touches as usual.
+ */
+
+#if defined(__GNUC__)
+# define keyfile_ref(p)		__atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+# define keyfile_unref(p)	__atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+# define keyfile_refs(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#else
+# define keyfile_ref(p)		(++*(p))
+# define keyfile_unref(p)	(--*(p))
+# define keyfile_refs(p)	(*(p))
+#endif
+
+#define KEYFILE_BLOCK		16	/* entries per block when built in bulk */
+#define KEYFILE_BLOCK_MAX	32	/* blocks growing beyond this are split */
+
+typedef struct {
+	unsigned char *data;	/* follows a reference count */
+	size_t len;
+	unsigned int count;
+} keyfile_block_t;
+
+#define keyfile_block_refs(b)	((size_t *) (b)->data - 1)
+
+typedef struct {
+	char *key;
+	const char *value;
+	size_t seq;
+} keyfile_pair_t;
+
 typedef struct {
 	char *name;
-	mowgli_patricia_t *lines;
+	keyfile_block_t *blocks;
+	size_t nblocks;
+	keyfile_pair_t *pending;	/* values loaded but not yet in blocks */
+	size_t npending;
+	size_t pendalloc;
+	size_t refs;
 	mowgli_node_t node;
 } keyfile_section_t;
 
 typedef struct {
 	mowgli_patricia_t *sections;
+	size_t usage;
+	size_t refs;
 } keyfile_t;
 
+/* rough cost of a section, counting the patricia leaf which indexes it */
+#define KEYFILE_SECTION_COST(name)	(sizeof(keyfile_section_t) + strlen(name) + 1 + 64)
+#define KEYFILE_BLOCK_COST(b)		(sizeof(keyfile_block_t) + (b)->len)
+
+typedef struct {
+	const unsigned char *p;
+	const unsigned char *end;
+	size_t prefix;
+	const char *suffix;
+	const char *value;
+} keyfile_cursor_t;
+
+/* a growable buffer for rebuilding keys */
+typedef struct {
+	char *buf;
+	size_t alloc;
+} keyfile_keybuf_t;
+
 static void nocanon(char *str) {}
 
-static keyfile_t *
-keyfile_new(void)
+static size_t
+keyfile_varint_put(unsigned char *p, size_t v)
 {
-	keyfile_t *out;
+	size_t n = 0;
 
-	out = mowgli_alloc(sizeof(keyfile_t));
-	out->sections = mowgli_patricia_create(nocanon);
+	while (v >= 0x80)
+	{
+		p[n++] = (unsigned char) (v | 0x80);
+		v >>= 7;
+	}
 
-	return out;
+	p[n++] = (unsigned char) v;
+
+	return n;
 }
 
-static void
-keyfile_line_free_cb(const char *key, void *data, void *privdata)
+static size_t
+keyfile_varint_len(size_t v)
 {
-	free(data);
+	size_t n = 1;
+
+	while (v >= 0x80)
+	{
+		v >>= 7;
+		n++;
+	}
+
+	return n;
 }
 
 static void
-keyfile_section_free_cb(const char *key, void *data, void *privdata)
+keyfile_cursor_init(keyfile_cursor_t *c, const keyfile_block_t *b)
 {
-	keyfile_section_t *sec = data;
+	c->p = b->data;
+	c->end = b->data + b->len;
+}
 
-	mowgli_patricia_destroy(sec->lines, keyfile_line_free_cb, sec);
+static int
+keyfile_cursor_next(keyfile_cursor_t *c)
+{
+	int shift = 0;
 
-	free(sec->name);
-	mowgli_free(sec);
+	if (c->p >= c->end)
+		return 0;
+
+	c->prefix = 0;
+	do
+	{
+		c->prefix |= (size_t) (*c->p & 0x7f) << shift;
+		shift += 7;
+	} while (*c->p++ & 0x80);
+
+	c->suffix = (const char *) c->p;
+	c->p += strlen(c->suffix) + 1;
+	c->value = (const char *) c->p;
+	c->p += strlen(c->value) + 1;
+
+	return 1;
 }
 
-static void
-keyfile_destroy(keyfile_t *file)
+static const char *
+keyfile_keybuf_apply(keyfile_keybuf_t *kb, size_t prefix, const char *suffix)
 {
-	if (file == NULL)
-		return;
+	size_t need = prefix + strlen(suffix) + 1;
 
-	mowgli_patricia_destroy(file->sections, keyfile_section_free_cb, file);
-	mowgli_free(file);
+	if (need > kb->alloc)
+	{
+		kb->alloc = need > 2 * kb->alloc ? need : 2 * kb->alloc;
+		kb->buf = realloc(kb->buf, kb->alloc);
+	}
+
+	memcpy(kb->buf + prefix, suffix, need - prefix);
+
+	return kb->buf;
 }
 
-static keyfile_section_t *
-keyfile_create_section(keyfile_t *parent, const char *name)
+static size_t
+keyfile_common_prefix(const char *a, const char *b)
 {
-	keyfile_section_t *out = mowgli_alloc(sizeof(keyfile_section_t));
+	size_t n = 0;
 
-	out->name = strdup(name);
-	out->lines = mowgli_patricia_create(nocanon);
-
-	mowgli_patricia_add(parent->sections, out->name, out);
+	while (a[n] != '\0' && a[n] == b[n])
+		n++;
 
-	return out;
+	return n;
 }
 
-static keyfile_t *
-keyfile_open(const char *filename)
+/* encodes n sorted pairs into b, which must not hold data */
+static void
+keyfile_block_encode(keyfile_block_t *b, const keyfile_pair_t *pairs, size_t n)
 {
-	FILE *f = fopen(filename, "rb");
-	keyfile_t *out = keyfile_new();
-	keyfile_section_t *sec = NULL;
-	char buffer[4096], *tmp;
+	unsigned char *p;
+	size_t i, prefix, len = 0, klen, vlen;
 
-	if (f == NULL)
-		return out;
+	for (i = 0; i < n; i++)
+	{
+		prefix = i ? keyfile_common_prefix(pairs[i - 1].key, pairs[i].key) : 0;
+		len += keyfile_varint_len(prefix) + strlen(pairs[i].key) - prefix + 1 +
+		       strlen(pairs[i].value) + 1;
+	}
+
+	p = malloc(sizeof(size_t) + len);
+	*(size_t *) p = 1;
+	b->data = p = p + sizeof(size_t);
+	b->len = len;
+	b->count = n;
 
-	while (fgets(buffer, 4096, f))
+	for (i = 0; i < n; i++)
 	{
-		if (buffer[0] == '[')
-		{
-			if ((tmp = strchr(buffer, ']')))
-			{
-				*tmp = '\0';
+		prefix = i ? keyfile_common_prefix(pairs[i - 1].key, pairs[i].key) : 0;
+		klen = strlen(pairs[i].key + prefix) + 1;
+		vlen = strlen(pairs[i].value) + 1;
+
+		p += keyfile_varint_put(p, prefix);
+		memcpy(p, pairs[i].key + prefix, klen);
+		p += klen;
+		memcpy(p, pairs[i].value, vlen);
+		p += vlen;
+	}
+}
 
-				if ((sec = mowgli_patricia_retrieve(out->sections, &buffer[1])) == NULL)
-					sec = keyfile_create_section(out, &buffer[1]);
-				else
-					mowgli_log("Duplicate section %s in %s", &buffer[1], filename);
-			}
-		}
-		else if (buffer[0] != '#' && sec != NULL)
-		{
-			if ((tmp = strchr(buffer, '=')))
-			{
-				char *tmp = strtok(buffer, "=");
-				char *tmp2 = strtok(NULL, "\n");
-
-				if (tmp2 != NULL && strlen(tmp2) > 0)
-				{
-					if (mowgli_patricia_retrieve(sec->lines, tmp) == NULL)
-						mowgli_patricia_add(sec->lines, tmp, strdup(tmp2));
-					else
-						mowgli_log("Ignoring duplicate value %s in section %s in %s", tmp, sec->name, filename);
-				}
-			}
-		}
+static void
+keyfile_block_release(keyfile_block_t *b)
+{
+	if (keyfile_unref(keyfile_block_refs(b)) == 0)
+		free(keyfile_block_refs(b));
+}
+
+/*
+ * Decodes a block into pairs whose keys are copies and whose values
+ * point into the block.
+ */
+static size_t
+keyfile_block_decode(const keyfile_block_t *b, keyfile_pair_t *pairs)
+{
+	keyfile_keybuf_t kb = { NULL, 0 };
+	keyfile_cursor_t c;
+	size_t n = 0;
+
+	keyfile_cursor_init(&c, b);
+
+	while (keyfile_cursor_next(&c))
+	{
+		pairs[n].key = strdup(keyfile_keybuf_apply(&kb, c.prefix, c.suffix));
+		pairs[n].value = c.value;
+		n++;
 	}
 
-	fclose(f);
+	free(kb.buf);
 
-	return out;
+	return n;
 }
 
-static int
-keyfile_write_line_cb(const char *key, void *data, void *privdata)
+static void
+keyfile_pairs_free_keys(keyfile_pair_t *pairs, size_t n)
 {
-	FILE *f = (FILE *) privdata;
-	const char *value = data;
-
-	fprintf(f, "%s=%s\n", key, value);
+	size_t i;
 
-	return 0;
+	for (i = 0; i < n; i++)
+		free(pairs[i].key);
 }
 
-static int
-keyfile_write_section_cb(const char *key, void *data, void *privdata)
+/* the first key of a block is stored whole after a zero prefix byte */
+#define keyfile_block_first(b)	((const char *) (b)->data + 1)
+
+/*
+ * Returns the block which holds key if anything does: the last one
+ * whose first key is not greater than it, or the first block.
+ */
+static size_t
+keyfile_block_find(const keyfile_section_t *sec, const char *key)
 {
-	FILE *f = (FILE *) privdata;
-	keyfile_section_t *sec = data;
+	size_t lo = 0, hi = sec->nblocks;
 
-	fprintf(f, "[%s]\n", sec->name);
-	mowgli_patricia_foreach(sec->lines, keyfile_write_line_cb, f);
+	while (hi - lo > 1)
+	{
+		size_t mid = lo + (hi - lo) / 2;
 
-	return 0;
+		if (strcmp(keyfile_block_first(&sec->blocks[mid]), key) <= 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
 }
 
-static mcs_response_t
-keyfile_write(keyfile_t *self, const char *filename)
+static const char *
+keyfile_section_lookup(const keyfile_section_t *sec, const char *key)
 {
-	FILE *f = fopen(filename, "w+b");
+	keyfile_cursor_t c;
+	size_t match = 0, n;
 
-	if (f == NULL)
+	if (sec->nblocks == 0)
+		return NULL;
+
+	keyfile_cursor_init(&c, &sec->blocks[keyfile_block_find(sec, key)]);
+
+	/*
+	 * match is how much of key the previous entry, which sorted below
+	 * it, had in common with it. An entry sharing more than that with
+	 * the previous one also sorts below key; one sharing less sorts
+	 * above it.
+	 */
+	while (keyfile_cursor_next(&c))
 	{
-		mowgli_log("keyfile_write(): Failed to open `%s' for writing: %s",
-			filename, strerror(errno));
-		return MCS_FAIL;
-	}
+		if (c.prefix > match)
+			continue;
+		if (c.prefix < match)
+			return NULL;
 
-	mowgli_patricia_foreach(self->sections, keyfile_write_section_cb, f);
+		n = keyfile_common_prefix(c.suffix, key + match);
 
-#ifdef _WIN32
-	_commit(fileno(f));
-#else
-	fsync(fileno(f));
-#endif
-	fclose(f);
+		if (c.suffix[n] == key[match + n])
+			return c.value;
+		if ((unsigned char) c.suffix[n] > (unsigned char) key[match + n])
+			return NULL;
 
-	return MCS_OK;
+		match += n;
+	}
+
+	return NULL;
 }
 
-static mcs_response_t
-keyfile_get_string(keyfile_t *self, const char *section,
-		   const char *key, char **value)
+/*
+ * Replaces count blocks of a section, starting at at, with blocks built
+ * from n sorted pairs. The pairs may point into the blocks replaced.
+ */
+static void
+keyfile_section_splice(keyfile_t *kf, keyfile_section_t *sec, size_t at,
+		       size_t count, const keyfile_pair_t *pairs, size_t n)
 {
-	keyfile_section_t *sec;
-	const char *val;
+	size_t nb = (n + KEYFILE_BLOCK_MAX - 1) / KEYFILE_BLOCK_MAX, i;
+	keyfile_block_t *built = nb ? malloc(nb * sizeof(keyfile_block_t)) : NULL;
 
-	if ((sec = mowgli_patricia_retrieve(self->sections, section)) == NULL)
-		return MCS_FAIL;
-	if ((val = mowgli_patricia_retrieve(sec->lines, key)) == NULL)
-		return MCS_FAIL;
+	for (i = 0; i < nb; i++)
+	{
+		size_t from = n * i / nb, to = n * (i + 1) / nb;
 
-	*value = strdup(val);
+		keyfile_block_encode(&built[i], pairs + from, to - from);
+		kf->usage += KEYFILE_BLOCK_COST(&built[i]);
+	}
 
-	return MCS_OK;
+	for (i = at; i < at + count; i++)
+	{
+		kf->usage -= KEYFILE_BLOCK_COST(&sec->blocks[i]);
+		keyfile_block_release(&sec->blocks[i]);
+	}
+
+	if (nb > count)
+		sec->blocks = realloc(sec->blocks, (sec->nblocks + nb - count) * sizeof(keyfile_block_t));
+
+	memmove(&sec->blocks[at + nb], &sec->blocks[at + count],
+		(sec->nblocks - at - count) * sizeof(keyfile_block_t));
+	sec->nblocks = sec->nblocks + nb - count;
+
+	if (built != NULL)
+	{
+		memcpy(&sec->blocks[at], built, nb * sizeof(keyfile_block_t));
+		free(built);
+	}
+
+	if (sec->nblocks == 0)
+	{
+		free(sec->blocks);
+		sec->blocks = NULL;
+	}
 }
 
-static mcs_response_t
-keyfile_get_int(keyfile_t *self, const char *section,
-	        const char *key, int *value)
+static void
+keyfile_section_set(keyfile_t *kf, keyfile_section_t *sec, const char *key,
+		    const char *value)
 {
-	char *str;
+	keyfile_pair_t pairs[KEYFILE_BLOCK_MAX + 1];
+	size_t at = 0, n = 0, i;
+	int cmp = 1;
 
-	if (!keyfile_get_string(self, section, key, &str))
-		return MCS_FAIL;
+	if (sec->nblocks > 0)
+	{
+		at = keyfile_block_find(sec, key);
+		n = keyfile_block_decode(&sec->blocks[at], pairs);
+	}
 
-	*value = atoi(str);
-	free(str);
+	for (i = 0; i < n && (cmp = strcmp(pairs[i].key, key)) < 0; i++)
+		;
 
-	return MCS_OK;
+	if (i < n && cmp == 0)
+		pairs[i].value = value;
+	else
+	{
+		memmove(&pairs[i + 1], &pairs[i], (n - i) * sizeof(keyfile_pair_t));
+		pairs[i].key = strdup(key);
+		pairs[i].value = value;
+		n++;
+	}
+
+	keyfile_section_splice(kf, sec, at, sec->nblocks > 0 ? 1 : 0, pairs, n);
+	keyfile_pairs_free_keys(pairs, n);
 }
 
-static mcs_response_t
-keyfile_get_bool(keyfile_t *self, const char *section,
-	         const char *key, int *value)
+static void
+keyfile_section_unset(keyfile_t *kf, keyfile_section_t *sec, const char *key)
 {
-	char *str;
+	keyfile_pair_t pairs[KEYFILE_BLOCK_MAX];
+	size_t at, n, i;
 
-	if (!keyfile_get_string(self, section, key, &str))
-		return MCS_FAIL;
+	at = keyfile_block_find(sec, key);
+	n = keyfile_block_decode(&sec->blocks[at], pairs);
 
-	if (!strcasecmp(str, "TRUE"))
-		*value = 1;
-	else
-		*value = 0;
-	free(str);
+	for (i = 0; i < n && strcmp(pairs[i].key, key); i++)
+		;
 
-	return MCS_OK;
+	if (i == n)
+	{
+		keyfile_pairs_free_keys(pairs, n);
+		return;
+	}
+
+	free(pairs[i].key);
+	memmove(&pairs[i], &pairs[i + 1], (n - i - 1) * sizeof(keyfile_pair_t));
+	n--;
+
+	keyfile_section_splice(kf, sec, at, 1, pairs, n);
+	keyfile_pairs_free_keys(pairs, n);
 }
 
-static mcs_response_t
-keyfile_get_float(keyfile_t *self, const char *section,
-	          const char *key, float *value)
+/*
+ * Calls func with every value in a section in key order, until it
+ * returns non-zero. Returns non-zero if func stopped the walk.
+ */
+static int
+keyfile_section_foreach(const keyfile_section_t *sec,
+			int (*func)(const char *key, const char *value, void *privdata),
+			void *privdata)
 {
-	char *str, *locale;
+	keyfile_keybuf_t kb = { NULL, 0 };
+	keyfile_cursor_t c;
+	size_t i;
+	int stop = 0;
 
-	if (!keyfile_get_string(self, section, key, &str))
-		return MCS_FAIL;
+	for (i = 0; i < sec->nblocks && !stop; i++)
+	{
+		keyfile_cursor_init(&c, &sec->blocks[i]);
 
-	locale = strdup(setlocale(LC_NUMERIC, NULL));
-	setlocale(LC_NUMERIC, "C");
-	*value = strtod(str, NULL);
-	setlocale(LC_NUMERIC, locale);
+		while (!stop && keyfile_cursor_next(&c))
+			stop = func(keyfile_keybuf_apply(&kb, c.prefix, c.suffix), c.value, privdata);
+	}
 
-	free(locale);
-	free(str);
+	free(kb.buf);
 
-	return MCS_OK;
+	return stop;
 }
 
-static mcs_response_t
-keyfile_get_double(keyfile_t *self, const char *section,
-	           const char *key, double *value)
+static keyfile_t *
+keyfile_new(void)
 {
-	char *str, *locale;
+	keyfile_t *out;
 
-	if (!keyfile_get_string(self, section, key, &str))
-		return MCS_FAIL;
+	out = mowgli_alloc(sizeof(keyfile_t));
+	out->sections = mowgli_patricia_create(nocanon);
+	out->refs = 1;
+
+	return out;
+}
 
-	locale = strdup(setlocale(LC_NUMERIC, NULL));
-	setlocale(LC_NUMERIC, "C");
-	*value = strtod(str, NULL);
-	setlocale(LC_NUMERIC, locale);
+static void
+keyfile_section_free_cb(const char *key, void *data, void *privdata)
+{
+	keyfile_section_t *sec = data;
+	size_t i;
 
-	free(locale);
-	free(str);
+	if (keyfile_unref(&sec->refs) != 0)
+		return;
 
-	return MCS_OK;
+	for (i = 0; i < sec->nblocks; i++)
+		keyfile_block_release(&sec->blocks[i]);
+
+	free(sec->blocks);
+	free(sec->name);
+	mowgli_free(sec);
 }
 
-static mcs_response_t
-keyfile_set_string(keyfile_t *self, const char *section,
-		   const char *key, const char *value)
+/* drops a reference to a file, freeing it with the last one */
+static void
+keyfile_destroy(keyfile_t *file)
 {
-	keyfile_section_t *sec;
-	char *val;
+	if (file == NULL || keyfile_unref(&file->refs) != 0)
+		return;
 
-	sec = mowgli_patricia_retrieve(self->sections, section);
-	if (sec == NULL)
-		sec = keyfile_create_section(self, section);
+	mowgli_patricia_destroy(file->sections, keyfile_section_free_cb, file);
+	mowgli_free(file);
+}
 
-	if ((val = mowgli_patricia_retrieve(sec->lines, key)) != NULL)
-	{
-		free(val);
+static keyfile_section_t *
+keyfile_create_section(keyfile_t *parent, const char *name)
+{
+	keyfile_section_t *out = mowgli_alloc(sizeof(keyfile_section_t));
 
-		mowgli_patricia_delete(sec->lines, key);
-	}
+	out->name = strdup(name);
+	out->refs = 1;
 
-	mowgli_patricia_add(sec->lines, key, strdup(value));
+	mowgli_patricia_add(parent->sections, out->name, out);
+	parent->usage += KEYFILE_SECTION_COST(name);
 
-	return MCS_OK;
+	return out;
 }
 
-static mcs_response_t
-keyfile_set_int(keyfile_t *self, const char *section,
-		const char *key, int value)
+static int
+keyfile_share_section_cb(const char *key, void *data, void *privdata)
 {
-	char strval[4096];
+	keyfile_section_t *sec = data;
 
-	snprintf(strval, 4096, "%d", value);
-	keyfile_set_string(self, section, key, strval);
+	keyfile_ref(&sec->refs);
+	mowgli_patricia_add(privdata, sec->name, sec);
 
-	return MCS_OK;
+	return 0;
 }
 
+/*
+ * Returns a file which may be changed in place of file: file itself if
+ * nothing else holds it, otherwise a copy sharing its sections, in
+ * which case the caller's reference to file is dropped.
+ */
+static keyfile_t *
+keyfile_unshare(keyfile_t *file)
+{
+	keyfile_t *out;
+
+	if (keyfile_refs(&file->refs) == 1)
+		return file;
+
+	out = keyfile_new();
+	out->usage = file->usage;
+	mowgli_patricia_foreach(file->sections, keyfile_share_section_cb, out->sections);
+
+	keyfile_destroy(file);
+
+	return out;
+}
+
+/*
+ * Returns a section of a file which may be changed, copying its block
+ * list if the section is shared with another file.
+ */
+static keyfile_section_t *
+keyfile_section_unshare(keyfile_t *file, keyfile_section_t *sec)
+{
+	keyfile_section_t *out;
+	size_t i;
+
+	if (keyfile_refs(&sec->refs) == 1)
+		return sec;
+
+	out = mowgli_alloc(sizeof(keyfile_section_t));
+	out->name = strdup(sec->name);
+	out->refs = 1;
+	out->nblocks = sec->nblocks;
+
+	if (sec->nblocks > 0)
+	{
+		out->blocks = malloc(sec->nblocks * sizeof(keyfile_block_t));
+		memcpy(out->blocks, sec->blocks, sec->nblocks * sizeof(keyfile_block_t));
+	}
+
+	for (i = 0; i < out->nblocks; i++)
+		keyfile_ref(keyfile_block_refs(&out->blocks[i]));
+
+	mowgli_patricia_delete(file->sections, sec->name);
+	keyfile_section_free_cb(sec->name, sec, NULL);
+	mowgli_patricia_add(file->sections, out->name, out);
+
+	return out;
+}
+
+/*
+ * Diffing.
+ *
+ * Two files are compared by walking their sections in name order and
+ * the values of each section in key order, side by side, so every value
+ * is read once and none is looked up. Sections and blocks which the two
+ * files still share since one was copied from the other are skipped
+ * without being read, which makes comparing a handle with its own
+ * snapshot cost about as much as the changes made since.
+ */
+
+/* a position in the values of a section */
+typedef struct {
+	const keyfile_section_t *sec;
+	size_t block;
+	keyfile_cursor_t c;
+	keyfile_keybuf_t kb;
+	const char *key;	/* NULL past the end */
+	const char *value;
+	int first;		/* the first value of its block */
+} keyfile_walk_t;
+
+static void
+keyfile_walk_entry(keyfile_walk_t *w, int first)
+{
+	w->key = keyfile_keybuf_apply(&w->kb, w->c.prefix, w->c.suffix);
+	w->value = w->c.value;
+	w->first = first;
+}
+
+/* moves to the first value of the current block or of a later one */
+static void
+keyfile_walk_block(keyfile_walk_t *w)
+{
+	for (; w->sec != NULL && w->block < w->sec->nblocks; w->block++)
+	{
+		keyfile_cursor_init(&w->c, &w->sec->blocks[w->block]);
+
+		if (keyfile_cursor_next(&w->c))
+		{
+			keyfile_walk_entry(w, 1);
+			return;
+		}
+	}
+
+	w->key = NULL;
+}
+
+static void
+keyfile_walk_init(keyfile_walk_t *w, const keyfile_section_t *sec)
+{
+	w->sec = sec;
+	w->block = 0;
+	w->kb.buf = NULL;
+	w->kb.alloc = 0;
+
+	keyfile_walk_block(w);
+}
+
+static void
+keyfile_walk_next(keyfile_walk_t *w)
+{
+	if (keyfile_cursor_next(&w->c))
+		keyfile_walk_entry(w, 0);
+	else
+	{
+		w->block++;
+		keyfile_walk_block(w);
+	}
+}
+
+/* compares the values of one section in two files, either of which may lack it */
+static int
+keyfile_diff_section(const char *name, const keyfile_section_t *from,
+		     const keyfile_section_t *to, mcs_diff_func_t func, void *privdata)
+{
+	keyfile_walk_t a, b;
+	int cmp, stop = 0;
+
+	if (from == NULL)
+		stop = func(MCS_DIFF_ADDED, name, NULL, NULL, NULL, privdata);
+	else if (to == NULL)
+		stop = func(MCS_DIFF_REMOVED, name, NULL, NULL, NULL, privdata);
+
+	keyfile_walk_init(&a, from);
+	keyfile_walk_init(&b, to);
+
+	while (!stop && (a.key != NULL || b.key != NULL))
+	{
+		if (a.key != NULL && b.key != NULL && a.first && b.first &&
+		    a.sec->blocks[a.block].data == b.sec->blocks[b.block].data)
+		{
+			a.block++;
+			b.block++;
+			keyfile_walk_block(&a);
+			keyfile_walk_block(&b);
+			continue;
+		}
+
+		cmp = a.key == NULL ? 1 : b.key == NULL ? -1 : strcmp(a.key, b.key);
+
+		if (cmp < 0)
+		{
+			stop = func(MCS_DIFF_REMOVED, name, a.key, a.value, NULL, privdata);
+			keyfile_walk_next(&a);
+		}
+		else if (cmp > 0)
+		{
+			stop = func(MCS_DIFF_ADDED, name, b.key, NULL, b.value, privdata);
+			keyfile_walk_next(&b);
+		}
+		else
+		{
+			if (strcmp(a.value, b.value))
+				stop = func(MCS_DIFF_CHANGED, name, a.key, a.value, b.value, privdata);
+			keyfile_walk_next(&a);
+			keyfile_walk_next(&b);
+		}
+	}
+
+	free(a.kb.buf);
+	free(b.kb.buf);
+
+	return stop;
+}
+
+typedef struct {
+	keyfile_section_t **sections;
+	size_t count;
+} keyfile_index_t;
+
+static int
+keyfile_index_cb(const char *key, void *data, void *privdata)
+{
+	keyfile_index_t *idx = privdata;
+
+	idx->sections[idx->count++] = data;
+
+	return 0;
+}
+
+static int
+keyfile_index_cmp(const void *a, const void *b)
+{
+	const keyfile_section_t *sa = *(keyfile_section_t * const *) a;
+	const keyfile_section_t *sb = *(keyfile_section_t * const *) b;
+
+	return strcmp(sa->name, sb->name);
+}
+
+/* lists the sections of a file in name order */
+static void
+keyfile_index(const keyfile_t *file, keyfile_index_t *idx)
+{
+	idx->sections = malloc((mowgli_patricia_size(file->sections) + 1) * sizeof(keyfile_section_t *));
+	idx->count = 0;
+
+	mowgli_patricia_foreach(file->sections, keyfile_index_cb, idx);
+
+	if (idx->count > 1)
+		qsort(idx->sections, idx->count, sizeof(keyfile_section_t *), keyfile_index_cmp);
+}
+
+/*
+ * Calls func with every difference between two files, in order of
+ * section and key, until it returns non-zero.
+ */
+static int
+keyfile_diff(const keyfile_t *from, const keyfile_t *to,
+	     mcs_diff_func_t func, void *privdata)
+{
+	keyfile_index_t a, b;
+	size_t i = 0, j = 0;
+	int cmp, stop = 0;
+
+	if (from == to)
+		return 0;
+
+	keyfile_index(from, &a);
+	keyfile_index(to, &b);
+
+	while (!stop && (i < a.count || j < b.count))
+	{
+		cmp = i == a.count ? 1 : j == b.count ? -1 :
+		      strcmp(a.sections[i]->name, b.sections[j]->name);
+
+		if (cmp < 0)
+		{
+			stop = keyfile_diff_section(a.sections[i]->name, a.sections[i], NULL, func, privdata);
+			i++;
+		}
+		else if (cmp > 0)
+		{
+			stop = keyfile_diff_section(b.sections[j]->name, NULL, b.sections[j], func, privdata);
+			j++;
+		}
+		else
+		{
+			if (a.sections[i] != b.sections[j])
+				stop = keyfile_diff_section(a.sections[i]->name, a.sections[i], b.sections[j], func, privdata);
+			i++;
+			j++;
+		}
+	}
+
+	free(a.sections);
+	free(b.sections);
+
+	return stop;
+}
+
+/* identifies the version of a file on disk which was read or written */
+typedef struct {
+	int exists;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_ns;
+} keyfile_stamp_t;
+
+static void
+keyfile_stamp_set(keyfile_stamp_t *stamp, const struct stat *st)
+{
+	stamp->exists = 1;
+	stamp->ino = st->st_ino;
+	stamp->size = st->st_size;
+	stamp->mtime = st->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	stamp->mtime_ns = st->st_mtim.tv_nsec;
+#else
+	stamp->mtime_ns = 0;
+#endif
+}
+
+/* tells whether a file is still the version it was when stamped */
+static int
+keyfile_stamp_current(const keyfile_stamp_t *stamp, const char *filename)
+{
+	keyfile_stamp_t now;
+	struct stat st;
+
+	if (stat(filename, &st) < 0)
+		return !stamp->exists;
+
+	keyfile_stamp_set(&now, &st);
+
+	return stamp->exists && stamp->ino == now.ino && stamp->size == now.size &&
+	       stamp->mtime == now.mtime && stamp->mtime_ns == now.mtime_ns;
+}
+
+typedef struct {
+	keyfile_t *kf;
+	keyfile_section_t *sec;
+	const char *filename;
+} keyfile_load_t;
+
+/*
+ * Builds the blocks of a section without any from n sorted pairs with
+ * distinct keys, returning their cost.
+ */
+static size_t
+keyfile_section_build(keyfile_section_t *sec, const keyfile_pair_t *pairs, size_t n)
+{
+	size_t usage = 0, i;
+
+	sec->nblocks = (n + KEYFILE_BLOCK - 1) / KEYFILE_BLOCK;
+	sec->blocks = sec->nblocks ? malloc(sec->nblocks * sizeof(keyfile_block_t)) : NULL;
+
+	for (i = 0; i < sec->nblocks; i++)
+	{
+		size_t from = i * KEYFILE_BLOCK;
+
+		keyfile_block_encode(&sec->blocks[i], pairs + from,
+				     n - from < KEYFILE_BLOCK ? n - from : KEYFILE_BLOCK);
+		usage += KEYFILE_BLOCK_COST(&sec->blocks[i]);
+	}
+
+	return usage;
+}
+
+static void
+keyfile_load_section(keyfile_load_t *ld, const char *name)
+{
+	if ((ld->sec = mowgli_patricia_retrieve(ld->kf->sections, name)) == NULL)
+		ld->sec = keyfile_create_section(ld->kf, name);
+	else
+		mowgli_log("Duplicate section %s in %s", name, ld->filename);
+}
+
+/* takes ownership of value */
+static void
+keyfile_load_value(keyfile_load_t *ld, const char *key, char *value)
+{
+	keyfile_section_t *sec = ld->sec;
+
+	if (sec->npending == sec->pendalloc)
+	{
+		sec->pendalloc = sec->pendalloc ? sec->pendalloc * 2 : KEYFILE_BLOCK;
+		sec->pending = realloc(sec->pending, sec->pendalloc * sizeof(keyfile_pair_t));
+	}
+
+	sec->pending[sec->npending].key = strdup(key);
+	sec->pending[sec->npending].value = value;
+	sec->pending[sec->npending].seq = sec->npending;
+	sec->npending++;
+}
+
+static int
+keyfile_pair_cmp(const void *a, const void *b)
+{
+	const keyfile_pair_t *pa = a, *pb = b;
+	int ret;
+
+	if ((ret = strcmp(pa->key, pb->key)) != 0)
+		return ret;
+
+	return pa->seq < pb->seq ? -1 : pa->seq > pb->seq;
+}
+
+/*
+ * Sorts the values loaded into a section and builds its blocks. The
+ * first of several values with the same key wins, as it always has.
+ */
+static int
+keyfile_load_finish_cb(const char *name, void *data, void *privdata)
+{
+	keyfile_load_t *ld = privdata;
+	keyfile_section_t *sec = data;
+	keyfile_pair_t *p = sec->pending;
+	size_t i, n = 0;
+
+	if (sec->npending == 0)
+		return 0;
+
+	qsort(p, sec->npending, sizeof(keyfile_pair_t), keyfile_pair_cmp);
+
+	for (i = 0; i < sec->npending; i++)
+	{
+		if (n > 0 && !strcmp(p[n - 1].key, p[i].key))
+		{
+			mowgli_log("Ignoring duplicate value %s in section %s in %s", p[i].key,
+				   sec->name, ld->filename);
+			free(p[i].key);
+			free((char *) p[i].value);
+			continue;
+		}
+
+		p[n++] = p[i];
+	}
+
+	ld->kf->usage += keyfile_section_build(sec, p, n);
+
+	for (i = 0; i < n; i++)
+	{
+		free(p[i].key);
+		free((char *) p[i].value);
+	}
+
+	free(p);
+	sec->pending = NULL;
+	sec->npending = sec->pendalloc = 0;
+
+	return 0;
+}
+
+/* copies a slice from the parser into a string */
+static char *
+keyfile_slice(char *buf, size_t size, const char *str, size_t len)
+{
+	if (len >= size)
+		len = size - 1;
+
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+
+	return buf;
+}
+
+static int
+keyfile_load_section_cb(const char *name, size_t len, void *ctx)
+{
+	char buf[4096];
+
+	keyfile_load_section(ctx, keyfile_slice(buf, sizeof buf, name, len));
+
+	return 0;
+}
+
+static int
+keyfile_load_value_cb(const char *key, size_t keylen, const char *value,
+		      size_t valuelen, void *ctx)
+{
+	char buf[4096];
+
+	keyfile_load_value(ctx, keyfile_slice(buf, sizeof buf, key, keylen),
+			   mcs_strndup(value, valuelen));
+
+	return 0;
+}
+
+static const mcs_keyfile_callbacks_t keyfile_load_callbacks = {
+	keyfile_load_section_cb,
+	keyfile_load_value_cb,
+	NULL
+};
+
+#ifdef HAVE_PTHREAD
+
+/*
+ * Large files are parsed in parallel. The file is read into memory and
+ * cut at section headers into one chunk per thread; each thread parses
+ * its chunk into a flat list of sections and values, copying the names
+ * into an arena of its own and the values into malloc'd strings. The
+ * trees are then built from the lists in file order on the calling
+ * thread, as mowgli's allocators are not thread safe, so duplicates are
+ * resolved and reported exactly as the sequential parser does.
+ */
+
+#define KEYFILE_PARALLEL_MIN	(1024 * 1024)
+#define KEYFILE_MAX_THREADS	8
+
+typedef struct {
+	size_t name;		/* offset of the section name or key in the arena */
+	char *value;		/* NULL for a section */
+} keyfile_event_t;
+
+typedef struct {
+	const char *start;
+	size_t len;
+	keyfile_event_t *events;
+	size_t nevents;
+	size_t events_alloc;
+	char *arena;
+	size_t arena_used;
+	size_t arena_alloc;
+	pthread_t thread;
+	int threaded;
+} keyfile_chunk_t;
+
+static size_t
+keyfile_chunk_name(keyfile_chunk_t *c, const char *name, size_t len)
+{
+	size_t off = c->arena_used;
+
+	if (c->arena_used + len + 1 > c->arena_alloc)
+	{
+		c->arena_alloc = (c->arena_alloc + len + 1) * 2;
+		c->arena = realloc(c->arena, c->arena_alloc);
+	}
+
+	memcpy(c->arena + off, name, len);
+	c->arena[off + len] = '\0';
+	c->arena_used += len + 1;
+
+	return off;
+}
+
+static void
+keyfile_chunk_event(keyfile_chunk_t *c, size_t name, char *value)
+{
+	if (c->nevents == c->events_alloc)
+	{
+		c->events_alloc = c->events_alloc ? c->events_alloc * 2 : 1024;
+		c->events = realloc(c->events, c->events_alloc * sizeof(keyfile_event_t));
+	}
+
+	c->events[c->nevents].name = name;
+	c->events[c->nevents].value = value;
+	c->nevents++;
+}
+
+static int
+keyfile_chunk_section_cb(const char *name, size_t len, void *ctx)
+{
+	keyfile_chunk_event(ctx, keyfile_chunk_name(ctx, name, len), NULL);
+
+	return 0;
+}
+
+static int
+keyfile_chunk_value_cb(const char *key, size_t keylen, const char *value,
+		       size_t valuelen, void *ctx)
+{
+	keyfile_chunk_event(ctx, keyfile_chunk_name(ctx, key, keylen), mcs_strndup(value, valuelen));
+
+	return 0;
+}
+
+static const mcs_keyfile_callbacks_t keyfile_chunk_callbacks = {
+	keyfile_chunk_section_cb,
+	keyfile_chunk_value_cb,
+	NULL
+};
+
+/*
+ * Loads the values a chunk has parsed into a file. This must happen on
+ * one thread, as the section index is not thread safe.
+ */
+static void
+keyfile_chunk_replay(keyfile_load_t *ld, keyfile_chunk_t *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->nevents; i++)
+	{
+		keyfile_event_t *ev = &c->events[i];
+
+		if (ev->value == NULL)
+			keyfile_load_section(ld, c->arena + ev->name);
+		else
+			keyfile_load_value(ld, c->arena + ev->name, ev->value);
+	}
+
+	free(c->events);
+	free(c->arena);
+}
+
+static size_t
+keyfile_read_all(int fd, char *buf, size_t size)
+{
+	size_t got = 0;
+
+	while (got < size)
+	{
+		ssize_t ret = read(fd, buf + got, size - got);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		got += ret;
+	}
+
+	return got;
+}
+
+static void *
+keyfile_chunk_parse(void *arg)
+{
+	keyfile_chunk_t *c = arg;
+
+	mcs_keyfile_parse_buffer(c->start, c->len, &keyfile_chunk_callbacks, c);
+
+	return NULL;
+}
+
+/*
+ * Returns non-zero if the line at p, which follows a newline, is a
+ * section header, so that a chunk may start there.
+ */
+static int
+keyfile_is_header(const char *p, const char *end)
+{
+	size_t len = end - p;
+	const char *nl, *close;
+
+	if (len > 4095)
+		len = 4095;
+	if ((nl = memchr(p, '\n', len)) != NULL)
+		len = nl - p;
+
+	if (len == 0 || *p != '[' || memchr(p, '\0', len) != NULL)
+		return 0;
+
+	close = memchr(p, ']', len);
+
+	return close != NULL;
+}
+
+/*
+ * Finds the first section header at or after off, returning len if
+ * there is none.
+ */
+static size_t
+keyfile_find_split(const char *buf, size_t len, size_t off)
+{
+	const char *p = buf + off, *end = buf + len;
+
+	while (p < end && (p = memchr(p, '\n', end - p)) != NULL)
+	{
+		p++;
+
+		if (keyfile_is_header(p, end))
+			return p - buf;
+	}
+
+	return len;
+}
+
+static int
+keyfile_threads(void)
+{
+	const char *env = getenv("MCS_KEYFILE_THREADS");
+	long n;
+
+	if (env != NULL)
+		n = atol(env);
+	else
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n > KEYFILE_MAX_THREADS)
+		n = KEYFILE_MAX_THREADS;
+
+	return n < 1 ? 1 : (int) n;
+}
+
+/*
+ * Parses a file of size bytes in parallel. Returns zero, having done
+ * nothing, if the file should be parsed sequentially.
+ */
+static int
+keyfile_load_parallel(keyfile_load_t *ld, int fd, size_t size)
+{
+	keyfile_chunk_t chunks[KEYFILE_MAX_THREADS];
+	int nthreads, nchunks = 0, i;
+	size_t pos = 0, got;
+	char *buf;
+
+	if (size < KEYFILE_PARALLEL_MIN || (nthreads = keyfile_threads()) < 2)
+		return 0;
+
+	if ((buf = malloc(size)) == NULL)
+		return 0;
+
+	got = keyfile_read_all(fd, buf, size);
+
+	/* a short read means the file changed under us; parse what we have */
+	memset(chunks, 0, sizeof chunks);
+
+	while (pos < got && nchunks < nthreads)
+	{
+		size_t next = nchunks == nthreads - 1 ? got :
+			keyfile_find_split(buf, got, pos + (got - pos) / (nthreads - nchunks));
+
+		chunks[nchunks].start = buf + pos;
+		chunks[nchunks].len = next - pos;
+		nchunks++;
+		pos = next;
+	}
+
+	for (i = 1; i < nchunks; i++)
+		chunks[i].threaded = pthread_create(&chunks[i].thread, NULL,
+						    keyfile_chunk_parse, &chunks[i]) == 0;
+
+	for (i = 0; i < nchunks; i++)
+		if (!chunks[i].threaded)
+			keyfile_chunk_parse(&chunks[i]);
+
+	for (i = 0; i < nchunks; i++)
+	{
+		if (chunks[i].threaded)
+			pthread_join(chunks[i].thread, NULL);
+
+		keyfile_chunk_replay(ld, &chunks[i]);
+	}
+
+	free(buf);
+
+	return 1;
+}
+
+#endif
+
+static keyfile_t *
+keyfile_open(const char *filename, keyfile_stamp_t *stamp)
+{
+	keyfile_load_t ld;
+	struct stat st;
+	int fd;
+
+	ld.kf = keyfile_new();
+	ld.sec = NULL;
+	ld.filename = filename;
+
+	memset(stamp, 0, sizeof(keyfile_stamp_t));
+
+	if ((fd = open(filename, O_RDONLY | O_BINARY)) < 0)
+		return ld.kf;
+
+	if (fstat(fd, &st) == 0)
+		keyfile_stamp_set(stamp, &st);
+
+#ifdef HAVE_PTHREAD
+	if (!keyfile_load_parallel(&ld, fd, stamp->size))
+#endif
+		mcs_keyfile_parse_fd(fd, &keyfile_load_callbacks, &ld);
+
+	close(fd);
+
+	mowgli_patricia_foreach(ld.kf->sections, keyfile_load_finish_cb, &ld);
+
+	return ld.kf;
+}
+
+static int
+keyfile_write_line_cb(const char *key, const char *value, void *privdata)
+{
+	FILE *f = (FILE *) privdata;
+
+	fprintf(f, "%s=%s\n", key, value);
+
+	return 0;
+}
+
+static int
+keyfile_write_section_cb(const char *key, void *data, void *privdata)
+{
+	FILE *f = (FILE *) privdata;
+	keyfile_section_t *sec = data;
+
+	fprintf(f, "[%s]\n", sec->name);
+	keyfile_section_foreach(sec, keyfile_write_line_cb, f);
+
+	return 0;
+}
+
+static mcs_response_t
+keyfile_write(mcs_handle_t *handle, keyfile_t *self, const char *filename,
+	      keyfile_stamp_t *stamp)
+{
+	FILE *f = fopen(filename, "w+b");
+	unsigned long long start;
+	struct stat st;
+	long bytes;
+
+	if (f == NULL)
+	{
+		mowgli_log("keyfile_write(): Failed to open `%s' for writing: %s",
+			filename, strerror(errno));
+		return MCS_FAIL;
+	}
+
+	mowgli_patricia_foreach(self->sections, keyfile_write_section_cb, f);
+
+	/* a file cut short by a full disk must never replace the config */
+	if (ferror(f) || fflush(f) != 0)
+		goto fail;
+
+	bytes = ftell(f);
+	start = mcs_stat_clock();
+#ifdef _WIN32
+	if (_commit(fileno(f)) != 0)
+		goto fail;
+#else
+	if (fsync(fileno(f)) != 0)
+		goto fail;
+#endif
+	mcs_stat_write(handle, bytes > 0 ? bytes : 0, mcs_stat_clock() - start);
+
+	if (fstat(fileno(f), &st) == 0)
+		keyfile_stamp_set(stamp, &st);
+
+	if (fclose(f) != 0)
+	{
+		f = NULL;
+		goto fail;
+	}
+
+	return MCS_OK;
+
+fail:
+	mowgli_log("keyfile_write(): Failed to write `%s': %s", filename, strerror(errno));
+
+	if (f != NULL)
+		fclose(f);
+	unlink(filename);
+
+	return MCS_FAIL;
+}
+
+static mcs_response_t
+keyfile_get_string(keyfile_t *self, const char *section,
+		   const char *key, char **value)
+{
+	keyfile_section_t *sec;
+	const char *val;
+
+	if ((sec = mowgli_patricia_retrieve(self->sections, section)) == NULL)
+		return MCS_FAIL;
+	if ((val = keyfile_section_lookup(sec, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = strdup(val);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+keyfile_get_int(keyfile_t *self, const char *section,
+	        const char *key, int *value)
+{
+	char *str;
+
+	if (!keyfile_get_string(self, section, key, &str))
+		return MCS_FAIL;
+
+	*value = atoi(str);
+	free(str);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+keyfile_get_bool(keyfile_t *self, const char *section,
+	         const char *key, int *value)
+{
+	char *str;
+
+	if (!keyfile_get_string(self, section, key, &str))
+		return MCS_FAIL;
+
+	if (!strcasecmp(str, "TRUE"))
+		*value = 1;
+	else
+		*value = 0;
+	free(str);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+keyfile_get_float(keyfile_t *self, const char *section,
+	          const char *key, float *value)
+{
+	char *str;
+
+	if (!keyfile_get_string(self, section, key, &str))
+		return MCS_FAIL;
+
+	*value = mcs_strtod_c(str, NULL);
+
+	free(str);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+keyfile_get_double(keyfile_t *self, const char *section,
+	           const char *key, double *value)
+{
+	char *str;
+
+	if (!keyfile_get_string(self, section, key, &str))
+		return MCS_FAIL;
+
+	*value = mcs_strtod_c(str, NULL);
+
+	free(str);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+keyfile_set_string(keyfile_t *self, const char *section,
+		   const char *key, const char *value)
+{
+	keyfile_section_t *sec;
+
+	/* the file is line based, so line breaks cannot be written back */
+	if (strpbrk(section, "\r\n") != NULL || strpbrk(key, "\r\n") != NULL ||
+	    strpbrk(value, "\r\n") != NULL)
+	{
+		mowgli_log("keyfile_set_string(): [%s] %s: line breaks cannot be stored in a keyfile",
+			   section, key);
+		return MCS_FAIL;
+	}
+
+	sec = mowgli_patricia_retrieve(self->sections, section);
+	if (sec == NULL)
+		sec = keyfile_create_section(self, section);
+	else
+		sec = keyfile_section_unshare(self, sec);
+
+	keyfile_section_set(self, sec, key, value);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+keyfile_set_int(keyfile_t *self, const char *section,
+		const char *key, int value)
+{
+	char strval[4096];
+
+	snprintf(strval, 4096, "%d", value);
+	keyfile_set_string(self, section, key, strval);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+keyfile_set_bool(keyfile_t *self, const char *section,
+		 const char *key, int value)
+{
+	if (value)
+		keyfile_set_string(self, section, key, "TRUE");
+	else
+		keyfile_set_string(self, section, key, "FALSE");
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+keyfile_set_float(keyfile_t *self, const char *section,
+		  const char *key, float value)
+{
+	char strval[64];
+
+	mcs_dtostr_c(strval, sizeof strval, value);
+	keyfile_set_string(self, section, key, strval);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+keyfile_set_double(keyfile_t *self, const char *section,
+		   const char *key, double value)
+{
+	char strval[64];
+
+	mcs_dtostr_c(strval, sizeof strval, value);
+	keyfile_set_string(self, section, key, strval);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+keyfile_unset_key(keyfile_t *self, const char *section,
+		  const char *key)
+{
+	keyfile_section_t *sec;
+
+	if ((sec = mowgli_patricia_retrieve(self->sections, section)) != NULL &&
+	    keyfile_section_lookup(sec, key) != NULL)
+		keyfile_section_unset(self, keyfile_section_unshare(self, sec), key);
+
+	return MCS_OK;
+}
+
+static const char *
+keyfile_value(const keyfile_t *kf, const char *section, const char *key)
+{
+	keyfile_section_t *sec = mowgli_patricia_retrieve(kf->sections, section);
+
+	return sec != NULL ? keyfile_section_lookup(sec, key) : NULL;
+}
+
+typedef struct {
+	keyfile_t *kf;
+	const keyfile_t *base;	/* the version of kf the changes were made to */
+	const char *filename;
+} keyfile_merge_t;
+
+static int
+keyfile_streq(const char *a, const char *b)
+{
+	return a == NULL || b == NULL ? a == b : !strcmp(a, b);
+}
+
+/*
+ * Applies one change made by a handle since it loaded its file to the
+ * latest version of that file. Where the file on disk has changed the
+ * same value differently, the handle's change wins.
+ */
+static int
+keyfile_merge_cb(mcs_diff_t change, const char *section, const char *key,
+		 const char *old_value, const char *new_value, void *privdata)
+{
+	keyfile_merge_t *m = privdata;
+	keyfile_section_t *sec = mowgli_patricia_retrieve(m->kf->sections, section);
+	const char *theirs;
+
+	if (key == NULL)
+	{
+		if (change == MCS_DIFF_ADDED && sec == NULL)
+			keyfile_create_section(m->kf, section);
+		return 0;
+	}
+
+	theirs = sec != NULL ? keyfile_section_lookup(sec, key) : NULL;
+
+	if (!keyfile_streq(theirs, keyfile_value(m->base, section, key)) &&
+	    !keyfile_streq(theirs, new_value))
+		mowgli_log("Overwriting concurrent change to [%s] %s in %s",
+			section, key, m->filename);
+
+	if (change == MCS_DIFF_REMOVED)
+		keyfile_unset_key(m->kf, section, key);
+	else
+		keyfile_set_string(m->kf, section, key, new_value);
+
+	return 0;
+}
+
+static int
+keyfile_differs_cb(mcs_diff_t change, const char *section, const char *key,
+		   const char *old_value, const char *new_value, void *privdata)
+{
+	return 1;
+}
+
+/*
+ * Applies a change found on disk to the handle's file, unless the
+ * handle has changed the same value itself and not yet written it.
+ */
+static int
+keyfile_refresh_cb(mcs_diff_t change, const char *section, const char *key,
+		   const char *old_value, const char *new_value, void *privdata)
+{
+	keyfile_t *kf = privdata;
+	keyfile_section_t *sec = mowgli_patricia_retrieve(kf->sections, section);
+
+	if (key == NULL || !keyfile_streq(sec != NULL ? keyfile_section_lookup(sec, key) : NULL, old_value))
+		return 0;
+
+	if (change == MCS_DIFF_REMOVED)
+		keyfile_unset_key(kf, section, key);
+	else
+		keyfile_set_string(kf, section, key, new_value);
+
+	return 0;
+}
+
+static size_t
+keyfile_section_usage(const keyfile_section_t *sec)
+{
+	size_t usage = KEYFILE_SECTION_COST(sec->name), i;
+
+	for (i = 0; i < sec->nblocks; i++)
+		usage += KEYFILE_BLOCK_COST(&sec->blocks[i]);
+
+	return usage;
+}
+
+/* puts another file's section, or none, in place of a section of kf */
+static void
+keyfile_replace_section(keyfile_t *kf, const char *name, keyfile_section_t *with)
+{
+	keyfile_section_t *sec;
+
+	if ((sec = mowgli_patricia_delete(kf->sections, name)) != NULL)
+	{
+		kf->usage -= keyfile_section_usage(sec);
+		keyfile_section_free_cb(sec->name, sec, NULL);
+	}
+
+	if (with != NULL)
+	{
+		keyfile_ref(&with->refs);
+		mowgli_patricia_add(kf->sections, with->name, with);
+		kf->usage += keyfile_section_usage(with);
+	}
+}
+
+typedef struct {
+	mcs_handle_t *handle;
+	int changed;
+} keyfile_notify_t;
+
+static int
+keyfile_notify_cb(mcs_diff_t change, const char *section, const char *key,
+		  const char *old_value, const char *new_value, void *privdata)
+{
+	keyfile_notify_t *n = privdata;
+
+	if (key != NULL)
+		mcs_bindings_update(n->handle, section, key);
+	n->changed = 1;
+
+	return 0;
+}
+
+/*
+ * Serializes the processes writing a file with a lock file next to it,
+ * so that none can replace the file between another reading and
+ * writing it. Returns the descriptor holding the lock, or -1.
+ */
+static int
+keyfile_lock(const char *filename)
+{
+#ifndef _WIN32
+	char lockfile[PATH_MAX];
+	struct flock fl;
+	int fd;
+
+	mcs_strlcpy(lockfile, filename, PATH_MAX);
+	mcs_strlcat(lockfile, ".lock", PATH_MAX);
+
+	if ((fd = open(lockfile, O_RDWR | O_CREAT, 0666)) < 0)
+		return -1;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	while (fcntl(fd, F_SETLKW, &fl) < 0)
+	{
+		if (errno != EINTR)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+static void
+keyfile_unlock(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * Drop-in directories.
+ *
+ * Besides its config file, a domain may have fragments named *.conf in
+ * a config.d directory next to it. The fragments are read in parallel
+ * and layered in lexical order of their names, followed by the config
+ * file, each overriding the values of the layers before it. A section
+ * found in one layer only is shared with that layer; the others are
+ * merged into new blocks. Changes made through a handle are written to
+ * the config file alone, and a fragment which changes on disk is read
+ * again by itself.
+ */
+
+typedef struct {
+	char *path;
+	keyfile_t *kf;
+	keyfile_stamp_t stamp;
+} keyfile_layer_t;
+
+static void
+keyfile_layers_free(keyfile_layer_t *layers, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		keyfile_destroy(layers[i].kf);
+		free(layers[i].path);
+	}
+
+	free(layers);
+}
+
+/* tells whether the drop-in directory and each layer read from it are unchanged */
+static int
+keyfile_layers_current(const char *dir, const keyfile_stamp_t *dirstamp,
+		       const keyfile_layer_t *layers, size_t n)
+{
+	size_t i;
+
+	if (!keyfile_stamp_current(dirstamp, dir))
+		return 0;
+
+	for (i = 0; i < n; i++)
+		if (!keyfile_stamp_current(&layers[i].stamp, layers[i].path))
+			return 0;
+
+	return 1;
+}
+
+static int
+keyfile_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* lists the fragments in a drop-in directory, in lexical order */
+static char **
+keyfile_dropins(const char *dir, size_t *count)
+{
+	char **names = NULL;
+	size_t alloc = 0;
+
+	*count = 0;
+
+#ifndef _WIN32
+	{
+		struct dirent *de;
+		DIR *d;
+
+		if ((d = opendir(dir)) == NULL)
+			return NULL;
+
+		while ((de = readdir(d)) != NULL)
+		{
+			size_t len = strlen(de->d_name);
+
+			if (de->d_name[0] == '.' || len <= 5 || strcmp(de->d_name + len - 5, ".conf"))
+				continue;
+
+			if (*count == alloc)
+			{
+				alloc = alloc ? alloc * 2 : 16;
+				names = realloc(names, alloc * sizeof(char *));
+			}
+
+			names[(*count)++] = strdup(de->d_name);
+		}
+
+		closedir(d);
+	}
+
+	if (*count > 1)
+		qsort(names, *count, sizeof(char *), keyfile_name_cmp);
+#endif
+
+	return names;
+}
+
+#ifdef HAVE_PTHREAD
+
+typedef struct {
+	keyfile_layer_t *layer;
+	keyfile_chunk_t chunk;
+	char *buf;
+} keyfile_job_t;
+
+typedef struct {
+	keyfile_job_t *jobs;
+	size_t count;
+	size_t first;
+	size_t step;
+	pthread_t thread;
+	int threaded;
+} keyfile_worker_t;
+
+static void
+keyfile_job_read(keyfile_job_t *job)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(job->layer->path, O_RDONLY | O_BINARY)) < 0)
+		return;
+
+	if (fstat(fd, &st) == 0 && (job->buf = malloc(st.st_size + 1)) != NULL)
+	{
+		keyfile_stamp_set(&job->layer->stamp, &st);
+
+		job->chunk.start = job->buf;
+		job->chunk.len = keyfile_read_all(fd, job->buf, st.st_size);
+		mcs_keyfile_parse_buffer(job->chunk.start, job->chunk.len,
+					 &keyfile_chunk_callbacks, &job->chunk);
+	}
+
+	close(fd);
+}
+
+static void *
+keyfile_worker_run(void *arg)
+{
+	keyfile_worker_t *w = arg;
+	size_t i;
+
+	for (i = w->first; i < w->count; i += w->step)
+		keyfile_job_read(&w->jobs[i]);
+
+	return NULL;
+}
+
+#endif
+
+/*
+ * Parses the layers which have not been parsed yet, several at once
+ * where threads are available. Returns the number of bytes read.
+ */
+static size_t
+keyfile_layers_parse(keyfile_layer_t *layers, size_t n)
+{
+	size_t bytes = 0, i;
+#ifdef HAVE_PTHREAD
+	keyfile_worker_t workers[KEYFILE_MAX_THREADS];
+	keyfile_job_t *jobs;
+	keyfile_load_t ld;
+	size_t count = 0;
+	int nworkers, t;
+
+	if (n == 0)
+		return 0;
+
+	jobs = calloc(n, sizeof(keyfile_job_t));
+
+	for (i = 0; i < n; i++)
+	{
+		if (layers[i].kf == NULL)
+		{
+			memset(&layers[i].stamp, 0, sizeof(keyfile_stamp_t));
+			jobs[count++].layer = &layers[i];
+		}
+	}
+
+	nworkers = keyfile_threads();
+	if ((size_t) nworkers > count)
+		nworkers = count;
+
+	for (t = 0; t < nworkers; t++)
+	{
+		workers[t].jobs = jobs;
+		workers[t].count = count;
+		workers[t].first = t;
+		workers[t].step = nworkers;
+		workers[t].threaded = t > 0 &&
+			pthread_create(&workers[t].thread, NULL, keyfile_worker_run, &workers[t]) == 0;
+	}
+
+	for (t = 0; t < nworkers; t++)
+		if (!workers[t].threaded)
+			keyfile_worker_run(&workers[t]);
+
+	for (t = 0; t < nworkers; t++)
+		if (workers[t].threaded)
+			pthread_join(workers[t].thread, NULL);
+
+	for (i = 0; i < count; i++)
+	{
+		ld.kf = keyfile_new();
+		ld.sec = NULL;
+		ld.filename = jobs[i].layer->path;
+
+		keyfile_chunk_replay(&ld, &jobs[i].chunk);
+		mowgli_patricia_foreach(ld.kf->sections, keyfile_load_finish_cb, &ld);
+		free(jobs[i].buf);
+
+		jobs[i].layer->kf = ld.kf;
+		bytes += jobs[i].layer->stamp.size;
+	}
+
+	free(jobs);
+#else
+	for (i = 0; i < n; i++)
+	{
+		if (layers[i].kf == NULL)
+		{
+			layers[i].kf = keyfile_open(layers[i].path, &layers[i].stamp);
+			bytes += layers[i].stamp.size;
+		}
+	}
+#endif
+
+	return bytes;
+}
+
+/*
+ * Reads the layers of a drop-in directory, keeping those of an earlier
+ * reading which have not changed since. Returns the number of bytes
+ * read.
+ */
+static size_t
+keyfile_layers_load(const char *dir, keyfile_stamp_t *dirstamp,
+		    const keyfile_layer_t *old, size_t nold,
+		    keyfile_layer_t **layers, size_t *n)
+{
+	char path[PATH_MAX];
+	char **names;
+	struct stat st;
+	size_t i, j = 0;
+
+	memset(dirstamp, 0, sizeof(keyfile_stamp_t));
+	if (stat(dir, &st) == 0)
+		keyfile_stamp_set(dirstamp, &st);
+
+	names = keyfile_dropins(dir, n);
+	*layers = *n ? calloc(*n, sizeof(keyfile_layer_t)) : NULL;
+
+	for (i = 0; i < *n; i++)
+	{
+		snprintf(path, sizeof path, "%s/%s", dir, names[i]);
+		(*layers)[i].path = strdup(path);
+		free(names[i]);
+
+		/* both lists are sorted by path */
+		while (j < nold && strcmp(old[j].path, path) < 0)
+			j++;
+
+		if (j < nold && !strcmp(old[j].path, path) &&
+		    keyfile_stamp_current(&old[j].stamp, path))
+		{
+			(*layers)[i].kf = old[j].kf;
+			(*layers)[i].stamp = old[j].stamp;
+			keyfile_ref(&old[j].kf->refs);
+		}
+	}
+
+	free(names);
+
+	return keyfile_layers_parse(*layers, *n);
+}
+
+/* builds a section holding the values of two, those of over winning */
+static keyfile_section_t *
+keyfile_section_overlay(const keyfile_section_t *under, const keyfile_section_t *over,
+			size_t *usage)
+{
+	keyfile_section_t *out = mowgli_alloc(sizeof(keyfile_section_t));
+	keyfile_pair_t *pairs;
+	keyfile_walk_t a, b;
+	size_t n = 0, i;
+	int cmp;
+
+	for (i = 0; i < under->nblocks; i++)
+		n += under->blocks[i].count;
+	for (i = 0; i < over->nblocks; i++)
+		n += over->blocks[i].count;
+
+	pairs = malloc((n + 1) * sizeof(keyfile_pair_t));
+	n = 0;
+
+	keyfile_walk_init(&a, under);
+	keyfile_walk_init(&b, over);
+
+	while (a.key != NULL || b.key != NULL)
+	{
+		cmp = a.key == NULL ? 1 : b.key == NULL ? -1 : strcmp(a.key, b.key);
+
+		if (cmp < 0)
+		{
+			pairs[n].key = strdup(a.key);
+			pairs[n++].value = a.value;
+			keyfile_walk_next(&a);
+			continue;
+		}
+
+		pairs[n].key = strdup(b.key);
+		pairs[n++].value = b.value;
+		if (cmp == 0)
+			keyfile_walk_next(&a);
+		keyfile_walk_next(&b);
+	}
+
+	free(a.kb.buf);
+	free(b.kb.buf);
+
+	out->name = strdup(over->name);
+	out->refs = 1;
+	*usage = KEYFILE_SECTION_COST(out->name) + keyfile_section_build(out, pairs, n);
+
+	keyfile_pairs_free_keys(pairs, n);
+	free(pairs);
+
+	return out;
+}
+
+static int
+keyfile_overlay_cb(const char *key, void *data, void *privdata)
+{
+	keyfile_t *out = privdata;
+	keyfile_section_t *sec = data, *under, *merged;
+	size_t usage;
+
+	if ((under = mowgli_patricia_retrieve(out->sections, sec->name)) == NULL)
+	{
+		keyfile_replace_section(out, sec->name, sec);
+		return 0;
+	}
+
+	merged = keyfile_section_overlay(under, sec, &usage);
+	keyfile_replace_section(out, sec->name, NULL);
+	mowgli_patricia_add(out->sections, merged->name, merged);
+	out->usage += usage;
+
+	return 0;
+}
+
+/* returns the file seen through a stack of layers topped by top */
+static keyfile_t *
+keyfile_layers_merge(const keyfile_layer_t *layers, size_t n, keyfile_t *top)
+{
+	keyfile_t *out;
+	size_t i;
+
+	if (n == 0)
+	{
+		keyfile_ref(&top->refs);
+		return top;
+	}
+
+	out = keyfile_new();
+
+	for (i = 0; i < n; i++)
+		mowgli_patricia_foreach(layers[i].kf->sections, keyfile_overlay_cb, out);
+	mowgli_patricia_foreach(top->sections, keyfile_overlay_cb, out);
+
+	return out;
+}
+
+/* ***************************************************************** */
+
+extern mcs_backend_t keyfile_backend;
+
+typedef struct {
+	char *loc;
+	char *dir;		/* the drop-in directory */
+	keyfile_t *kf;
+	keyfile_t *merged;	/* the layers and base, as kf started out */
+	keyfile_t *base;	/* loc as last read or written */
+	keyfile_stamp_t stamp;	/* the version of loc base was */
+	keyfile_layer_t *layers;
+	size_t nlayers;
+	keyfile_stamp_t dirstamp;
+	int dirty;
+	int readonly;	/* a snapshot */
+	int detached;	/* a snapshot or clone, only written by mcs_commit() */
+} mcs_keyfile_handle_t;
+
+/* marks the handle as needing to be written back if a change succeeded */
 static mcs_response_t
-keyfile_set_bool(keyfile_t *self, const char *section,
-		 const char *key, int value)
+mcs_keyfile_touch(mcs_keyfile_handle_t *h, mcs_response_t ret)
 {
-	if (value)
-		keyfile_set_string(self, section, key, "TRUE");
-	else
-		keyfile_set_string(self, section, key, "FALSE");
+	if (ret == MCS_OK)
+		h->dirty = 1;
 
-	return MCS_OK;
+	return ret;
 }
 
-static mcs_response_t
-keyfile_set_float(keyfile_t *self, const char *section,
-		  const char *key, float value)
+/*
+ * Returns the path of the drop-in fragment a value of a loaded handle
+ * comes from, or NULL if it was set through the handle or by the config
+ * file itself.
+ */
+static const char *
+mcs_keyfile_layer_of(mcs_keyfile_handle_t *h, const char *section,
+		     const char *key, const char *value)
 {
-	char strval[4096];
-	char *locale;
+	size_t i;
 
-	locale = strdup(setlocale(LC_NUMERIC, NULL));
-	setlocale(LC_NUMERIC, "C");
-	snprintf(strval, 4096, "%g", value);
-	setlocale(LC_NUMERIC, locale);
-	keyfile_set_string(self, section, key, strval);
-	free(locale);
+	if (!keyfile_streq(value, keyfile_value(h->merged, section, key)) ||
+	    keyfile_value(h->base, section, key) != NULL)
+		return NULL;
 
-	return MCS_OK;
+	for (i = h->nlayers; i-- > 0; )
+	{
+		if (keyfile_value(h->layers[i].kf, section, key) != NULL)
+			return h->layers[i].path;
+	}
+
+	return NULL;
 }
 
-static mcs_response_t
-keyfile_set_double(keyfile_t *self, const char *section,
-		   const char *key, double value)
+/*
+ * Returns the parsed file, loading it first if the handle has not been
+ * loaded yet or has been evicted.
+ */
+static keyfile_t *
+mcs_keyfile_file(mcs_handle_t *self)
 {
-	char strval[4096];
-	char *locale;
+	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
+	unsigned long long start;
 
-	locale = strdup(setlocale(LC_NUMERIC, NULL));
-	setlocale(LC_NUMERIC, "C");
-	snprintf(strval, 4096, "%g", value);
-	setlocale(LC_NUMERIC, locale);
-	keyfile_set_string(self, section, key, strval);
-	free(locale);
+	size_t bytes;
 
-	return MCS_OK;
+	if (h->kf == NULL)
+	{
+		start = mcs_stat_clock();
+		h->base = keyfile_open(h->loc, &h->stamp);
+		bytes = h->stamp.size + keyfile_layers_load(h->dir, &h->dirstamp, NULL, 0,
+							    &h->layers, &h->nlayers);
+		mcs_stat_parse(self, bytes, mcs_stat_clock() - start);
+
+		h->merged = keyfile_layers_merge(h->layers, h->nlayers, h->base);
+		h->kf = h->merged;
+		keyfile_ref(&h->kf->refs);
+	}
+
+	return h->kf;
 }
 
-static mcs_response_t
-keyfile_unset_key(keyfile_t *self, const char *section,
-		  const char *key)
+/* drops everything a handle has loaded */
+static void
+mcs_keyfile_unload(mcs_keyfile_handle_t *h)
 {
-	keyfile_section_t *sec;
-	char *value;
-
-	if ((sec = mowgli_patricia_retrieve(self->sections, section)) != NULL)
-	{
-		if ((value = mowgli_patricia_retrieve(sec->lines, key)) != NULL)
-			free(value);
-
-		mowgli_patricia_delete(sec->lines, key);
-	}
+	keyfile_destroy(h->kf);
+	keyfile_destroy(h->merged);
+	keyfile_destroy(h->base);
+	keyfile_layers_free(h->layers, h->nlayers);
 
-	return MCS_OK;
+	h->kf = h->merged = h->base = NULL;
+	h->layers = NULL;
+	h->nlayers = 0;
 }
 
-/* ***************************************************************** */
+/*
+ * Returns the parsed file for a change, first copying whatever of it is
+ * shared with snapshots or clones.
+ */
+static keyfile_t *
+mcs_keyfile_writable(mcs_handle_t *self)
+{
+	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
 
-extern mcs_backend_t keyfile_backend;
+	mcs_keyfile_file(self);
+	h->kf = keyfile_unshare(h->kf);
 
-typedef struct {
-	char *loc;
-	keyfile_t *kf;
-} mcs_keyfile_handle_t;
+	return h->kf;
+}
 
 static mcs_handle_t *
 mcs_keyfile_new(char *domain)
 {
 	char scratch[PATH_MAX];
-	char *magic = getenv("XDG_CONFIG_HOME");
 
 #if defined(_WIN32)
 	const mode_t mode755 = 0;
@@ -409,91 +2224,243 @@ mcs_keyfile_new(char *domain)
 	out->base = &keyfile_backend;
 	out->mcs_priv_handle = h;
 
-	if (magic != NULL)
-		snprintf(scratch, PATH_MAX, "%s/%s", magic, domain);
-	else
-		snprintf(scratch, PATH_MAX, "%s/.config/%s", getenv("HOME"), domain);
-
+	mcs_domain_path(scratch, PATH_MAX, domain, NULL);
 	mcs_create_directory(scratch, mode755);
 	mcs_strlcat(scratch, "/config", PATH_MAX);
 
 	h->loc = strdup(scratch);
-	h->kf = keyfile_open(h->loc);
+
+	mcs_strlcat(scratch, ".d", PATH_MAX);
+	h->dir = strdup(scratch);
+
+	mcs_keyfile_file(out);
 
 	return out;
 }
 
-static void
-mcs_keyfile_destroy(mcs_handle_t *self)
+/*
+ * Returns what to write to a handle's config file: its latest version
+ * on disk, with the changes made through the handle since it last read
+ * its layers applied on top. Values found in drop-in fragments are not
+ * copied into it unless the handle changed them.
+ */
+static keyfile_t *
+mcs_keyfile_rebase(mcs_handle_t *self)
+{
+	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
+	unsigned long long start;
+	keyfile_stamp_t stamp;
+	keyfile_merge_t m;
+	keyfile_t *disk;
+
+	if (keyfile_stamp_current(&h->stamp, h->loc))
+	{
+		disk = h->base;
+		keyfile_ref(&disk->refs);
+	}
+	else
+	{
+		start = mcs_stat_clock();
+		disk = keyfile_open(h->loc, &stamp);
+		mcs_stat_parse(self, stamp.size, mcs_stat_clock() - start);
+	}
+
+	/* merge into a copy sharing the sections of disk */
+	keyfile_ref(&disk->refs);
+	m.kf = keyfile_unshare(disk);
+	m.base = h->base;
+	m.filename = h->loc;
+
+	keyfile_diff(h->merged, h->kf, keyfile_merge_cb, &m);
+	keyfile_destroy(disk);
+
+	return m.kf;
+}
+
+static mcs_response_t
+mcs_keyfile_commit(mcs_handle_t *self)
 {
 	char tfile[PATH_MAX];
 	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
+	keyfile_stamp_t stamp;
+	mcs_response_t ret;
+	keyfile_t *out;
+	int lock;
 
-	return_if_fail(h->kf != NULL);
-	return_if_fail(h->loc != NULL);
+	return_val_if_fail(h->loc != NULL, MCS_FAIL);
+
+	if (!h->dirty || h->kf == NULL)
+		return MCS_OK;
+
+	lock = keyfile_lock(h->loc);
+
+	/* with no layers and nobody else writing, the handle is the file */
+	if (h->nlayers == 0 && keyfile_stamp_current(&h->stamp, h->loc))
+	{
+		out = h->kf;
+		keyfile_ref(&out->refs);
+	}
+	else
+		out = mcs_keyfile_rebase(self);
 
 	mcs_strlcpy(tfile, h->loc, PATH_MAX);
 	mcs_strlcat(tfile, ".tmp", PATH_MAX);
 
-	mcs_response_t ret = keyfile_write(h->kf, tfile);
-	keyfile_destroy(h->kf);
-
-	if (ret == MCS_OK)
+	if ((ret = keyfile_write(self, out, tfile, &stamp)) == MCS_OK)
 	{
+#ifdef _WIN32
+		/* rename() does not replace an existing file there */
 		unlink(h->loc);
+#endif
 		if (rename(tfile, h->loc) < 0)
+		{
 			fprintf(stderr, "rename(%s, %s) failed: %s\n", tfile, h->loc, strerror(errno));
+			unlink(tfile);
+			ret = MCS_FAIL;
+		}
+	}
+
+	if (ret == MCS_OK)
+	{
+		h->dirty = 0;
+		h->stamp = stamp;
+
+		keyfile_destroy(h->base);
+		keyfile_destroy(h->merged);
+		keyfile_destroy(h->kf);
+		h->base = out;
+		h->merged = keyfile_layers_merge(h->layers, h->nlayers, h->base);
+		h->kf = h->merged;
+		keyfile_ref(&h->kf->refs);
 	}
+	else
+		keyfile_destroy(out);
+
+	keyfile_unlock(lock);
+
+	return ret;
+}
+
+static void
+mcs_keyfile_destroy(mcs_handle_t *self)
+{
+	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
+
+	return_if_fail(h->loc != NULL);
+
+	if (!h->detached)
+		mcs_keyfile_commit(self);
+	mcs_keyfile_unload(h);
 
 	free(h->loc);
+	free(h->dir);
 	free(h);
 
 	free(self);
 }
 
+static size_t
+mcs_keyfile_memory_usage(mcs_handle_t *self)
+{
+	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
+
+	if (h->kf == NULL)
+		return 0;
+
+	return sizeof(keyfile_t) + h->kf->usage;
+}
+
 static mcs_response_t
-mcs_keyfile_get_string(mcs_handle_t *self, const char *section,
-		       const char *key, char **value)
+mcs_keyfile_evict(mcs_handle_t *self)
+{
+	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
+
+	if (h->kf == NULL)
+		return MCS_OK;
+
+	/* snapshots and clones could not be loaded again */
+	if (h->detached)
+		return MCS_FAIL;
+
+	if (mcs_keyfile_commit(self) != MCS_OK)
+		return MCS_FAIL;
+
+	mcs_keyfile_unload(h);
+
+	return MCS_OK;
+}
+
+static mcs_handle_t *
+mcs_keyfile_snapshot(mcs_handle_t *self, int writable)
 {
 	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
+	mcs_keyfile_handle_t *sh = calloc(sizeof(mcs_keyfile_handle_t), 1);
+	mcs_handle_t *out = calloc(sizeof(mcs_handle_t), 1);
+	size_t i;
+
+	out->base = &keyfile_backend;
+	out->mcs_priv_handle = sh;
+
+	sh->loc = strdup(h->loc);
+	sh->dir = strdup(h->dir);
+	sh->kf = mcs_keyfile_file(self);
+	keyfile_ref(&sh->kf->refs);
+	sh->merged = h->merged;
+	keyfile_ref(&sh->merged->refs);
+	sh->base = h->base;
+	keyfile_ref(&sh->base->refs);
+	sh->stamp = h->stamp;
+
+	sh->nlayers = h->nlayers;
+	sh->layers = h->nlayers ? calloc(h->nlayers, sizeof(keyfile_layer_t)) : NULL;
+	for (i = 0; i < h->nlayers; i++)
+	{
+		sh->layers[i].path = strdup(h->layers[i].path);
+		sh->layers[i].kf = h->layers[i].kf;
+		sh->layers[i].stamp = h->layers[i].stamp;
+		keyfile_ref(&sh->layers[i].kf->refs);
+	}
+	sh->dirstamp = h->dirstamp;
+	sh->dirty = writable && h->dirty;
+	sh->readonly = !writable;
+	sh->detached = 1;
+
+	return out;
+}
 
-	return keyfile_get_string(h->kf, section, key, value);
+static mcs_response_t
+mcs_keyfile_get_string(mcs_handle_t *self, const char *section,
+		       const char *key, char **value)
+{
+	return keyfile_get_string(mcs_keyfile_file(self), section, key, value);
 }
 
 static mcs_response_t
 mcs_keyfile_get_int(mcs_handle_t *self, const char *section,
 		    const char *key, int *value)
 {
-	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
-
-	return keyfile_get_int(h->kf, section, key, value);
+	return keyfile_get_int(mcs_keyfile_file(self), section, key, value);
 }
 
 static mcs_response_t
 mcs_keyfile_get_bool(mcs_handle_t *self, const char *section,
 		     const char *key, int *value)
 {
-	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
-
-	return keyfile_get_bool(h->kf, section, key, value);
+	return keyfile_get_bool(mcs_keyfile_file(self), section, key, value);
 }
 
 static mcs_response_t
 mcs_keyfile_get_float(mcs_handle_t *self, const char *section,
 		      const char *key, float *value)
 {
-	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
-
-	return keyfile_get_float(h->kf, section, key, value);
+	return keyfile_get_float(mcs_keyfile_file(self), section, key, value);
 }
 
 static mcs_response_t
 mcs_keyfile_get_double(mcs_handle_t *self, const char *section,
 		       const char *key, double *value)
 {
-	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
-
-	return keyfile_get_double(h->kf, section, key, value);
+	return keyfile_get_double(mcs_keyfile_file(self), section, key, value);
 }
 
 static mcs_response_t
@@ -502,7 +2469,10 @@ mcs_keyfile_set_string(mcs_handle_t *self, const char *section,
 {
 	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
 
-	return keyfile_set_string(h->kf, section, key, value);
+	if (h->readonly)
+		return MCS_FAIL;
+
+	return mcs_keyfile_touch(h, keyfile_set_string(mcs_keyfile_writable(self), section, key, value));
 }
 
 static mcs_response_t
@@ -511,7 +2481,10 @@ mcs_keyfile_set_int(mcs_handle_t *self, const char *section,
 {
 	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
 
-	return keyfile_set_int(h->kf, section, key, value);
+	if (h->readonly)
+		return MCS_FAIL;
+
+	return mcs_keyfile_touch(h, keyfile_set_int(mcs_keyfile_writable(self), section, key, value));
 }
 
 static mcs_response_t
@@ -520,7 +2493,10 @@ mcs_keyfile_set_bool(mcs_handle_t *self, const char *section,
 {
 	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
 
-	return keyfile_set_bool(h->kf, section, key, value);
+	if (h->readonly)
+		return MCS_FAIL;
+
+	return mcs_keyfile_touch(h, keyfile_set_bool(mcs_keyfile_writable(self), section, key, value));
 }
 
 static mcs_response_t
@@ -529,7 +2505,10 @@ mcs_keyfile_set_float(mcs_handle_t *self, const char *section,
 {
 	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
 
-	return keyfile_set_float(h->kf, section, key, value);
+	if (h->readonly)
+		return MCS_FAIL;
+
+	return mcs_keyfile_touch(h, keyfile_set_float(mcs_keyfile_writable(self), section, key, value));
 }
 
 static mcs_response_t
@@ -538,7 +2517,10 @@ mcs_keyfile_set_double(mcs_handle_t *self, const char *section,
 {
 	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
 
-	return keyfile_set_double(h->kf, section, key, value);
+	if (h->readonly)
+		return MCS_FAIL;
+
+	return mcs_keyfile_touch(h, keyfile_set_double(mcs_keyfile_writable(self), section, key, value));
 }
 
 static mcs_response_t
@@ -546,8 +2528,17 @@ mcs_keyfile_unset_key(mcs_handle_t *self, const char *section,
 		      const char *key)
 {
 	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
+	const char *value;
+
+	if (h->readonly)
+		return MCS_FAIL;
 
-	return keyfile_unset_key(h->kf, section, key);
+	/* the config file cannot take away what a fragment sets */
+	if ((value = keyfile_value(mcs_keyfile_file(self), section, key)) != NULL &&
+	    mcs_keyfile_layer_of(h, section, key, value) != NULL)
+		return MCS_FAIL;
+
+	return mcs_keyfile_touch(h, keyfile_unset_key(mcs_keyfile_writable(self), section, key));
 }
 
 static int
@@ -562,17 +2553,26 @@ keyfile_collect_lines_cb(const char *key, void *data, void *privdata)
 	return 0;
 }
 
+static int
+keyfile_collect_keys_cb(const char *key, const char *value, void *privdata)
+{
+	mowgli_queue_t **out = privdata;
+
+	*out = mowgli_queue_shift(*out, strdup(key));
+
+	return 0;
+}
+
 static mowgli_queue_t *
 mcs_keyfile_get_keys(mcs_handle_t *self, const char *section)
 {
-	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
-	keyfile_section_t *ks = mowgli_patricia_retrieve(h->kf->sections, section);
+	keyfile_section_t *ks = mowgli_patricia_retrieve(mcs_keyfile_file(self)->sections, section);
 	mowgli_queue_t *out = NULL;
 
 	if (ks == NULL)
 		return NULL;
 
-	mowgli_patricia_foreach(ks->lines, keyfile_collect_lines_cb, &out);
+	keyfile_section_foreach(ks, keyfile_collect_keys_cb, &out);
 
 	return out;
 }
@@ -580,14 +2580,191 @@ mcs_keyfile_get_keys(mcs_handle_t *self, const char *section)
 static mowgli_queue_t *
 mcs_keyfile_get_sections(mcs_handle_t *self)
 {
-	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
 	mowgli_queue_t *out = NULL;
 
-	mowgli_patricia_foreach(h->kf->sections, keyfile_collect_lines_cb, &out);
+	mowgli_patricia_foreach(mcs_keyfile_file(self)->sections, keyfile_collect_lines_cb, &out);
 
 	return out;
 }
 
+typedef struct {
+	const char *section;
+	mcs_iterate_func_t func;
+	void *privdata;
+	int stop;
+} keyfile_iterate_t;
+
+static int
+keyfile_iterate_line_cb(const char *key, const char *value, void *privdata)
+{
+	keyfile_iterate_t *it = privdata;
+
+	it->stop = it->func(it->section, key, value, it->privdata) != 0;
+
+	return it->stop;
+}
+
+static int
+keyfile_iterate_section_cb(const char *key, void *data, void *privdata)
+{
+	keyfile_iterate_t *it = privdata;
+	keyfile_section_t *sec = data;
+
+	if (!it->stop)
+	{
+		it->section = sec->name;
+		keyfile_section_foreach(sec, keyfile_iterate_line_cb, it);
+	}
+
+	return it->stop;
+}
+
+static mcs_response_t
+mcs_keyfile_iterate(mcs_handle_t *self, const char *section,
+		    mcs_iterate_func_t func, void *privdata)
+{
+	keyfile_iterate_t it = { NULL, func, privdata, 0 };
+	keyfile_section_t *sec;
+
+	if (section == NULL)
+	{
+		mowgli_patricia_foreach(mcs_keyfile_file(self)->sections, keyfile_iterate_section_cb, &it);
+		return MCS_OK;
+	}
+
+	if ((sec = mowgli_patricia_retrieve(mcs_keyfile_file(self)->sections, section)) == NULL)
+		return MCS_FAIL;
+
+	keyfile_iterate_section_cb(section, sec, &it);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_keyfile_diff(mcs_handle_t *from, mcs_handle_t *to,
+		 mcs_diff_func_t func, void *privdata)
+{
+	keyfile_diff(mcs_keyfile_file(from), mcs_keyfile_file(to), func, privdata);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_keyfile_get_origin(mcs_handle_t *self, const char *section,
+		       const char *key, char **origin)
+{
+	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
+	const char *value = keyfile_value(mcs_keyfile_file(self), section, key);
+	const char *layer;
+
+	if (value == NULL)
+		return MCS_FAIL;
+
+	layer = mcs_keyfile_layer_of(h, section, key, value);
+	*origin = strdup(layer != NULL ? layer : h->loc);
+
+	return MCS_OK;
+}
+
+/*
+ * Brings a handle up to date with its file and drop-in fragments, of
+ * which only those which changed are read again. Sections which have
+ * not changed are kept as they are, and so stay shared with any
+ * snapshots; changed sections the handle has not touched are taken
+ * from the new reading whole, and those it has are updated value by
+ * value, keeping the handle's own pending changes.
+ */
+static mcs_response_t
+mcs_keyfile_refresh(mcs_handle_t *self)
+{
+	mcs_keyfile_handle_t *h = (mcs_keyfile_handle_t *) self->mcs_priv_handle;
+	keyfile_notify_t notify = { self, 0 };
+	keyfile_stamp_t stamp, dirstamp;
+	keyfile_section_t *was, *now;
+	keyfile_layer_t *layers;
+	keyfile_t *disk, *old, *view;
+	unsigned long long start;
+	keyfile_index_t a, b;
+	size_t i = 0, j = 0, nlayers, bytes = 0;
+	const char *name;
+	int cmp;
+
+	/* snapshots and clones hold the state they were taken with */
+	if (h->detached || (keyfile_stamp_current(&h->stamp, h->loc) &&
+	    keyfile_layers_current(h->dir, &h->dirstamp, h->layers, h->nlayers)))
+		return MCS_OK;
+
+	if (h->kf == NULL)
+	{
+		mcs_keyfile_file(self);
+		mcs_bindings_refresh(self);
+		self->generation++;
+		return MCS_OK;
+	}
+
+	start = mcs_stat_clock();
+	if (keyfile_stamp_current(&h->stamp, h->loc))
+	{
+		disk = h->base;
+		stamp = h->stamp;
+		keyfile_ref(&disk->refs);
+	}
+	else
+	{
+		disk = keyfile_open(h->loc, &stamp);
+		bytes = stamp.size;
+	}
+	bytes += keyfile_layers_load(h->dir, &dirstamp, h->layers, h->nlayers, &layers, &nlayers);
+	mcs_stat_parse(self, bytes, mcs_stat_clock() - start);
+
+	view = keyfile_layers_merge(layers, nlayers, disk);
+
+	old = h->kf;
+	keyfile_ref(&old->refs);
+	h->kf = keyfile_unshare(h->kf);
+
+	keyfile_index(h->merged, &a);
+	keyfile_index(view, &b);
+
+	while (i < a.count || j < b.count)
+	{
+		cmp = i == a.count ? 1 : j == b.count ? -1 :
+		      strcmp(a.sections[i]->name, b.sections[j]->name);
+		was = cmp <= 0 ? a.sections[i++] : NULL;
+		now = cmp >= 0 ? b.sections[j++] : NULL;
+		name = was != NULL ? was->name : now->name;
+
+		if (was == now || (was != NULL && now != NULL &&
+		    !keyfile_diff_section(name, was, now, keyfile_differs_cb, NULL)))
+			continue;
+
+		if (mowgli_patricia_retrieve(h->kf->sections, name) == was)
+			keyfile_replace_section(h->kf, name, now);
+		else
+			keyfile_diff_section(name, was, now, keyfile_refresh_cb, h->kf);
+	}
+
+	free(a.sections);
+	free(b.sections);
+
+	keyfile_diff(old, h->kf, keyfile_notify_cb, &notify);
+	if (notify.changed)
+		self->generation++;
+
+	keyfile_destroy(old);
+	keyfile_destroy(h->base);
+	keyfile_destroy(h->merged);
+	keyfile_layers_free(h->layers, h->nlayers);
+	h->base = disk;
+	h->merged = view;
+	h->layers = layers;
+	h->nlayers = nlayers;
+	h->stamp = stamp;
+	h->dirstamp = dirstamp;
+
+	return MCS_OK;
+}
+
 mcs_backend_t keyfile_backend = {
 	NULL,
 	"default",
@@ -609,5 +2786,21 @@ mcs_backend_t keyfile_backend = {
 	mcs_keyfile_unset_key,
 
 	mcs_keyfile_get_keys,
-	mcs_keyfile_get_sections
+	mcs_keyfile_get_sections,
+
+	mcs_keyfile_commit,
+
+	NULL,
+
+	mcs_keyfile_iterate,
+
+	mcs_keyfile_memory_usage,
+	mcs_keyfile_evict,
+
+	mcs_keyfile_snapshot,
+	mcs_keyfile_diff,
+
+	mcs_keyfile_refresh,
+
+	mcs_keyfile_get_origin
 };
@@ -0,0 +1,239 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A streaming parser for keyfiles.
+ *
+ * The parser reports sections, values and comments to callbacks as it
+ * reads, handing out slices of its own buffer rather than copies, so it
+ * runs in constant memory however large the file is. It accepts exactly
+ * what keyfile_open() always has: input is split into lines the way
+ * fgets(3) splits it into a 4096 byte buffer, the key is the first run
+ * of characters other than '=' and the value runs from the character
+ * after it to the end of the line, and values before the first section
+ * are dropped.
+ */
+
+#include "libmcs/mcs.h"
+
+/* the longest line fgets() returns into the 4096 byte buffer we used */
+#define PARSE_LINE_MAX		4095
+
+#define PARSE_BUFSIZE		65536
+
+typedef struct {
+	const mcs_keyfile_callbacks_t *cb;
+	void *ctx;
+	int in_section;
+} parse_state_t;
+
+/*
+ * Parses one line, as fgets() would have returned it. Returns non-zero
+ * if a callback asked to stop.
+ */
+static int
+parse_line(parse_state_t *st, const char *line, size_t len)
+{
+	const char *p, *end, *key, *keyend, *value, *nul;
+
+	/* everything after a NUL byte was invisible to the string functions */
+	if ((nul = memchr(line, '\0', len)) != NULL)
+		len = nul - line;
+
+	if (len == 0)
+		return 0;
+
+	end = line + len;
+
+	if (line[0] == '[')
+	{
+		if ((p = memchr(line, ']', len)) == NULL)
+			return 0;
+
+		st->in_section = 1;
+
+		return st->cb->section != NULL ?
+			st->cb->section(line + 1, p - line - 1, st->ctx) : 0;
+	}
+
+	if (line[0] == '#')
+	{
+		if (end[-1] == '\n')
+			end--;
+
+		return st->cb->comment != NULL ?
+			st->cb->comment(line, end - line, st->ctx) : 0;
+	}
+
+	if (!st->in_section || memchr(line, '=', len) == NULL)
+		return 0;
+
+	/* these are the tokens strtok(line, "=") and strtok(NULL, "\n") gave */
+	for (p = line; p < end && *p == '='; p++)
+		;
+	for (key = p; p < end && *p != '='; p++)
+		;
+
+	if (p == end)
+		return 0;
+
+	for (keyend = p++; p < end && *p == '\n'; p++)
+		;
+	for (value = p; p < end && *p != '\n'; p++)
+		;
+
+	if (p == value || st->cb->value == NULL)
+		return 0;
+
+	return st->cb->value(key, keyend - key, value, p - value, st->ctx);
+}
+
+/*
+ * Returns the length of the line at the start of buf, or 0 if the line
+ * might continue beyond len bytes and more input is to come.
+ */
+static size_t
+parse_next_line(const char *buf, size_t len, int eof)
+{
+	size_t n = len > PARSE_LINE_MAX ? PARSE_LINE_MAX : len;
+	const char *nl;
+
+	if ((nl = memchr(buf, '\n', n)) != NULL)
+		return nl - buf + 1;
+
+	if (n == PARSE_LINE_MAX || eof)
+		return n;
+
+	return 0;
+}
+
+/**
+ * \brief Parses keyfile data held in memory.
+ *
+ * The slices passed to the callbacks point into buf and are not
+ * NUL-terminated.
+ *
+ * \param buf The data to parse.
+ * \param len The length of the data.
+ * \param cb The callbacks to report the contents to; any may be NULL.
+ * \param ctx Opaque data passed to the callbacks.
+ *
+ * \return MCS_OK, or MCS_FAIL if a callback stopped the parse.
+ */
+mcs_response_t
+mcs_keyfile_parse_buffer(const char *buf, size_t len,
+			 const mcs_keyfile_callbacks_t *cb, void *ctx)
+{
+	parse_state_t st = { cb, ctx, 0 };
+	size_t pos = 0, n;
+
+	return_val_if_fail(cb != NULL, MCS_FAIL);
+
+	while (pos < len)
+	{
+		n = parse_next_line(buf + pos, len - pos, 1);
+
+		if (parse_line(&st, buf + pos, n))
+			return MCS_FAIL;
+
+		pos += n;
+	}
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Parses keyfile data read from a file descriptor.
+ *
+ * The data is read in blocks until the end of the file, so memory use
+ * does not depend on its size. The slices passed to the callbacks are
+ * only valid until the callback returns.
+ *
+ * \param fd The file descriptor to read from.
+ * \param cb The callbacks to report the contents to; any may be NULL.
+ * \param ctx Opaque data passed to the callbacks.
+ *
+ * \return MCS_OK, or MCS_FAIL if reading failed or a callback stopped
+ *         the parse.
+ */
+mcs_response_t
+mcs_keyfile_parse_fd(int fd, const mcs_keyfile_callbacks_t *cb, void *ctx)
+{
+	parse_state_t st = { cb, ctx, 0 };
+	char *buf;
+	size_t start = 0, end = 0, n;
+	mcs_response_t ret = MCS_OK;
+	int eof = 0;
+
+	return_val_if_fail(cb != NULL, MCS_FAIL);
+
+	buf = malloc(PARSE_BUFSIZE);
+
+	while (ret == MCS_OK)
+	{
+		if ((n = parse_next_line(buf + start, end - start, eof)) == 0)
+		{
+			ssize_t got;
+
+			if (eof)
+				break;
+
+			memmove(buf, buf + start, end - start);
+			end -= start;
+			start = 0;
+
+			if ((got = read(fd, buf + end, PARSE_BUFSIZE - end)) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				mowgli_log("mcs_keyfile_parse_fd(): read failed: %s", strerror(errno));
+				ret = MCS_FAIL;
+			}
+			else if (got == 0)
+				eof = 1;
+			else
+				end += got;
+
+			continue;
+		}
+
+		if (parse_line(&st, buf + start, n))
+			ret = MCS_FAIL;
+
+		start += n;
+	}
+
+	free(buf);
+
+	return ret;
+}
@@ -0,0 +1,564 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The memory backend keeps everything in process memory and never touches
+ * the filesystem. Values are stored in the type they were set with, so a
+ * get of the same type is a pair of patricia lookups and a copy; cross-type
+ * gets are converted through the same string representation the keyfile
+ * backend would have written, so both backends agree on the result.
+ *
+ * Because it does nothing but the lookups themselves, it is also the
+ * baseline to measure the mcs.handle dispatch overhead against.
+ */
+
+#include "libmcs/mcs.h"
+
+typedef enum {
+	MEMORY_STRING,
+	MEMORY_INT,
+	MEMORY_BOOL,
+	MEMORY_FLOAT,
+	MEMORY_DOUBLE
+} memory_type_t;
+
+typedef struct {
+	memory_type_t type;
+	union {
+		char *s;
+		int i;
+		float f;
+		double d;
+	} u;
+} memory_value_t;
+
+typedef struct {
+	mowgli_patricia_t *sections;
+} mcs_memory_handle_t;
+
+extern mcs_backend_t memory_backend;
+
+static void nocanon(char *str) {}
+
+static void
+memory_value_free(memory_value_t *val)
+{
+	if (val->type == MEMORY_STRING)
+		free(val->u.s);
+
+	mowgli_free(val);
+}
+
+static void
+memory_value_free_cb(const char *key, void *data, void *privdata)
+{
+	memory_value_free(data);
+}
+
+static void
+memory_section_free_cb(const char *key, void *data, void *privdata)
+{
+	mowgli_patricia_destroy(data, memory_value_free_cb, NULL);
+}
+
+static memory_value_t *
+memory_lookup(mcs_handle_t *self, const char *section, const char *key)
+{
+	mcs_memory_handle_t *h = (mcs_memory_handle_t *) self->mcs_priv_handle;
+	mowgli_patricia_t *sec;
+
+	if ((sec = mowgli_patricia_retrieve(h->sections, section)) == NULL)
+		return NULL;
+
+	return mowgli_patricia_retrieve(sec, key);
+}
+
+/*
+ * Returns a zeroed value slot for section/key, releasing whatever was
+ * stored there before.
+ */
+static memory_value_t *
+memory_store(mcs_handle_t *self, const char *section, const char *key)
+{
+	mcs_memory_handle_t *h = (mcs_memory_handle_t *) self->mcs_priv_handle;
+	mowgli_patricia_t *sec;
+	memory_value_t *val;
+
+	if ((sec = mowgli_patricia_retrieve(h->sections, section)) == NULL)
+	{
+		sec = mowgli_patricia_create(nocanon);
+		mowgli_patricia_add(h->sections, section, sec);
+	}
+
+	if ((val = mowgli_patricia_retrieve(sec, key)) != NULL)
+	{
+		if (val->type == MEMORY_STRING)
+			free(val->u.s);
+
+		memset(val, 0, sizeof(memory_value_t));
+		return val;
+	}
+
+	val = mowgli_alloc(sizeof(memory_value_t));
+	mowgli_patricia_add(sec, key, val);
+
+	return val;
+}
+
+/*
+ * Renders a non-string value the way the keyfile backend stores it.
+ */
+static void
+memory_value_format(memory_value_t *val, char *buf, size_t len)
+{
+	switch (val->type)
+	{
+	case MEMORY_INT:
+		snprintf(buf, len, "%d", val->u.i);
+		break;
+	case MEMORY_BOOL:
+		mcs_strlcpy(buf, val->u.i ? "TRUE" : "FALSE", len);
+		break;
+	case MEMORY_FLOAT:
+		mcs_dtostr_c(buf, len, val->u.f);
+		break;
+	case MEMORY_DOUBLE:
+		mcs_dtostr_c(buf, len, val->u.d);
+		break;
+	default:
+		mcs_strlcpy(buf, val->u.s, len);
+		break;
+	}
+}
+
+static const char *
+memory_value_string(memory_value_t *val, char *buf, size_t len)
+{
+	if (val->type == MEMORY_STRING)
+		return val->u.s;
+
+	memory_value_format(val, buf, len);
+
+	return buf;
+}
+
+/* ***************************************************************** */
+
+static mcs_handle_t *
+mcs_memory_new(char *domain)
+{
+	mcs_memory_handle_t *h = calloc(sizeof(mcs_memory_handle_t), 1);
+	mcs_handle_t *out = calloc(sizeof(mcs_handle_t), 1);
+
+	out->base = &memory_backend;
+	out->mcs_priv_handle = h;
+
+	h->sections = mowgli_patricia_create(nocanon);
+
+	return out;
+}
+
+static void
+mcs_memory_destroy(mcs_handle_t *self)
+{
+	mcs_memory_handle_t *h = (mcs_memory_handle_t *) self->mcs_priv_handle;
+
+	mowgli_patricia_destroy(h->sections, memory_section_free_cb, NULL);
+
+	free(h);
+	free(self);
+}
+
+static mcs_response_t
+mcs_memory_get_string(mcs_handle_t *self, const char *section,
+		      const char *key, char **value)
+{
+	memory_value_t *val;
+	char buf[64];
+
+	if ((val = memory_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	*value = strdup(memory_value_string(val, buf, sizeof buf));
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_memory_get_int(mcs_handle_t *self, const char *section,
+		   const char *key, int *value)
+{
+	memory_value_t *val;
+	char buf[64];
+
+	if ((val = memory_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	if (val->type == MEMORY_INT)
+		*value = val->u.i;
+	else
+		*value = atoi(memory_value_string(val, buf, sizeof buf));
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_memory_get_bool(mcs_handle_t *self, const char *section,
+		    const char *key, int *value)
+{
+	memory_value_t *val;
+	char buf[64];
+
+	if ((val = memory_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	if (val->type == MEMORY_BOOL)
+		*value = val->u.i;
+	else
+		*value = !strcasecmp(memory_value_string(val, buf, sizeof buf), "TRUE");
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_memory_get_float(mcs_handle_t *self, const char *section,
+		     const char *key, float *value)
+{
+	memory_value_t *val;
+	char buf[64];
+
+	if ((val = memory_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	if (val->type == MEMORY_FLOAT)
+		*value = val->u.f;
+	else
+		*value = mcs_strtod_c(memory_value_string(val, buf, sizeof buf), NULL);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_memory_get_double(mcs_handle_t *self, const char *section,
+		      const char *key, double *value)
+{
+	memory_value_t *val;
+	char buf[64];
+
+	if ((val = memory_lookup(self, section, key)) == NULL)
+		return MCS_FAIL;
+
+	if (val->type == MEMORY_DOUBLE)
+		*value = val->u.d;
+	else
+		*value = mcs_strtod_c(memory_value_string(val, buf, sizeof buf), NULL);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_memory_set_string(mcs_handle_t *self, const char *section,
+		      const char *key, const char *value)
+{
+	memory_value_t *val = memory_store(self, section, key);
+
+	val->type = MEMORY_STRING;
+	val->u.s = strdup(value);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_memory_set_int(mcs_handle_t *self, const char *section,
+		   const char *key, int value)
+{
+	memory_value_t *val = memory_store(self, section, key);
+
+	val->type = MEMORY_INT;
+	val->u.i = value;
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_memory_set_bool(mcs_handle_t *self, const char *section,
+		    const char *key, int value)
+{
+	memory_value_t *val = memory_store(self, section, key);
+
+	val->type = MEMORY_BOOL;
+	val->u.i = value ? 1 : 0;
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_memory_set_float(mcs_handle_t *self, const char *section,
+		     const char *key, float value)
+{
+	memory_value_t *val = memory_store(self, section, key);
+
+	val->type = MEMORY_FLOAT;
+	val->u.f = value;
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_memory_set_double(mcs_handle_t *self, const char *section,
+		      const char *key, double value)
+{
+	memory_value_t *val = memory_store(self, section, key);
+
+	val->type = MEMORY_DOUBLE;
+	val->u.d = value;
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_memory_unset_key(mcs_handle_t *self, const char *section,
+		     const char *key)
+{
+	mcs_memory_handle_t *h = (mcs_memory_handle_t *) self->mcs_priv_handle;
+	mowgli_patricia_t *sec;
+	memory_value_t *val;
+
+	if ((sec = mowgli_patricia_retrieve(h->sections, section)) == NULL)
+		return MCS_OK;
+
+	if ((val = mowgli_patricia_delete(sec, key)) != NULL)
+		memory_value_free(val);
+
+	return MCS_OK;
+}
+
+static int
+memory_collect_names_cb(const char *key, void *data, void *privdata)
+{
+	mowgli_queue_t **out = privdata;
+
+	*out = mowgli_queue_shift(*out, strdup(key));
+
+	return 0;
+}
+
+static mowgli_queue_t *
+mcs_memory_get_keys(mcs_handle_t *self, const char *section)
+{
+	mcs_memory_handle_t *h = (mcs_memory_handle_t *) self->mcs_priv_handle;
+	mowgli_patricia_t *sec;
+	mowgli_queue_t *out = NULL;
+
+	if ((sec = mowgli_patricia_retrieve(h->sections, section)) == NULL)
+		return NULL;
+
+	mowgli_patricia_foreach(sec, memory_collect_names_cb, &out);
+
+	return out;
+}
+
+static mowgli_queue_t *
+mcs_memory_get_sections(mcs_handle_t *self)
+{
+	mcs_memory_handle_t *h = (mcs_memory_handle_t *) self->mcs_priv_handle;
+	mowgli_queue_t *out = NULL;
+
+	mowgli_patricia_foreach(h->sections, memory_collect_names_cb, &out);
+
+	return out;
+}
+
+/*
+ * Nothing here blocks, so asynchronous requests are answered on the spot
+ * instead of waiting for the next pass of the event loop. They still go
+ * through the public functions, as they would from the loop, so that
+ * they are counted and update bound variables.
+ */
+static mcs_response_t
+mcs_memory_async_submit(mcs_handle_t *self, mcs_async_request_t *req)
+{
+	switch (req->op)
+	{
+	case MCS_ASYNC_GET_STRING:
+		req->response = mcs_get_string(self, req->section, req->key, &req->value);
+		break;
+	case MCS_ASYNC_SET_STRING:
+		req->response = mcs_set_string(self, req->section, req->key, req->value);
+		break;
+	case MCS_ASYNC_COMMIT:
+		req->response = MCS_OK;
+		break;
+	}
+
+	mcs_async_complete(req);
+
+	return MCS_OK;
+}
+
+/* ***************************************************************** */
+
+/**
+ * \brief Creates a memory-backed copy of an existing mcs.handle.
+ *
+ * Every key visible through the source handle is copied as a string into
+ * a new handle of the "memory" backend, regardless of which backend the
+ * source uses. The copy never writes anything back, so it is suitable for
+ * sandboxes and for throwaway per-request overrides.
+ *
+ * \param src The mcs.handle object to copy.
+ * \return A new mcs.handle object, or NULL if the memory backend is not
+ *         registered.
+ */
+mcs_handle_t *
+mcs_memory_new_from_handle(mcs_handle_t *src)
+{
+	mcs_handle_t *out;
+	mowgli_queue_t *sections, *keys, *i, *j;
+
+	if ((out = mcs_new_with_backend(memory_backend.name, NULL)) == NULL)
+		return NULL;
+
+	sections = mcs_get_sections(src);
+
+	for (i = sections; i != NULL; i = i->next)
+	{
+		keys = mcs_get_keys(src, i->data);
+
+		for (j = keys; j != NULL; j = j->next)
+		{
+			char *value;
+
+			if (mcs_get_string(src, i->data, j->data, &value))
+			{
+				mcs_memory_set_string(out, i->data, j->data, value);
+				free(value);
+			}
+
+			free(j->data);
+		}
+
+		mowgli_queue_destroy(keys);
+		free(i->data);
+	}
+
+	mowgli_queue_destroy(sections);
+
+	return out;
+}
+
+typedef struct {
+	const char *section;
+	mcs_iterate_func_t func;
+	void *privdata;
+	int stop;
+} memory_iterate_t;
+
+static int
+memory_iterate_value_cb(const char *key, void *data, void *privdata)
+{
+	memory_iterate_t *it = privdata;
+	char buf[64];
+
+	if (!it->stop)
+		it->stop = it->func(it->section, key,
+				    memory_value_string(data, buf, sizeof buf),
+				    it->privdata) != 0;
+
+	return it->stop;
+}
+
+static int
+memory_iterate_section_cb(const char *key, void *data, void *privdata)
+{
+	memory_iterate_t *it = privdata;
+
+	if (!it->stop)
+	{
+		it->section = key;
+		mowgli_patricia_foreach(data, memory_iterate_value_cb, it);
+	}
+
+	return it->stop;
+}
+
+static mcs_response_t
+mcs_memory_iterate(mcs_handle_t *self, const char *section,
+		   mcs_iterate_func_t func, void *privdata)
+{
+	mcs_memory_handle_t *h = (mcs_memory_handle_t *) self->mcs_priv_handle;
+	memory_iterate_t it = { NULL, func, privdata, 0 };
+	mowgli_patricia_t *sec;
+
+	if (section == NULL)
+	{
+		mowgli_patricia_foreach(h->sections, memory_iterate_section_cb, &it);
+		return MCS_OK;
+	}
+
+	if ((sec = mowgli_patricia_retrieve(h->sections, section)) == NULL)
+		return MCS_FAIL;
+
+	memory_iterate_section_cb(section, sec, &it);
+
+	return MCS_OK;
+}
+
+mcs_backend_t memory_backend = {
+	NULL,
+	"memory",
+	mcs_memory_new,
+	mcs_memory_destroy,
+
+	mcs_memory_get_string,
+	mcs_memory_get_int,
+	mcs_memory_get_bool,
+	mcs_memory_get_float,
+	mcs_memory_get_double,
+
+	mcs_memory_set_string,
+	mcs_memory_set_int,
+	mcs_memory_set_bool,
+	mcs_memory_set_float,
+	mcs_memory_set_double,
+
+	mcs_memory_unset_key,
+
+	mcs_memory_get_keys,
+	mcs_memory_get_sections,
+
+	NULL,
+
+	mcs_memory_async_submit,
+
+	mcs_memory_iterate
+};
@@ -0,0 +1,1799 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The pagestore backend keeps a domain in a single file (config.pages)
+ * organised as a copy-on-write B+tree of fixed size pages, for domains
+ * which are too large to parse or rewrite as a whole.
+ *
+ * Every record is keyed by section, a NUL byte and key, so a section is a
+ * contiguous range of the tree. A point lookup or update reads one page
+ * per tree level through a bounded page cache.
+ *
+ * Pages of the last committed tree are never modified: the first change
+ * to a page within a transaction copies it to a free page, and its
+ * parents up to the root are copied in turn. mcs_commit() writes only
+ * those copies, syncs them, and then flips to the new root by writing one
+ * of the two meta pages, which alternate between transactions. A crash
+ * at any point leaves at least one valid meta page pointing at a
+ * complete tree.
+ *
+ * Pages released by a transaction are only reused once the following
+ * transaction has committed, as the previous meta page still refers to
+ * them until then. The free lists are stored in page chains referenced
+ * from the meta page.
+ *
+ * Empty leaves are unlinked from the tree, but underfull pages are not
+ * merged.
+ *
+ * There are no overflow pages. A record, that is its two lengths, the
+ * section, the NUL, the key and the value, takes at most PS_MAX_ENTRY
+ * bytes, so that a page split always leaves room for the new record;
+ * larger ones are refused.
+ */
+
+#include <stdint.h>
+#include <fcntl.h>
+#ifndef _WIN32
+# include <sys/file.h>
+#endif
+
+#include "libmcs/mcs.h"
+
+#define PS_FILENAME		"config.pages"
+#define PS_MAGIC		"MCSPAGE1"
+#define PS_PAGE_SIZE		4096
+#define PS_MAX_ENTRY		1024
+#define PS_CACHE_PAGES		1024
+
+#define PS_LEAF			1
+#define PS_BRANCH		2
+#define PS_FREELIST		3
+
+typedef struct {
+	char magic[8];
+	uint32_t page_size;
+	uint32_t root;
+	uint64_t txnid;
+	uint32_t npages;
+	uint32_t free_ready;	/* head of the reusable page chain */
+	uint32_t free_pending;	/* head of the chain released by txnid */
+	uint32_t reserved;
+	uint64_t checksum;
+} ps_meta_t;
+
+/*
+ * Every tree page starts with this header. Slot offsets follow it and
+ * grow upwards, entries are packed from the end of the page downwards.
+ *
+ * Leaf entries are: uint16 key length, uint16 value length, key, value.
+ * Branch entries are: uint32 child, uint16 key length, key; the child
+ * holds keys greater than or equal to the entry key, keys below the first
+ * entry live in the leftmost child. Free list pages store page numbers
+ * where the slots would be.
+ */
+typedef struct {
+	uint16_t type;
+	uint16_t nkeys;
+	uint16_t lower;
+	uint16_t upper;
+	uint32_t link;		/* leftmost child, or next free list page */
+	uint32_t reserved;
+} ps_page_hdr_t;
+
+#define PS_FREE_PER_PAGE	((PS_PAGE_SIZE - sizeof(ps_page_hdr_t)) / sizeof(uint32_t))
+
+typedef struct ps_page_ {
+	uint32_t pgno;
+	int dirty;
+	unsigned char *data;
+	struct ps_page_ *prev, *next;	/* LRU list of clean pages */
+} ps_page_t;
+
+typedef struct {
+	uint32_t *v;
+	size_t n;
+	size_t alloc;
+} ps_pgvec_t;
+
+typedef struct {
+	int fd;
+	int readonly;
+
+	uint64_t txnid;
+	uint32_t root;
+	uint32_t npages;
+	int changed;
+
+	ps_page_t **cache;	/* indexed by page number */
+	size_t cache_alloc;
+	ps_page_t *lru_head, *lru_tail;
+	size_t nclean;
+	size_t capacity;
+
+	ps_pgvec_t dirty;
+	ps_pgvec_t free_ready;		/* reusable in this transaction */
+	ps_pgvec_t free_pending;	/* released by the last commit */
+	ps_pgvec_t freed;		/* released by this transaction */
+	ps_pgvec_t chain;		/* free list pages of the last commit */
+} mcs_pagestore_handle_t;
+
+typedef struct {
+	const unsigned char *data;
+	size_t len;
+} ps_key_t;
+
+typedef struct {
+	uint32_t pgno[32];
+	uint16_t idx[32];
+	int depth;
+} ps_cursor_t;
+
+extern mcs_backend_t pagestore_backend;
+
+/* ***************************************************************** */
+
+static void
+ps_pgvec_push(ps_pgvec_t *vec, uint32_t pgno)
+{
+	if (vec->n == vec->alloc)
+	{
+		vec->alloc = vec->alloc ? vec->alloc * 2 : 64;
+		vec->v = realloc(vec->v, vec->alloc * sizeof(uint32_t));
+	}
+
+	vec->v[vec->n++] = pgno;
+}
+
+static void
+ps_pgvec_free(ps_pgvec_t *vec)
+{
+	free(vec->v);
+	memset(vec, 0, sizeof(ps_pgvec_t));
+}
+
+static uint16_t
+ps_get16(const unsigned char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint32_t
+ps_get32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static void
+ps_put16(unsigned char *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof v);
+}
+
+static void
+ps_put32(unsigned char *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof v);
+}
+
+static uint64_t
+ps_meta_checksum(const ps_meta_t *meta)
+{
+	const unsigned char *p = (const unsigned char *) meta;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < offsetof(ps_meta_t, checksum); i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+
+	return h;
+}
+
+static int
+ps_key_cmp(ps_key_t a, ps_key_t b)
+{
+	int ret = memcmp(a.data, b.data, a.len < b.len ? a.len : b.len);
+
+	if (ret != 0)
+		return ret;
+
+	return a.len < b.len ? -1 : a.len > b.len;
+}
+
+/*
+ * Builds the composite record key: section, NUL, key. Returns 0 if the
+ * result does not fit into buf.
+ */
+static int
+ps_make_key(unsigned char *buf, size_t len, const char *section,
+	    const char *key, ps_key_t *out)
+{
+	size_t slen = strlen(section), klen = key != NULL ? strlen(key) : 0;
+
+	if (slen + 1 + klen > len)
+		return 0;
+
+	memcpy(buf, section, slen);
+	buf[slen] = '\0';
+	if (klen)
+		memcpy(buf + slen + 1, key, klen);
+
+	out->data = buf;
+	out->len = slen + 1 + klen;
+
+	return 1;
+}
+
+/* ***************************************************************** */
+
+static ps_page_hdr_t *
+ps_hdr(ps_page_t *pg)
+{
+	return (ps_page_hdr_t *) pg->data;
+}
+
+static unsigned char *
+ps_entry(ps_page_t *pg, unsigned int i)
+{
+	return pg->data + ps_get16(pg->data + sizeof(ps_page_hdr_t) + i * 2);
+}
+
+static ps_key_t
+ps_entry_key(ps_page_t *pg, unsigned int i)
+{
+	unsigned char *e = ps_entry(pg, i);
+	ps_key_t k;
+
+	if (ps_hdr(pg)->type == PS_LEAF)
+	{
+		k.len = ps_get16(e);
+		k.data = e + 4;
+	}
+	else
+	{
+		k.len = ps_get16(e + 4);
+		k.data = e + 6;
+	}
+
+	return k;
+}
+
+static size_t
+ps_entry_size(ps_page_t *pg, unsigned int i)
+{
+	unsigned char *e = ps_entry(pg, i);
+
+	if (ps_hdr(pg)->type == PS_LEAF)
+		return 4 + ps_get16(e) + ps_get16(e + 2);
+
+	return 6 + ps_get16(e + 4);
+}
+
+static uint32_t
+ps_branch_child(ps_page_t *pg, int i)
+{
+	if (i < 0)
+		return ps_hdr(pg)->link;
+
+	return ps_get32(ps_entry(pg, i));
+}
+
+static void
+ps_page_init(ps_page_t *pg, uint16_t type)
+{
+	ps_page_hdr_t *hdr = ps_hdr(pg);
+
+	memset(pg->data, 0, PS_PAGE_SIZE);
+	hdr->type = type;
+	hdr->lower = sizeof(ps_page_hdr_t);
+	hdr->upper = PS_PAGE_SIZE;
+}
+
+/*
+ * Binary search for key. Returns the index of the first entry which is
+ * greater than or equal to key, and sets *exact if it is equal.
+ */
+static unsigned int
+ps_search(ps_page_t *pg, ps_key_t key, int *exact)
+{
+	unsigned int lo = 0, hi = ps_hdr(pg)->nkeys;
+
+	*exact = 0;
+
+	while (lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		int ret = ps_key_cmp(ps_entry_key(pg, mid), key);
+
+		if (ret == 0)
+		{
+			*exact = 1;
+			return mid;
+		}
+		else if (ret < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Index of the branch entry whose child covers key, -1 being the
+ * leftmost child.
+ */
+static int
+ps_branch_index(ps_page_t *pg, ps_key_t key)
+{
+	int exact;
+	unsigned int idx = ps_search(pg, key, &exact);
+
+	return exact ? (int) idx : (int) idx - 1;
+}
+
+static void
+ps_page_compact(ps_page_t *pg)
+{
+	unsigned char tmp[PS_PAGE_SIZE];
+	ps_page_hdr_t *hdr = ps_hdr(pg);
+	unsigned int i, upper = PS_PAGE_SIZE;
+
+	memcpy(tmp, pg->data, PS_PAGE_SIZE);
+
+	for (i = 0; i < hdr->nkeys; i++)
+	{
+		uint16_t off = ps_get16(tmp + sizeof(ps_page_hdr_t) + i * 2);
+		size_t len;
+
+		if (hdr->type == PS_LEAF)
+			len = 4 + ps_get16(tmp + off) + ps_get16(tmp + off + 2);
+		else
+			len = 6 + ps_get16(tmp + off + 4);
+
+		upper -= len;
+		memcpy(pg->data + upper, tmp + off, len);
+		ps_put16(pg->data + sizeof(ps_page_hdr_t) + i * 2, upper);
+	}
+
+	hdr->upper = upper;
+}
+
+static size_t
+ps_page_used(ps_page_t *pg)
+{
+	ps_page_hdr_t *hdr = ps_hdr(pg);
+	size_t used = 0;
+	unsigned int i;
+
+	for (i = 0; i < hdr->nkeys; i++)
+		used += ps_entry_size(pg, i) + 2;
+
+	return used;
+}
+
+/*
+ * Inserts a raw entry at slot idx. Returns 0 if the page is full.
+ */
+static int
+ps_page_insert(ps_page_t *pg, unsigned int idx, const unsigned char *entry, size_t len)
+{
+	ps_page_hdr_t *hdr = ps_hdr(pg);
+	unsigned char *slots = pg->data + sizeof(ps_page_hdr_t);
+
+	if ((size_t) (hdr->upper - hdr->lower) < len + 2)
+	{
+		if (sizeof(ps_page_hdr_t) + ps_page_used(pg) + len + 2 > PS_PAGE_SIZE)
+			return 0;
+
+		ps_page_compact(pg);
+	}
+
+	hdr->upper -= len;
+	memcpy(pg->data + hdr->upper, entry, len);
+
+	memmove(slots + (idx + 1) * 2, slots + idx * 2, (hdr->nkeys - idx) * 2);
+	ps_put16(slots + idx * 2, hdr->upper);
+
+	hdr->nkeys++;
+	hdr->lower += 2;
+
+	return 1;
+}
+
+static void
+ps_page_remove(ps_page_t *pg, unsigned int idx)
+{
+	ps_page_hdr_t *hdr = ps_hdr(pg);
+	unsigned char *slots = pg->data + sizeof(ps_page_hdr_t);
+
+	memmove(slots + idx * 2, slots + (idx + 1) * 2, (hdr->nkeys - idx - 1) * 2);
+
+	hdr->nkeys--;
+	hdr->lower -= 2;
+}
+
+static size_t
+ps_leaf_entry(unsigned char *buf, ps_key_t key, const char *value, size_t vlen)
+{
+	ps_put16(buf, (uint16_t) key.len);
+	ps_put16(buf + 2, (uint16_t) vlen);
+	memcpy(buf + 4, key.data, key.len);
+	memcpy(buf + 4 + key.len, value, vlen);
+
+	return 4 + key.len + vlen;
+}
+
+static size_t
+ps_branch_entry(unsigned char *buf, ps_key_t key, uint32_t child)
+{
+	ps_put32(buf, child);
+	ps_put16(buf + 4, (uint16_t) key.len);
+	memcpy(buf + 6, key.data, key.len);
+
+	return 6 + key.len;
+}
+
+/* ***************************************************************** */
+
+static void
+ps_lru_unlink(mcs_pagestore_handle_t *h, ps_page_t *pg)
+{
+	if (pg->prev != NULL)
+		pg->prev->next = pg->next;
+	else
+		h->lru_head = pg->next;
+
+	if (pg->next != NULL)
+		pg->next->prev = pg->prev;
+	else
+		h->lru_tail = pg->prev;
+
+	pg->prev = pg->next = NULL;
+	h->nclean--;
+}
+
+static void
+ps_lru_push(mcs_pagestore_handle_t *h, ps_page_t *pg)
+{
+	pg->prev = NULL;
+	pg->next = h->lru_head;
+
+	if (h->lru_head != NULL)
+		h->lru_head->prev = pg;
+	else
+		h->lru_tail = pg;
+
+	h->lru_head = pg;
+	h->nclean++;
+}
+
+static void
+ps_cache_drop(mcs_pagestore_handle_t *h, ps_page_t *pg)
+{
+	if (!pg->dirty)
+		ps_lru_unlink(h, pg);
+
+	h->cache[pg->pgno] = NULL;
+	free(pg->data);
+	free(pg);
+}
+
+static ps_page_t *
+ps_cache_insert(mcs_pagestore_handle_t *h, uint32_t pgno, int dirty)
+{
+	ps_page_t *pg;
+
+	if (pgno >= h->cache_alloc)
+	{
+		size_t n = h->cache_alloc ? h->cache_alloc : 256;
+
+		while (n <= pgno)
+			n *= 2;
+
+		h->cache = realloc(h->cache, n * sizeof(ps_page_t *));
+		memset(h->cache + h->cache_alloc, 0, (n - h->cache_alloc) * sizeof(ps_page_t *));
+		h->cache_alloc = n;
+	}
+
+	/* evict clean pages beyond the cache capacity, least recently used first */
+	while (h->nclean >= h->capacity && h->lru_tail != NULL)
+		ps_cache_drop(h, h->lru_tail);
+
+	pg = calloc(sizeof(ps_page_t), 1);
+	pg->pgno = pgno;
+	pg->dirty = dirty;
+	pg->data = malloc(PS_PAGE_SIZE);
+
+	h->cache[pgno] = pg;
+
+	if (!dirty)
+		ps_lru_push(h, pg);
+
+	return pg;
+}
+
+static int
+ps_read_at(int fd, void *buf, size_t len, off_t off)
+{
+	unsigned char *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t ret = pread(fd, p, len, off);
+
+		if (ret <= 0)
+		{
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			return 0;
+		}
+
+		p += ret;
+		len -= ret;
+		off += ret;
+	}
+
+	return 1;
+}
+
+static int
+ps_write_at(int fd, const void *buf, size_t len, off_t off)
+{
+	const unsigned char *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t ret = pwrite(fd, p, len, off);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return 0;
+		}
+
+		p += ret;
+		len -= ret;
+		off += ret;
+	}
+
+	return 1;
+}
+
+static ps_page_t *
+ps_get(mcs_pagestore_handle_t *h, uint32_t pgno)
+{
+	ps_page_t *pg;
+
+	if (pgno < 2 || pgno >= h->npages)
+	{
+		mowgli_log("pagestore: reference to invalid page %u", pgno);
+		return NULL;
+	}
+
+	if (pgno < h->cache_alloc && (pg = h->cache[pgno]) != NULL)
+	{
+		if (!pg->dirty && pg != h->lru_head)
+		{
+			ps_lru_unlink(h, pg);
+			ps_lru_push(h, pg);
+		}
+
+		return pg;
+	}
+
+	pg = ps_cache_insert(h, pgno, 0);
+
+	if (!ps_read_at(h->fd, pg->data, PS_PAGE_SIZE, (off_t) pgno * PS_PAGE_SIZE))
+	{
+		mowgli_log("pagestore: failed to read page %u: %s", pgno, strerror(errno));
+		ps_cache_drop(h, pg);
+		return NULL;
+	}
+
+	return pg;
+}
+
+static ps_page_t *
+ps_alloc(mcs_pagestore_handle_t *h, uint16_t type)
+{
+	uint32_t pgno;
+	ps_page_t *pg;
+
+	if (h->free_ready.n > 0)
+		pgno = h->free_ready.v[--h->free_ready.n];
+	else
+		pgno = h->npages++;
+
+	if (pgno < h->cache_alloc && h->cache[pgno] != NULL)
+		ps_cache_drop(h, h->cache[pgno]);
+
+	pg = ps_cache_insert(h, pgno, 1);
+	ps_page_init(pg, type);
+	ps_pgvec_push(&h->dirty, pgno);
+
+	h->changed = 1;
+
+	return pg;
+}
+
+/*
+ * Returns a writable version of a page: pages already copied in this
+ * transaction are modified in place, others are copied to a new page
+ * and the original is released.
+ */
+static ps_page_t *
+ps_touch(mcs_pagestore_handle_t *h, ps_page_t *pg)
+{
+	ps_page_t *copy;
+	uint32_t old = pg->pgno;
+
+	if (pg->dirty)
+		return pg;
+
+	copy = ps_alloc(h, ps_hdr(pg)->type);
+
+	/* ps_alloc() may have evicted the original from the cache */
+	if ((pg = ps_get(h, old)) == NULL)
+		return NULL;
+
+	memcpy(copy->data, pg->data, PS_PAGE_SIZE);
+	ps_pgvec_push(&h->freed, old);
+
+	return copy;
+}
+
+static void
+ps_release(mcs_pagestore_handle_t *h, ps_page_t *pg)
+{
+	size_t i;
+
+	if (!pg->dirty)
+	{
+		ps_pgvec_push(&h->freed, pg->pgno);
+		ps_cache_drop(h, pg);
+		return;
+	}
+
+	/* pages written only by this transaction can be reused right away */
+	for (i = 0; i < h->dirty.n; i++)
+	{
+		if (h->dirty.v[i] == pg->pgno)
+		{
+			h->dirty.v[i] = h->dirty.v[--h->dirty.n];
+			break;
+		}
+	}
+
+	ps_pgvec_push(&h->free_ready, pg->pgno);
+	ps_cache_drop(h, pg);
+}
+
+/* ***************************************************************** */
+
+static ps_page_t *
+ps_find_leaf(mcs_pagestore_handle_t *h, ps_key_t key)
+{
+	ps_page_t *pg;
+	int depth = 0;
+
+	if (h->root == 0 || (pg = ps_get(h, h->root)) == NULL)
+		return NULL;
+
+	while (ps_hdr(pg)->type == PS_BRANCH)
+	{
+		if (++depth > 32 || (pg = ps_get(h, ps_branch_child(pg, ps_branch_index(pg, key)))) == NULL)
+			return NULL;
+	}
+
+	return ps_hdr(pg)->type == PS_LEAF ? pg : NULL;
+}
+
+/*
+ * Looks up a record. On success, *value points into the cached page and
+ * stays valid until the next page is read.
+ */
+static int
+ps_lookup(mcs_pagestore_handle_t *h, ps_key_t key, const char **value, size_t *vlen)
+{
+	ps_page_t *pg;
+	unsigned int idx;
+	int exact;
+
+	if ((pg = ps_find_leaf(h, key)) == NULL)
+		return 0;
+
+	idx = ps_search(pg, key, &exact);
+	if (!exact)
+		return 0;
+
+	*value = (const char *) ps_entry(pg, idx) + 4 + key.len;
+	*vlen = ps_get16(ps_entry(pg, idx) + 2);
+
+	return 1;
+}
+
+typedef struct {
+	int split;
+	unsigned char key[PS_MAX_ENTRY];
+	size_t klen;
+	uint32_t right;
+} ps_split_t;
+
+/*
+ * Splits a full page while inserting an entry at idx. The lower half
+ * stays in pg, the upper half moves to a new page which is reported to
+ * the parent along with its separator key.
+ */
+static int
+ps_split_page(mcs_pagestore_handle_t *h, ps_page_t *pg, unsigned int idx,
+	      const unsigned char *entry, size_t len, ps_split_t *split)
+{
+	unsigned char tmp[PS_PAGE_SIZE + PS_MAX_ENTRY];
+	size_t offs[PS_PAGE_SIZE / 4], lens[PS_PAGE_SIZE / 4];
+	size_t total = 0, acc = 0, pos = 0;
+	unsigned int n, i, j, mid;
+	uint16_t type = ps_hdr(pg)->type;
+	uint32_t link = ps_hdr(pg)->link;
+	ps_page_t *right;
+	ps_key_t sep;
+
+	n = ps_hdr(pg)->nkeys + 1;
+
+	for (i = 0, j = 0; i < n; i++)
+	{
+		const unsigned char *src;
+
+		if (i == idx)
+		{
+			src = entry;
+			lens[i] = len;
+		}
+		else
+		{
+			src = ps_entry(pg, j);
+			lens[i] = ps_entry_size(pg, j);
+			j++;
+		}
+
+		memcpy(tmp + pos, src, lens[i]);
+		offs[i] = pos;
+		pos += lens[i];
+		total += lens[i] + 2;
+	}
+
+	for (mid = 1; mid < n - 1; mid++)
+	{
+		acc += lens[mid - 1] + 2;
+		if (acc >= total / 2)
+			break;
+	}
+
+	if ((right = ps_alloc(h, type)) == NULL)
+		return 0;
+
+	ps_page_init(pg, type);
+	ps_hdr(pg)->link = link;
+
+	for (i = 0; i < mid; i++)
+		ps_page_insert(pg, i, tmp + offs[i], lens[i]);
+
+	if (type == PS_LEAF)
+	{
+		sep.len = ps_get16(tmp + offs[mid]);
+		sep.data = tmp + offs[mid] + 4;
+		j = mid;
+	}
+	else
+	{
+		ps_hdr(right)->link = ps_get32(tmp + offs[mid]);
+		sep.len = ps_get16(tmp + offs[mid] + 4);
+		sep.data = tmp + offs[mid] + 6;
+		j = mid + 1;
+	}
+
+	for (i = j; i < n; i++)
+		ps_page_insert(right, i - j, tmp + offs[i], lens[i]);
+
+	split->split = 1;
+	split->klen = sep.len;
+	memcpy(split->key, sep.data, sep.len);
+	split->right = right->pgno;
+
+	return 1;
+}
+
+/*
+ * Inserts or replaces a record below pgno. Returns the page number of
+ * the (possibly copied) subtree root, or 0 on failure.
+ */
+static uint32_t
+ps_insert(mcs_pagestore_handle_t *h, uint32_t pgno, ps_key_t key,
+	  const char *value, size_t vlen, ps_split_t *split, int depth)
+{
+	unsigned char buf[PS_MAX_ENTRY + 8];
+	ps_page_t *pg;
+	size_t len;
+
+	split->split = 0;
+
+	if (depth > 32 || (pg = ps_get(h, pgno)) == NULL || (pg = ps_touch(h, pg)) == NULL)
+		return 0;
+
+	if (ps_hdr(pg)->type == PS_LEAF)
+	{
+		int exact;
+		unsigned int idx = ps_search(pg, key, &exact);
+
+		if (exact)
+			ps_page_remove(pg, idx);
+
+		len = ps_leaf_entry(buf, key, value, vlen);
+		if (!ps_page_insert(pg, idx, buf, len) &&
+		    !ps_split_page(h, pg, idx, buf, len, split))
+			return 0;
+	}
+	else
+	{
+		ps_split_t sub;
+		int i = ps_branch_index(pg, key);
+		uint32_t child = ps_branch_child(pg, i), newchild;
+		ps_key_t sep;
+
+		if ((newchild = ps_insert(h, child, key, value, vlen, &sub, depth + 1)) == 0)
+			return 0;
+
+		if (i < 0)
+			ps_hdr(pg)->link = newchild;
+		else
+			ps_put32(ps_entry(pg, i), newchild);
+
+		if (sub.split)
+		{
+			sep.data = sub.key;
+			sep.len = sub.klen;
+
+			len = ps_branch_entry(buf, sep, sub.right);
+			if (!ps_page_insert(pg, i + 1, buf, len) &&
+			    !ps_split_page(h, pg, i + 1, buf, len, split))
+				return 0;
+		}
+	}
+
+	return pg->pgno;
+}
+
+/*
+ * Removes a record below pgno. *newpgno receives the page number of the
+ * copied subtree root, or 0 if the subtree became empty.
+ */
+static int
+ps_remove(mcs_pagestore_handle_t *h, uint32_t pgno, ps_key_t key,
+	  uint32_t *newpgno, int depth)
+{
+	ps_page_t *pg;
+
+	if (depth > 32 || (pg = ps_get(h, pgno)) == NULL || (pg = ps_touch(h, pg)) == NULL)
+		return 0;
+
+	if (ps_hdr(pg)->type == PS_LEAF)
+	{
+		int exact;
+		unsigned int idx = ps_search(pg, key, &exact);
+
+		if (exact)
+			ps_page_remove(pg, idx);
+	}
+	else
+	{
+		int i = ps_branch_index(pg, key);
+		uint32_t child = ps_branch_child(pg, i), newchild;
+
+		if (!ps_remove(h, child, key, &newchild, depth + 1))
+			return 0;
+
+		if (newchild != 0)
+		{
+			if (i < 0)
+				ps_hdr(pg)->link = newchild;
+			else
+				ps_put32(ps_entry(pg, i), newchild);
+
+			*newpgno = pg->pgno;
+			return 1;
+		}
+
+		/* the child became empty, unlink it */
+		if (i >= 0)
+			ps_page_remove(pg, i);
+		else if (ps_hdr(pg)->nkeys > 0)
+		{
+			ps_hdr(pg)->link = ps_branch_child(pg, 0);
+			ps_page_remove(pg, 0);
+		}
+		else
+			ps_hdr(pg)->link = 0;
+
+		/* a branch with a single child is replaced by that child */
+		if (ps_hdr(pg)->nkeys == 0)
+		{
+			*newpgno = ps_hdr(pg)->link;
+			ps_release(h, pg);
+			return 1;
+		}
+	}
+
+	if (ps_hdr(pg)->nkeys == 0)
+	{
+		*newpgno = 0;
+		ps_release(h, pg);
+		return 1;
+	}
+
+	*newpgno = pg->pgno;
+
+	return 1;
+}
+
+static mcs_response_t
+ps_put(mcs_pagestore_handle_t *h, ps_key_t key, const char *value)
+{
+	unsigned char buf[PS_MAX_ENTRY + 8];
+	size_t vlen = strlen(value), oldlen;
+	const char *old;
+	ps_split_t split;
+	uint32_t root;
+
+	if (h->readonly)
+		return MCS_FAIL;
+
+	if (4 + key.len + vlen > PS_MAX_ENTRY)
+	{
+		mowgli_log("pagestore: record too large (%lu bytes, at most %d)",
+			   (unsigned long) (key.len + vlen), PS_MAX_ENTRY - 4);
+		return MCS_FAIL;
+	}
+
+	/* rewriting a value with itself should not copy any pages */
+	if (ps_lookup(h, key, &old, &oldlen) && oldlen == vlen && !memcmp(old, value, vlen))
+		return MCS_OK;
+
+	if (h->root == 0)
+	{
+		ps_page_t *leaf = ps_alloc(h, PS_LEAF);
+
+		ps_page_insert(leaf, 0, buf, ps_leaf_entry(buf, key, value, vlen));
+		h->root = leaf->pgno;
+
+		return MCS_OK;
+	}
+
+	if ((root = ps_insert(h, h->root, key, value, vlen, &split, 0)) == 0)
+		return MCS_FAIL;
+
+	if (split.split)
+	{
+		ps_page_t *pg = ps_alloc(h, PS_BRANCH);
+		ps_key_t sep;
+
+		sep.data = split.key;
+		sep.len = split.klen;
+
+		ps_hdr(pg)->link = root;
+		ps_page_insert(pg, 0, buf, ps_branch_entry(buf, sep, split.right));
+		root = pg->pgno;
+	}
+
+	h->root = root;
+	h->changed = 1;
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+ps_del(mcs_pagestore_handle_t *h, ps_key_t key)
+{
+	const char *old;
+	size_t oldlen;
+	uint32_t root;
+
+	if (h->readonly)
+		return MCS_FAIL;
+
+	if (!ps_lookup(h, key, &old, &oldlen))
+		return MCS_OK;
+
+	if (!ps_remove(h, h->root, key, &root, 0))
+		return MCS_FAIL;
+
+	h->root = root;
+	h->changed = 1;
+
+	return MCS_OK;
+}
+
+/* ***************************************************************** */
+
+/*
+ * Positions the cursor on the first record greater than or equal to key.
+ * Returns 0 if there is no such record.
+ */
+static int ps_cursor_next(mcs_pagestore_handle_t *h, ps_cursor_t *cur);
+
+static int
+ps_cursor_settle(mcs_pagestore_handle_t *h, ps_cursor_t *cur)
+{
+	ps_page_t *pg = ps_get(h, cur->pgno[cur->depth]);
+
+	if (pg == NULL)
+		return 0;
+
+	if (cur->idx[cur->depth] < ps_hdr(pg)->nkeys)
+		return 1;
+
+	return ps_cursor_next(h, cur);
+}
+
+static int
+ps_cursor_seek(mcs_pagestore_handle_t *h, ps_cursor_t *cur, ps_key_t key)
+{
+	ps_page_t *pg;
+	int exact;
+
+	cur->depth = 0;
+
+	if (h->root == 0 || (pg = ps_get(h, h->root)) == NULL)
+		return 0;
+
+	cur->pgno[0] = h->root;
+
+	while (ps_hdr(pg)->type == PS_BRANCH)
+	{
+		int i = ps_branch_index(pg, key);
+
+		if (cur->depth >= 31)
+			return 0;
+
+		cur->idx[cur->depth] = (uint16_t) (i + 1);
+		cur->depth++;
+		cur->pgno[cur->depth] = ps_branch_child(pg, i);
+
+		if ((pg = ps_get(h, cur->pgno[cur->depth])) == NULL)
+			return 0;
+	}
+
+	cur->idx[cur->depth] = (uint16_t) ps_search(pg, key, &exact);
+
+	return ps_cursor_settle(h, cur);
+}
+
+/*
+ * Advances the cursor. Branch levels store the child index plus one, so
+ * that zero designates the leftmost child.
+ */
+static int
+ps_cursor_next(mcs_pagestore_handle_t *h, ps_cursor_t *cur)
+{
+	ps_page_t *pg;
+
+	if ((pg = ps_get(h, cur->pgno[cur->depth])) == NULL)
+		return 0;
+
+	if (++cur->idx[cur->depth] < ps_hdr(pg)->nkeys)
+		return 1;
+
+	/* climb until a branch has a child to the right */
+	for (;;)
+	{
+		if (cur->depth == 0)
+			return 0;
+
+		cur->depth--;
+
+		if ((pg = ps_get(h, cur->pgno[cur->depth])) == NULL)
+			return 0;
+
+		if (cur->idx[cur->depth] < ps_hdr(pg)->nkeys)
+			break;
+	}
+
+	cur->idx[cur->depth]++;
+
+	/* and descend along the leftmost path of that child */
+	for (;;)
+	{
+		uint32_t child = ps_branch_child(pg, cur->idx[cur->depth] - 1);
+
+		cur->depth++;
+		cur->pgno[cur->depth] = child;
+		cur->idx[cur->depth] = 0;
+
+		if ((pg = ps_get(h, child)) == NULL)
+			return 0;
+
+		if (ps_hdr(pg)->type != PS_BRANCH)
+			break;
+	}
+
+	return ps_cursor_settle(h, cur);
+}
+
+static ps_key_t
+ps_cursor_key(mcs_pagestore_handle_t *h, ps_cursor_t *cur)
+{
+	ps_page_t *pg = ps_get(h, cur->pgno[cur->depth]);
+	ps_key_t k = { NULL, 0 };
+
+	if (pg != NULL)
+		k = ps_entry_key(pg, cur->idx[cur->depth]);
+
+	return k;
+}
+
+/* ***************************************************************** */
+
+static int
+ps_write_meta(mcs_pagestore_handle_t *h, uint64_t txnid, uint32_t ready, uint32_t pending)
+{
+	ps_meta_t meta;
+
+	memset(&meta, 0, sizeof meta);
+	memcpy(meta.magic, PS_MAGIC, 8);
+	meta.page_size = PS_PAGE_SIZE;
+	meta.root = h->root;
+	meta.txnid = txnid;
+	meta.npages = h->npages;
+	meta.free_ready = ready;
+	meta.free_pending = pending;
+	meta.checksum = ps_meta_checksum(&meta);
+
+	return ps_write_at(h->fd, &meta, sizeof meta, (off_t) (txnid % 2) * PS_PAGE_SIZE);
+}
+
+static int
+ps_sync(mcs_pagestore_handle_t *h)
+{
+#ifdef _WIN32
+	return _commit(h->fd) == 0;
+#else
+	return fsync(h->fd) == 0;
+#endif
+}
+
+/* the number of pages the free list chains of a commit take */
+static size_t
+ps_chain_pages(mcs_pagestore_handle_t *h)
+{
+	size_t ready = h->free_ready.n + h->free_pending.n;
+
+	return (ready + PS_FREE_PER_PAGE - 1) / PS_FREE_PER_PAGE +
+		(h->freed.n + PS_FREE_PER_PAGE - 1) / PS_FREE_PER_PAGE;
+}
+
+/*
+ * Writes a list of page numbers to a chain of pages and returns the head
+ * of the chain. The pages are taken from spare while it lasts, and past
+ * the end of the file after that.
+ */
+static uint32_t
+ps_write_chain(mcs_pagestore_handle_t *h, ps_pgvec_t *list, ps_pgvec_t *spare,
+	       ps_pgvec_t *chain, int *ok)
+{
+	unsigned char buf[PS_PAGE_SIZE];
+	ps_page_hdr_t *hdr = (ps_page_hdr_t *) buf;
+	uint32_t next = 0;
+	size_t left = list->n;
+
+	while (left > 0)
+	{
+		size_t n = left > PS_FREE_PER_PAGE ? PS_FREE_PER_PAGE : left;
+		uint32_t pgno = spare->n > 0 ? spare->v[--spare->n] : h->npages++;
+
+		left -= n;
+
+		memset(buf, 0, PS_PAGE_SIZE);
+		hdr->type = PS_FREELIST;
+		hdr->nkeys = (uint16_t) n;
+		hdr->link = next;
+		memcpy(buf + sizeof(ps_page_hdr_t), list->v + left, n * sizeof(uint32_t));
+
+		if (!ps_write_at(h->fd, buf, PS_PAGE_SIZE, (off_t) pgno * PS_PAGE_SIZE))
+			*ok = 0;
+
+		ps_pgvec_push(chain, pgno);
+		next = pgno;
+	}
+
+	return next;
+}
+
+static int
+ps_read_chain(mcs_pagestore_handle_t *h, uint32_t pgno, ps_pgvec_t *list)
+{
+	unsigned char buf[PS_PAGE_SIZE];
+	ps_page_hdr_t *hdr = (ps_page_hdr_t *) buf;
+	size_t limit = h->npages;
+
+	while (pgno != 0)
+	{
+		if (pgno < 2 || pgno >= h->npages || limit-- == 0 ||
+		    !ps_read_at(h->fd, buf, PS_PAGE_SIZE, (off_t) pgno * PS_PAGE_SIZE) ||
+		    hdr->type != PS_FREELIST || hdr->nkeys > PS_FREE_PER_PAGE)
+			return 0;
+
+		ps_pgvec_push(&h->chain, pgno);
+
+		while (list->n + hdr->nkeys > list->alloc)
+			list->alloc = list->alloc ? list->alloc * 2 : 64;
+
+		list->v = realloc(list->v, list->alloc * sizeof(uint32_t));
+		memcpy(list->v + list->n, buf + sizeof(ps_page_hdr_t), hdr->nkeys * sizeof(uint32_t));
+		list->n += hdr->nkeys;
+
+		pgno = hdr->link;
+	}
+
+	return 1;
+}
+
+static mcs_response_t
+ps_commit(mcs_handle_t *self)
+{
+	mcs_pagestore_handle_t *h = (mcs_pagestore_handle_t *) self->mcs_priv_handle;
+	ps_pgvec_t ready, chain, spare;
+	uint32_t ready_head, pending_head, npages;
+	unsigned long long start, fsync_ns;
+	size_t i;
+	int ok = 1;
+
+	if (!h->changed)
+		return MCS_OK;
+
+	if (h->readonly)
+		return MCS_FAIL;
+
+	memset(&ready, 0, sizeof ready);
+	memset(&chain, 0, sizeof chain);
+	memset(&spare, 0, sizeof spare);
+
+	/* the free list pages of the last commit are released by this one */
+	for (i = 0; i < h->chain.n; i++)
+		ps_pgvec_push(&h->freed, h->chain.v[i]);
+
+	/*
+	 * The chains go to reusable pages where there are any, so that the
+	 * file does not grow with every commit. Those pages are taken off
+	 * the list before it is written; if that saves a chain page, the
+	 * last one goes back.
+	 */
+	while (h->free_ready.n > 0 && spare.n < ps_chain_pages(h))
+	{
+		ps_pgvec_push(&spare, h->free_ready.v[--h->free_ready.n]);
+
+		if (spare.n > ps_chain_pages(h))
+		{
+			ps_pgvec_push(&h->free_ready, spare.v[--spare.n]);
+			break;
+		}
+	}
+
+	/*
+	 * Once this transaction is committed, nothing refers to the pages
+	 * released by the previous one any more.
+	 */
+	for (i = 0; i < h->free_ready.n; i++)
+		ps_pgvec_push(&ready, h->free_ready.v[i]);
+	for (i = 0; i < h->free_pending.n; i++)
+		ps_pgvec_push(&ready, h->free_pending.v[i]);
+
+	npages = h->npages;
+	ready_head = ps_write_chain(h, &ready, &spare, &chain, &ok);
+	pending_head = ps_write_chain(h, &h->freed, &spare, &chain, &ok);
+
+	for (i = 0; i < h->dirty.n && ok; i++)
+	{
+		ps_page_t *pg = h->cache[h->dirty.v[i]];
+
+		ok = ps_write_at(h->fd, pg->data, PS_PAGE_SIZE, (off_t) pg->pgno * PS_PAGE_SIZE);
+	}
+
+	start = mcs_stat_clock();
+	ok = ok && ps_sync(h);
+	fsync_ns = mcs_stat_clock() - start;
+
+	ok = ok && ps_write_meta(h, h->txnid + 1, ready_head, pending_head);
+
+	start = mcs_stat_clock();
+	ok = ok && ps_sync(h);
+	fsync_ns += mcs_stat_clock() - start;
+
+	if (!ok)
+	{
+		mowgli_log("pagestore: commit failed: %s", strerror(errno));
+
+		/* the chain pages were never referenced, forget them */
+		for (i = 0; i < h->chain.n; i++)
+			h->freed.n--;
+
+		h->npages = npages;
+
+		/* and the reusable pages they took are reusable again */
+		for (i = 0; i < chain.n; i++)
+		{
+			if (chain.v[i] < npages)
+				ps_pgvec_push(&h->free_ready, chain.v[i]);
+		}
+		for (i = 0; i < spare.n; i++)
+			ps_pgvec_push(&h->free_ready, spare.v[i]);
+
+		ps_pgvec_free(&ready);
+		ps_pgvec_free(&chain);
+		ps_pgvec_free(&spare);
+
+		return MCS_FAIL;
+	}
+
+	mcs_stat_write(self, (chain.n + h->dirty.n) * PS_PAGE_SIZE + sizeof(ps_meta_t), fsync_ns);
+	ps_pgvec_free(&spare);
+
+	for (i = 0; i < h->dirty.n; i++)
+	{
+		ps_page_t *pg = h->cache[h->dirty.v[i]];
+
+		pg->dirty = 0;
+		ps_lru_push(h, pg);
+	}
+
+	h->dirty.n = 0;
+
+	ps_pgvec_free(&h->free_ready);
+	ps_pgvec_free(&h->free_pending);
+	ps_pgvec_free(&h->chain);
+
+	h->free_ready = ready;
+	h->free_pending = h->freed;
+	h->chain = chain;
+	memset(&h->freed, 0, sizeof h->freed);
+
+	h->txnid++;
+	h->changed = 0;
+
+	/* the clean pages may now exceed the cache capacity */
+	while (h->nclean > h->capacity && h->lru_tail != NULL)
+		ps_cache_drop(h, h->lru_tail);
+
+	return MCS_OK;
+}
+
+static int
+ps_read_meta(mcs_pagestore_handle_t *h, int slot, ps_meta_t *meta)
+{
+	if (!ps_read_at(h->fd, meta, sizeof(ps_meta_t), (off_t) slot * PS_PAGE_SIZE))
+		return 0;
+
+	return !memcmp(meta->magic, PS_MAGIC, 8) && meta->page_size == PS_PAGE_SIZE &&
+		meta->checksum == ps_meta_checksum(meta) && meta->npages >= 2 &&
+		meta->txnid % 2 == (uint64_t) slot;
+}
+
+static void
+ps_open(mcs_pagestore_handle_t *h, const char *path)
+{
+	ps_meta_t meta[2], *cur = NULL;
+	struct stat st;
+	char *cache;
+
+	h->capacity = PS_CACHE_PAGES;
+	if ((cache = getenv("MCS_PAGESTORE_CACHE")) != NULL && atoi(cache) > 0)
+		h->capacity = (size_t) atoi(cache);
+
+	h->npages = 2;
+
+	if ((h->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+	{
+		h->readonly = 1;
+
+		if ((h->fd = open(path, O_RDONLY)) < 0)
+			return;
+	}
+
+#ifndef _WIN32
+	if (!h->readonly && flock(h->fd, LOCK_EX | LOCK_NB) < 0)
+	{
+		mowgli_log("pagestore: `%s' is in use, opening it read-only", path);
+		h->readonly = 1;
+	}
+#endif
+
+	if (fstat(h->fd, &st) < 0)
+		return;
+
+	if (st.st_size < 2 * PS_PAGE_SIZE)
+	{
+		unsigned char zero[PS_PAGE_SIZE];
+
+		if (h->readonly)
+			return;
+
+		memset(zero, 0, sizeof zero);
+
+		if (!ps_write_at(h->fd, zero, PS_PAGE_SIZE, PS_PAGE_SIZE) ||
+		    !ps_write_meta(h, 0, 0, 0) || !ps_sync(h))
+		{
+			mowgli_log("pagestore: failed to initialise `%s': %s", path, strerror(errno));
+			h->readonly = 1;
+		}
+
+		return;
+	}
+
+	if (ps_read_meta(h, 0, &meta[0]))
+		cur = &meta[0];
+	if (ps_read_meta(h, 1, &meta[1]) && (cur == NULL || meta[1].txnid > cur->txnid))
+		cur = &meta[1];
+
+	if (cur == NULL)
+	{
+		mowgli_log("pagestore: `%s' has no valid meta page, opening it read-only", path);
+		h->readonly = 1;
+		return;
+	}
+
+	h->txnid = cur->txnid;
+	h->root = cur->root;
+	h->npages = cur->npages;
+
+	if (!ps_read_chain(h, cur->free_ready, &h->free_ready) ||
+	    !ps_read_chain(h, cur->free_pending, &h->free_pending))
+	{
+		mowgli_log("pagestore: `%s' has a damaged free list, opening it read-only", path);
+		h->readonly = 1;
+	}
+}
+
+/* ***************************************************************** */
+
+static mcs_handle_t *
+mcs_pagestore_new(char *domain)
+{
+	char scratch[PATH_MAX];
+
+#if defined(_WIN32)
+	const mode_t mode755 = 0;
+#else
+	const mode_t mode755 = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH |
+			       S_IXOTH;
+#endif
+
+	mcs_pagestore_handle_t *h = calloc(sizeof(mcs_pagestore_handle_t), 1);
+	mcs_handle_t *out = calloc(sizeof(mcs_handle_t), 1);
+
+	out->base = &pagestore_backend;
+	out->mcs_priv_handle = h;
+
+	mcs_domain_path(scratch, PATH_MAX, domain, NULL);
+	mcs_create_directory(scratch, mode755);
+	mcs_strlcat(scratch, "/" PS_FILENAME, PATH_MAX);
+
+	ps_open(h, scratch);
+
+	return out;
+}
+
+static void
+mcs_pagestore_destroy(mcs_handle_t *self)
+{
+	mcs_pagestore_handle_t *h = (mcs_pagestore_handle_t *) self->mcs_priv_handle;
+	size_t i;
+
+	if (h->fd >= 0)
+	{
+		ps_commit(self);
+		close(h->fd);
+	}
+
+	for (i = 0; i < h->cache_alloc; i++)
+	{
+		if (h->cache[i] != NULL)
+		{
+			free(h->cache[i]->data);
+			free(h->cache[i]);
+		}
+	}
+
+	free(h->cache);
+	ps_pgvec_free(&h->dirty);
+	ps_pgvec_free(&h->free_ready);
+	ps_pgvec_free(&h->free_pending);
+	ps_pgvec_free(&h->freed);
+	ps_pgvec_free(&h->chain);
+
+	free(h);
+	free(self);
+}
+
+static mcs_response_t
+mcs_pagestore_commit(mcs_handle_t *self)
+{
+	return ps_commit(self);
+}
+
+static mcs_response_t
+mcs_pagestore_get_string(mcs_handle_t *self, const char *section,
+			 const char *key, char **value)
+{
+	mcs_pagestore_handle_t *h = (mcs_pagestore_handle_t *) self->mcs_priv_handle;
+	unsigned char buf[PS_MAX_ENTRY];
+	const char *val;
+	size_t vlen;
+	ps_key_t k;
+
+	if (!ps_make_key(buf, sizeof buf, section, key, &k) || !ps_lookup(h, k, &val, &vlen))
+		return MCS_FAIL;
+
+	*value = mcs_strndup(val, vlen);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_pagestore_get_int(mcs_handle_t *self, const char *section,
+		      const char *key, int *value)
+{
+	char *str;
+
+	if (!mcs_pagestore_get_string(self, section, key, &str))
+		return MCS_FAIL;
+
+	*value = atoi(str);
+	free(str);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_pagestore_get_bool(mcs_handle_t *self, const char *section,
+		       const char *key, int *value)
+{
+	char *str;
+
+	if (!mcs_pagestore_get_string(self, section, key, &str))
+		return MCS_FAIL;
+
+	*value = !strcasecmp(str, "TRUE");
+	free(str);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_pagestore_get_float(mcs_handle_t *self, const char *section,
+			const char *key, float *value)
+{
+	char *str;
+
+	if (!mcs_pagestore_get_string(self, section, key, &str))
+		return MCS_FAIL;
+
+	*value = mcs_strtod_c(str, NULL);
+	free(str);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_pagestore_get_double(mcs_handle_t *self, const char *section,
+			 const char *key, double *value)
+{
+	char *str;
+
+	if (!mcs_pagestore_get_string(self, section, key, &str))
+		return MCS_FAIL;
+
+	*value = mcs_strtod_c(str, NULL);
+	free(str);
+
+	return MCS_OK;
+}
+
+static mcs_response_t
+mcs_pagestore_set_string(mcs_handle_t *self, const char *section,
+			 const char *key, const char *value)
+{
+	mcs_pagestore_handle_t *h = (mcs_pagestore_handle_t *) self->mcs_priv_handle;
+	unsigned char buf[PS_MAX_ENTRY];
+	ps_key_t k;
+
+	if (!ps_make_key(buf, sizeof buf, section, key, &k))
+		return MCS_FAIL;
+
+	return ps_put(h, k, value);
+}
+
+static mcs_response_t
+mcs_pagestore_set_int(mcs_handle_t *self, const char *section,
+		      const char *key, int value)
+{
+	char strval[64];
+
+	snprintf(strval, sizeof strval, "%d", value);
+
+	return mcs_pagestore_set_string(self, section, key, strval);
+}
+
+static mcs_response_t
+mcs_pagestore_set_bool(mcs_handle_t *self, const char *section,
+		       const char *key, int value)
+{
+	return mcs_pagestore_set_string(self, section, key, value ? "TRUE" : "FALSE");
+}
+
+static mcs_response_t
+mcs_pagestore_set_float(mcs_handle_t *self, const char *section,
+			const char *key, float value)
+{
+	char strval[64];
+
+	mcs_dtostr_c(strval, sizeof strval, value);
+
+	return mcs_pagestore_set_string(self, section, key, strval);
+}
+
+static mcs_response_t
+mcs_pagestore_set_double(mcs_handle_t *self, const char *section,
+			 const char *key, double value)
+{
+	char strval[64];
+
+	mcs_dtostr_c(strval, sizeof strval, value);
+
+	return mcs_pagestore_set_string(self, section, key, strval);
+}
+
+static mcs_response_t
+mcs_pagestore_unset_key(mcs_handle_t *self, const char *section,
+			const char *key)
+{
+	mcs_pagestore_handle_t *h = (mcs_pagestore_handle_t *) self->mcs_priv_handle;
+	unsigned char buf[PS_MAX_ENTRY];
+	ps_key_t k;
+
+	if (!ps_make_key(buf, sizeof buf, section, key, &k))
+		return MCS_FAIL;
+
+	return ps_del(h, k);
+}
+
+static mowgli_queue_t *
+mcs_pagestore_get_keys(mcs_handle_t *self, const char *section)
+{
+	mcs_pagestore_handle_t *h = (mcs_pagestore_handle_t *) self->mcs_priv_handle;
+	unsigned char buf[PS_MAX_ENTRY];
+	mowgli_queue_t *out = NULL, *tail = NULL;
+	ps_cursor_t cur;
+	ps_key_t prefix, k;
+
+	if (!ps_make_key(buf, sizeof buf, section, NULL, &prefix))
+		return NULL;
+
+	if (!ps_cursor_seek(h, &cur, prefix))
+		return NULL;
+
+	do
+	{
+		k = ps_cursor_key(h, &cur);
+
+		if (k.len < prefix.len || memcmp(k.data, prefix.data, prefix.len))
+			break;
+
+		tail = mowgli_queue_push(tail, mcs_strndup((const char *) k.data + prefix.len, k.len - prefix.len));
+		if (out == NULL)
+			out = tail;
+	} while (ps_cursor_next(h, &cur));
+
+	return out;
+}
+
+static mowgli_queue_t *
+mcs_pagestore_get_sections(mcs_handle_t *self)
+{
+	mcs_pagestore_handle_t *h = (mcs_pagestore_handle_t *) self->mcs_priv_handle;
+	unsigned char buf[PS_MAX_ENTRY];
+	mowgli_queue_t *out = NULL, *tail = NULL;
+	ps_cursor_t cur;
+	ps_key_t k;
+
+	k.data = buf;
+	k.len = 0;
+
+	/*
+	 * Visit one record per section: after each section, seek past all
+	 * of its keys by looking for the section name followed by \001.
+	 */
+	while (ps_cursor_seek(h, &cur, k))
+	{
+		size_t slen;
+
+		k = ps_cursor_key(h, &cur);
+		slen = mcs_strnlen((const char *) k.data, k.len);
+
+		if (slen + 1 >= sizeof buf)
+			break;
+
+		memmove(buf, k.data, slen);
+		buf[slen] = '\001';
+
+		tail = mowgli_queue_push(tail, mcs_strndup((const char *) buf, slen));
+		if (out == NULL)
+			out = tail;
+
+		k.data = buf;
+		k.len = slen + 1;
+	}
+
+	return out;
+}
+
+mcs_backend_t pagestore_backend = {
+	NULL,
+	"pagestore",
+	mcs_pagestore_new,
+	mcs_pagestore_destroy,
+
+	mcs_pagestore_get_string,
+	mcs_pagestore_get_int,
+	mcs_pagestore_get_bool,
+	mcs_pagestore_get_float,
+	mcs_pagestore_get_double,
+
+	mcs_pagestore_set_string,
+	mcs_pagestore_set_int,
+	mcs_pagestore_set_bool,
+	mcs_pagestore_set_float,
+	mcs_pagestore_set_double,
+
+	mcs_pagestore_unset_key,
+
+	mcs_pagestore_get_keys,
+	mcs_pagestore_get_sections,
+
+	mcs_pagestore_commit
+};
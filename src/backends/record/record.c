@@ -0,0 +1,496 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The record backend wraps another backend, selected with
+ * MCS_RECORD_BACKEND, and logs every call made through it to a compact
+ * binary trace named by MCS_RECORD_TRACE (mcs-<pid>.trace by default),
+ * with its timing, arguments, value sizes and result. mcs-replay(1)
+ * plays such a trace back against any backend.
+ *
+ * All handles of a process share one trace, which is opened with the
+ * first of them and stays open until the process exits; each record
+ * carries the id of the handle it was made on.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "libmcs/mcs.h"
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include "backends/record/record_format.h"
+
+typedef struct {
+	mcs_handle_t *inner;
+	uint64_t id;
+} mcs_record_handle_t;
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t alloc;
+} record_buf_t;
+
+extern mcs_backend_t record_backend;
+
+static FILE *trace;
+static mowgli_patricia_t *symbols;
+static uint64_t next_symbol;
+static uint64_t next_handle;
+static uint64_t last_time;
+static record_buf_t buf;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+# define record_lock()		pthread_mutex_lock(&record_lock)
+# define record_unlock()	pthread_mutex_unlock(&record_lock)
+#else
+# define record_lock()
+# define record_unlock()
+#endif
+
+static void nocanon(char *str) {}
+
+static uint64_t
+record_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+record_reserve(size_t len)
+{
+	if (buf.len + len <= buf.alloc)
+		return;
+
+	while (buf.len + len > buf.alloc)
+		buf.alloc = buf.alloc ? buf.alloc * 2 : 256;
+
+	buf.data = realloc(buf.data, buf.alloc);
+}
+
+static void
+record_varint(uint64_t v)
+{
+	record_reserve(10);
+	buf.len = record_put_varint(buf.data + buf.len, v) - buf.data;
+}
+
+static void
+record_byte(unsigned char v)
+{
+	record_reserve(1);
+	buf.data[buf.len++] = v;
+}
+
+static void
+record_symbol(const char *str)
+{
+	uintptr_t id;
+	size_t len;
+
+	if (str == NULL)
+		str = "";
+
+	if ((id = (uintptr_t) mowgli_patricia_retrieve(symbols, str)) != 0)
+	{
+		record_varint(id);
+		return;
+	}
+
+	mowgli_patricia_add(symbols, str, (void *) (uintptr_t) ++next_symbol);
+
+	len = strlen(str);
+	record_varint(0);
+	record_varint(len);
+	record_reserve(len);
+	memcpy(buf.data + buf.len, str, len);
+	buf.len += len;
+}
+
+/*
+ * Starts a record, with the lock held until record_end().
+ */
+static void
+record_begin(record_op_t op, uint64_t handle, uint64_t started,
+	     uint64_t finished, mcs_response_t ret)
+{
+	record_lock();
+
+	buf.len = 0;
+	record_byte(op);
+	record_varint(started >= last_time ? started - last_time : 0);
+	record_varint(handle);
+	record_varint(finished - started);
+	record_byte(ret);
+
+	if (started > last_time)
+		last_time = started;
+}
+
+static void
+record_end(void)
+{
+	if (trace != NULL)
+	{
+		fwrite(buf.data, 1, buf.len, trace);
+
+		/* keep the trace whole up to the last commit or close */
+		if (buf.data[0] == RECORD_COMMIT || buf.data[0] == RECORD_CLOSE)
+			fflush(trace);
+	}
+
+	record_unlock();
+}
+
+static void
+record_pair(record_op_t op, mcs_handle_t *self, uint64_t started,
+	    mcs_response_t ret, const char *section, const char *key)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+
+	record_begin(op, h->id, started, record_now(), ret);
+	record_symbol(section);
+	record_symbol(key);
+	record_end();
+}
+
+static void
+record_open_trace(void)
+{
+	const char *path;
+	char tmp[64];
+
+	if (symbols != NULL)
+		return;
+
+	if ((path = getenv("MCS_RECORD_TRACE")) == NULL || *path == '\0')
+	{
+		snprintf(tmp, sizeof tmp, "mcs-%lu.trace", (unsigned long) getpid());
+		path = tmp;
+	}
+
+	symbols = mowgli_patricia_create(nocanon);
+	next_symbol = 0;
+	last_time = record_now();
+
+	if ((trace = fopen(path, "wb")) == NULL)
+	{
+		mowgli_log("record: cannot open trace `%s': %s", path, strerror(errno));
+		return;
+	}
+
+	fwrite(RECORD_MAGIC, 1, RECORD_MAGIC_LEN, trace);
+}
+
+/* ***************************************************************** */
+
+static mcs_handle_t *
+mcs_record_new(char *domain)
+{
+	mcs_record_handle_t *h = calloc(sizeof(mcs_record_handle_t), 1);
+	mcs_handle_t *out = calloc(sizeof(mcs_handle_t), 1);
+	const char *magic;
+	uint64_t started = record_now();
+
+	out->base = &record_backend;
+	out->mcs_priv_handle = h;
+
+	if ((magic = getenv("MCS_RECORD_BACKEND")) == NULL || *magic == '\0')
+		magic = mcs_backend_select();
+
+	if (!strcasecmp(magic, record_backend.name))
+		magic = "default";
+
+	if ((h->inner = mcs_new_with_backend(magic, domain)) == NULL)
+	{
+		mowgli_log("record: unknown backend `%s', using the default one", magic);
+		h->inner = mcs_new_with_backend("default", domain);
+	}
+
+	record_lock();
+	record_open_trace();
+	h->id = next_handle++;
+	record_unlock();
+
+	record_begin(RECORD_OPEN, h->id, started, record_now(), MCS_OK);
+	record_symbol(domain);
+	record_end();
+
+	return out;
+}
+
+static void
+mcs_record_destroy(mcs_handle_t *self)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+
+	mowgli_object_unref(h->inner);
+
+	record_begin(RECORD_CLOSE, h->id, started, record_now(), MCS_OK);
+	record_end();
+
+	free(h);
+	free(self);
+}
+
+static mcs_response_t
+mcs_record_get_string(mcs_handle_t *self, const char *section,
+		      const char *key, char **value)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret;
+
+	ret = mcs_get_string(h->inner, section, key, value);
+
+	record_begin(RECORD_GET_STRING, h->id, started, record_now(), ret);
+	record_symbol(section);
+	record_symbol(key);
+	record_varint(ret == MCS_OK ? strlen(*value) : 0);
+	record_end();
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_record_get_int(mcs_handle_t *self, const char *section,
+		   const char *key, int *value)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret = mcs_get_int(h->inner, section, key, value);
+
+	record_pair(RECORD_GET_INT, self, started, ret, section, key);
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_record_get_bool(mcs_handle_t *self, const char *section,
+		    const char *key, int *value)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret = mcs_get_bool(h->inner, section, key, value);
+
+	record_pair(RECORD_GET_BOOL, self, started, ret, section, key);
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_record_get_float(mcs_handle_t *self, const char *section,
+		     const char *key, float *value)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret = mcs_get_float(h->inner, section, key, value);
+
+	record_pair(RECORD_GET_FLOAT, self, started, ret, section, key);
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_record_get_double(mcs_handle_t *self, const char *section,
+		      const char *key, double *value)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret = mcs_get_double(h->inner, section, key, value);
+
+	record_pair(RECORD_GET_DOUBLE, self, started, ret, section, key);
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_record_set_string(mcs_handle_t *self, const char *section,
+		      const char *key, const char *value)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret;
+
+	ret = mcs_set_string(h->inner, section, key, value);
+
+	record_begin(RECORD_SET_STRING, h->id, started, record_now(), ret);
+	record_symbol(section);
+	record_symbol(key);
+	record_varint(strlen(value));
+	record_end();
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_record_set_int(mcs_handle_t *self, const char *section,
+		   const char *key, int value)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret = mcs_set_int(h->inner, section, key, value);
+
+	record_pair(RECORD_SET_INT, self, started, ret, section, key);
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_record_set_bool(mcs_handle_t *self, const char *section,
+		    const char *key, int value)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret = mcs_set_bool(h->inner, section, key, value);
+
+	record_pair(RECORD_SET_BOOL, self, started, ret, section, key);
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_record_set_float(mcs_handle_t *self, const char *section,
+		     const char *key, float value)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret = mcs_set_float(h->inner, section, key, value);
+
+	record_pair(RECORD_SET_FLOAT, self, started, ret, section, key);
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_record_set_double(mcs_handle_t *self, const char *section,
+		      const char *key, double value)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret = mcs_set_double(h->inner, section, key, value);
+
+	record_pair(RECORD_SET_DOUBLE, self, started, ret, section, key);
+
+	return ret;
+}
+
+static mcs_response_t
+mcs_record_unset_key(mcs_handle_t *self, const char *section,
+		     const char *key)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret = mcs_unset_key(h->inner, section, key);
+
+	record_pair(RECORD_UNSET, self, started, ret, section, key);
+
+	return ret;
+}
+
+static mowgli_queue_t *
+mcs_record_get_keys(mcs_handle_t *self, const char *section)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mowgli_queue_t *out = mcs_get_keys(h->inner, section);
+
+	record_begin(RECORD_GET_KEYS, h->id, started, record_now(), out != NULL ? MCS_OK : MCS_FAIL);
+	record_symbol(section);
+	record_varint(out != NULL ? mowgli_queue_length(out) : 0);
+	record_end();
+
+	return out;
+}
+
+static mowgli_queue_t *
+mcs_record_get_sections(mcs_handle_t *self)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mowgli_queue_t *out = mcs_get_sections(h->inner);
+
+	record_begin(RECORD_GET_SECTIONS, h->id, started, record_now(), out != NULL ? MCS_OK : MCS_FAIL);
+	record_varint(out != NULL ? mowgli_queue_length(out) : 0);
+	record_end();
+
+	return out;
+}
+
+static mcs_response_t
+mcs_record_commit(mcs_handle_t *self)
+{
+	mcs_record_handle_t *h = (mcs_record_handle_t *) self->mcs_priv_handle;
+	uint64_t started = record_now();
+	mcs_response_t ret = mcs_commit(h->inner);
+
+	record_begin(RECORD_COMMIT, h->id, started, record_now(), ret);
+	record_end();
+
+	return ret;
+}
+
+mcs_backend_t record_backend = {
+	NULL,
+	"record",
+	mcs_record_new,
+	mcs_record_destroy,
+
+	mcs_record_get_string,
+	mcs_record_get_int,
+	mcs_record_get_bool,
+	mcs_record_get_float,
+	mcs_record_get_double,
+
+	mcs_record_set_string,
+	mcs_record_set_int,
+	mcs_record_set_bool,
+	mcs_record_set_float,
+	mcs_record_set_double,
+
+	mcs_record_unset_key,
+
+	mcs_record_get_keys,
+	mcs_record_get_sections,
+
+	mcs_record_commit
+};
@@ -0,0 +1,119 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Trace format shared by the record backend and mcs-replay(1).
+ *
+ * A trace is the 8 byte magic below followed by one record per call:
+ *
+ *   u8 op, varint time since the previous record (ns), varint handle,
+ *   varint duration (ns), u8 response, then the arguments of op.
+ *
+ * Sections, keys and domains are symbols: a varint id, or 0 followed by
+ * a varint length and the bytes of a string not seen before, which then
+ * gets the next id (starting at 1). Only the sizes of values are kept.
+ */
+
+#ifndef __RECORD_FORMAT_H__
+#define __RECORD_FORMAT_H__
+
+#include <stdint.h>
+
+#define RECORD_MAGIC		"MCSREC\0\1"
+#define RECORD_MAGIC_LEN	8
+
+typedef enum {
+	RECORD_OPEN,		/* sym domain */
+	RECORD_CLOSE,
+	RECORD_GET_STRING,	/* sym section, sym key, varint value length */
+	RECORD_GET_INT,		/* sym section, sym key */
+	RECORD_GET_BOOL,
+	RECORD_GET_FLOAT,
+	RECORD_GET_DOUBLE,
+	RECORD_SET_STRING,	/* sym section, sym key, varint value length */
+	RECORD_SET_INT,		/* sym section, sym key */
+	RECORD_SET_BOOL,
+	RECORD_SET_FLOAT,
+	RECORD_SET_DOUBLE,
+	RECORD_UNSET,		/* sym section, sym key */
+	RECORD_GET_KEYS,	/* sym section, varint count */
+	RECORD_GET_SECTIONS,	/* varint count */
+	RECORD_COMMIT,
+	RECORD_OP_COUNT
+} record_op_t;
+
+static const char *const record_op_names[RECORD_OP_COUNT] = {
+	"open", "close",
+	"get_string", "get_int", "get_bool", "get_float", "get_double",
+	"set_string", "set_int", "set_bool", "set_float", "set_double",
+	"unset", "get_keys", "get_sections", "commit"
+};
+
+static inline unsigned char *
+record_put_varint(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80)
+	{
+		*p++ = (unsigned char) (v | 0x80);
+		v >>= 7;
+	}
+
+	*p++ = (unsigned char) v;
+
+	return p;
+}
+
+/*
+ * Returns the number of bytes used, or 0 if the input ends early.
+ */
+static inline size_t
+record_get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+	const unsigned char *start = p;
+	int shift = 0;
+
+	*v = 0;
+
+	while (p < end && shift < 64)
+	{
+		*v |= (uint64_t) (*p & 0x7f) << shift;
+
+		if (!(*p++ & 0x80))
+			return p - start;
+
+		shift += 7;
+	}
+
+	return 0;
+}
+
+#endif
@@ -73,6 +73,80 @@ typedef enum {
 /** Friendly name for struct mcs_handle_ */
 typedef struct mcs_handle_ mcs_handle_t;
 
+/** Variables bound to the keys of a handle, see mcs_bind_int(). */
+typedef struct mcs_bindings_ mcs_bindings_t;
+
+/*! mcs_async_op_t denotes the operation of an asynchronous request. */
+typedef enum {
+	MCS_ASYNC_GET_STRING, /*!< retrieve a string value */
+	MCS_ASYNC_SET_STRING, /*!< set a string value */
+	MCS_ASYNC_COMMIT      /*!< write back pending changes */
+} mcs_async_op_t;
+
+/**
+ * \brief An asynchronous request, as seen by a backend.
+ *
+ * Requests are created by the functions in mcs_async.h. Backends with a
+ * mcs_async_submit hook fill in response, and value for gets, and then
+ * pass the request to mcs_async_complete().
+ */
+typedef struct {
+	mcs_async_op_t op;       /*!< the operation requested */
+	char *section;           /*!< section name, NULL for commits */
+	char *key;               /*!< key name, NULL for commits */
+	char *value;             /*!< value to set, or the value retrieved */
+	mcs_response_t response; /*!< outcome of the operation */
+	void *priv;              /*!< private to the async API */
+} mcs_async_request_t;
+
+/**
+ * \brief Called from an event loop when a watched descriptor is readable.
+ *
+ * \param fd The descriptor, see mcs_async_watch().
+ * \param privdata Opaque data passed to mcs_async_watch().
+ */
+typedef void (*mcs_async_io_func_t)(int fd, void *privdata);
+
+/**
+ * \brief Called by mcs_iterate() with each value in a domain.
+ *
+ * \param section The section the value is in.
+ * \param key The key of the value.
+ * \param value The value, as the string the keyfile backend would store.
+ * \param privdata Opaque data passed to mcs_iterate().
+ *
+ * \return Non-zero to stop the iteration.
+ */
+typedef int (*mcs_iterate_func_t)(const char *section, const char *key,
+				  const char *value, void *privdata);
+
+/*! mcs_diff_t describes one difference found by mcs_diff(). */
+typedef enum {
+	MCS_DIFF_ADDED,
+	MCS_DIFF_REMOVED,
+	MCS_DIFF_CHANGED
+} mcs_diff_t;
+
+/**
+ * \brief Called by mcs_diff() with each difference between two handles.
+ *
+ * Differences come in order of section, then key. A section found in
+ * only one of the handles is first reported with a NULL key, followed
+ * by each of its values.
+ *
+ * \param change Whether the section or value was added, removed or changed.
+ * \param section The section the difference is in.
+ * \param key The key of the value, or NULL for the section itself.
+ * \param old_value The value in the first handle, or NULL if added.
+ * \param new_value The value in the second handle, or NULL if removed.
+ * \param privdata Opaque data passed to mcs_diff().
+ *
+ * \return Non-zero to stop the comparison.
+ */
+typedef int (*mcs_diff_func_t)(mcs_diff_t change, const char *section,
+			       const char *key, const char *old_value,
+			       const char *new_value, void *privdata);
+
 /**
  * \brief Contains the vtable and some references for an mcs storage backend.
  *
@@ -296,17 +370,324 @@ typedef struct {
 	 * \param handle A mcs.handle object to get the sections from.
 	 */
 	mowgli_queue_t *(*mcs_get_sections)(mcs_handle_t *handle);
+
+	/*
+	 * The following functions are optional and may be NULL. They are
+	 * appended here so that existing backends keep working unchanged.
+	 */
+
+	/* write back */
+
+	/**
+	 * \brief Writes pending changes to the backing store.
+	 *
+	 * Backends which defer writes until the handle is destroyed
+	 * should implement this so that applications can persist
+	 * changes at a point of their choosing.
+	 *
+	 * \param handle A mcs.handle object to commit.
+	 */
+	mcs_response_t (*mcs_commit)(mcs_handle_t *handle);
+
+	/* asynchronous requests */
+
+	/**
+	 * \brief Starts an asynchronous request without blocking.
+	 *
+	 * Backends which can do their work without blocking the caller
+	 * implement this, rather than having the async API run their
+	 * synchronous functions from the event loop. The backend calls
+	 * mcs_async_complete() once the request is done, which may happen
+	 * before this returns. A backend waiting on a descriptor passes it
+	 * to mcs_async_watch(), so that the request's event loop calls it
+	 * back when the descriptor is readable.
+	 *
+	 * \param handle A mcs.handle object to run the request on.
+	 * \param request The request to run.
+	 * \return MCS_OK if the request was taken, MCS_FAIL to have it run
+	 *         from the event loop instead.
+	 */
+	mcs_response_t (*mcs_async_submit)(mcs_handle_t *handle,
+					   mcs_async_request_t *request);
+
+	/* iteration */
+
+	/**
+	 * \brief Calls a function with every value in a section, or in
+	 *        the whole domain.
+	 *
+	 * Backends which can walk their values directly implement this
+	 * to spare mcs_iterate() a lookup for every key.
+	 *
+	 * \param handle A mcs.handle object to walk.
+	 * \param section The section to walk, or NULL for all of them.
+	 * \param func The function to call with each value.
+	 * \param privdata Opaque data passed to func.
+	 * \return MCS_FAIL if the section does not exist.
+	 */
+	mcs_response_t (*mcs_iterate)(mcs_handle_t *handle,
+				      const char *section,
+				      mcs_iterate_func_t func,
+				      void *privdata);
+
+	/* memory management */
+
+	/**
+	 * \brief Estimates the memory held by a handle's parsed state.
+	 *
+	 * \param handle A mcs.handle object to measure.
+	 * \return The number of bytes, or 0 if nothing is loaded.
+	 */
+	size_t (*mcs_memory_usage)(mcs_handle_t *handle);
+
+	/**
+	 * \brief Drops a handle's parsed state until it is next used.
+	 *
+	 * Pending changes are written back first. The handle stays
+	 * valid, and loads its state again on the next call which
+	 * needs it.
+	 *
+	 * \param handle A mcs.handle object to evict.
+	 * \return MCS_FAIL if pending changes could not be written.
+	 */
+	mcs_response_t (*mcs_evict)(mcs_handle_t *handle);
+
+	/* snapshots */
+
+	/**
+	 * \brief Returns a new handle holding the current state of a
+	 *        handle, without copying it.
+	 *
+	 * The new handle is not written back when it is destroyed.
+	 * Backends which implement this share state between the
+	 * handles, copying only what either of them later changes.
+	 *
+	 * \param handle A mcs.handle object to take a snapshot of.
+	 * \param writable Zero for a read-only snapshot, non-zero for a
+	 *                 clone which may be changed and committed.
+	 * \return The new handle, not yet initialized as a mowgli.object.
+	 */
+	mcs_handle_t *(*mcs_snapshot)(mcs_handle_t *handle, int writable);
+
+	/**
+	 * \brief Reports the differences between two handles of this
+	 *        backend.
+	 *
+	 * Backends which keep their values sorted implement this to
+	 * compare them in a single pass, without looking up keys.
+	 *
+	 * \param from The mcs.handle object to compare from.
+	 * \param to The mcs.handle object to compare to.
+	 * \param func The function to call with each difference.
+	 * \param privdata Opaque data passed to func.
+	 * \return MCS_FAIL if either handle could not be read.
+	 */
+	mcs_response_t (*mcs_diff)(mcs_handle_t *from, mcs_handle_t *to,
+				   mcs_diff_func_t func, void *privdata);
+
+	/* refreshing */
+
+	/**
+	 * \brief Picks up changes made to the backing store behind a
+	 *        handle's back.
+	 *
+	 * The backend calls mcs_bindings_update() for each value which
+	 * changed, or mcs_bindings_refresh() if it cannot tell which,
+	 * and bumps the handle's generation if anything did.
+	 *
+	 * \param handle A mcs.handle object to refresh.
+	 * \return MCS_FAIL if the backing store could not be read.
+	 */
+	mcs_response_t (*mcs_refresh)(mcs_handle_t *handle);
+
+	/**
+	 * \brief Tells where a value was read from.
+	 *
+	 * \param handle A mcs.handle object to query.
+	 * \param section The section the value is in.
+	 * \param key The key of the value.
+	 * \param origin Set to a newly allocated path of the file the
+	 *               value came from, or will be written to.
+	 * \return MCS_FAIL if the value is not set.
+	 */
+	mcs_response_t (*mcs_get_origin)(mcs_handle_t *handle,
+					 const char *section,
+					 const char *key,
+					 char **origin);
 } mcs_backend_t;
 
+/*! mcs_stat_type_t indexes the per-type counters in mcs_stats_t. */
+typedef enum {
+	MCS_STAT_STRING,
+	MCS_STAT_INT,
+	MCS_STAT_BOOL,
+	MCS_STAT_FLOAT,
+	MCS_STAT_DOUBLE,
+	MCS_STAT_TYPES
+} mcs_stat_type_t;
+
+/**
+ * \brief Counters reported by mcs_handle_get_stats() and mcs_get_global_stats().
+ *
+ * The counters are updated with relaxed atomic operations, so they are
+ * always on. Times are in nanoseconds.
+ */
+typedef struct {
+	unsigned long long gets[MCS_STAT_TYPES]; /*!< gets, by type */
+	unsigned long long sets[MCS_STAT_TYPES]; /*!< sets, by type */
+	unsigned long long unsets;       /*!< keys unset */
+	unsigned long long misses;       /*!< gets which failed */
+	unsigned long long opens;        /*!< handles opened */
+	unsigned long long bytes_parsed; /*!< bytes read when loading */
+	unsigned long long parse_ns;     /*!< time spent loading */
+	unsigned long long writes;       /*!< write backs to storage */
+	unsigned long long write_bytes;  /*!< bytes written back */
+	unsigned long long fsync_ns;     /*!< time spent in fsync(2) */
+} mcs_stats_t;
+
 /**
  * \brief Represents an MCS object handle.
+ *
+ * Backends must allocate sizeof(mcs_handle_t) bytes, zeroed, so that
+ * the fields after mcs_priv_handle start out cleared.
  */
 struct mcs_handle_ {
 	mowgli_object_t object;  /*!< mowgli.object parent. */
 	mcs_backend_t *base;     /*!< vtable of backend functions */
 	void *mcs_priv_handle;   /*!< backend-specific opaque data */
+	mcs_stats_t stats;       /*!< counters for this handle */
+	mcs_bindings_t *bindings; /*!< bound variables, or NULL */
+	unsigned long generation; /*!< bumped whenever a value changes */
+	mcs_handle_t *frozen;    /*!< read-only image from mcs_freeze(), or NULL */
 };
 
+/**
+ * \brief Counters reported by mcs_cache_get_stats().
+ */
+typedef struct {
+	unsigned long hits;           /*!< gets answered from the cache */
+	unsigned long negative_hits;  /*!< gets answered by a cached miss */
+	unsigned long misses;         /*!< gets passed to the inner backend */
+	unsigned long evictions;      /*!< entries evicted to make room */
+	unsigned long expirations;    /*!< entries dropped by the TTL */
+	unsigned long writebacks;     /*!< write-back values written out */
+	unsigned long entries;        /*!< entries currently cached */
+	unsigned long long miss_ns;   /*!< time spent in the inner backend */
+	unsigned long long time_saved_ns; /*!< estimated time saved by hits */
+} mcs_cache_stats_t;
+
+/*! mcs_trace_op_t identifies the call reported to a tracer. */
+typedef enum {
+	MCS_TRACE_OPEN,         /*!< mcs_new(); section is the domain */
+	MCS_TRACE_GET_STRING,
+	MCS_TRACE_GET_INT,
+	MCS_TRACE_GET_BOOL,
+	MCS_TRACE_GET_FLOAT,
+	MCS_TRACE_GET_DOUBLE,
+	MCS_TRACE_SET_STRING,
+	MCS_TRACE_SET_INT,
+	MCS_TRACE_SET_BOOL,
+	MCS_TRACE_SET_FLOAT,
+	MCS_TRACE_SET_DOUBLE,
+	MCS_TRACE_UNSET,
+	MCS_TRACE_GET_KEYS,
+	MCS_TRACE_GET_SECTIONS,
+	MCS_TRACE_COMMIT,
+	MCS_TRACE_ITERATE,
+	MCS_TRACE_OPS
+} mcs_trace_op_t;
+
+/**
+ * \brief A completed call, as passed to a tracer.
+ */
+typedef struct {
+	mcs_trace_op_t op;       /*!< the call made */
+	const char *backend;     /*!< name of the backend which served it */
+	mcs_handle_t *handle;    /*!< the handle it was made on */
+	const char *section;     /*!< section, or the domain for opens; may be NULL */
+	const char *key;         /*!< key; may be NULL */
+	mcs_response_t response; /*!< outcome of the call */
+	unsigned long long ns;   /*!< time the backend took */
+} mcs_trace_event_t;
+
+/** A tracer registered with mcs_trace_register(). */
+typedef void (*mcs_trace_func_t)(const mcs_trace_event_t *event, void *privdata);
+
+/*
+ * Latency histograms are log-linear: values below 4ns have a bucket
+ * each, and every power of two above that is split into four buckets,
+ * so a bucket is never wider than a quarter of its lower bound.
+ */
+#define MCS_TRACE_BUCKETS 252
+
+/**
+ * \brief A latency histogram kept by the tracing layer.
+ */
+typedef struct {
+	unsigned long long count;  /*!< calls recorded */
+	unsigned long long sum_ns; /*!< total time of those calls */
+	unsigned long long max_ns; /*!< slowest call */
+	unsigned long long buckets[MCS_TRACE_BUCKETS]; /*!< calls per bucket */
+} mcs_trace_histogram_t;
+
+/*! mcs_schema_type_t is the type of a field filled in by mcs_schema_load(). */
+typedef enum {
+	MCS_SCHEMA_STRING, /*!< char *, released by mcs_schema_free() */
+	MCS_SCHEMA_INT,    /*!< int */
+	MCS_SCHEMA_BOOL,   /*!< int, 0 or 1 */
+	MCS_SCHEMA_FLOAT,  /*!< float */
+	MCS_SCHEMA_DOUBLE  /*!< double */
+} mcs_schema_type_t;
+
+/**
+ * \brief Describes a field of a struct filled in by mcs_schema_load().
+ *
+ * Tables of these are normally generated by mcs-schema-compile(1).
+ */
+typedef struct {
+	const char *section;     /*!< section the value is in */
+	const char *key;         /*!< key of the value */
+	mcs_schema_type_t type;  /*!< type of the field */
+	size_t offset;           /*!< offset of the field in the struct */
+	const char *def;         /*!< default, as a stored value, or NULL */
+	int ranged;              /*!< non-zero if min and max apply */
+	double min;              /*!< smallest valid value */
+	double max;              /*!< largest valid value */
+} mcs_schema_field_t;
+
+/*! mcs_manager_t is a set of handles kept within a memory budget. */
+typedef struct mcs_manager_ mcs_manager_t;
+
+/**
+ * \brief Counters reported by mcs_manager_get_stats().
+ */
+typedef struct {
+	unsigned long hits;           /*!< gets of a domain which was loaded */
+	unsigned long misses;         /*!< gets which opened or reloaded a domain */
+	unsigned long evictions;      /*!< domains evicted to keep within budget */
+	unsigned long failed_evictions; /*!< evictions refused by the backend */
+	unsigned long handles;        /*!< domains currently managed */
+	size_t usage;                 /*!< memory held by loaded domains */
+	size_t budget;                /*!< the memory budget */
+} mcs_manager_stats_t;
+
+/**
+ * \brief Callbacks for the streaming keyfile parser.
+ *
+ * The strings passed are slices of the parser's buffer: they are not
+ * NUL-terminated, and only valid until the callback returns. Each
+ * callback returns non-zero to stop parsing.
+ */
+typedef struct {
+	/** A section header; later values belong to this section. */
+	int (*section)(const char *name, size_t len, void *ctx);
+	/** A value in the current section. */
+	int (*value)(const char *key, size_t keylen,
+		     const char *value, size_t valuelen, void *ctx);
+	/** A comment line, including the leading '#'. */
+	int (*comment)(const char *text, size_t len, void *ctx);
+} mcs_keyfile_callbacks_t;
+
 /*
  * These functions have to do with initialization of the
  * library.
@@ -333,6 +714,7 @@ extern const char *       mcs_backend_select(void);
  * disk.
  */
 extern mcs_handle_t *mcs_new(char *domain);
+extern mcs_handle_t *mcs_new_with_backend(const char *backend, char *domain);
 extern void mcs_destroy(mcs_handle_t *handle);
 
 /*
@@ -401,6 +783,119 @@ extern mowgli_queue_t *mcs_get_keys(mcs_handle_t *handle,
 
 extern mowgli_queue_t *mcs_get_sections(mcs_handle_t *handle);
 
+/* write back */
+extern mcs_response_t mcs_commit(mcs_handle_t *handle);
+
+/* iteration */
+extern mcs_response_t mcs_iterate(mcs_handle_t *handle, const char *section,
+				  mcs_iterate_func_t func, void *privdata);
+
+/* snapshots */
+extern mcs_handle_t *mcs_snapshot(mcs_handle_t *handle);
+extern mcs_handle_t *mcs_clone(mcs_handle_t *handle);
+extern mcs_response_t mcs_diff(mcs_handle_t *from, mcs_handle_t *to,
+			       mcs_diff_func_t func, void *privdata);
+
+/* memory management */
+extern size_t mcs_handle_memory_usage(mcs_handle_t *handle);
+extern mcs_response_t mcs_handle_evict(mcs_handle_t *handle);
+
+/* refreshing */
+extern mcs_response_t mcs_refresh(mcs_handle_t *handle);
+extern unsigned long mcs_handle_generation(mcs_handle_t *handle);
+
+/* provenance */
+extern mcs_response_t mcs_get_origin(mcs_handle_t *handle, const char *section,
+				     const char *key, char **origin);
+
+/* read-mostly handles */
+extern mcs_response_t mcs_freeze(mcs_handle_t *handle);
+extern int mcs_handle_is_frozen(mcs_handle_t *handle);
+
+/* statistics */
+extern void mcs_handle_get_stats(mcs_handle_t *handle, mcs_stats_t *stats);
+extern void mcs_get_global_stats(mcs_stats_t *stats);
+extern void mcs_foreach_domain_opens(int (*func)(const char *domain, unsigned long long opens,
+						 void *privdata), void *privdata);
+
+/*
+ * These functions keep many domains open within a memory budget.
+ */
+extern mcs_manager_t *mcs_manager_new(size_t budget);
+extern void mcs_manager_destroy(mcs_manager_t *manager);
+extern mcs_handle_t *mcs_manager_get(mcs_manager_t *manager, const char *domain);
+extern void mcs_manager_set_budget(mcs_manager_t *manager, size_t budget);
+extern void mcs_manager_get_stats(mcs_manager_t *manager, mcs_manager_stats_t *stats);
+
+/*
+ * These functions load a whole struct of settings at once.
+ */
+extern mcs_response_t mcs_schema_load(mcs_handle_t *handle, const mcs_schema_field_t *fields,
+				      size_t count, void *out);
+extern void mcs_schema_free(const mcs_schema_field_t *fields, size_t count, void *out);
+extern mcs_response_t mcs_schema_check(const mcs_schema_field_t *field, const char *value);
+
+/*
+ * These functions bind variables to keys, so that they follow changes
+ * made through the handle.
+ */
+extern mcs_response_t mcs_bind_string(mcs_handle_t *handle, const char *section, const char *key,
+				      const char **var, const char *def);
+extern mcs_response_t mcs_bind_int(mcs_handle_t *handle, const char *section, const char *key,
+				   int *var, int def);
+extern mcs_response_t mcs_bind_bool(mcs_handle_t *handle, const char *section, const char *key,
+				    int *var, int def);
+extern mcs_response_t mcs_bind_float(mcs_handle_t *handle, const char *section, const char *key,
+				     float *var, float def);
+extern mcs_response_t mcs_bind_double(mcs_handle_t *handle, const char *section, const char *key,
+				      double *var, double def);
+extern mcs_response_t mcs_unbind(mcs_handle_t *handle, const void *var);
+extern void mcs_bind_reclaim(mcs_handle_t *handle);
+
+/*
+ * These functions have to do with tracing calls into the backends.
+ */
+extern mcs_response_t mcs_trace_register(mcs_trace_func_t func, void *privdata);
+extern mcs_response_t mcs_trace_unregister(mcs_trace_func_t func, void *privdata);
+extern void mcs_trace_set_histograms(int enable);
+extern void mcs_trace_foreach_histogram(int (*func)(const char *backend, mcs_trace_op_t op,
+						    const mcs_trace_histogram_t *hist,
+						    void *privdata), void *privdata);
+extern unsigned long long mcs_trace_histogram_percentile(const mcs_trace_histogram_t *hist,
+							 double percentile);
+extern unsigned long long mcs_trace_bucket_floor(int bucket);
+extern const char *mcs_trace_op_name(mcs_trace_op_t op);
+
+/*
+ * These functions are specific to the keyfile backend.
+ */
+extern mcs_response_t mcs_keyfile_parse_buffer(const char *buf, size_t len,
+					       const mcs_keyfile_callbacks_t *cb, void *ctx);
+extern mcs_response_t mcs_keyfile_parse_fd(int fd, const mcs_keyfile_callbacks_t *cb, void *ctx);
+
+/*
+ * These functions are specific to the memory backend.
+ */
+extern mcs_handle_t *mcs_memory_new_from_handle(mcs_handle_t *src);
+
+/*
+ * These functions are specific to the cdb backend.
+ */
+extern mcs_response_t mcs_cdb_compile(mcs_handle_t *src, const char *path);
+extern mcs_handle_t *mcs_cdb_new_from_handle(mcs_handle_t *src);
+
+/*
+ * These functions are specific to the cache backend.
+ */
+extern void mcs_cache_invalidate(mcs_handle_t *handle, const char *section, const char *key);
+extern mcs_response_t mcs_cache_get_stats(mcs_handle_t *handle, mcs_cache_stats_t *stats);
+
+/*
+ * These functions are specific to the daemon backend.
+ */
+extern mcs_response_t mcs_daemon_prefetch(mcs_handle_t *handle, const char **sections,
+					  const char **keys, size_t count);
+
 /*
  * These functions have to do with the plugin loader.
  */
@@ -413,8 +908,45 @@ extern void mcs_unload_plugins(mowgli_patricia_t *l);
 extern size_t mcs_strnlen(const char *str, size_t len);
 extern char * mcs_strndup(const char *str, size_t len);
 extern int mcs_create_directory(const char *path, mode_t mode);
+extern size_t mcs_domain_path(char *buf, size_t len, const char *domain, const char *file);
 extern size_t mcs_strlcat(char *dest, const char *src, size_t count);
 extern size_t mcs_strlcpy(char *dest, const char *src, size_t count);
 extern void mcs_strcasecanon(char *str);
+extern double mcs_strtod_c(const char *str, char **end);
+extern void mcs_dtostr_c(char *buf, size_t len, double value);
+extern void mcs_dtostr_prec_c(char *buf, size_t len, double value, int digits);
+
+/*
+ * These functions are for backends implementing mcs_async_submit.
+ * mcs_async_forget() must be called before closing a descriptor which
+ * was passed to mcs_async_watch().
+ */
+extern void mcs_async_complete(mcs_async_request_t *request);
+extern void mcs_async_watch(mcs_async_request_t *request, int fd,
+			    mcs_async_io_func_t func, void *privdata);
+extern void mcs_async_forget(int fd);
+
+#ifdef _MCS_CORE
+extern unsigned long long mcs_stat_clock(void);
+extern void mcs_stat_open(mcs_handle_t *handle, const char *domain);
+extern void mcs_stat_get(mcs_handle_t *handle, mcs_stat_type_t type, mcs_response_t ret);
+extern void mcs_stat_set(mcs_handle_t *handle, mcs_stat_type_t type);
+extern void mcs_stat_unset(mcs_handle_t *handle);
+extern void mcs_stat_parse(mcs_handle_t *handle, size_t bytes, unsigned long long ns);
+extern void mcs_stat_write(mcs_handle_t *handle, size_t bytes, unsigned long long fsync_ns);
+extern void mcs_stats_fini(void);
+
+extern int mcs_trace_active;
+extern void mcs_trace_call(mcs_handle_t *handle, mcs_trace_op_t op, const char *section,
+			   const char *key, mcs_response_t ret, unsigned long long ns);
+extern void mcs_trace_fini(void);
+
+extern void mcs_bindings_update(mcs_handle_t *handle, const char *section, const char *key);
+extern void mcs_bindings_refresh(mcs_handle_t *handle);
+extern void mcs_bindings_destroy(mcs_handle_t *handle);
+
+extern void mcs_util_init(void);
+extern void mcs_util_fini(void);
+#endif
 
 #endif
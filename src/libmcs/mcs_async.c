@@ -0,0 +1,548 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "libmcs/mcs.h"
+
+#ifdef HAVE_MOWGLI_EVENTLOOP
+
+#include <fcntl.h>
+#include <sys/select.h>
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include "libmcs/mcs_async.h"
+
+typedef struct mcs_async_loop_ mcs_async_loop_t;
+typedef struct mcs_async_job_ mcs_async_job_t;
+typedef struct mcs_async_watch_ mcs_async_watch_t;
+
+/*
+ * Completed requests are queued on the loop they were submitted with and
+ * a byte is written to its pipe, so that the callbacks run on the event
+ * loop's thread whichever thread finished the request.
+ *
+ * Requests for backends without a mcs_async_submit hook are queued on
+ * the loop too, and run from it. Running them on a thread of our own
+ * would race with the rest of the program over mowgli's allocators, the
+ * locale and everything else libmcs shares between handles.
+ *
+ * Backends which wait on a socket instead ask for it to be watched with
+ * mcs_async_watch(). The watch lasts as long as some request on the loop
+ * waits on it, and is only touched on the loop's thread.
+ */
+struct mcs_async_loop_ {
+	mowgli_eventloop_t *eventloop;
+	mowgli_eventloop_pollable_t *pollable;
+	int pipe[2];
+	mcs_async_job_t *queued;	/* only touched on the loop's thread */
+	mcs_async_job_t *queued_tail;
+	mcs_async_job_t *done;
+	mcs_async_job_t *done_tail;
+	mcs_async_watch_t *watches;
+	unsigned int pending;
+	mcs_async_loop_t *next;
+};
+
+struct mcs_async_watch_ {
+	int fd;			/* -1 once forgotten */
+	mowgli_eventloop_pollable_t *pollable;
+	mcs_async_io_func_t func;
+	void *privdata;
+	unsigned int refs;	/* requests waiting on it */
+	mcs_async_watch_t *next;
+};
+
+struct mcs_async_job_ {
+	mcs_async_request_t request;
+	mcs_handle_t *handle;
+	mcs_async_loop_t *loop;
+	mcs_async_watch_t *watch;
+	mcs_async_cb_t cb;
+	void *privdata;
+	mcs_async_job_t *next;
+};
+
+static mcs_async_loop_t *loops;
+
+/* backends may complete requests from threads of their own */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+
+# define async_lock()	pthread_mutex_lock(&async_lock)
+# define async_unlock()	pthread_mutex_unlock(&async_lock)
+#else
+# define async_lock()
+# define async_unlock()
+#endif
+
+static void
+mcs_async_run(mcs_async_job_t *job)
+{
+	mcs_async_request_t *req = &job->request;
+
+	switch (req->op)
+	{
+	case MCS_ASYNC_GET_STRING:
+		req->response = mcs_get_string(job->handle, req->section, req->key, &req->value);
+		break;
+	case MCS_ASYNC_SET_STRING:
+		req->response = mcs_set_string(job->handle, req->section, req->key, req->value);
+		break;
+	case MCS_ASYNC_COMMIT:
+		req->response = mcs_commit(job->handle);
+		break;
+	}
+}
+
+static void
+mcs_async_watch_release(mcs_async_loop_t *loop, mcs_async_watch_t *w)
+{
+	mcs_async_watch_t **prev;
+
+	if (--w->refs > 0)
+		return;
+
+	for (prev = &loop->watches; *prev != w; prev = &(*prev)->next)
+		;
+	*prev = w->next;
+
+	if (w->pollable != NULL)
+		mowgli_pollable_destroy(loop->eventloop, w->pollable);
+
+	free(w);
+}
+
+static void
+mcs_async_watch_ready(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io,
+		      mowgli_eventloop_io_dir_t dir, void *userdata)
+{
+	mcs_async_watch_t *w = userdata;
+
+	w->func(w->fd, w->privdata);
+}
+
+static void
+mcs_async_wakeup(mcs_async_loop_t *loop)
+{
+	/* a full pipe already guarantees a wakeup */
+	if (write(loop->pipe[1], "", 1) < 0 && errno != EAGAIN)
+		mowgli_log("mcs_async: cannot wake up the event loop: %s", strerror(errno));
+}
+
+/*
+ * Runs the requests queued for this loop, then the callbacks of every
+ * request completed on it.
+ */
+static void
+mcs_async_dispatch(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io,
+		   mowgli_eventloop_io_dir_t dir, void *userdata)
+{
+	mcs_async_loop_t *loop = userdata;
+	mcs_async_job_t *job, *next;
+	char buf[256];
+
+	while (read(loop->pipe[0], buf, sizeof buf) > 0)
+		;
+
+	/* requests queued by callbacks below wait for the next wakeup */
+	job = loop->queued;
+	loop->queued = loop->queued_tail = NULL;
+
+	for (; job != NULL; job = next)
+	{
+		next = job->next;
+		mcs_async_run(job);
+		mcs_async_complete(&job->request);
+	}
+
+	async_lock();
+	job = loop->done;
+	loop->done = loop->done_tail = NULL;
+	async_unlock();
+
+	for (; job != NULL; job = next)
+	{
+		next = job->next;
+
+		if (job->cb != NULL)
+			job->cb(job->handle, job->request.response, job->request.value, job->privdata);
+
+		if (job->watch != NULL)
+			mcs_async_watch_release(loop, job->watch);
+
+		loop->pending--;
+
+		mowgli_object_unref(job->handle);
+		free(job->request.section);
+		free(job->request.key);
+		free(job->request.value);
+		free(job);
+	}
+}
+
+static mcs_async_loop_t *
+mcs_async_loop(mowgli_eventloop_t *eventloop)
+{
+	mcs_async_loop_t *loop;
+
+	for (loop = loops; loop != NULL; loop = loop->next)
+	{
+		if (loop->eventloop == eventloop)
+			return loop;
+	}
+
+	loop = calloc(sizeof(mcs_async_loop_t), 1);
+
+	if (pipe(loop->pipe) < 0)
+	{
+		mowgli_log("mcs_async: cannot create a pipe: %s", strerror(errno));
+		free(loop);
+		return NULL;
+	}
+
+	fcntl(loop->pipe[0], F_SETFL, fcntl(loop->pipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl(loop->pipe[1], F_SETFL, fcntl(loop->pipe[1], F_GETFL) | O_NONBLOCK);
+
+	loop->eventloop = eventloop;
+	loop->pollable = mowgli_pollable_create(eventloop, loop->pipe[0], loop);
+	mowgli_pollable_setselect(eventloop, loop->pollable, MOWGLI_EVENTLOOP_IO_READ, mcs_async_dispatch);
+
+	loop->next = loops;
+	loops = loop;
+
+	return loop;
+}
+
+static mcs_response_t
+mcs_async_submit(mowgli_eventloop_t *eventloop, mcs_handle_t *self,
+		 mcs_async_op_t op, const char *section, const char *key,
+		 const char *value, mcs_async_cb_t cb, void *privdata)
+{
+	mcs_async_loop_t *loop;
+	mcs_async_job_t *job;
+
+	return_val_if_fail(eventloop != NULL, MCS_FAIL);
+	return_val_if_fail(self != NULL, MCS_FAIL);
+
+	if ((loop = mcs_async_loop(eventloop)) == NULL)
+		return MCS_FAIL;
+
+	job = calloc(sizeof(mcs_async_job_t), 1);
+	job->request.op = op;
+	job->request.section = section != NULL ? strdup(section) : NULL;
+	job->request.key = key != NULL ? strdup(key) : NULL;
+	job->request.value = value != NULL ? strdup(value) : NULL;
+	job->request.response = MCS_FAIL;
+	job->request.priv = job;
+	job->handle = mowgli_object_ref(self);
+	job->loop = loop;
+	job->cb = cb;
+	job->privdata = privdata;
+
+	loop->pending++;
+
+	if (self->base->mcs_async_submit != NULL &&
+	    self->base->mcs_async_submit(self, &job->request) == MCS_OK)
+		return MCS_OK;
+
+	if (loop->queued_tail != NULL)
+		loop->queued_tail->next = job;
+	else
+		loop->queued = job;
+
+	loop->queued_tail = job;
+	job->next = NULL;
+
+	mcs_async_wakeup(loop);
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Retrieves a string value without blocking.
+ *
+ * The value is looked up as with mcs_get_string(), and cb is run from
+ * eventloop with the result.
+ *
+ * \param eventloop The event loop to run the callback from.
+ * \param handle A mcs.handle object to search for the key in.
+ * \param section A section name to look for the key in.
+ * \param key The name of the key to look up.
+ * \param cb The completion callback.
+ * \param privdata A pointer to pass to the callback.
+ * \return MCS_OK if the request was submitted, MCS_FAIL otherwise.
+ */
+mcs_response_t
+mcs_get_string_async(mowgli_eventloop_t *eventloop, mcs_handle_t *self,
+		     const char *section, const char *key, mcs_async_cb_t cb,
+		     void *privdata)
+{
+	return_val_if_fail(section != NULL, MCS_FAIL);
+	return_val_if_fail(key != NULL, MCS_FAIL);
+
+	return mcs_async_submit(eventloop, self, MCS_ASYNC_GET_STRING, section, key, NULL, cb, privdata);
+}
+
+/**
+ * \brief Sets a string value without blocking.
+ *
+ * \param eventloop The event loop to run the callback from.
+ * \param handle A mcs.handle object to set the key in.
+ * \param section A section name to set the key in.
+ * \param key The name of the key to set.
+ * \param value The value to set.
+ * \param cb The completion callback, or NULL.
+ * \param privdata A pointer to pass to the callback.
+ * \return MCS_OK if the request was submitted, MCS_FAIL otherwise.
+ */
+mcs_response_t
+mcs_set_async(mowgli_eventloop_t *eventloop, mcs_handle_t *self,
+	      const char *section, const char *key, const char *value,
+	      mcs_async_cb_t cb, void *privdata)
+{
+	return_val_if_fail(section != NULL, MCS_FAIL);
+	return_val_if_fail(key != NULL, MCS_FAIL);
+	return_val_if_fail(value != NULL, MCS_FAIL);
+
+	return mcs_async_submit(eventloop, self, MCS_ASYNC_SET_STRING, section, key, value, cb, privdata);
+}
+
+/**
+ * \brief Writes back pending changes without blocking.
+ *
+ * \param eventloop The event loop to run the callback from.
+ * \param handle A mcs.handle object to commit.
+ * \param cb The completion callback, or NULL.
+ * \param privdata A pointer to pass to the callback.
+ * \return MCS_OK if the request was submitted, MCS_FAIL otherwise.
+ */
+mcs_response_t
+mcs_commit_async(mowgli_eventloop_t *eventloop, mcs_handle_t *self,
+		 mcs_async_cb_t cb, void *privdata)
+{
+	return mcs_async_submit(eventloop, self, MCS_ASYNC_COMMIT, NULL, NULL, NULL, cb, privdata);
+}
+
+/**
+ * \brief Stops using an event loop for asynchronous requests.
+ *
+ * Requests still in flight on the loop are waited for and their
+ * callbacks run before this returns. This must be called before the
+ * event loop is destroyed if it was ever used with the async API.
+ *
+ * \param eventloop The event loop to detach from.
+ */
+void
+mcs_async_detach(mowgli_eventloop_t *eventloop)
+{
+	mcs_async_loop_t *loop, **prev;
+
+	for (prev = &loops; (loop = *prev) != NULL; prev = &loop->next)
+	{
+		if (loop->eventloop == eventloop)
+			break;
+	}
+
+	if (loop == NULL)
+		return;
+
+	while (loop->pending > 0)
+	{
+		mcs_async_watch_t *w, *next;
+		fd_set readfds;
+		int maxfd = loop->pipe[0];
+
+		FD_ZERO(&readfds);
+		FD_SET(loop->pipe[0], &readfds);
+
+		for (w = loop->watches; w != NULL; w = w->next)
+		{
+			if (w->fd < 0)
+				continue;
+
+			FD_SET(w->fd, &readfds);
+			if (w->fd > maxfd)
+				maxfd = w->fd;
+		}
+
+		select(maxfd + 1, &readfds, NULL, NULL, NULL);
+
+		/* a watch is only released from the dispatch below */
+		for (w = loop->watches; w != NULL; w = next)
+		{
+			next = w->next;
+
+			if (w->fd >= 0 && FD_ISSET(w->fd, &readfds))
+				w->func(w->fd, w->privdata);
+		}
+
+		mcs_async_dispatch(eventloop, NULL, MOWGLI_EVENTLOOP_IO_READ, loop);
+	}
+
+	*prev = loop->next;
+
+	mowgli_pollable_destroy(eventloop, loop->pollable);
+	close(loop->pipe[0]);
+	close(loop->pipe[1]);
+	free(loop);
+}
+
+/**
+ * \brief Hands a finished request back to the async API.
+ *
+ * Backends call this from any thread once they have filled in the
+ * response of a request given to their mcs_async_submit hook. The
+ * callback runs later from the request's event loop.
+ *
+ * \param request The finished request.
+ */
+void
+mcs_async_complete(mcs_async_request_t *req)
+{
+	mcs_async_job_t *job = req->priv;
+	mcs_async_loop_t *loop = job->loop;
+
+	async_lock();
+
+	if (loop->done_tail != NULL)
+		loop->done_tail->next = job;
+	else
+		loop->done = job;
+
+	loop->done_tail = job;
+	job->next = NULL;
+
+	async_unlock();
+
+	mcs_async_wakeup(loop);
+}
+
+/**
+ * \brief Runs a function whenever a descriptor becomes readable, until a
+ *        request has completed.
+ *
+ * Backends which send a request over a socket and read the answer later
+ * call this from their mcs_async_submit hook, on the event loop's
+ * thread. func is called from the request's event loop whenever fd is
+ * readable and should read what it can without blocking, completing
+ * whichever requests it can. Requests watching the same descriptor on a
+ * loop share one watch.
+ *
+ * \param request The request waiting on fd.
+ * \param fd The descriptor to watch.
+ * \param func The function to call when fd is readable.
+ * \param privdata A pointer to pass to func.
+ */
+void
+mcs_async_watch(mcs_async_request_t *req, int fd, mcs_async_io_func_t func,
+		void *privdata)
+{
+	mcs_async_job_t *job = req->priv;
+	mcs_async_loop_t *loop = job->loop;
+	mcs_async_watch_t *w;
+
+	if (job->watch != NULL)
+		return;
+
+	for (w = loop->watches; w != NULL; w = w->next)
+	{
+		if (w->fd == fd && w->func == func && w->privdata == privdata)
+			break;
+	}
+
+	if (w == NULL)
+	{
+		w = calloc(sizeof(mcs_async_watch_t), 1);
+		w->fd = fd;
+		w->func = func;
+		w->privdata = privdata;
+		w->pollable = mowgli_pollable_create(loop->eventloop, fd, w);
+		mowgli_pollable_setselect(loop->eventloop, w->pollable, MOWGLI_EVENTLOOP_IO_READ,
+					  mcs_async_watch_ready);
+
+		w->next = loop->watches;
+		loop->watches = w;
+	}
+
+	w->refs++;
+	job->watch = w;
+}
+
+/**
+ * \brief Stops watching a descriptor which is about to be closed.
+ *
+ * Backends call this before closing a descriptor they passed to
+ * mcs_async_watch(), and complete the requests waiting on it.
+ *
+ * \param fd The descriptor.
+ */
+void
+mcs_async_forget(int fd)
+{
+	mcs_async_loop_t *loop;
+	mcs_async_watch_t *w;
+
+	for (loop = loops; loop != NULL; loop = loop->next)
+	{
+		for (w = loop->watches; w != NULL; w = w->next)
+		{
+			if (w->fd != fd)
+				continue;
+
+			mowgli_pollable_destroy(loop->eventloop, w->pollable);
+			w->pollable = NULL;
+			w->fd = -1;
+		}
+	}
+}
+
+#else
+
+void
+mcs_async_complete(mcs_async_request_t *req)
+{
+}
+
+void
+mcs_async_watch(mcs_async_request_t *req, int fd, mcs_async_io_func_t func,
+		void *privdata)
+{
+}
+
+void
+mcs_async_forget(int fd)
+{
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LIBMCS_MCS_ASYNC_H__
+#define __LIBMCS_MCS_ASYNC_H__
+
+#include <libmcs/mcs.h>
+
+/*
+ * The asynchronous API needs the event loop of libmowgli-2.
+ *
+ * Requests complete through a callback run from the event loop they were
+ * submitted with. Backends with a mcs_async_submit hook take requests
+ * without blocking; for the others, the request is run on the next pass
+ * of the event loop, in submission order, and holds the loop up for as
+ * long as the backend takes. Nothing is ever run on another thread.
+ */
+
+/**
+ * \brief Completion callback for asynchronous requests.
+ *
+ * \param handle The mcs.handle object the request ran on.
+ * \param response The outcome of the request.
+ * \param value The value retrieved by a get, NULL otherwise. It is only
+ *              valid until the callback returns.
+ * \param privdata The pointer given when the request was submitted.
+ */
+typedef void (*mcs_async_cb_t)(mcs_handle_t *handle, mcs_response_t response,
+			       const char *value, void *privdata);
+
+extern mcs_response_t mcs_get_string_async(mowgli_eventloop_t *eventloop,
+					   mcs_handle_t *handle,
+					   const char *section,
+					   const char *key,
+					   mcs_async_cb_t cb,
+					   void *privdata);
+
+extern mcs_response_t mcs_set_async(mowgli_eventloop_t *eventloop,
+				    mcs_handle_t *handle,
+				    const char *section,
+				    const char *key,
+				    const char *value,
+				    mcs_async_cb_t cb,
+				    void *privdata);
+
+extern mcs_response_t mcs_commit_async(mowgli_eventloop_t *eventloop,
+				       mcs_handle_t *handle,
+				       mcs_async_cb_t cb,
+				       void *privdata);
+
+extern void mcs_async_detach(mowgli_eventloop_t *eventloop);
+
+#endif
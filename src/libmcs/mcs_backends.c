@@ -95,12 +95,18 @@ mcs_backend_get_list(void)
 /**
  * \brief Determines the backend that should be used.
  *
- * Currently, this function always returns "default".
+ * The MCS_BACKEND environment variable takes precedence, otherwise
+ * "default" is used.
  *
  * \return The name of the backend that should be used.
  */
 const char *
 mcs_backend_select(void)
 {
+	const char *magic = getenv("MCS_BACKEND");
+
+	if (magic != NULL && *magic != '\0')
+		return magic;
+
 	return "default";
 }
@@ -0,0 +1,529 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Variables bound to keys.
+ *
+ * A handle with bindings keeps a table from section and key to the
+ * variables bound there. The dispatch functions pass every successful
+ * set and unset to mcs_bindings_update(), which re-reads the key through
+ * the backend and publishes the result into each variable with a single
+ * atomic store, so other threads reading a bound variable never see a
+ * torn value. Strings are published by pointer; the strings they replace
+ * are kept, since a reader may still hold one, until the program says
+ * none does with mcs_bind_reclaim() or the binding goes away.
+ */
+
+#include "libmcs/mcs.h"
+
+#if defined(__GNUC__)
+# define bind_publish(var, val)	__atomic_store((var), (val), __ATOMIC_RELEASE)
+#else
+# define bind_publish(var, val)	(*(var) = *(val))
+#endif
+
+typedef struct mcs_binding_ mcs_binding_t;
+
+struct mcs_binding_ {
+	mcs_binding_t *next;	/* next variable bound to the same key */
+	char *section;
+	char *key;
+	mcs_schema_type_t type;
+	void *var;
+	union {
+		int i;
+		float f;
+		double d;
+		char *s;
+	} def;
+	char *current;		/* string published to var */
+	mowgli_queue_t *retired; /* strings published before it */
+};
+
+/* the variables bound to one key */
+typedef struct {
+	mcs_binding_t *head;
+} binding_list_t;
+
+struct mcs_bindings_ {
+	mowgli_patricia_t *keys;
+};
+
+static void nocanon(char *str) {}
+
+static char *
+binding_key(char *buf, size_t len, const char *section, const char *key)
+{
+	snprintf(buf, len, "%lu:%s%s", (unsigned long) strlen(section), section, key);
+
+	return buf;
+}
+
+static void
+binding_publish_string(mcs_binding_t *b, char *value)
+{
+	if (value == NULL ? b->current == NULL :
+	    b->current != NULL && !strcmp(value, b->current))
+	{
+		free(value);
+		return;
+	}
+
+	bind_publish((char **) b->var, &value);
+
+	if (b->current != NULL)
+		b->retired = mowgli_queue_shift(b->retired, b->current);
+	b->current = value;
+}
+
+/*
+ * Reads the bound key through the backend, without counting it as a
+ * get, and publishes the value or the default.
+ */
+static void
+binding_refresh(mcs_handle_t *self, mcs_binding_t *b)
+{
+	mcs_backend_t *base = self->base;
+
+	switch (b->type)
+	{
+	case MCS_SCHEMA_STRING:
+	{
+		char *v;
+
+		if (base->mcs_get_string(self, b->section, b->key, &v) != MCS_OK)
+			v = b->def.s != NULL ? strdup(b->def.s) : NULL;
+		binding_publish_string(b, v);
+		break;
+	}
+	case MCS_SCHEMA_INT:
+	case MCS_SCHEMA_BOOL:
+	{
+		int v;
+
+		if ((b->type == MCS_SCHEMA_INT ?
+		     base->mcs_get_int(self, b->section, b->key, &v) :
+		     base->mcs_get_bool(self, b->section, b->key, &v)) != MCS_OK)
+			v = b->def.i;
+		bind_publish((int *) b->var, &v);
+		break;
+	}
+	case MCS_SCHEMA_FLOAT:
+	{
+		float v;
+
+		if (base->mcs_get_float(self, b->section, b->key, &v) != MCS_OK)
+			v = b->def.f;
+		bind_publish((float *) b->var, &v);
+		break;
+	}
+	case MCS_SCHEMA_DOUBLE:
+	{
+		double v;
+
+		if (base->mcs_get_double(self, b->section, b->key, &v) != MCS_OK)
+			v = b->def.d;
+		bind_publish((double *) b->var, &v);
+		break;
+	}
+	}
+}
+
+static void
+binding_reclaim(mcs_binding_t *b)
+{
+	mowgli_queue_t *n;
+
+	for (n = b->retired; n != NULL; n = n->next)
+		free(n->data);
+
+	if (b->retired != NULL)
+		mowgli_queue_destroy(b->retired);
+
+	b->retired = NULL;
+}
+
+static void
+binding_free(mcs_binding_t *b)
+{
+	binding_reclaim(b);
+
+	if (b->type == MCS_SCHEMA_STRING)
+		free(b->def.s);
+
+	free(b->current);
+	free(b->section);
+	free(b->key);
+	free(b);
+}
+
+typedef struct {
+	const void *var;
+	binding_list_t *list;
+	mcs_binding_t *found;
+} binding_find_t;
+
+static int
+binding_find_cb(const char *key, void *data, void *privdata)
+{
+	binding_find_t *f = privdata;
+	binding_list_t *l = data;
+	mcs_binding_t *b;
+
+	for (b = l->head; b != NULL && f->found == NULL; b = b->next)
+	{
+		if (b->var == f->var)
+		{
+			f->list = l;
+			f->found = b;
+		}
+	}
+
+	return f->found != NULL;
+}
+
+static mcs_response_t
+binding_remove(mcs_handle_t *self, const void *var)
+{
+	mcs_bindings_t *t = self->bindings;
+	binding_find_t f = { var, NULL, NULL };
+	mcs_binding_t **p;
+	char buf[4096];
+
+	if (t == NULL)
+		return MCS_FAIL;
+
+	mowgli_patricia_foreach(t->keys, binding_find_cb, &f);
+	if (f.found == NULL)
+		return MCS_FAIL;
+
+	for (p = &f.list->head; *p != f.found; p = &(*p)->next)
+		;
+	*p = f.found->next;
+
+	if (f.list->head == NULL)
+	{
+		binding_key(buf, sizeof buf, f.found->section, f.found->key);
+		mowgli_patricia_delete(t->keys, buf);
+		free(f.list);
+	}
+
+	binding_free(f.found);
+
+	return MCS_OK;
+}
+
+static mcs_binding_t *
+binding_add(mcs_handle_t *self, const char *section, const char *key,
+	    mcs_schema_type_t type, void *var)
+{
+	binding_list_t *l;
+	mcs_binding_t *b;
+	char buf[4096];
+
+	return_val_if_fail(self != NULL, NULL);
+	return_val_if_fail(section != NULL, NULL);
+	return_val_if_fail(key != NULL, NULL);
+	return_val_if_fail(var != NULL, NULL);
+
+	binding_remove(self, var);
+
+	if (self->bindings == NULL)
+	{
+		self->bindings = calloc(sizeof(mcs_bindings_t), 1);
+		self->bindings->keys = mowgli_patricia_create(nocanon);
+	}
+
+	b = calloc(sizeof(mcs_binding_t), 1);
+	b->section = strdup(section);
+	b->key = strdup(key);
+	b->type = type;
+	b->var = var;
+
+	binding_key(buf, sizeof buf, section, key);
+	if ((l = mowgli_patricia_retrieve(self->bindings->keys, buf)) == NULL)
+	{
+		l = calloc(sizeof(binding_list_t), 1);
+		mowgli_patricia_add(self->bindings->keys, buf, l);
+	}
+
+	b->next = l->head;
+	l->head = b;
+
+	return b;
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Re-reads the variables bound to a key after it has changed.
+ *
+ * This is called by the dispatch functions after a set or unset.
+ */
+void
+mcs_bindings_update(mcs_handle_t *self, const char *section, const char *key)
+{
+	binding_list_t *l;
+	mcs_binding_t *b;
+	char buf[4096];
+
+	if (self->bindings == NULL)
+		return;
+
+	l = mowgli_patricia_retrieve(self->bindings->keys, binding_key(buf, sizeof buf, section, key));
+	if (l == NULL)
+		return;
+
+	for (b = l->head; b != NULL; b = b->next)
+		binding_refresh(self, b);
+}
+
+static int
+bindings_refresh_cb(const char *key, void *data, void *privdata)
+{
+	binding_list_t *l = data;
+	mcs_binding_t *b;
+
+	for (b = l->head; b != NULL; b = b->next)
+		binding_refresh(privdata, b);
+
+	return 0;
+}
+
+/**
+ * \brief Re-reads every bound variable, for when the backend's data has
+ *        been reloaded as a whole.
+ */
+void
+mcs_bindings_refresh(mcs_handle_t *self)
+{
+	if (self->bindings != NULL)
+		mowgli_patricia_foreach(self->bindings->keys, bindings_refresh_cb, self);
+}
+
+static int
+bindings_reclaim_cb(const char *key, void *data, void *privdata)
+{
+	binding_list_t *l = data;
+	mcs_binding_t *b;
+
+	for (b = l->head; b != NULL; b = b->next)
+		binding_reclaim(b);
+
+	return 0;
+}
+
+static void
+bindings_free_cb(const char *key, void *data, void *privdata)
+{
+	binding_list_t *l = data;
+	mcs_binding_t *b, *next;
+
+	for (b = l->head; b != NULL; b = next)
+	{
+		next = b->next;
+		binding_free(b);
+	}
+
+	free(l);
+}
+
+/**
+ * \brief Releases the bindings of a handle which is being destroyed.
+ */
+void
+mcs_bindings_destroy(mcs_handle_t *self)
+{
+	if (self->bindings == NULL)
+		return;
+
+	mowgli_patricia_destroy(self->bindings->keys, bindings_free_cb, NULL);
+	free(self->bindings);
+	self->bindings = NULL;
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Binds a string variable to a key.
+ *
+ * The variable is set to the key's value, or to a copy of def if the key
+ * is not set, and follows every later change made through the handle.
+ * The strings it points to stay valid until the variable is unbound, the
+ * handle is destroyed or mcs_bind_reclaim() is called; until then, every
+ * change keeps the string it replaced.
+ *
+ * Binding, unbinding and changing the handle must not race with each
+ * other; reading the variable may happen on any thread.
+ *
+ * \param self The mcs.handle object to bind to.
+ * \param section The section of the key.
+ * \param key The key to bind to.
+ * \param var The variable to keep up to date.
+ * \param def The value to use while the key is not set, or NULL.
+ *
+ * \return A mcs_response_t value representing the success or failure of
+ *         the transaction.
+ */
+mcs_response_t
+mcs_bind_string(mcs_handle_t *self, const char *section, const char *key,
+		const char **var, const char *def)
+{
+	mcs_binding_t *b;
+
+	if ((b = binding_add(self, section, key, MCS_SCHEMA_STRING, var)) == NULL)
+		return MCS_FAIL;
+
+	b->def.s = def != NULL ? strdup(def) : NULL;
+	binding_refresh(self, b);
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Binds an integer variable to a key.
+ *
+ * See mcs_bind_string() for the details.
+ */
+mcs_response_t
+mcs_bind_int(mcs_handle_t *self, const char *section, const char *key,
+	     int *var, int def)
+{
+	mcs_binding_t *b;
+
+	if ((b = binding_add(self, section, key, MCS_SCHEMA_INT, var)) == NULL)
+		return MCS_FAIL;
+
+	b->def.i = def;
+	binding_refresh(self, b);
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Binds a boolean variable to a key.
+ *
+ * See mcs_bind_string() for the details.
+ */
+mcs_response_t
+mcs_bind_bool(mcs_handle_t *self, const char *section, const char *key,
+	      int *var, int def)
+{
+	mcs_binding_t *b;
+
+	if ((b = binding_add(self, section, key, MCS_SCHEMA_BOOL, var)) == NULL)
+		return MCS_FAIL;
+
+	b->def.i = def;
+	binding_refresh(self, b);
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Binds a floating point variable to a key.
+ *
+ * See mcs_bind_string() for the details.
+ */
+mcs_response_t
+mcs_bind_float(mcs_handle_t *self, const char *section, const char *key,
+	       float *var, float def)
+{
+	mcs_binding_t *b;
+
+	if ((b = binding_add(self, section, key, MCS_SCHEMA_FLOAT, var)) == NULL)
+		return MCS_FAIL;
+
+	b->def.f = def;
+	binding_refresh(self, b);
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Binds a double-precision floating point variable to a key.
+ *
+ * See mcs_bind_string() for the details.
+ */
+mcs_response_t
+mcs_bind_double(mcs_handle_t *self, const char *section, const char *key,
+		double *var, double def)
+{
+	mcs_binding_t *b;
+
+	if ((b = binding_add(self, section, key, MCS_SCHEMA_DOUBLE, var)) == NULL)
+		return MCS_FAIL;
+
+	b->def.d = def;
+	binding_refresh(self, b);
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Stops updating a bound variable.
+ *
+ * The variable keeps its last value, except that a string variable must
+ * not be used any more, as the strings it pointed to are released.
+ *
+ * \param self The mcs.handle object the variable is bound to.
+ * \param var The bound variable.
+ *
+ * \return MCS_FAIL if the variable was not bound to the handle.
+ */
+mcs_response_t
+mcs_unbind(mcs_handle_t *self, const void *var)
+{
+	return_val_if_fail(self != NULL, MCS_FAIL);
+
+	return binding_remove(self, var);
+}
+
+/**
+ * \brief Releases the strings bound string variables no longer point to.
+ *
+ * Every change to a bound string keeps the string it replaced, as a
+ * reader may still be using it, so a key which keeps changing grows the
+ * handle without bound. Programs call this at a point where no thread
+ * holds a pointer read from a bound string variable earlier, for example
+ * between requests; the strings the variables point to now stay valid.
+ *
+ * \param self The mcs.handle object whose bindings to clean up.
+ */
+void
+mcs_bind_reclaim(mcs_handle_t *self)
+{
+	return_if_fail(self != NULL);
+
+	if (self->bindings != NULL)
+		mowgli_patricia_foreach(self->bindings->keys, bindings_reclaim_cb, NULL);
+}
@@ -32,15 +32,72 @@
 
 #include "libmcs/mcs.h"
 
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define trace_probe_entry(op, backend, section, key) \
+	DTRACE_PROBE4(mcs, op__entry, op, backend, section, key)
+# define trace_probe_return(op, backend, ret) \
+	DTRACE_PROBE3(mcs, op__return, op, backend, ret)
+#else
+# define trace_probe_entry(op, backend, section, key)
+# define trace_probe_return(op, backend, ret)
+#endif
+
+#if defined(__GNUC__)
+# define trace_unlikely(x)	__builtin_expect(!!(x), 0)
+#else
+# define trace_unlikely(x)	(x)
+#endif
+
+/*
+ * Makes a call into a backend, reporting it to the static probes and,
+ * when tracing is switched on, timing it for mcs_trace_call(). ok is
+ * evaluated after the call to tell whether it succeeded.
+ */
+#define TRACE_CALL(ret, self, op, section, key, call, ok)			\
+	do {									\
+		trace_probe_entry(op, (self)->base->name, section, key);	\
+		if (trace_unlikely(mcs_trace_active))				\
+		{								\
+			unsigned long long start_ = mcs_stat_clock();		\
+			ret = call;						\
+			mcs_trace_call(self, op, section, key,			\
+				       (ok) ? MCS_OK : MCS_FAIL,			\
+				       mcs_stat_clock() - start_);		\
+		}								\
+		else								\
+			ret = call;						\
+		trace_probe_return(op, (self)->base->name, (ok) ? MCS_OK : MCS_FAIL); \
+	} while (0)
+
 mowgli_patricia_t *mcs_backends = NULL;
 
 /* ******************************************************************* */
 
 static mowgli_object_class_t klass;
 
+/* gets are answered by the image mcs_freeze() built, while there is one */
+static inline mcs_handle_t *
+mcs_handle_reader(mcs_handle_t *self)
+{
+	return self->frozen != NULL ? self->frozen : self;
+}
+
+static void
+mcs_handle_thaw(mcs_handle_t *self)
+{
+	if (self->frozen == NULL)
+		return;
+
+	mowgli_object_unref(self->frozen);
+	self->frozen = NULL;
+}
+
 static void
 mcs_handle_destroy(mcs_handle_t *self)
 {
+	mcs_handle_thaw(self);
+	mcs_bindings_destroy(self);
 	self->base->mcs_destroy(self);
 }
 
@@ -56,20 +113,41 @@ mcs_handle_class_init(void)
 
 /* ******************************************************************* */
 
+/**
+ * \brief Creates a new mcs.handle object using a specific backend.
+ *
+ * This bypasses mcs_backend_select(), which is useful for tools that
+ * move data between backends and for backends which stack on top of
+ * other backends.
+ *
+ * \param backend The name of a registered mcs.backend.
+ * \param domain The domain to associate the handle with.
+ *
+ * \return A new mcs.handle object, or NULL if no such backend is registered.
+ */
 mcs_handle_t *
-mcs_new(char *domain)
+mcs_new_with_backend(const char *backend, char *domain)
 {
 	mcs_backend_t *b;
-	const char *magic;
 
-	if ((magic = mcs_backend_select()) == NULL)
-		magic = "default";
-
-	b = mowgli_patricia_retrieve(mcs_backends, magic);
+	b = mowgli_patricia_retrieve(mcs_backends, backend);
 	if (b != NULL)
 	{
-		mcs_handle_t *out = b->mcs_new(domain);
+		unsigned long long start = 0;
+		mcs_handle_t *out;
+
+		trace_probe_entry(MCS_TRACE_OPEN, b->name, domain, NULL);
+		if (trace_unlikely(mcs_trace_active))
+			start = mcs_stat_clock();
+
+		out = b->mcs_new(domain);
 		mowgli_object_init(mowgli_object(out), NULL, &klass, NULL);
+		mcs_stat_open(out, domain);
+
+		if (trace_unlikely(mcs_trace_active))
+			mcs_trace_call(out, MCS_TRACE_OPEN, domain, NULL, MCS_OK,
+				       mcs_stat_clock() - start);
+		trace_probe_return(MCS_TRACE_OPEN, b->name, MCS_OK);
 
 		return out;
 	}
@@ -77,6 +155,17 @@ mcs_new(char *domain)
 	return NULL;
 }
 
+mcs_handle_t *
+mcs_new(char *domain)
+{
+	const char *magic;
+
+	if ((magic = mcs_backend_select()) == NULL)
+		magic = "default";
+
+	return mcs_new_with_backend(magic, domain);
+}
+
 /**
  * \brief Destroys an mcs.handle object.
  *
@@ -111,7 +200,14 @@ mcs_get_string(mcs_handle_t *self,
 	       const char *key,
 	       char **value)
 {
-	return self->base->mcs_get_string(self, section, key, value);
+	mcs_handle_t *reader = mcs_handle_reader(self);
+	mcs_response_t ret;
+
+	TRACE_CALL(ret, self, MCS_TRACE_GET_STRING, section, key,
+		   reader->base->mcs_get_string(reader, section, key, value), ret == MCS_OK);
+	mcs_stat_get(self, MCS_STAT_STRING, ret);
+
+	return ret;
 }
 
 /**
@@ -135,7 +231,14 @@ mcs_get_int(mcs_handle_t *self,
 	    const char *key,
 	    int *value)
 {
-	return self->base->mcs_get_int(self, section, key, value);
+	mcs_handle_t *reader = mcs_handle_reader(self);
+	mcs_response_t ret;
+
+	TRACE_CALL(ret, self, MCS_TRACE_GET_INT, section, key,
+		   reader->base->mcs_get_int(reader, section, key, value), ret == MCS_OK);
+	mcs_stat_get(self, MCS_STAT_INT, ret);
+
+	return ret;
 }
 
 /**
@@ -159,7 +262,14 @@ mcs_get_bool(mcs_handle_t *self,
 	     const char *key,
 	     int *value)
 {
-	return self->base->mcs_get_bool(self, section, key, value);
+	mcs_handle_t *reader = mcs_handle_reader(self);
+	mcs_response_t ret;
+
+	TRACE_CALL(ret, self, MCS_TRACE_GET_BOOL, section, key,
+		   reader->base->mcs_get_bool(reader, section, key, value), ret == MCS_OK);
+	mcs_stat_get(self, MCS_STAT_BOOL, ret);
+
+	return ret;
 }
 
 /**
@@ -183,7 +293,14 @@ mcs_get_float(mcs_handle_t *self,
 	      const char *key,
 	      float *value)
 {
-	return self->base->mcs_get_float(self, section, key, value);
+	mcs_handle_t *reader = mcs_handle_reader(self);
+	mcs_response_t ret;
+
+	TRACE_CALL(ret, self, MCS_TRACE_GET_FLOAT, section, key,
+		   reader->base->mcs_get_float(reader, section, key, value), ret == MCS_OK);
+	mcs_stat_get(self, MCS_STAT_FLOAT, ret);
+
+	return ret;
 }
 
 /**
@@ -207,11 +324,28 @@ mcs_get_double(mcs_handle_t *self,
 	       const char *key,
 	       double *value)
 {
-	return self->base->mcs_get_double(self, section, key, value);
+	mcs_handle_t *reader = mcs_handle_reader(self);
+	mcs_response_t ret;
+
+	TRACE_CALL(ret, self, MCS_TRACE_GET_DOUBLE, section, key,
+		   reader->base->mcs_get_double(reader, section, key, value), ret == MCS_OK);
+	mcs_stat_get(self, MCS_STAT_DOUBLE, ret);
+
+	return ret;
 }
 
 /* ******************************************************************* */
 
+/* a value was set or unset: bump the generation and re-read its bindings */
+static void
+mcs_handle_changed(mcs_handle_t *self, const char *section, const char *key)
+{
+	self->generation++;
+
+	if (self->bindings != NULL)
+		mcs_bindings_update(self, section, key);
+}
+
 /**
  * \brief Public function to set a string value in a configuration database.
  *
@@ -232,7 +366,16 @@ mcs_set_string(mcs_handle_t *self,
 	       const char *key,
 	       const char *value)
 {
-	return self->base->mcs_set_string(self, section, key, value);
+	mcs_response_t ret;
+
+	mcs_handle_thaw(self);
+	mcs_stat_set(self, MCS_STAT_STRING);
+	TRACE_CALL(ret, self, MCS_TRACE_SET_STRING, section, key,
+		   self->base->mcs_set_string(self, section, key, value), ret == MCS_OK);
+	if (ret == MCS_OK)
+		mcs_handle_changed(self, section, key);
+
+	return ret;
 }
 
 /**
@@ -255,7 +398,16 @@ mcs_set_int(mcs_handle_t *self,
 	    const char *key,
 	    int value)
 {
-	return self->base->mcs_set_int(self, section, key, value);
+	mcs_response_t ret;
+
+	mcs_handle_thaw(self);
+	mcs_stat_set(self, MCS_STAT_INT);
+	TRACE_CALL(ret, self, MCS_TRACE_SET_INT, section, key,
+		   self->base->mcs_set_int(self, section, key, value), ret == MCS_OK);
+	if (ret == MCS_OK)
+		mcs_handle_changed(self, section, key);
+
+	return ret;
 }
 
 /**
@@ -278,7 +430,16 @@ mcs_set_bool(mcs_handle_t *self,
 	     const char *key,
 	     int value)
 {
-	return self->base->mcs_set_bool(self, section, key, value);
+	mcs_response_t ret;
+
+	mcs_handle_thaw(self);
+	mcs_stat_set(self, MCS_STAT_BOOL);
+	TRACE_CALL(ret, self, MCS_TRACE_SET_BOOL, section, key,
+		   self->base->mcs_set_bool(self, section, key, value), ret == MCS_OK);
+	if (ret == MCS_OK)
+		mcs_handle_changed(self, section, key);
+
+	return ret;
 }
 
 /**
@@ -301,7 +462,16 @@ mcs_set_float(mcs_handle_t *self,
 	      const char *key,
 	      float value)
 {
-	return self->base->mcs_set_float(self, section, key, value);
+	mcs_response_t ret;
+
+	mcs_handle_thaw(self);
+	mcs_stat_set(self, MCS_STAT_FLOAT);
+	TRACE_CALL(ret, self, MCS_TRACE_SET_FLOAT, section, key,
+		   self->base->mcs_set_float(self, section, key, value), ret == MCS_OK);
+	if (ret == MCS_OK)
+		mcs_handle_changed(self, section, key);
+
+	return ret;
 }
 
 /**
@@ -325,7 +495,16 @@ mcs_set_double(mcs_handle_t *self,
 	       const char *key,
 	       double value)
 {
-	return self->base->mcs_set_double(self, section, key, value);
+	mcs_response_t ret;
+
+	mcs_handle_thaw(self);
+	mcs_stat_set(self, MCS_STAT_DOUBLE);
+	TRACE_CALL(ret, self, MCS_TRACE_SET_DOUBLE, section, key,
+		   self->base->mcs_set_double(self, section, key, value), ret == MCS_OK);
+	if (ret == MCS_OK)
+		mcs_handle_changed(self, section, key);
+
+	return ret;
 }
 
 /* ******************************************************************* */
@@ -348,7 +527,16 @@ mcs_unset_key(mcs_handle_t *self,
 	      const char *section,
 	      const char *key)
 {
-	return self->base->mcs_unset_key(self, section, key);
+	mcs_response_t ret;
+
+	mcs_handle_thaw(self);
+	mcs_stat_unset(self);
+	TRACE_CALL(ret, self, MCS_TRACE_UNSET, section, key,
+		   self->base->mcs_unset_key(self, section, key), ret == MCS_OK);
+	if (ret == MCS_OK)
+		mcs_handle_changed(self, section, key);
+
+	return ret;
 }
 
 /* ******************************************************************* */
@@ -369,7 +557,13 @@ mowgli_queue_t *
 mcs_get_keys(mcs_handle_t *self,
 	     const char *section)
 {
-	return self->base->mcs_get_keys(self, section);
+	mcs_handle_t *reader = mcs_handle_reader(self);
+	mowgli_queue_t *ret;
+
+	TRACE_CALL(ret, self, MCS_TRACE_GET_KEYS, section, NULL,
+		   reader->base->mcs_get_keys(reader, section), ret != NULL);
+
+	return ret;
 }
 
 /* ******************************************************************* */
@@ -388,5 +582,569 @@ mcs_get_keys(mcs_handle_t *self,
 mowgli_queue_t *
 mcs_get_sections(mcs_handle_t *self)
 {
-	return self->base->mcs_get_sections(self);
+	mcs_handle_t *reader = mcs_handle_reader(self);
+	mowgli_queue_t *ret;
+
+	TRACE_CALL(ret, self, MCS_TRACE_GET_SECTIONS, NULL, NULL,
+		   reader->base->mcs_get_sections(reader), ret != NULL);
+
+	return ret;
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Public function to write pending changes to a configuration
+ *        database.
+ *
+ * Backends which have nothing to defer do not implement commit, in which
+ * case this is a no-op.
+ *
+ * \param self The mcs.handle object that represents the configuration database.
+ *
+ * \return A mcs_response_t value representing the success or failure of
+ *         the transaction.
+ */
+mcs_response_t
+mcs_commit(mcs_handle_t *self)
+{
+	mcs_response_t ret;
+
+	if (self->base->mcs_commit == NULL)
+		return MCS_OK;
+
+	TRACE_CALL(ret, self, MCS_TRACE_COMMIT, NULL, NULL,
+		   self->base->mcs_commit(self), ret == MCS_OK);
+
+	return ret;
+}
+
+/* ******************************************************************* */
+
+/*
+ * Walks a section with get_keys and get_string, for backends without an
+ * mcs_iterate hook. Returns -1 if the section has no keys, 1 if func
+ * asked to stop and 0 otherwise.
+ */
+static int
+mcs_iterate_section(mcs_handle_t *self, const char *section,
+		    mcs_iterate_func_t func, void *privdata)
+{
+	mowgli_queue_t *keys, *n;
+	int stop = 0;
+
+	if ((keys = self->base->mcs_get_keys(self, section)) == NULL)
+		return -1;
+
+	for (n = keys; n != NULL; n = n->next)
+	{
+		char *value;
+
+		if (!stop && self->base->mcs_get_string(self, section, n->data, &value) == MCS_OK)
+		{
+			stop = func(section, n->data, value, privdata) != 0;
+			free(value);
+		}
+
+		free(n->data);
+	}
+
+	mowgli_queue_destroy(keys);
+
+	return stop;
+}
+
+static mcs_response_t
+mcs_iterate_fallback(mcs_handle_t *self, const char *section,
+		     mcs_iterate_func_t func, void *privdata)
+{
+	mowgli_queue_t *sections, *n;
+	int stop = 0;
+
+	if (section != NULL)
+		return mcs_iterate_section(self, section, func, privdata) < 0 ? MCS_FAIL : MCS_OK;
+
+	sections = self->base->mcs_get_sections(self);
+
+	for (n = sections; n != NULL; n = n->next)
+	{
+		if (!stop)
+			stop = mcs_iterate_section(self, n->data, func, privdata) > 0;
+
+		free(n->data);
+	}
+
+	mowgli_queue_destroy(sections);
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Public function to walk the values of a configuration database.
+ *
+ * Values are passed to func as strings, in no particular order. Backends
+ * which can walk their values directly do so in a single pass; for the
+ * others this falls back to looking up every key.
+ *
+ * \param self The mcs.handle object that represents the configuration database.
+ * \param section The section to walk, or NULL to walk every section.
+ * \param func The function to call with each value; a non-zero return
+ *             stops the walk.
+ * \param privdata Opaque data passed to func.
+ *
+ * \return MCS_FAIL if the section does not exist, MCS_OK otherwise.
+ */
+mcs_response_t
+mcs_iterate(mcs_handle_t *self, const char *section,
+	    mcs_iterate_func_t func, void *privdata)
+{
+	mcs_handle_t *reader = mcs_handle_reader(self);
+	mcs_response_t ret;
+
+	return_val_if_fail(func != NULL, MCS_FAIL);
+
+	if (reader->base->mcs_iterate != NULL)
+		TRACE_CALL(ret, self, MCS_TRACE_ITERATE, section, NULL,
+			   reader->base->mcs_iterate(reader, section, func, privdata), ret == MCS_OK);
+	else
+		TRACE_CALL(ret, self, MCS_TRACE_ITERATE, section, NULL,
+			   mcs_iterate_fallback(reader, section, func, privdata), ret == MCS_OK);
+
+	return ret;
+}
+
+/* ******************************************************************* */
+
+static mcs_handle_t *
+mcs_snapshot_new(mcs_handle_t *self, int writable)
+{
+	mcs_handle_t *out;
+
+	return_val_if_fail(self != NULL, NULL);
+
+	if (self->base->mcs_snapshot == NULL)
+		return mcs_memory_new_from_handle(self);
+
+	if ((out = self->base->mcs_snapshot(self, writable)) != NULL)
+		mowgli_object_init(mowgli_object(out), NULL, &klass, NULL);
+
+	return out;
+}
+
+/**
+ * \brief Public function to take a read-only, point-in-time view of a
+ *        configuration database.
+ *
+ * Later changes made through the original handle are not seen by the
+ * snapshot, and the snapshot cannot be changed. Backends which support
+ * snapshots make one without copying anything; the original handle
+ * copies only the parts it changes afterwards. For other backends, the
+ * values are copied into a memory backend handle instead.
+ *
+ * A snapshot may be read on one thread while the original handle is
+ * changed on another.
+ *
+ * \param self The mcs.handle object to take a snapshot of.
+ *
+ * \return A new mcs.handle object, or NULL on failure.
+ */
+mcs_handle_t *
+mcs_snapshot(mcs_handle_t *self)
+{
+	return mcs_snapshot_new(self, 0);
+}
+
+/**
+ * \brief Public function to make a cheap, independent copy of a
+ *        configuration database.
+ *
+ * A clone starts out with the state of the original handle, and either
+ * may then be changed without affecting the other. Clones are not
+ * written back when they are destroyed, so changes made to one are
+ * discarded unless it is committed with mcs_commit(). Like snapshots,
+ * clones share state with the original where the backend supports it.
+ *
+ * \param self The mcs.handle object to clone.
+ *
+ * \return A new mcs.handle object, or NULL on failure.
+ */
+mcs_handle_t *
+mcs_clone(mcs_handle_t *self)
+{
+	return mcs_snapshot_new(self, 1);
+}
+
+/* ******************************************************************* */
+
+typedef struct {
+	char *section;
+	char *key;
+	char *value;
+} mcs_diff_entry_t;
+
+typedef struct {
+	mcs_diff_entry_t *entries;
+	size_t count;
+	size_t alloc;
+} mcs_diff_list_t;
+
+static int
+mcs_diff_collect_cb(const char *section, const char *key, const char *value,
+		    void *privdata)
+{
+	mcs_diff_list_t *list = privdata;
+	mcs_diff_entry_t *e;
+
+	if (list->count == list->alloc)
+	{
+		list->alloc = list->alloc ? list->alloc * 2 : 64;
+		list->entries = realloc(list->entries, list->alloc * sizeof(mcs_diff_entry_t));
+	}
+
+	e = &list->entries[list->count++];
+	e->section = strdup(section);
+	e->key = strdup(key);
+	e->value = strdup(value);
+
+	return 0;
+}
+
+static int
+mcs_diff_entry_cmp(const void *a, const void *b)
+{
+	const mcs_diff_entry_t *ea = a, *eb = b;
+	int ret;
+
+	if ((ret = strcmp(ea->section, eb->section)) != 0)
+		return ret;
+
+	return strcmp(ea->key, eb->key);
+}
+
+static void
+mcs_diff_list_free(mcs_diff_list_t *list)
+{
+	size_t i;
+
+	for (i = 0; i < list->count; i++)
+	{
+		free(list->entries[i].section);
+		free(list->entries[i].key);
+		free(list->entries[i].value);
+	}
+
+	free(list->entries);
+}
+
+/*
+ * Compares two handles by sorting copies of their values and merging
+ * them. Sections without values are not seen this way.
+ */
+static mcs_response_t
+mcs_diff_fallback(mcs_handle_t *from, mcs_handle_t *to,
+		  mcs_diff_func_t func, void *privdata)
+{
+	mcs_diff_list_t a = { NULL, 0, 0 }, b = { NULL, 0, 0 };
+	const char *section = NULL;
+	size_t i = 0, j = 0;
+	int stop = 0;
+
+	mcs_iterate(from, NULL, mcs_diff_collect_cb, &a);
+	mcs_iterate(to, NULL, mcs_diff_collect_cb, &b);
+
+	if (a.count > 1)
+		qsort(a.entries, a.count, sizeof(mcs_diff_entry_t), mcs_diff_entry_cmp);
+	if (b.count > 1)
+		qsort(b.entries, b.count, sizeof(mcs_diff_entry_t), mcs_diff_entry_cmp);
+
+	while (!stop && (i < a.count || j < b.count))
+	{
+		mcs_diff_entry_t *x = i < a.count ? &a.entries[i] : NULL;
+		mcs_diff_entry_t *y = j < b.count ? &b.entries[j] : NULL;
+		int cmp = x == NULL ? 1 : y == NULL ? -1 : mcs_diff_entry_cmp(x, y);
+		const char *next = cmp <= 0 ? x->section : y->section;
+
+		/* both lists are at the start of a section they may share */
+		if (section == NULL || strcmp(section, next))
+		{
+			int inx = x != NULL && !strcmp(x->section, next);
+			int iny = y != NULL && !strcmp(y->section, next);
+
+			section = next;
+
+			if (inx && !iny)
+				stop = func(MCS_DIFF_REMOVED, section, NULL, NULL, NULL, privdata);
+			else if (iny && !inx)
+				stop = func(MCS_DIFF_ADDED, section, NULL, NULL, NULL, privdata);
+
+			if (stop)
+				break;
+		}
+
+		if (cmp < 0)
+		{
+			stop = func(MCS_DIFF_REMOVED, x->section, x->key, x->value, NULL, privdata);
+			i++;
+		}
+		else if (cmp > 0)
+		{
+			stop = func(MCS_DIFF_ADDED, y->section, y->key, NULL, y->value, privdata);
+			j++;
+		}
+		else
+		{
+			if (strcmp(x->value, y->value))
+				stop = func(MCS_DIFF_CHANGED, x->section, x->key, x->value, y->value, privdata);
+			i++;
+			j++;
+		}
+	}
+
+	mcs_diff_list_free(&a);
+	mcs_diff_list_free(&b);
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Public function to compare two configuration databases.
+ *
+ * Calls func with every section and value which was added, removed or
+ * changed going from one handle to the other, in order of section and
+ * then key. The handles are usually a snapshot and a later state of
+ * the same domain, but may be any two handles.
+ *
+ * When both handles belong to a backend which keeps its values sorted,
+ * they are compared in a single pass without looking up any key, and
+ * whatever they still share since a snapshot is skipped without being
+ * read. Otherwise their values are copied and sorted first.
+ *
+ * \param from The mcs.handle object to compare from.
+ * \param to The mcs.handle object to compare to.
+ * \param func The function to call with each difference.
+ * \param privdata Opaque data passed to func.
+ *
+ * \return MCS_FAIL if either handle could not be read, MCS_OK otherwise.
+ */
+mcs_response_t
+mcs_diff(mcs_handle_t *from, mcs_handle_t *to,
+	 mcs_diff_func_t func, void *privdata)
+{
+	return_val_if_fail(from != NULL, MCS_FAIL);
+	return_val_if_fail(to != NULL, MCS_FAIL);
+	return_val_if_fail(func != NULL, MCS_FAIL);
+
+	if (from->base == to->base && from->base->mcs_diff != NULL)
+		return from->base->mcs_diff(from, to, func, privdata);
+
+	return mcs_diff_fallback(from, to, func, privdata);
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Public function to estimate the memory held by a handle.
+ *
+ * \param self The mcs.handle object that represents the configuration database.
+ *
+ * \return The bytes held by the handle's parsed state, or 0 if it holds
+ *         none or its backend cannot tell.
+ */
+size_t
+mcs_handle_memory_usage(mcs_handle_t *self)
+{
+	size_t usage = 0;
+
+	return_val_if_fail(self != NULL, 0);
+
+	if (self->base->mcs_memory_usage != NULL)
+		usage = self->base->mcs_memory_usage(self);
+
+	if (self->frozen != NULL)
+		usage += mcs_handle_memory_usage(self->frozen);
+
+	return usage;
+}
+
+/**
+ * \brief Public function to drop a handle's parsed state until it is
+ *        next used.
+ *
+ * Pending changes are written back first, and a frozen handle is thawed,
+ * see mcs_freeze(). The handle remains valid and reloads its state
+ * transparently on its next use.
+ *
+ * \param self The mcs.handle object that represents the configuration database.
+ *
+ * \return MCS_FAIL if the backend cannot evict, or could not write back
+ *         pending changes; MCS_OK otherwise.
+ */
+mcs_response_t
+mcs_handle_evict(mcs_handle_t *self)
+{
+	int thawed;
+
+	return_val_if_fail(self != NULL, MCS_FAIL);
+
+	thawed = self->frozen != NULL;
+	mcs_handle_thaw(self);
+
+	if (self->base->mcs_evict == NULL)
+		return thawed ? MCS_OK : MCS_FAIL;
+
+	return self->base->mcs_evict(self);
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Public function to pick up changes made to a configuration
+ *        database by other handles or programs.
+ *
+ * The check costs a single stat(2) when nothing has changed. When the
+ * backing file has been replaced, it is read again and only what
+ * differs is replaced: unchanged sections stay shared with snapshots,
+ * changes not yet committed through this handle are kept, and only
+ * variables bound to values which changed are re-read. A frozen handle is
+ * thawed if anything changed. Backends which cannot be refreshed are left
+ * as they are.
+ *
+ * \param self The mcs.handle object to refresh.
+ *
+ * \return MCS_FAIL if the backing store could not be read, MCS_OK otherwise.
+ */
+mcs_response_t
+mcs_refresh(mcs_handle_t *self)
+{
+	unsigned long generation;
+	mcs_response_t ret;
+
+	return_val_if_fail(self != NULL, MCS_FAIL);
+
+	if (self->base->mcs_refresh == NULL)
+		return MCS_OK;
+
+	generation = self->generation;
+	ret = self->base->mcs_refresh(self);
+
+	/* a frozen image of the old values would hide the change */
+	if (self->generation != generation)
+		mcs_handle_thaw(self);
+
+	return ret;
+}
+
+/**
+ * \brief Public function to tell whether the values of a handle have
+ *        changed.
+ *
+ * The generation starts at zero and grows whenever a value is set or
+ * unset through the handle, or mcs_refresh() brings in a change. It is
+ * cheap enough to be polled, for example to rebuild state derived from
+ * the configuration only when it has changed.
+ *
+ * \param self The mcs.handle object to query.
+ *
+ * \return The current generation of the handle.
+ */
+unsigned long
+mcs_handle_generation(mcs_handle_t *self)
+{
+	return_val_if_fail(self != NULL, 0);
+
+	return self->generation;
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Public function to find out where a value was configured.
+ *
+ * With the keyfile backend, a domain's values may come from drop-in
+ * fragments in its config.d directory as well as from its config file.
+ * This reports the file which provided the value in effect; values
+ * changed through the handle are reported as coming from the config
+ * file, where they will be written.
+ *
+ * \param self The mcs.handle object that represents the configuration database.
+ * \param section The section to look in.
+ * \param key The key to look up.
+ * \param origin Set to the path of the file, which the caller must free.
+ *
+ * \return MCS_FAIL if the value is not set or the backend cannot tell
+ *         where it came from, MCS_OK otherwise.
+ */
+mcs_response_t
+mcs_get_origin(mcs_handle_t *self, const char *section, const char *key,
+	       char **origin)
+{
+	return_val_if_fail(self != NULL, MCS_FAIL);
+	return_val_if_fail(origin != NULL, MCS_FAIL);
+
+	if (self->base->mcs_get_origin == NULL)
+		return MCS_FAIL;
+
+	return self->base->mcs_get_origin(self, section, key, origin);
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Public function to turn a handle into a read-only image for
+ *        fast lookups.
+ *
+ * The values of the handle are rebuilt into a single immutable block,
+ * as the cdb backend lays them out: a perfect hash table of records
+ * whose typed values are resolved in advance, with each table starting
+ * on a cache line. Gets and mcs_iterate() are answered from it with no
+ * locking and no mowgli allocations, so any number of threads may call
+ * them on a frozen handle at once. mcs_get_keys() and mcs_get_sections()
+ * build their lists with mowgli and are no safer than usual. The parsed
+ * state of the backend is dropped where it can be, which writes back
+ * pending changes as mcs_handle_evict() does.
+ *
+ * The handle stays frozen until a value is set or unset through it,
+ * mcs_refresh() brings in a change, or it is evicted; then it thaws
+ * transparently and the backend serves it again. Those calls must not
+ * run while other threads read the handle.
+ *
+ * \param self The mcs.handle object to freeze.
+ *
+ * \return MCS_FAIL if the image could not be built, MCS_OK otherwise.
+ */
+mcs_response_t
+mcs_freeze(mcs_handle_t *self)
+{
+	mcs_handle_t *frozen;
+
+	return_val_if_fail(self != NULL, MCS_FAIL);
+
+	if (self->frozen != NULL)
+		return MCS_OK;
+
+	if ((frozen = mcs_cdb_new_from_handle(self)) == NULL)
+		return MCS_FAIL;
+
+	/* the image answers every read now */
+	if (self->base->mcs_evict != NULL)
+		self->base->mcs_evict(self);
+
+	self->frozen = frozen;
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Public function to tell whether a handle is frozen.
+ *
+ * \param self The mcs.handle object to query.
+ *
+ * \return Non-zero if reads are answered by the image mcs_freeze() built.
+ */
+int
+mcs_handle_is_frozen(mcs_handle_t *self)
+{
+	return_val_if_fail(self != NULL, 0);
+
+	return self->frozen != NULL;
 }
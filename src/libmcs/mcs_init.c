@@ -33,6 +33,12 @@
 #include "libmcs/mcs.h"
 
 extern mcs_backend_t keyfile_backend; /* ../backends/default/keyfile.c */
+extern mcs_backend_t memory_backend;  /* ../backends/memory/memory.c */
+extern mcs_backend_t cdb_backend;     /* ../backends/cdb/cdb.c */
+extern mcs_backend_t pagestore_backend; /* ../backends/pagestore/pagestore.c */
+extern mcs_backend_t daemon_backend;  /* ../backends/daemon/daemon.c */
+extern mcs_backend_t cache_backend;   /* ../backends/cache/cache.c */
+extern mcs_backend_t record_backend;  /* ../backends/record/record.c */
 
 /**
  * \brief A list of registered backends.
@@ -58,8 +64,15 @@ mcs_init(void)
 
 	mcs_backends = mowgli_patricia_create(mcs_strcasecanon);
 	mcs_backend_register(&keyfile_backend);
+	mcs_backend_register(&memory_backend);
+	mcs_backend_register(&cdb_backend);
+	mcs_backend_register(&pagestore_backend);
+	mcs_backend_register(&daemon_backend);
+	mcs_backend_register(&cache_backend);
+	mcs_backend_register(&record_backend);
 
 	mcs_handle_class_init();
+	mcs_util_init();
 }
 
 /**
@@ -71,8 +84,17 @@ mcs_init(void)
 void
 mcs_fini(void)
 {
+	mcs_backend_unregister(&record_backend);
+	mcs_backend_unregister(&cache_backend);
+	mcs_backend_unregister(&daemon_backend);
+	mcs_backend_unregister(&pagestore_backend);
+	mcs_backend_unregister(&cdb_backend);
+	mcs_backend_unregister(&memory_backend);
 	mcs_backend_unregister(&keyfile_backend);
 	mowgli_patricia_destroy(mcs_backends, NULL, NULL);
+	mcs_stats_fini();
+	mcs_trace_fini();
+	mcs_util_fini();
 }
 
 /**
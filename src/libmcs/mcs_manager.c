@@ -0,0 +1,260 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Handle managers.
+ *
+ * A manager opens domains on request and keeps their handles for as
+ * long as it lives, but holds their parsed state to a memory budget.
+ * After every request the footprint of each loaded handle is summed,
+ * and while it is over budget a CLOCK hand sweeps the handles, evicting
+ * the first loaded one which has not been requested since the hand last
+ * passed. Eviction writes back pending changes and drops the parsed
+ * state; the handle itself stays valid and reloads on its next use.
+ *
+ * Managers are not thread safe; use one per thread or lock around them.
+ */
+
+#include "libmcs/mcs.h"
+
+typedef struct {
+	char *domain;
+	mcs_handle_t *handle;
+	size_t usage;
+	unsigned int referenced : 1;
+	unsigned int resident : 1;
+} mcs_manager_entry_t;
+
+struct mcs_manager_ {
+	mowgli_patricia_t *index;
+	mcs_manager_entry_t **entries;
+	size_t count;
+	size_t alloc;
+	size_t hand;
+	mcs_manager_stats_t stats;
+};
+
+static void nocanon(char *str) {}
+
+/**
+ * \brief Creates a handle manager.
+ *
+ * \param budget The memory, in bytes, which loaded domains may use
+ *               together, or 0 for no limit.
+ *
+ * \return A new manager, to be freed with mcs_manager_destroy().
+ */
+mcs_manager_t *
+mcs_manager_new(size_t budget)
+{
+	mcs_manager_t *m = calloc(sizeof(mcs_manager_t), 1);
+
+	m->index = mowgli_patricia_create(nocanon);
+	m->stats.budget = budget;
+
+	return m;
+}
+
+/**
+ * \brief Destroys a handle manager and every handle it opened.
+ *
+ * Pending changes are written back as the handles are destroyed.
+ *
+ * \param m The manager to destroy.
+ */
+void
+mcs_manager_destroy(mcs_manager_t *m)
+{
+	size_t i;
+
+	return_if_fail(m != NULL);
+
+	for (i = 0; i < m->count; i++)
+	{
+		mowgli_object_unref(m->entries[i]->handle);
+		free(m->entries[i]->domain);
+		free(m->entries[i]);
+	}
+
+	mowgli_patricia_destroy(m->index, NULL, NULL);
+	free(m->entries);
+	free(m);
+}
+
+static mcs_manager_entry_t *
+mcs_manager_open(mcs_manager_t *m, const char *domain)
+{
+	mcs_manager_entry_t *e;
+	mcs_handle_t *h;
+
+	if ((h = mcs_new((char *) domain)) == NULL)
+		return NULL;
+
+	if (m->count == m->alloc)
+	{
+		m->alloc = m->alloc ? m->alloc * 2 : 16;
+		m->entries = realloc(m->entries, m->alloc * sizeof(mcs_manager_entry_t *));
+	}
+
+	e = calloc(sizeof(mcs_manager_entry_t), 1);
+	e->domain = strdup(domain);
+	e->handle = h;
+	e->resident = 1;
+
+	m->entries[m->count++] = e;
+	mowgli_patricia_add(m->index, e->domain, e);
+
+	return e;
+}
+
+/*
+ * Evicts handles, sparing keep, until the loaded ones fit the budget or
+ * none is left to evict.
+ */
+static void
+mcs_manager_enforce(mcs_manager_t *m, mcs_manager_entry_t *keep)
+{
+	mcs_manager_entry_t *e;
+	size_t i, total = 0;
+
+	for (i = 0; i < m->count; i++)
+	{
+		m->entries[i]->usage = mcs_handle_memory_usage(m->entries[i]->handle);
+		total += m->entries[i]->usage;
+	}
+
+	m->stats.usage = total;
+
+	if (m->stats.budget == 0)
+		return;
+
+	/* two turns of the hand clear every reference bit on the way */
+	for (i = 0; total > m->stats.budget && i < 2 * m->count; i++)
+	{
+		e = m->entries[m->hand];
+		m->hand = (m->hand + 1) % m->count;
+
+		if (e == keep || e->usage == 0)
+			continue;
+
+		if (e->referenced)
+		{
+			e->referenced = 0;
+			continue;
+		}
+
+		if (mcs_handle_evict(e->handle) != MCS_OK)
+		{
+			m->stats.failed_evictions++;
+			continue;
+		}
+
+		total -= e->usage;
+		e->usage = 0;
+		e->resident = 0;
+		m->stats.evictions++;
+	}
+
+	m->stats.usage = total;
+}
+
+/**
+ * \brief Returns the handle for a domain, opening it if needed.
+ *
+ * The handle belongs to the manager and stays valid until the manager
+ * is destroyed, even if its parsed state is evicted in the meantime.
+ * Other domains may be evicted to bring the manager within budget.
+ *
+ * \param m The manager to ask.
+ * \param domain The domain to return a handle for.
+ *
+ * \return The handle, or NULL if the domain could not be opened.
+ */
+mcs_handle_t *
+mcs_manager_get(mcs_manager_t *m, const char *domain)
+{
+	mcs_manager_entry_t *e;
+
+	return_val_if_fail(m != NULL, NULL);
+	return_val_if_fail(domain != NULL, NULL);
+
+	if ((e = mowgli_patricia_retrieve(m->index, domain)) == NULL)
+	{
+		if ((e = mcs_manager_open(m, domain)) == NULL)
+			return NULL;
+
+		m->stats.misses++;
+	}
+	else if (e->resident || mcs_handle_memory_usage(e->handle) > 0)
+		m->stats.hits++;
+	else
+		m->stats.misses++;
+
+	e->referenced = 1;
+	e->resident = 1;
+
+	mcs_manager_enforce(m, e);
+
+	return e->handle;
+}
+
+/**
+ * \brief Changes a manager's memory budget, evicting domains at once
+ *        if they no longer fit.
+ *
+ * \param m The manager to change.
+ * \param budget The new budget in bytes, or 0 for no limit.
+ */
+void
+mcs_manager_set_budget(mcs_manager_t *m, size_t budget)
+{
+	return_if_fail(m != NULL);
+
+	m->stats.budget = budget;
+	mcs_manager_enforce(m, NULL);
+}
+
+/**
+ * \brief Reads a manager's counters.
+ *
+ * \param m The manager to read.
+ * \param stats Filled in with the counters.
+ */
+void
+mcs_manager_get_stats(mcs_manager_t *m, mcs_manager_stats_t *stats)
+{
+	return_if_fail(m != NULL);
+	return_if_fail(stats != NULL);
+
+	*stats = m->stats;
+	stats->handles = m->count;
+}
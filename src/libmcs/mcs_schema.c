@@ -0,0 +1,305 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Loading a struct of settings in one pass.
+ *
+ * The fields are sorted by section and key, so each section the schema
+ * mentions is walked once with mcs_iterate() and every value found is
+ * matched to its field with a binary search. Values are converted and
+ * checked as they are seen; fields which were missing or invalid get
+ * their default afterwards.
+ */
+
+#include "libmcs/mcs.h"
+
+enum {
+	FIELD_UNSEEN,
+	FIELD_SET,
+	FIELD_INVALID
+};
+
+typedef struct {
+	const mcs_schema_field_t *fields; /* the fields of the section being walked */
+	size_t count;
+	unsigned char *state;
+	void *out;
+	int invalid;
+} schema_load_t;
+
+static int
+schema_key_cmp(const void *key, const void *field)
+{
+	return strcmp(key, ((const mcs_schema_field_t *) field)->key);
+}
+
+static int
+schema_end_ok(const char *str, const char *end)
+{
+	if (end == str)
+		return 0;
+
+	while (*end == ' ' || *end == '\t')
+		end++;
+
+	return *end == '\0';
+}
+
+/*
+ * Converts a stored value into the field. Returns zero, leaving the field
+ * untouched, if the value does not parse or is out of range.
+ */
+static int
+schema_convert(const mcs_schema_field_t *f, const char *value, void *out)
+{
+	char *p = (char *) out + f->offset;
+	char *end;
+	double d;
+	long l;
+
+	switch (f->type)
+	{
+	case MCS_SCHEMA_STRING:
+		*(char **) p = strdup(value);
+		return 1;
+
+	case MCS_SCHEMA_BOOL:
+		if (!strcasecmp(value, "TRUE"))
+			*(int *) p = 1;
+		else if (!strcasecmp(value, "FALSE"))
+			*(int *) p = 0;
+		else
+			return 0;
+		return 1;
+
+	case MCS_SCHEMA_INT:
+		errno = 0;
+		l = strtol(value, &end, 10);
+		if (!schema_end_ok(value, end) || errno == ERANGE || l < INT_MIN || l > INT_MAX)
+			return 0;
+		if (f->ranged && (l < f->min || l > f->max))
+			return 0;
+		*(int *) p = (int) l;
+		return 1;
+
+	case MCS_SCHEMA_FLOAT:
+	case MCS_SCHEMA_DOUBLE:
+		d = mcs_strtod_c(value, &end);
+		if (!schema_end_ok(value, end) || d != d)
+			return 0;
+		if (f->ranged && (d < f->min || d > f->max))
+			return 0;
+		if (f->type == MCS_SCHEMA_FLOAT)
+			*(float *) p = (float) d;
+		else
+			*(double *) p = d;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+schema_default(const mcs_schema_field_t *f, void *out)
+{
+	char *p = (char *) out + f->offset;
+
+	if (f->def != NULL && schema_convert(f, f->def, out))
+		return;
+
+	switch (f->type)
+	{
+	case MCS_SCHEMA_STRING:
+		*(char **) p = NULL;
+		break;
+	case MCS_SCHEMA_INT:
+	case MCS_SCHEMA_BOOL:
+		*(int *) p = 0;
+		break;
+	case MCS_SCHEMA_FLOAT:
+		*(float *) p = 0;
+		break;
+	case MCS_SCHEMA_DOUBLE:
+		*(double *) p = 0;
+		break;
+	}
+}
+
+static int
+schema_load_cb(const char *section, const char *key, const char *value, void *privdata)
+{
+	schema_load_t *ld = privdata;
+	const mcs_schema_field_t *f;
+	size_t i;
+
+	f = bsearch(key, ld->fields, ld->count, sizeof(mcs_schema_field_t), schema_key_cmp);
+	if (f == NULL)
+		return 0;
+
+	i = f - ld->fields;
+
+	/* a key seen twice replaces the string copied the first time */
+	if (f->type == MCS_SCHEMA_STRING && ld->state[i] == FIELD_SET)
+	{
+		char **p = (char **) ((char *) ld->out + f->offset);
+
+		free(*p);
+		*p = NULL;
+	}
+
+	if (schema_convert(f, value, ld->out))
+		ld->state[i] = FIELD_SET;
+	else
+	{
+		mowgli_log("mcs_schema_load(): invalid value `%s' for %s/%s, using the default",
+			value, section, key);
+		ld->state[i] = FIELD_INVALID;
+		ld->invalid++;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Fills in a struct of settings from an mcs.handle in one pass.
+ *
+ * Every field of out described by the table is overwritten, either with
+ * the value stored in the handle or, if that is missing or invalid, with
+ * the field's default. Strings are copied and must be released with
+ * mcs_schema_free().
+ *
+ * \param self The mcs.handle object to read the settings from.
+ * \param fields The fields to fill in, sorted by section and then key
+ *               in strcmp() order, as mcs-schema-compile(1) emits them.
+ * \param count The number of fields.
+ * \param out The struct to fill in.
+ *
+ * \return MCS_FAIL if any value was invalid, MCS_OK otherwise.
+ */
+mcs_response_t
+mcs_schema_load(mcs_handle_t *self, const mcs_schema_field_t *fields,
+		size_t count, void *out)
+{
+	schema_load_t ld;
+	unsigned char *state;
+	size_t i, j;
+
+	return_val_if_fail(self != NULL, MCS_FAIL);
+	return_val_if_fail(out != NULL, MCS_FAIL);
+
+	state = calloc(count ? count : 1, 1);
+	ld.out = out;
+	ld.invalid = 0;
+
+	for (i = 0; i < count; i = j)
+	{
+		for (j = i + 1; j < count && !strcmp(fields[j].section, fields[i].section); j++)
+			;
+
+		ld.fields = &fields[i];
+		ld.count = j - i;
+		ld.state = &state[i];
+
+		mcs_iterate(self, fields[i].section, schema_load_cb, &ld);
+	}
+
+	for (i = 0; i < count; i++)
+		if (state[i] != FIELD_SET)
+			schema_default(&fields[i], out);
+
+	free(state);
+
+	return ld.invalid ? MCS_FAIL : MCS_OK;
+}
+
+/**
+ * \brief Checks whether mcs_schema_load() would accept a value for a field.
+ *
+ * The value is held to the same rules as a stored value, but nothing is
+ * logged, so tools can report a bad value in their own words.
+ *
+ * \param field The field the value is meant for; its offset is ignored.
+ * \param value The value to check.
+ *
+ * \return MCS_OK if the value is valid for the field, MCS_FAIL otherwise.
+ */
+mcs_response_t
+mcs_schema_check(const mcs_schema_field_t *field, const char *value)
+{
+	mcs_schema_field_t f;
+	union {
+		char *s;
+		int i;
+		float f;
+		double d;
+	} scratch;
+
+	return_val_if_fail(field != NULL, MCS_FAIL);
+	return_val_if_fail(value != NULL, MCS_FAIL);
+
+	f = *field;
+	f.offset = 0;
+
+	if (!schema_convert(&f, value, &scratch))
+		return MCS_FAIL;
+
+	if (f.type == MCS_SCHEMA_STRING)
+		free(scratch.s);
+
+	return MCS_OK;
+}
+
+/**
+ * \brief Releases the strings of a struct filled in by mcs_schema_load().
+ *
+ * \param fields The fields the struct was loaded with.
+ * \param count The number of fields.
+ * \param out The struct to release the strings of.
+ */
+void
+mcs_schema_free(const mcs_schema_field_t *fields, size_t count, void *out)
+{
+	size_t i;
+
+	return_if_fail(out != NULL);
+
+	for (i = 0; i < count; i++)
+	{
+		if (fields[i].type == MCS_SCHEMA_STRING)
+		{
+			char **p = (char **) ((char *) out + fields[i].offset);
+
+			free(*p);
+			*p = NULL;
+		}
+	}
+}
@@ -0,0 +1,303 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Performance counters.
+ *
+ * Every handle carries its own mcs_stats_t, and every update is also
+ * added to a process-wide copy. Counters are bumped with relaxed atomic
+ * additions: they only have to be eventually consistent and must cost
+ * next to nothing, since they are always enabled.
+ */
+
+#include <time.h>
+
+#include "libmcs/mcs.h"
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#if defined(__GNUC__)
+# define stat_add(p, n)		__atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+# define stat_load(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#else
+# define stat_add(p, n)		(*(p) += (n))
+# define stat_load(p)		(*(p))
+#endif
+
+static mcs_stats_t global_stats;
+
+/* handle opens by domain; the counters themselves are atomic */
+static mowgli_patricia_t *domain_opens;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t domain_lock = PTHREAD_MUTEX_INITIALIZER;
+# define domain_lock()		pthread_mutex_lock(&domain_lock)
+# define domain_unlock()	pthread_mutex_unlock(&domain_lock)
+#else
+# define domain_lock()
+# define domain_unlock()
+#endif
+
+static void nocanon(char *str) {}
+
+static void
+domain_free_cb(const char *key, void *data, void *privdata)
+{
+	free(data);
+}
+
+static void
+stats_snapshot(mcs_stats_t *src, mcs_stats_t *dst)
+{
+	int i;
+
+	for (i = 0; i < MCS_STAT_TYPES; i++)
+	{
+		dst->gets[i] = stat_load(&src->gets[i]);
+		dst->sets[i] = stat_load(&src->sets[i]);
+	}
+
+	dst->unsets = stat_load(&src->unsets);
+	dst->misses = stat_load(&src->misses);
+	dst->opens = stat_load(&src->opens);
+	dst->bytes_parsed = stat_load(&src->bytes_parsed);
+	dst->parse_ns = stat_load(&src->parse_ns);
+	dst->writes = stat_load(&src->writes);
+	dst->write_bytes = stat_load(&src->write_bytes);
+	dst->fsync_ns = stat_load(&src->fsync_ns);
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Returns a monotonic timestamp in nanoseconds, for timing
+ *        the counters which measure time.
+ */
+unsigned long long
+mcs_stat_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * \brief Counts a handle being opened on a domain.
+ */
+void
+mcs_stat_open(mcs_handle_t *self, const char *domain)
+{
+	unsigned long long *count;
+
+	stat_add(&self->stats.opens, 1);
+	stat_add(&global_stats.opens, 1);
+
+	/* handles built by mcs_memory_new_from_handle() have no domain */
+	if (domain == NULL)
+		return;
+
+	domain_lock();
+
+	if (domain_opens == NULL)
+		domain_opens = mowgli_patricia_create(nocanon);
+
+	if ((count = mowgli_patricia_retrieve(domain_opens, domain)) == NULL)
+	{
+		count = calloc(sizeof(unsigned long long), 1);
+		mowgli_patricia_add(domain_opens, domain, count);
+	}
+
+	domain_unlock();
+
+	stat_add(count, 1);
+}
+
+/**
+ * \brief Counts a get, and a miss if it failed.
+ */
+void
+mcs_stat_get(mcs_handle_t *self, mcs_stat_type_t type, mcs_response_t ret)
+{
+	stat_add(&self->stats.gets[type], 1);
+	stat_add(&global_stats.gets[type], 1);
+
+	if (ret != MCS_OK)
+	{
+		stat_add(&self->stats.misses, 1);
+		stat_add(&global_stats.misses, 1);
+	}
+}
+
+/**
+ * \brief Counts a set.
+ */
+void
+mcs_stat_set(mcs_handle_t *self, mcs_stat_type_t type)
+{
+	stat_add(&self->stats.sets[type], 1);
+	stat_add(&global_stats.sets[type], 1);
+}
+
+/**
+ * \brief Counts an unset.
+ */
+void
+mcs_stat_unset(mcs_handle_t *self)
+{
+	stat_add(&self->stats.unsets, 1);
+	stat_add(&global_stats.unsets, 1);
+}
+
+/**
+ * \brief Counts data loaded by a backend.
+ *
+ * \param self The handle the data was loaded for.
+ * \param bytes The number of bytes read.
+ * \param ns The time taken to read and parse them.
+ */
+void
+mcs_stat_parse(mcs_handle_t *self, size_t bytes, unsigned long long ns)
+{
+	stat_add(&self->stats.bytes_parsed, bytes);
+	stat_add(&self->stats.parse_ns, ns);
+	stat_add(&global_stats.bytes_parsed, bytes);
+	stat_add(&global_stats.parse_ns, ns);
+}
+
+/**
+ * \brief Counts a write back by a backend.
+ *
+ * \param self The handle which was written back.
+ * \param bytes The number of bytes written.
+ * \param fsync_ns The time spent waiting for them to reach the disk.
+ */
+void
+mcs_stat_write(mcs_handle_t *self, size_t bytes, unsigned long long fsync_ns)
+{
+	stat_add(&self->stats.writes, 1);
+	stat_add(&self->stats.write_bytes, bytes);
+	stat_add(&self->stats.fsync_ns, fsync_ns);
+	stat_add(&global_stats.writes, 1);
+	stat_add(&global_stats.write_bytes, bytes);
+	stat_add(&global_stats.fsync_ns, fsync_ns);
+}
+
+/**
+ * \brief Releases the per-domain open counters.
+ */
+void
+mcs_stats_fini(void)
+{
+	domain_lock();
+
+	if (domain_opens != NULL)
+		mowgli_patricia_destroy(domain_opens, domain_free_cb, NULL);
+	domain_opens = NULL;
+
+	domain_unlock();
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Retrieves the counters of an mcs.handle object.
+ *
+ * \param self The mcs.handle object to get the counters of.
+ * \param stats A memory location to copy the counters to.
+ */
+void
+mcs_handle_get_stats(mcs_handle_t *self, mcs_stats_t *stats)
+{
+	return_if_fail(self != NULL);
+	return_if_fail(stats != NULL);
+
+	stats_snapshot(&self->stats, stats);
+}
+
+/**
+ * \brief Retrieves the counters summed over every handle the process
+ *        has opened, including those already closed.
+ *
+ * \param stats A memory location to copy the counters to.
+ */
+void
+mcs_get_global_stats(mcs_stats_t *stats)
+{
+	return_if_fail(stats != NULL);
+
+	stats_snapshot(&global_stats, stats);
+}
+
+typedef struct {
+	int (*func)(const char *domain, unsigned long long opens, void *privdata);
+	void *privdata;
+	int stop;
+} domain_opens_iter_t;
+
+static int
+domain_opens_cb(const char *key, void *data, void *privdata)
+{
+	domain_opens_iter_t *it = privdata;
+	unsigned long long *count = data;
+
+	if (!it->stop)
+		it->stop = it->func(key, stat_load(count), it->privdata) != 0;
+
+	return it->stop;
+}
+
+/**
+ * \brief Calls a function with the number of handles opened on each
+ *        domain so far.
+ *
+ * \param func The function to call; a non-zero return stops the walk.
+ * \param privdata Opaque data passed to func.
+ */
+void
+mcs_foreach_domain_opens(int (*func)(const char *domain, unsigned long long opens,
+				     void *privdata), void *privdata)
+{
+	domain_opens_iter_t it = { func, privdata, 0 };
+
+	return_if_fail(func != NULL);
+
+	domain_lock();
+
+	if (domain_opens != NULL)
+		mowgli_patricia_foreach(domain_opens, domain_opens_cb, &it);
+
+	domain_unlock();
+}
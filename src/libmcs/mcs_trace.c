@@ -0,0 +1,414 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tracing of calls into the backends.
+ *
+ * The dispatch functions in mcs_handle_factory.c only time a call when
+ * mcs_trace_active is set, which happens once a tracer is registered or
+ * histograms are enabled; otherwise tracing costs a predicted branch.
+ * Completed calls are passed to the registered tracers and added to a
+ * latency histogram for each backend and operation.
+ */
+
+#include "libmcs/mcs.h"
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#define TRACE_MAX_TRACERS	8
+
+#if defined(__GNUC__)
+# define trace_add(p, n)	__atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+# define trace_load(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define trace_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+# define trace_add(p, n)	(*(p) += (n))
+# define trace_load(p)		(*(p))
+# define trace_store(p, v)	(*(p) = (v))
+#endif
+
+typedef struct trace_backend_ trace_backend_t;
+
+struct trace_backend_ {
+	trace_backend_t *next;
+	char *name;
+	mcs_trace_histogram_t hist[MCS_TRACE_OPS];
+};
+
+typedef struct {
+	mcs_trace_func_t func;
+	void *privdata;
+} trace_tracer_t;
+
+int mcs_trace_active = 0;
+
+static int histograms;
+static trace_tracer_t tracers[TRACE_MAX_TRACERS];
+static int ntracers;
+
+/* backends are only ever prepended, so the list can be walked unlocked */
+static trace_backend_t *backends;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+# define trace_lock()		pthread_mutex_lock(&trace_lock)
+# define trace_unlock()		pthread_mutex_unlock(&trace_lock)
+#else
+# define trace_lock()
+# define trace_unlock()
+#endif
+
+static const char *op_names[MCS_TRACE_OPS] = {
+	"open",
+	"get_string", "get_int", "get_bool", "get_float", "get_double",
+	"set_string", "set_int", "set_bool", "set_float", "set_double",
+	"unset", "get_keys", "get_sections", "commit", "iterate"
+};
+
+static void
+trace_update_active(void)
+{
+	mcs_trace_active = histograms || ntracers > 0;
+}
+
+static int
+trace_bucket(unsigned long long ns)
+{
+	int e = 0;
+
+	if (ns < 4)
+		return (int) ns;
+
+#if defined(__GNUC__)
+	e = 63 - __builtin_clzll(ns);
+#else
+	while ((ns >> (e + 1)) != 0)
+		e++;
+#endif
+
+	return (e - 1) * 4 + (int) ((ns >> (e - 2)) & 3);
+}
+
+static trace_backend_t *
+trace_backend_find(const char *name)
+{
+	trace_backend_t *tb;
+
+	for (tb = trace_load(&backends); tb != NULL; tb = tb->next)
+		if (!strcmp(tb->name, name))
+			return tb;
+
+	trace_lock();
+
+	/* look again, another thread may have added it meanwhile */
+	for (tb = backends; tb != NULL; tb = tb->next)
+		if (!strcmp(tb->name, name))
+			break;
+
+	if (tb == NULL)
+	{
+		tb = calloc(sizeof(trace_backend_t), 1);
+		tb->name = strdup(name);
+		tb->next = backends;
+		trace_store(&backends, tb);
+	}
+
+	trace_unlock();
+
+	return tb;
+}
+
+static void
+trace_histogram_add(mcs_trace_histogram_t *hist, unsigned long long ns)
+{
+#if defined(__GNUC__)
+	unsigned long long max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+
+	while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+#else
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+#endif
+
+	trace_add(&hist->count, 1);
+	trace_add(&hist->sum_ns, ns);
+	trace_add(&hist->buckets[trace_bucket(ns)], 1);
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Reports a completed call to the tracers and histograms.
+ *
+ * This is called by the dispatch functions when mcs_trace_active is set.
+ */
+void
+mcs_trace_call(mcs_handle_t *self, mcs_trace_op_t op, const char *section,
+	       const char *key, mcs_response_t ret, unsigned long long ns)
+{
+	trace_tracer_t local[TRACE_MAX_TRACERS];
+	mcs_trace_event_t ev;
+	int i, n;
+
+	if (self == NULL)
+		return;
+
+	ev.op = op;
+	ev.backend = self->base->name;
+	ev.handle = self;
+	ev.section = section;
+	ev.key = key;
+	ev.response = ret;
+	ev.ns = ns;
+
+	if (histograms)
+		trace_histogram_add(&trace_backend_find(ev.backend)->hist[op], ns);
+
+	/* tracers may register or unregister tracers, so call a copy */
+	trace_lock();
+	n = ntracers;
+	memcpy(local, tracers, n * sizeof(trace_tracer_t));
+	trace_unlock();
+
+	for (i = 0; i < n; i++)
+		local[i].func(&ev, local[i].privdata);
+}
+
+/**
+ * \brief Releases the histograms and forgets the registered tracers.
+ */
+void
+mcs_trace_fini(void)
+{
+	trace_backend_t *tb, *next;
+
+	trace_lock();
+
+	for (tb = backends; tb != NULL; tb = next)
+	{
+		next = tb->next;
+		free(tb->name);
+		free(tb);
+	}
+
+	backends = NULL;
+	ntracers = 0;
+	histograms = 0;
+	trace_update_active();
+
+	trace_unlock();
+}
+
+/* ******************************************************************* */
+
+/**
+ * \brief Registers a function to be called after each call into a backend.
+ *
+ * Tracers are called on the thread which made the call, once it has
+ * completed. They may call into mcs themselves, but those calls are
+ * traced too.
+ *
+ * \param func The function to call.
+ * \param privdata Opaque data passed to func.
+ *
+ * \return MCS_OK, or MCS_FAIL if too many tracers are registered.
+ */
+mcs_response_t
+mcs_trace_register(mcs_trace_func_t func, void *privdata)
+{
+	mcs_response_t ret = MCS_FAIL;
+
+	return_val_if_fail(func != NULL, MCS_FAIL);
+
+	trace_lock();
+
+	if (ntracers < TRACE_MAX_TRACERS)
+	{
+		tracers[ntracers].func = func;
+		tracers[ntracers].privdata = privdata;
+		ntracers++;
+		ret = MCS_OK;
+	}
+	else
+		mowgli_log("mcs_trace_register(): too many tracers registered");
+
+	trace_update_active();
+	trace_unlock();
+
+	return ret;
+}
+
+/**
+ * \brief Unregisters a tracer added with mcs_trace_register().
+ *
+ * \param func The function which was registered.
+ * \param privdata The opaque data it was registered with.
+ *
+ * \return MCS_OK, or MCS_FAIL if no such tracer was registered.
+ */
+mcs_response_t
+mcs_trace_unregister(mcs_trace_func_t func, void *privdata)
+{
+	mcs_response_t ret = MCS_FAIL;
+	int i;
+
+	trace_lock();
+
+	for (i = 0; i < ntracers; i++)
+	{
+		if (tracers[i].func == func && tracers[i].privdata == privdata)
+		{
+			memmove(&tracers[i], &tracers[i + 1],
+				(ntracers - i - 1) * sizeof(trace_tracer_t));
+			ntracers--;
+			ret = MCS_OK;
+			break;
+		}
+	}
+
+	trace_update_active();
+	trace_unlock();
+
+	return ret;
+}
+
+/**
+ * \brief Turns the latency histograms on or off.
+ *
+ * Histograms are off by default. Turning them off keeps what has been
+ * recorded so far.
+ *
+ * \param enable Non-zero to record histograms.
+ */
+void
+mcs_trace_set_histograms(int enable)
+{
+	trace_lock();
+	histograms = enable != 0;
+	trace_update_active();
+	trace_unlock();
+}
+
+/**
+ * \brief Calls a function with every histogram which has recorded a call.
+ *
+ * \param func The function to call; a non-zero return stops the walk.
+ * \param privdata Opaque data passed to func.
+ */
+void
+mcs_trace_foreach_histogram(int (*func)(const char *backend, mcs_trace_op_t op,
+					const mcs_trace_histogram_t *hist,
+					void *privdata), void *privdata)
+{
+	trace_backend_t *tb;
+	int op;
+
+	return_if_fail(func != NULL);
+
+	for (tb = trace_load(&backends); tb != NULL; tb = tb->next)
+	{
+		for (op = 0; op < MCS_TRACE_OPS; op++)
+		{
+			if (tb->hist[op].count == 0)
+				continue;
+
+			if (func(tb->name, op, &tb->hist[op], privdata))
+				return;
+		}
+	}
+}
+
+/**
+ * \brief Returns the smallest value a histogram bucket holds.
+ *
+ * \param bucket A bucket index, below MCS_TRACE_BUCKETS.
+ */
+unsigned long long
+mcs_trace_bucket_floor(int bucket)
+{
+	int e;
+
+	if (bucket < 4)
+		return bucket;
+
+	e = bucket / 4 + 1;
+
+	return (unsigned long long) (4 + bucket % 4) << (e - 2);
+}
+
+/**
+ * \brief Estimates a percentile from a histogram.
+ *
+ * \param hist The histogram to look at.
+ * \param percentile The percentile wanted, from 0 to 100.
+ *
+ * \return The lower bound of the bucket holding the percentile, in ns.
+ */
+unsigned long long
+mcs_trace_histogram_percentile(const mcs_trace_histogram_t *hist, double percentile)
+{
+	unsigned long long seen = 0, want;
+	int i;
+
+	return_val_if_fail(hist != NULL, 0);
+
+	if (hist->count == 0)
+		return 0;
+
+	want = (unsigned long long) (hist->count * percentile / 100.0);
+	if (want >= hist->count)
+		want = hist->count - 1;
+
+	for (i = 0; i < MCS_TRACE_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if (seen > want)
+			return mcs_trace_bucket_floor(i);
+	}
+
+	return hist->max_ns;
+}
+
+/**
+ * \brief Returns a name for a traced operation, e.g. "get_string".
+ */
+const char *
+mcs_trace_op_name(mcs_trace_op_t op)
+{
+	return_val_if_fail(op < MCS_TRACE_OPS, "unknown");
+
+	return op_names[op];
+}
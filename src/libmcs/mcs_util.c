@@ -30,12 +30,20 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <ctype.h>
+#include <locale.h>
+
 #include "libmcs/mcs.h"
 
 #ifdef _WIN32
 # define mkdir(_tpath, _tmode)   _mkdir(_tpath)
 #endif
 
+#ifdef HAVE_USELOCALE
+/* switched to per thread, so that the application's locale is untouched */
+static locale_t c_locale = (locale_t) 0;
+#endif
+
 /**
  * \brief Determines the length of a string, limited by an arbitrary length.
  *
@@ -128,6 +136,37 @@ mcs_create_directory(const char *path, mode_t mode)
 	return 0;
 }
 
+/**
+ * \brief Builds the path of a domain's configuration directory.
+ *
+ * The directory is $XDG_CONFIG_HOME/domain, falling back to
+ * $HOME/.config/domain. If file is not NULL, it is appended as a
+ * component of the path.
+ *
+ * \param buf The buffer to write the path to.
+ * \param len The size of the buffer.
+ * \param domain The domain to build the path for.
+ * \param file An optional file name inside the domain directory.
+ * \return The length of the resulting path.
+ */
+size_t
+mcs_domain_path(char *buf, size_t len, const char *domain, const char *file)
+{
+	char *magic = getenv("XDG_CONFIG_HOME");
+
+	if (magic != NULL)
+		snprintf(buf, len, "%s/%s", magic, domain);
+	else
+		snprintf(buf, len, "%s/.config/%s", getenv("HOME"), domain);
+
+	if (file == NULL)
+		return strlen(buf);
+
+	mcs_strlcat(buf, "/", len);
+
+	return mcs_strlcat(buf, file, len);
+}
+
 /**
  * \brief Concatenates a string, limited to a maximum buffer size.
  *
@@ -187,6 +226,119 @@ size_t mcs_strlcpy(char *dest, const char *src, size_t size)
 	return retlen;
 }
 
+/*
+ * Called from mcs_init() and mcs_fini().
+ */
+void
+mcs_util_init(void)
+{
+#ifdef HAVE_USELOCALE
+	if (c_locale == (locale_t) 0)
+		c_locale = newlocale(LC_ALL_MASK, "C", (locale_t) 0);
+#endif
+}
+
+void
+mcs_util_fini(void)
+{
+#ifdef HAVE_USELOCALE
+	if (c_locale != (locale_t) 0)
+		freelocale(c_locale);
+
+	c_locale = (locale_t) 0;
+#endif
+}
+
+/**
+ * \brief Parses a floating point value in the C locale.
+ *
+ * Backends which store values as text use this so that the stored
+ * representation does not depend on the application's locale. Where
+ * uselocale() is available, the locale of other threads is left alone.
+ *
+ * \param str The string to parse.
+ * \param end Where to store a pointer past the parsed text, or NULL.
+ * \return The parsed value.
+ */
+double
+mcs_strtod_c(const char *str, char **end)
+{
+	char *locale;
+	double out;
+
+#ifdef HAVE_USELOCALE
+	if (c_locale != (locale_t) 0)
+	{
+		locale_t old = uselocale(c_locale);
+
+		out = strtod(str, end);
+		uselocale(old);
+
+		return out;
+	}
+#endif
+
+	locale = strdup(setlocale(LC_NUMERIC, NULL));
+	setlocale(LC_NUMERIC, "C");
+	out = strtod(str, end);
+	setlocale(LC_NUMERIC, locale);
+	free(locale);
+
+	return out;
+}
+
+/**
+ * \brief Formats a floating point value in the C locale.
+ *
+ * This is the counterpart of mcs_strtod_c(). The value is written with
+ * the given number of significant digits; 9 are enough for a float and
+ * 17 for a double to read back unchanged.
+ *
+ * \param buf The buffer to write the value to.
+ * \param len The size of the buffer.
+ * \param value The value to format.
+ * \param digits The number of significant digits to write.
+ */
+void
+mcs_dtostr_prec_c(char *buf, size_t len, double value, int digits)
+{
+	char *locale;
+
+#ifdef HAVE_USELOCALE
+	if (c_locale != (locale_t) 0)
+	{
+		locale_t old = uselocale(c_locale);
+
+		snprintf(buf, len, "%.*g", digits, value);
+		uselocale(old);
+
+		return;
+	}
+#endif
+
+	locale = strdup(setlocale(LC_NUMERIC, NULL));
+	setlocale(LC_NUMERIC, "C");
+	snprintf(buf, len, "%.*g", digits, value);
+	setlocale(LC_NUMERIC, locale);
+	free(locale);
+}
+
+/**
+ * \brief Formats a floating point value in the C locale.
+ *
+ * This is the counterpart of mcs_strtod_c(), writing the value as "%g"
+ * does, with six significant digits.
+ *
+ * \param buf The buffer to write the value to.
+ * \param len The size of the buffer.
+ * \param value The value to format.
+ */
+void
+mcs_dtostr_c(char *buf, size_t len, double value)
+{
+	mcs_dtostr_prec_c(buf, len, value, 6);
+}
+
 /**
  * \brief Canonization function for MCS backend entity names.
  *
@@ -0,0 +1,75 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "libmcs/mcs.h"
+
+int
+main(int argc, char *argv[])
+{
+	mcs_handle_t *h;
+	char path[PATH_MAX];
+	const char *backend;
+	mcs_response_t ret;
+
+	if (argc < 2)
+	{
+		printf("usage: %s domain [source-backend]\n", argv[0]);
+		return -1;
+	}
+
+	backend = argc > 2 ? argv[2] : "default";
+
+	mcs_init();
+
+	if ((h = mcs_new_with_backend(backend, argv[1])) == NULL)
+	{
+		fprintf(stderr, "%s: unknown backend `%s'\n", argv[0], backend);
+		mcs_fini();
+		return 1;
+	}
+
+	mcs_domain_path(path, PATH_MAX, argv[1], "config.cdb");
+	ret = mcs_cdb_compile(h, path);
+	mowgli_object_unref(h);
+
+	mcs_fini();
+
+	if (ret != MCS_OK)
+	{
+		fprintf(stderr, "%s: failed to compile %s\n", argv[0], path);
+		return 1;
+	}
+
+	printf("%s => %s\n", argv[1], path);
+
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Writes every value of a domain to stdout, one per line, as
+ *
+ *   section <TAB> key <TAB> value
+ *
+ * with backslash, tab, carriage return and newline escaped as \\, \t,
+ * \r and \n. mcs-load reads the same format back.
+ */
+
+#include "libmcs/mcs.h"
+
+static void
+put_escaped(FILE *out, const char *str)
+{
+	for (; *str != '\0'; str++)
+	{
+		switch (*str)
+		{
+		case '\\':
+			fputs("\\\\", out);
+			break;
+		case '\t':
+			fputs("\\t", out);
+			break;
+		case '\r':
+			fputs("\\r", out);
+			break;
+		case '\n':
+			fputs("\\n", out);
+			break;
+		default:
+			putc(*str, out);
+			break;
+		}
+	}
+}
+
+static int
+dump_value_cb(const char *section, const char *key, const char *value, void *privdata)
+{
+	FILE *out = privdata;
+
+	put_escaped(out, section);
+	putc('\t', out);
+	put_escaped(out, key);
+	putc('\t', out);
+	put_escaped(out, value);
+	putc('\n', out);
+
+	return ferror(out);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *backend = NULL;
+	mcs_handle_t *h;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "b:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			backend = optarg;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	if (optind != argc - 1)
+	{
+		fprintf(stderr, "usage: %s [-b backend] domain\n", argv[0]);
+		return 1;
+	}
+
+	mcs_init();
+
+	h = backend != NULL ? mcs_new_with_backend(backend, argv[optind]) : mcs_new(argv[optind]);
+	if (h == NULL)
+	{
+		fprintf(stderr, "%s: unknown backend `%s'\n", argv[0], backend);
+		mcs_fini();
+		return 1;
+	}
+
+	mcs_iterate(h, NULL, dump_value_cb, stdout);
+
+	if (fflush(stdout) != 0 || ferror(stdout))
+	{
+		fprintf(stderr, "%s: write error: %s\n", argv[0], strerror(errno));
+		ret = 1;
+	}
+
+	mowgli_object_unref(h);
+	mcs_fini();
+
+	return ret;
+}
@@ -30,25 +30,255 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/*
+ * Besides looking up a single value, mcs-getconfval can answer a stream
+ * of queries, one "domain section key [type]" per line. Each domain is
+ * opened once and kept open until the input ends, so a script asking
+ * for thousands of values pays for parsing each domain only once.
+ *
+ * Every query is answered with one line: "ok<TAB>value", "missing", or
+ * "error<TAB>reason". Blank lines are skipped. Values are escaped as
+ * mcs-dump escapes them; floats and doubles are written in the C locale
+ * with enough digits to read back exactly. In coprocess mode (-c) each
+ * answer is flushed as soon as it is written, so a program can hold the
+ * tool open on a pair of pipes.
+ */
+
 #include "libmcs/mcs.h"
 
+static mowgli_patricia_t *handles;
+
+static void nocanon(char *str) {}
+
+static void
+handle_free_cb(const char *key, void *data, void *privdata)
+{
+	mowgli_object_unref(data);
+}
+
+static mcs_handle_t *
+handle_get(const char *domain)
+{
+	mcs_handle_t *h;
+
+	if ((h = mowgli_patricia_retrieve(handles, domain)) != NULL)
+		return h;
+
+	if ((h = mcs_new((char *) domain)) != NULL)
+		mowgli_patricia_add(handles, domain, h);
+
+	return h;
+}
+
+static void
+print_escaped(FILE *out, const char *str)
+{
+	for (; *str != '\0'; str++)
+	{
+		switch (*str)
+		{
+		case '\\':
+			fputs("\\\\", out);
+			break;
+		case '\t':
+			fputs("\\t", out);
+			break;
+		case '\r':
+			fputs("\\r", out);
+			break;
+		case '\n':
+			fputs("\\n", out);
+			break;
+		default:
+			putc(*str, out);
+			break;
+		}
+	}
+}
+
+/*
+ * Answers one query line, returning zero if it was malformed.
+ */
+static int
+answer(char *line)
+{
+	char *domain, *section, *key, *type, *value = NULL;
+	mcs_handle_t *h;
+	mcs_response_t ret;
+	int ival;
+	float fval;
+	double dval;
+	char buf[64];
+
+	domain = strtok(line, " \t");
+	section = strtok(NULL, " \t");
+	key = strtok(NULL, " \t");
+	type = strtok(NULL, " \t");
+
+	if (key == NULL || strtok(NULL, " \t") != NULL)
+	{
+		puts("error\texpected domain, section, key and an optional type");
+		return 0;
+	}
+
+	if ((h = handle_get(domain)) == NULL)
+	{
+		puts("error\tcould not open domain");
+		return 0;
+	}
+
+	if (type == NULL || !strcmp(type, "string"))
+	{
+		if ((ret = mcs_get_string(h, section, key, &value)) == MCS_OK)
+		{
+			fputs("ok\t", stdout);
+			print_escaped(stdout, value);
+			putchar('\n');
+			free(value);
+		}
+	}
+	else if (!strcmp(type, "int"))
+	{
+		if ((ret = mcs_get_int(h, section, key, &ival)) == MCS_OK)
+			printf("ok\t%d\n", ival);
+	}
+	else if (!strcmp(type, "bool"))
+	{
+		if ((ret = mcs_get_bool(h, section, key, &ival)) == MCS_OK)
+			printf("ok\t%s\n", ival ? "TRUE" : "FALSE");
+	}
+	else if (!strcmp(type, "float"))
+	{
+		if ((ret = mcs_get_float(h, section, key, &fval)) == MCS_OK)
+		{
+			mcs_dtostr_prec_c(buf, sizeof buf, fval, 9);
+			printf("ok\t%s\n", buf);
+		}
+	}
+	else if (!strcmp(type, "double"))
+	{
+		if ((ret = mcs_get_double(h, section, key, &dval)) == MCS_OK)
+		{
+			mcs_dtostr_prec_c(buf, sizeof buf, dval, 17);
+			printf("ok\t%s\n", buf);
+		}
+	}
+	else
+	{
+		puts("error\tunknown type");
+		return 0;
+	}
+
+	if (ret != MCS_OK)
+		puts("missing");
+
+	return 1;
+}
+
+static int
+run_queries(FILE *in, int coprocess)
+{
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	int errors = 0;
+
+	if (coprocess)
+		setvbuf(stdout, NULL, _IOLBF, 0);
+
+	handles = mowgli_patricia_create(nocanon);
+
+	while ((len = getline(&line, &alloc, in)) >= 0)
+	{
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len > 0 && line[len - 1] == '\r')
+			line[--len] = '\0';
+
+		/* blank lines are skipped, not answered */
+		if (line[strspn(line, " \t")] == '\0')
+			continue;
+
+		if (!answer(line))
+			errors++;
+	}
+
+	mowgli_patricia_destroy(handles, handle_free_cb, NULL);
+	free(line);
+
+	return errors;
+}
+
+static void
+usage(const char *prog)
+{
+	printf("usage: %s domain section keyname\n", prog);
+	printf("       %s -f file|-\n", prog);
+	printf("       %s -c\n", prog);
+}
+
 int
 main(int argc, char *argv[])
 {
 	mcs_handle_t *h;
 	char *foo = NULL;
+	const char *batch = NULL;
+	int coprocess = 0, errors, opt;
+	FILE *in = stdin;
+
+	while ((opt = getopt(argc, argv, "cf:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			coprocess = 1;
+			break;
+		case 'f':
+			batch = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (batch != NULL || coprocess)
+	{
+		if (optind != argc || (batch != NULL && coprocess))
+		{
+			usage(argv[0]);
+			return -1;
+		}
+
+		if (batch != NULL && strcmp(batch, "-") &&
+		    (in = fopen(batch, "r")) == NULL)
+		{
+			fprintf(stderr, "%s: %s: %s\n", argv[0], batch, strerror(errno));
+			return 1;
+		}
+
+		mcs_init();
+		errors = run_queries(in, coprocess);
+		mcs_fini();
+
+		if (in != stdin)
+			fclose(in);
+
+		return errors ? 1 : 0;
+	}
 
-	if (argc < 4)
+	if (argc - optind < 3)
 	{
-		printf("usage: %s domain section keyname\n", argv[0]);
+		usage(argv[0]);
 		return -1;
 	}
 
 	mcs_init();
 
-	h = mcs_new(argv[1]);
-	mcs_get_string(h, argv[2], argv[3], &foo);
-	printf("%s/%s => %s\n", argv[2], argv[3], foo);
+	h = mcs_new(argv[optind]);
+	mcs_get_string(h, argv[optind + 1], argv[optind + 2], &foo);
+	printf("%s/%s => %s\n", argv[optind + 1], argv[optind + 2], foo);
+	free(foo);
 	mowgli_object_unref(h);
 
 	mcs_fini();
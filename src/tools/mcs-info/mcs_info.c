@@ -32,6 +32,201 @@
 
 #include "libmcs/mcs.h"
 
+static const char *stat_types[MCS_STAT_TYPES] = {
+	"string", "int", "bool", "float", "double"
+};
+
+static void
+print_stats(const char *title, mcs_stats_t *st)
+{
+	int i;
+
+	printf("%s:\n", title);
+
+	for (i = 0; i < MCS_STAT_TYPES; i++)
+		printf("   %-14s %llu gets, %llu sets\n", stat_types[i], st->gets[i], st->sets[i]);
+
+	printf("   %-14s %llu\n", "unsets", st->unsets);
+	printf("   %-14s %llu\n", "misses", st->misses);
+	printf("   %-14s %llu\n", "opens", st->opens);
+	printf("   %-14s %llu bytes in %.3f ms\n", "parsed", st->bytes_parsed, st->parse_ns / 1e6);
+	printf("   %-14s %llu, %llu bytes\n", "writes", st->writes, st->write_bytes);
+	printf("   %-14s %.3f ms\n", "fsync", st->fsync_ns / 1e6);
+}
+
+static int
+print_domain_opens(const char *domain, unsigned long long opens, void *privdata)
+{
+	printf("   %-14s %llu\n", domain, opens);
+
+	return 0;
+}
+
+/*
+ * Reads every value in a domain, so that the counters reflect a full
+ * load of it.
+ */
+static void
+read_domain(mcs_handle_t *h)
+{
+	mowgli_queue_t *groups, *i;
+
+	groups = mcs_get_sections(h);
+
+	for (i = groups; i != NULL; i = i->next)
+	{
+		mowgli_queue_t *keys, *i2;
+
+		keys = mcs_get_keys(h, i->data);
+
+		for (i2 = keys; i2 != NULL; i2 = i2->next)
+		{
+			char *value;
+
+			if (mcs_get_string(h, i->data, i2->data, &value) == MCS_OK)
+				free(value);
+
+			free(i2->data);
+		}
+
+		mowgli_queue_destroy(keys);
+		free(i->data);
+	}
+
+	mowgli_queue_destroy(groups);
+}
+
+/*
+ * Returns non-zero if a directory under the configuration root holds a
+ * domain, that is a config file, or a config.d directory or config.*
+ * file of some other backend. Opening a handle would create it instead.
+ */
+static int
+domain_exists(const char *domain)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	DIR *dir;
+	int found = 0;
+
+	mcs_domain_path(path, sizeof path, domain, NULL);
+
+	if ((dir = opendir(path)) == NULL)
+		return 0;
+
+	while (!found && (ent = readdir(dir)) != NULL)
+		found = !strcmp(ent->d_name, "config") || !strncmp(ent->d_name, "config.", 7);
+
+	closedir(dir);
+
+	return found;
+}
+
+/*
+ * Opens a domain which already exists, complaining about one which does
+ * not rather than leaving an empty one behind.
+ */
+static mcs_handle_t *
+open_domain(char *domain)
+{
+	mcs_handle_t *h;
+
+	if (!domain_exists(domain))
+	{
+		fprintf(stderr, "%s: no such domain\n", domain);
+		return NULL;
+	}
+
+	if ((h = mcs_new(domain)) == NULL)
+		fprintf(stderr, "%s: cannot open the domain\n", domain);
+
+	return h;
+}
+
+static int
+stats_domain(char *domain)
+{
+	mcs_handle_t *h;
+	mcs_stats_t st;
+	char title[256];
+
+	if ((h = open_domain(domain)) == NULL)
+		return 0;
+
+	read_domain(h);
+
+	mcs_handle_get_stats(h, &st);
+	snprintf(title, sizeof title, "Domain %s", domain);
+	print_stats(title, &st);
+
+	mowgli_object_unref(h);
+
+	return 1;
+}
+
+static int
+stats_main(int argc, char *argv[])
+{
+	mcs_stats_t st;
+	int i, errors = 0;
+
+	for (i = 0; i < argc; i++)
+		if (!stats_domain(argv[i]))
+			errors++;
+
+	mcs_get_global_stats(&st);
+	print_stats("Process totals", &st);
+
+	printf("Handles opened by domain:\n");
+	mcs_foreach_domain_opens(print_domain_opens, NULL);
+
+	return errors ? 1 : 0;
+}
+
+static int
+print_histogram(const char *backend, mcs_trace_op_t op,
+		const mcs_trace_histogram_t *hist, void *privdata)
+{
+	printf("   %-10s %-13s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		backend, mcs_trace_op_name(op), hist->count,
+		hist->sum_ns / 1e3 / hist->count,
+		mcs_trace_histogram_percentile(hist, 50) / 1e3,
+		mcs_trace_histogram_percentile(hist, 90) / 1e3,
+		mcs_trace_histogram_percentile(hist, 99) / 1e3,
+		hist->max_ns / 1e3);
+
+	return 0;
+}
+
+static int
+latency_main(int argc, char *argv[])
+{
+	int i, errors = 0;
+
+	mcs_trace_set_histograms(1);
+
+	for (i = 0; i < argc; i++)
+	{
+		mcs_handle_t *h;
+
+		if ((h = open_domain(argv[i])) == NULL)
+		{
+			errors++;
+			continue;
+		}
+
+		read_domain(h);
+		mowgli_object_unref(h);
+	}
+
+	printf("Latency of calls into the backends, in microseconds:\n");
+	printf("   %-10s %-13s %8s %10s %10s %10s %10s %10s\n",
+		"backend", "call", "count", "mean", "p50", "p90", "p99", "max");
+	mcs_trace_foreach_histogram(print_histogram, NULL);
+
+	return errors ? 1 : 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -40,6 +235,30 @@ main(int argc, char *argv[])
 
 	mcs_init();
 
+	if (argc > 1 && !strcmp(argv[1], "--stats"))
+	{
+		int ret = stats_main(argc - 2, argv + 2);
+
+		mcs_fini();
+
+		return ret;
+	}
+	else if (argc > 1 && !strcmp(argv[1], "--latency"))
+	{
+		int ret = latency_main(argc - 2, argv + 2);
+
+		mcs_fini();
+
+		return ret;
+	}
+	else if (argc > 1)
+	{
+		printf("usage: %s [--stats | --latency [domain...]]\n", argv[0]);
+		mcs_fini();
+
+		return -1;
+	}
+
 	ver = mcs_version();
 
 	printf("mcs version: %s\n", ver);
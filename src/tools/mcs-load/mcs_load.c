@@ -0,0 +1,196 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Loads values written by mcs-dump into a domain. Every line is applied
+ * to one handle and the domain is written back once at the end, so the
+ * cost does not grow with the number of values beyond the sets
+ * themselves. Malformed lines are reported and skipped.
+ */
+
+#include "libmcs/mcs.h"
+
+/*
+ * Unescapes a field in place, returning zero on an unknown escape.
+ */
+static int
+unescape(char *str)
+{
+	char *in = str, *out = str;
+
+	for (; *in != '\0'; in++)
+	{
+		if (*in != '\\')
+		{
+			*out++ = *in;
+			continue;
+		}
+
+		switch (*++in)
+		{
+		case '\\':
+			*out++ = '\\';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 'n':
+			*out++ = '\n';
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	*out = '\0';
+
+	return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *backend = NULL, *path = "-";
+	mcs_handle_t *h;
+	FILE *in = stdin;
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	unsigned long lineno = 0, loaded = 0, errors = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			backend = optarg;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	if (optind != argc - 1 && optind != argc - 2)
+	{
+		fprintf(stderr, "usage: %s [-b backend] domain [file]\n", argv[0]);
+		return 1;
+	}
+
+	if (optind == argc - 2 && strcmp(argv[optind + 1], "-"))
+	{
+		path = argv[optind + 1];
+
+		if ((in = fopen(path, "r")) == NULL)
+		{
+			fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+			return 1;
+		}
+	}
+
+	mcs_init();
+
+	h = backend != NULL ? mcs_new_with_backend(backend, argv[optind]) : mcs_new(argv[optind]);
+	if (h == NULL)
+	{
+		fprintf(stderr, "%s: unknown backend `%s'\n", argv[0], backend);
+		mcs_fini();
+		return 1;
+	}
+
+	while ((len = getline(&line, &alloc, in)) >= 0)
+	{
+		char *section, *key, *value;
+
+		lineno++;
+
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		section = line;
+		if ((key = strchr(section, '\t')) == NULL ||
+		    (value = strchr(++key, '\t')) == NULL ||
+		    strchr(++value, '\t') != NULL)
+		{
+			fprintf(stderr, "%s:%lu: expected section, key and value separated by tabs\n",
+				path, lineno);
+			errors++;
+			continue;
+		}
+
+		key[-1] = value[-1] = '\0';
+
+		if (!unescape(section) || !unescape(key) || !unescape(value))
+		{
+			fprintf(stderr, "%s:%lu: invalid escape sequence\n", path, lineno);
+			errors++;
+			continue;
+		}
+
+		if (mcs_set_string(h, section, key, value) != MCS_OK)
+		{
+			fprintf(stderr, "%s:%lu: failed to set %s/%s\n", path, lineno, section, key);
+			errors++;
+			continue;
+		}
+
+		loaded++;
+	}
+
+	if (ferror(in))
+	{
+		fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+		errors++;
+	}
+
+	if (mcs_commit(h) != MCS_OK)
+	{
+		fprintf(stderr, "%s: failed to write back %s\n", argv[0], argv[optind]);
+		errors++;
+	}
+
+	mowgli_object_unref(h);
+	mcs_fini();
+
+	free(line);
+	if (in != stdin)
+		fclose(in);
+
+	fprintf(stderr, "%s: loaded %lu values into %s, %lu errors\n", argv[0], loaded,
+		argv[optind], errors);
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,501 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Plays back a trace written by the record backend against any backend
+ * and reports throughput and latency per operation, next to the latency
+ * that was recorded.
+ *
+ * Several workers may replay the trace at once. They are processes, not
+ * threads: backends allocate from mowgli's heaps, which are not thread
+ * safe. Workers replay onto the same domains, so with backends which
+ * write back on close the last one wins.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "libmcs/mcs.h"
+
+#include "backends/record/record_format.h"
+
+typedef struct {
+	uint8_t op;
+	uint8_t response;
+	uint32_t handle;
+	uint32_t a;
+	uint32_t b;
+	uint32_t len;
+	uint64_t duration;
+} replay_op_t;
+
+static replay_op_t *ops;
+static size_t nops;
+static char **symbols;
+static size_t nsymbols;
+static uint32_t nhandles;
+static size_t max_len;
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+read_symbol(const unsigned char **p, const unsigned char *end, uint32_t *out)
+{
+	uint64_t id, len;
+	size_t n;
+
+	if ((n = record_get_varint(*p, end, &id)) == 0)
+		return 0;
+
+	*p += n;
+
+	if (id != 0)
+	{
+		if (id > nsymbols)
+			return 0;
+
+		*out = (uint32_t) id - 1;
+		return 1;
+	}
+
+	if ((n = record_get_varint(*p, end, &len)) == 0 || len > (uint64_t) (end - *p - n))
+		return 0;
+
+	*p += n;
+
+	symbols = realloc(symbols, (nsymbols + 1) * sizeof(char *));
+	symbols[nsymbols] = mcs_strndup((const char *) *p, len);
+	*out = nsymbols++;
+	*p += len;
+
+	return 1;
+}
+
+static int
+read_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+	size_t n = record_get_varint(*p, end, v);
+
+	*p += n;
+
+	return n != 0;
+}
+
+static int
+load_trace(const char *path)
+{
+	const unsigned char *p, *end;
+	unsigned char *data;
+	size_t alloc = 0;
+	struct stat st;
+	FILE *f;
+
+	if ((f = fopen(path, "rb")) == NULL || fstat(fileno(f), &st) < 0)
+	{
+		fprintf(stderr, "mcs-replay: cannot open `%s': %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	data = malloc(st.st_size + 1);
+
+	if (fread(data, 1, st.st_size, f) != (size_t) st.st_size ||
+	    st.st_size < RECORD_MAGIC_LEN || memcmp(data, RECORD_MAGIC, RECORD_MAGIC_LEN))
+	{
+		fprintf(stderr, "mcs-replay: `%s' is not an mcs trace\n", path);
+		fclose(f);
+		free(data);
+		return 0;
+	}
+
+	fclose(f);
+
+	p = data + RECORD_MAGIC_LEN;
+	end = data + st.st_size;
+
+	while (p < end)
+	{
+		replay_op_t op;
+		uint64_t v, handle;
+		int ok;
+
+		memset(&op, 0, sizeof op);
+		op.op = *p++;
+
+		/* the time since the previous record is not used */
+		ok = op.op < RECORD_OP_COUNT &&
+		     read_varint(&p, end, &v) &&
+		     read_varint(&p, end, &handle) &&
+		     read_varint(&p, end, &op.duration) &&
+		     p < end;
+
+		if (ok)
+		{
+			op.handle = handle;
+			op.response = *p++;
+
+			switch (op.op)
+			{
+			case RECORD_OPEN:
+				ok = read_symbol(&p, end, &op.a);
+				break;
+			case RECORD_GET_SECTIONS:
+				ok = read_varint(&p, end, &v);
+				break;
+			case RECORD_CLOSE:
+			case RECORD_COMMIT:
+				break;
+			case RECORD_GET_KEYS:
+				ok = read_symbol(&p, end, &op.a) && read_varint(&p, end, &v);
+				break;
+			case RECORD_GET_STRING:
+			case RECORD_SET_STRING:
+				ok = read_symbol(&p, end, &op.a) && read_symbol(&p, end, &op.b) &&
+				     read_varint(&p, end, &v);
+				op.len = v;
+				break;
+			default:
+				ok = read_symbol(&p, end, &op.a) && read_symbol(&p, end, &op.b);
+				break;
+			}
+		}
+
+		/* a trace cut short by a crash is still worth replaying */
+		if (!ok)
+		{
+			fprintf(stderr, "mcs-replay: `%s' is truncated after %lu records\n",
+				path, (unsigned long) nops);
+			break;
+		}
+
+		if (nops == alloc)
+		{
+			alloc = alloc ? alloc * 2 : 4096;
+			ops = realloc(ops, alloc * sizeof(replay_op_t));
+		}
+
+		if (op.handle >= nhandles)
+			nhandles = op.handle + 1;
+
+		if (op.len > max_len)
+			max_len = op.len;
+
+		ops[nops++] = op;
+	}
+
+	free(data);
+
+	return 1;
+}
+
+static void
+free_queue(mowgli_queue_t *q)
+{
+	mowgli_queue_t *n;
+
+	for (n = q; n != NULL; n = n->next)
+		free(n->data);
+
+	if (q != NULL)
+		mowgli_queue_destroy(q);
+}
+
+/*
+ * Replays the whole trace, storing the latency of each call in lat, or
+ * -1 for calls on handles which could not be opened.
+ */
+static double
+replay(const char *backend, float *lat)
+{
+	mcs_handle_t **handles = calloc(nhandles ? nhandles : 1, sizeof(mcs_handle_t *));
+	char *filler = malloc(max_len + 1);
+	double started = now_ns(), t0;
+	size_t i;
+
+	memset(filler, 'x', max_len);
+	filler[max_len] = '\0';
+
+	for (i = 0; i < nops; i++)
+	{
+		replay_op_t *op = &ops[i];
+		mcs_handle_t *h = handles[op->handle];
+		const char *a = symbols != NULL ? symbols[op->a] : NULL;
+		const char *b = symbols != NULL ? symbols[op->b] : NULL;
+		char *s;
+		int iv;
+		float fv;
+		double dv;
+
+		if (h == NULL && op->op != RECORD_OPEN)
+		{
+			lat[i] = -1;
+			continue;
+		}
+
+		t0 = now_ns();
+
+		switch (op->op)
+		{
+		case RECORD_OPEN:
+			if (h != NULL)
+				mowgli_object_unref(h);
+
+			handles[op->handle] = mcs_new_with_backend(backend, (char *) a);
+			break;
+		case RECORD_CLOSE:
+			mowgli_object_unref(h);
+			handles[op->handle] = NULL;
+			break;
+		case RECORD_GET_STRING:
+			if (mcs_get_string(h, a, b, &s))
+				free(s);
+			break;
+		case RECORD_GET_INT:
+			mcs_get_int(h, a, b, &iv);
+			break;
+		case RECORD_GET_BOOL:
+			mcs_get_bool(h, a, b, &iv);
+			break;
+		case RECORD_GET_FLOAT:
+			mcs_get_float(h, a, b, &fv);
+			break;
+		case RECORD_GET_DOUBLE:
+			mcs_get_double(h, a, b, &dv);
+			break;
+		case RECORD_SET_STRING:
+			mcs_set_string(h, a, b, filler + max_len - op->len);
+			break;
+		case RECORD_SET_INT:
+			mcs_set_int(h, a, b, 0);
+			break;
+		case RECORD_SET_BOOL:
+			mcs_set_bool(h, a, b, 0);
+			break;
+		case RECORD_SET_FLOAT:
+			mcs_set_float(h, a, b, 0);
+			break;
+		case RECORD_SET_DOUBLE:
+			mcs_set_double(h, a, b, 0);
+			break;
+		case RECORD_UNSET:
+			mcs_unset_key(h, a, b);
+			break;
+		case RECORD_GET_KEYS:
+			free_queue(mcs_get_keys(h, a));
+			break;
+		case RECORD_GET_SECTIONS:
+			free_queue(mcs_get_sections(h));
+			break;
+		case RECORD_COMMIT:
+			mcs_commit(h);
+			break;
+		}
+
+		lat[i] = now_ns() - t0;
+	}
+
+	t0 = now_ns() - started;
+
+	for (i = 0; i < nhandles; i++)
+	{
+		if (handles[i] != NULL)
+			mowgli_object_unref(handles[i]);
+	}
+
+	free(handles);
+	free(filler);
+
+	return t0;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(const float *lat, int workers, const double *elapsed)
+{
+	double *samples = malloc((nops * workers + 1) * sizeof(double));
+	double *recorded = malloc((nops + 1) * sizeof(double));
+	double wall = 0, total;
+	size_t replayed = 0, i, n, nrec;
+	int op, w;
+
+	for (w = 0; w < workers; w++)
+	{
+		if (elapsed[w] > wall)
+			wall = elapsed[w];
+	}
+
+	for (i = 0; i < nops * workers; i++)
+	{
+		if (lat[i] >= 0)
+			replayed++;
+	}
+
+	printf("%lu calls replayed by %d worker%s in %.3f s: %.0f calls/s\n\n",
+	       (unsigned long) replayed, workers, workers == 1 ? "" : "s",
+	       wall / 1e9, replayed / (wall / 1e9));
+
+	printf("%-14s %10s %10s %10s %10s %10s %10s %12s\n", "operation", "calls",
+	       "mean us", "p50 us", "p90 us", "p99 us", "max us", "recorded p50");
+
+	for (op = 0; op < RECORD_OP_COUNT; op++)
+	{
+		for (i = n = nrec = 0, total = 0; i < nops; i++)
+		{
+			if (ops[i].op != op)
+				continue;
+
+			recorded[nrec++] = ops[i].duration;
+
+			for (w = 0; w < workers; w++)
+			{
+				float l = lat[w * nops + i];
+
+				if (l >= 0)
+				{
+					samples[n++] = l;
+					total += l;
+				}
+			}
+		}
+
+		if (n == 0)
+			continue;
+
+		qsort(samples, n, sizeof(double), cmp_double);
+		qsort(recorded, nrec, sizeof(double), cmp_double);
+
+		printf("%-14s %10lu %10.2f %10.2f %10.2f %10.2f %10.2f %12.2f\n",
+		       record_op_names[op], (unsigned long) n, total / n / 1e3,
+		       samples[(n - 1) / 2] / 1e3, samples[(size_t) ((n - 1) * 0.9)] / 1e3,
+		       samples[(size_t) ((n - 1) * 0.99)] / 1e3, samples[n - 1] / 1e3,
+		       recorded[(nrec - 1) / 2] / 1e3);
+	}
+
+	free(samples);
+	free(recorded);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *backend = NULL;
+	float *lat;
+	double *elapsed;
+	size_t size;
+	int opt, workers = 1, w;
+
+	while ((opt = getopt(argc, argv, "b:j:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			backend = optarg;
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	if (optind != argc - 1 || workers < 1)
+	{
+		fprintf(stderr, "usage: %s [-b backend] [-j workers] trace\n", argv[0]);
+		return 1;
+	}
+
+	if (!load_trace(argv[optind]))
+		return 1;
+
+	mcs_init();
+
+	if (backend == NULL)
+		backend = mcs_backend_select();
+
+	/* the timings are written by the workers and read back here */
+	size = workers * sizeof(double) + nops * workers * sizeof(float);
+	elapsed = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (elapsed == MAP_FAILED)
+	{
+		perror("mcs-replay: mmap");
+		return 1;
+	}
+
+	lat = (float *) (elapsed + workers);
+
+	printf("replaying %lu calls on %u handles against the %s backend\n",
+	       (unsigned long) nops, nhandles, backend);
+	fflush(stdout);
+
+	if (workers == 1)
+		elapsed[0] = replay(backend, lat);
+	else
+	{
+		for (w = 0; w < workers; w++)
+		{
+			if (fork() == 0)
+			{
+				elapsed[w] = replay(backend, lat + w * nops);
+				_exit(0);
+			}
+		}
+
+		while (wait(NULL) > 0)
+			;
+	}
+
+	report(lat, workers, elapsed);
+
+	munmap(elapsed, size);
+	mcs_fini();
+
+	return 0;
+}
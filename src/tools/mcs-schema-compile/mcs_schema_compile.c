@@ -0,0 +1,499 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compiles a schema of settings into a C header declaring a struct with a
+ * field for each setting, and functions to load it with mcs_schema_load()
+ * and release it again.
+ *
+ * Each line of the schema describes one setting:
+ *
+ *   section key type [default [min max]]
+ *
+ * where type is one of string, int, bool, float or double. Fields may be
+ * quoted with double quotes, and # starts a comment.
+ */
+
+#include <ctype.h>
+
+#include "libmcs/mcs.h"
+
+typedef struct {
+	char *section;
+	char *key;
+	char *field;
+	mcs_schema_type_t type;
+	char *def;
+	int ranged;
+	double min;
+	double max;
+	int line;
+} schema_entry_t;
+
+static const char *type_names[] = { "string", "int", "bool", "float", "double" };
+static const char *type_enums[] = {
+	"MCS_SCHEMA_STRING", "MCS_SCHEMA_INT", "MCS_SCHEMA_BOOL",
+	"MCS_SCHEMA_FLOAT", "MCS_SCHEMA_DOUBLE"
+};
+static const char *type_ctypes[] = { "char *", "int ", "int ", "float ", "double " };
+
+static schema_entry_t *entries;
+static size_t nentries;
+static const char *progname;
+
+/*
+ * Splits a line into at most max words, honouring double quotes and
+ * backslash escapes inside them. Returns the number of words, or -1.
+ */
+static int
+split_line(char *line, char **words, int max)
+{
+	char *in = line, *out;
+	int n = 0;
+
+	for (;;)
+	{
+		while (isspace((unsigned char) *in))
+			in++;
+
+		if (*in == '\0' || *in == '#')
+			return n;
+
+		if (n == max)
+			return -1;
+
+		words[n++] = out = in;
+
+		if (*in == '"')
+		{
+			for (in++; *in != '"'; in++)
+			{
+				if (*in == '\0')
+					return -1;
+				if (*in == '\\' && in[1] != '\0')
+					in++;
+				*out++ = *in;
+			}
+			in++;
+		}
+		else
+		{
+			while (*in != '\0' && !isspace((unsigned char) *in))
+				*out++ = *in++;
+		}
+
+		if (*in != '\0' && !isspace((unsigned char) *in))
+			return -1;
+		if (*in != '\0')
+			in++;
+		*out = '\0';
+	}
+}
+
+static char *
+make_identifier(const char *section, const char *key)
+{
+	size_t len = strlen(section) + strlen(key) + 3;
+	char *out = malloc(len), *p;
+
+	snprintf(out, len, "%s%s_%s", isdigit((unsigned char) *section) ? "_" : "",
+		 section, key);
+
+	for (p = out; *p != '\0'; p++)
+	{
+		if (!isalnum((unsigned char) *p))
+			*p = '_';
+		else
+			*p = tolower((unsigned char) *p);
+	}
+
+	return out;
+}
+
+static int
+parse_number(const char *str, double *out)
+{
+	char *end;
+
+	*out = strtod(str, &end);
+
+	return end != str && *end == '\0';
+}
+
+/*
+ * Checks a default with mcs_schema_check(), so that it is held to exactly
+ * the rules the generated loader applies.
+ */
+static int
+check_default(schema_entry_t *e)
+{
+	mcs_schema_field_t f;
+
+	memset(&f, 0, sizeof f);
+	f.section = e->section;
+	f.key = e->key;
+	f.type = e->type;
+	f.ranged = e->ranged;
+	f.min = e->min;
+	f.max = e->max;
+
+	return mcs_schema_check(&f, e->def) == MCS_OK;
+}
+
+static int
+parse_schema(const char *path)
+{
+	FILE *f;
+	char line[4096];
+	int lineno = 0, errors = 0;
+
+	if ((f = fopen(path, "r")) == NULL)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		return 0;
+	}
+
+	while (fgets(line, sizeof line, f) != NULL)
+	{
+		char *words[6];
+		schema_entry_t *e;
+		int n, t;
+
+		lineno++;
+
+		if ((n = split_line(line, words, 6)) == 0)
+			continue;
+
+		if (n < 3 || n == 5 || n > 6)
+		{
+			fprintf(stderr, "%s:%d: expected section, key, type, default and range\n", path, lineno);
+			errors++;
+			continue;
+		}
+
+		for (t = 0; t <= MCS_SCHEMA_DOUBLE; t++)
+			if (!strcmp(words[2], type_names[t]))
+				break;
+
+		if (t > MCS_SCHEMA_DOUBLE)
+		{
+			fprintf(stderr, "%s:%d: unknown type `%s'\n", path, lineno, words[2]);
+			errors++;
+			continue;
+		}
+
+		entries = realloc(entries, (nentries + 1) * sizeof(schema_entry_t));
+		e = &entries[nentries++];
+		memset(e, 0, sizeof *e);
+
+		e->section = strdup(words[0]);
+		e->key = strdup(words[1]);
+		e->field = make_identifier(words[0], words[1]);
+		e->type = t;
+		e->def = n > 3 ? strdup(words[3]) : NULL;
+		e->line = lineno;
+
+		if (n == 6)
+		{
+			if (t == MCS_SCHEMA_STRING || t == MCS_SCHEMA_BOOL)
+			{
+				fprintf(stderr, "%s:%d: a %s cannot have a range\n", path, lineno, words[2]);
+				errors++;
+				continue;
+			}
+
+			if (!parse_number(words[4], &e->min) || !parse_number(words[5], &e->max) ||
+			    e->min > e->max)
+			{
+				fprintf(stderr, "%s:%d: invalid range %s to %s\n", path, lineno, words[4], words[5]);
+				errors++;
+				continue;
+			}
+
+			e->ranged = 1;
+		}
+
+		if (e->def != NULL && !check_default(e))
+		{
+			fprintf(stderr, "%s:%d: invalid default `%s' for %s/%s\n", path, lineno,
+				e->def, e->section, e->key);
+			errors++;
+		}
+	}
+
+	fclose(f);
+
+	return errors == 0;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const schema_entry_t *ea = a, *eb = b;
+	int ret;
+
+	if ((ret = strcmp(ea->section, eb->section)) != 0)
+		return ret;
+
+	return strcmp(ea->key, eb->key);
+}
+
+static int
+check_duplicates(const char *path)
+{
+	size_t i, j;
+	int errors = 0;
+
+	for (i = 1; i < nentries; i++)
+	{
+		if (!entry_cmp(&entries[i - 1], &entries[i]))
+		{
+			fprintf(stderr, "%s:%d: %s/%s is already defined on line %d\n", path,
+				entries[i].line, entries[i].section, entries[i].key, entries[i - 1].line);
+			errors++;
+		}
+	}
+
+	for (i = 0; i < nentries; i++)
+	{
+		for (j = i + 1; j < nentries; j++)
+		{
+			if (!strcmp(entries[i].field, entries[j].field) && entry_cmp(&entries[i], &entries[j]))
+			{
+				fprintf(stderr, "%s:%d: %s/%s and %s/%s both map to the field %s\n", path,
+					entries[j].line, entries[i].section, entries[i].key,
+					entries[j].section, entries[j].key, entries[j].field);
+				errors++;
+			}
+		}
+	}
+
+	return errors == 0;
+}
+
+static void
+put_cstring(FILE *out, const char *str)
+{
+	if (str == NULL)
+	{
+		fputs("NULL", out);
+		return;
+	}
+
+	fputc('"', out);
+
+	for (; *str != '\0'; str++)
+	{
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20 || c >= 0x7f || c == '?')
+			fprintf(out, "\\%03o", c);
+		else
+			fputc(c, out);
+	}
+
+	fputc('"', out);
+}
+
+static void
+put_double(FILE *out, double d)
+{
+	/* the tool never changes locale, so this is always in the C locale */
+	fprintf(out, "%.17g", d);
+}
+
+static void
+generate(FILE *out, const char *schema, const char *name)
+{
+	char *guard = strdup(name), *p;
+	size_t i;
+
+	for (p = guard; *p != '\0'; p++)
+		*p = toupper((unsigned char) *p);
+
+	fprintf(out, "/*\n * Generated by mcs-schema-compile from %s; do not edit.\n */\n\n", schema);
+	fprintf(out, "#ifndef %s_H\n#define %s_H\n\n", guard, guard);
+	fprintf(out, "#include <stddef.h>\n#include <libmcs/mcs.h>\n\n");
+
+	fprintf(out, "typedef struct {\n");
+	for (i = 0; i < nentries; i++)
+	{
+		schema_entry_t *e = &entries[i];
+
+		fprintf(out, "\t%s%s; /* %s/%s", type_ctypes[e->type], e->field, e->section, e->key);
+		if (e->ranged)
+		{
+			fputs(", ", out);
+			put_double(out, e->min);
+			fputs(" to ", out);
+			put_double(out, e->max);
+		}
+		fputs(" */\n", out);
+	}
+	fprintf(out, "} %s_t;\n\n", name);
+
+	fprintf(out, "static const mcs_schema_field_t %s_fields[] = {\n", name);
+	for (i = 0; i < nentries; i++)
+	{
+		schema_entry_t *e = &entries[i];
+
+		fputs("\t{ ", out);
+		put_cstring(out, e->section);
+		fputs(", ", out);
+		put_cstring(out, e->key);
+		fprintf(out, ", %s, offsetof(%s_t, %s), ", type_enums[e->type], name, e->field);
+		put_cstring(out, e->def);
+		fprintf(out, ", %d, ", e->ranged);
+		put_double(out, e->min);
+		fputs(", ", out);
+		put_double(out, e->max);
+		fputs(" },\n", out);
+	}
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "static inline mcs_response_t\n%s_load(mcs_handle_t *handle, %s_t *out)\n{\n", name, name);
+	fprintf(out, "\treturn mcs_schema_load(handle, %s_fields,\n", name);
+	fprintf(out, "\t\tsizeof %s_fields / sizeof %s_fields[0], out);\n}\n\n", name, name);
+
+	fprintf(out, "static inline void\n%s_free(%s_t *out)\n{\n", name, name);
+	fprintf(out, "\tmcs_schema_free(%s_fields,\n", name);
+	fprintf(out, "\t\tsizeof %s_fields / sizeof %s_fields[0], out);\n}\n\n", name, name);
+
+	fprintf(out, "#endif\n");
+
+	free(guard);
+}
+
+static char *
+default_name(const char *schema)
+{
+	const char *base = strrchr(schema, '/');
+	char *out, *p;
+
+	base = base != NULL ? base + 1 : schema;
+	out = malloc(strlen(base) + sizeof "_config");
+	strcpy(out, base);
+
+	if ((p = strchr(out, '.')) != NULL)
+		*p = '\0';
+	strcat(out, "_config");
+
+	for (p = out; *p != '\0'; p++)
+		if (!isalnum((unsigned char) *p))
+			*p = '_';
+
+	return out;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n name] [-o header] schema\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *output = NULL;
+	char *name = NULL;
+	FILE *out = stdout;
+	int opt, ok;
+	size_t i;
+
+	progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "n:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			name = strdup(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+	if (name == NULL)
+		name = default_name(argv[optind]);
+
+	mcs_init();
+
+	ok = parse_schema(argv[optind]);
+
+	if (ok)
+	{
+		qsort(entries, nentries, sizeof(schema_entry_t), entry_cmp);
+		ok = check_duplicates(argv[optind]);
+	}
+
+	if (ok && output != NULL && (out = fopen(output, "w")) == NULL)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, output, strerror(errno));
+		ok = 0;
+	}
+
+	if (ok)
+	{
+		generate(out, argv[optind], name);
+
+		if (out != stdout && fclose(out) != 0)
+		{
+			fprintf(stderr, "%s: %s: %s\n", progname, output, strerror(errno));
+			ok = 0;
+		}
+	}
+
+	for (i = 0; i < nentries; i++)
+	{
+		free(entries[i].section);
+		free(entries[i].key);
+		free(entries[i].field);
+		free(entries[i].def);
+	}
+
+	free(entries);
+	free(name);
+
+	mcs_fini();
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
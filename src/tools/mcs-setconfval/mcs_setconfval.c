@@ -30,24 +30,204 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/*
+ * Besides setting a single value, mcs-setconfval can apply a whole file
+ * of settings, one "section key value" per line, where the key may be
+ * written as key:type to store an int, bool, float or double. All of
+ * them are applied to one handle and written back in a single commit,
+ * instead of rewriting the domain once per value. Lines which cannot be
+ * applied are reported and the rest of the batch carries on.
+ */
+
 #include "libmcs/mcs.h"
 
+/*
+ * Applies one line, returning a description of the problem if there
+ * was one.
+ */
+static const char *
+apply(mcs_handle_t *h, char *line)
+{
+	char *section, *key, *type, *value, *end;
+	long lval;
+	double dval;
+
+	section = strtok(line, " \t");
+	key = strtok(NULL, " \t");
+	value = strtok(NULL, "");
+
+	if (key == NULL || value == NULL)
+		return "expected section, key and value";
+
+	value += strspn(value, " \t");
+
+	if ((type = strchr(key, ':')) != NULL)
+		*type++ = '\0';
+
+	if (type == NULL || !strcmp(type, "string"))
+		return mcs_set_string(h, section, key, value) == MCS_OK ?
+			NULL : "failed to set value";
+
+	if (!strcmp(type, "int"))
+	{
+		errno = 0;
+		lval = strtol(value, &end, 10);
+		if (end == value || *end != '\0' || errno != 0 ||
+		    lval < INT_MIN || lval > INT_MAX)
+			return "value is not an int";
+
+		return mcs_set_int(h, section, key, (int) lval) == MCS_OK ?
+			NULL : "failed to set value";
+	}
+
+	if (!strcmp(type, "bool"))
+	{
+		if (!strcasecmp(value, "true"))
+			lval = 1;
+		else if (!strcasecmp(value, "false"))
+			lval = 0;
+		else
+			return "value is not a bool";
+
+		return mcs_set_bool(h, section, key, (int) lval) == MCS_OK ?
+			NULL : "failed to set value";
+	}
+
+	if (!strcmp(type, "float") || !strcmp(type, "double"))
+	{
+		dval = strtod(value, &end);
+		if (end == value || *end != '\0')
+			return "value is not a number";
+
+		if (*type == 'f')
+			return mcs_set_float(h, section, key, (float) dval) == MCS_OK ?
+				NULL : "failed to set value";
+
+		return mcs_set_double(h, section, key, dval) == MCS_OK ?
+			NULL : "failed to set value";
+	}
+
+	return "unknown type";
+}
+
+static int
+apply_batch(const char *prog, const char *domain, const char *path, FILE *in)
+{
+	mcs_handle_t *h;
+	char *line = NULL;
+	const char *err;
+	size_t alloc = 0;
+	ssize_t len;
+	unsigned long lineno = 0, applied = 0, errors = 0;
+
+	h = mcs_new((char *) domain);
+
+	while ((len = getline(&line, &alloc, in)) >= 0)
+	{
+		lineno++;
+
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len > 0 && line[len - 1] == '\r')
+			line[--len] = '\0';
+
+		if (line[strspn(line, " \t")] == '\0' || line[strspn(line, " \t")] == '#')
+			continue;
+
+		if ((err = apply(h, line)) != NULL)
+		{
+			fprintf(stderr, "%s:%lu: %s\n", path, lineno, err);
+			errors++;
+			continue;
+		}
+
+		applied++;
+	}
+
+	if (ferror(in))
+	{
+		fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+		errors++;
+	}
+
+	if (applied > 0 && mcs_commit(h) != MCS_OK)
+	{
+		fprintf(stderr, "%s: failed to write back %s\n", prog, domain);
+		errors++;
+	}
+
+	mowgli_object_unref(h);
+	free(line);
+
+	fprintf(stderr, "%s: applied %lu values to %s, %lu errors\n", prog, applied,
+		domain, errors);
+
+	return errors ? 1 : 0;
+}
+
+static void
+usage(const char *prog)
+{
+	printf("usage: %s domain section keyname setting\n", prog);
+	printf("       %s -f file|- domain\n", prog);
+}
+
 int
 main(int argc, char *argv[])
 {
 	mcs_handle_t *h;
+	const char *batch = NULL;
+	FILE *in = stdin;
+	int ret, opt;
+
+	while ((opt = getopt(argc, argv, "f:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			batch = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (batch != NULL)
+	{
+		if (optind != argc - 1)
+		{
+			usage(argv[0]);
+			return -1;
+		}
+
+		if (strcmp(batch, "-") && (in = fopen(batch, "r")) == NULL)
+		{
+			fprintf(stderr, "%s: %s: %s\n", argv[0], batch, strerror(errno));
+			return 1;
+		}
+
+		mcs_init();
+		ret = apply_batch(argv[0], argv[optind], batch, in);
+		mcs_fini();
+
+		if (in != stdin)
+			fclose(in);
+
+		return ret;
+	}
 
-	if (argc < 5)
+	if (argc - optind < 4)
 	{
-		printf("usage: %s domain section keyname setting\n", argv[0]);
+		usage(argv[0]);
 		return -1;
 	}
 
 	mcs_init();
 
-	h = mcs_new(argv[1]);
-	mcs_set_string(h, argv[2], argv[3], argv[4]);
-	printf("%s/%s => %s\n", argv[2], argv[3], argv[4]);
+	h = mcs_new(argv[optind]);
+	mcs_set_string(h, argv[optind + 1], argv[optind + 2], argv[optind + 3]);
+	printf("%s/%s => %s\n", argv[optind + 1], argv[optind + 2], argv[optind + 3]);
 	mowgli_object_unref(h);
 
 	mcs_fini();
@@ -30,24 +30,421 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/*
+ * With no options, mcs-walk-config prints the sections and keys of one
+ * domain as a tree. With -o, it instead streams every value of the
+ * given domains, or with -a of every domain under the configuration
+ * root, as JSON Lines or tab-separated records. Domains are read through
+ * the library, so the values are those a program would see, from
+ * whichever backend MCS_BACKEND selects.
+ *
+ * Domains are shared out to several workers, which claim them one at a
+ * time. They are processes, not threads: libmcs and mowgli are not
+ * thread safe. A worker formats the records of a domain into a buffer
+ * of its own and writes it out whenever it grows past WALK_FLUSH, so
+ * memory use grows with neither the number nor the size of the domains.
+ * Workers take turns on the output a domain at a time, so the records of
+ * a domain come out together.
+ */
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
 #include "libmcs/mcs.h"
 
-int
-main(int argc, char *argv[])
+#define WALK_MAX_WORKERS	64
+#define WALK_FLUSH		65536
+
+typedef enum {
+	WALK_JSONL,
+	WALK_TSV
+} walk_format_t;
+
+typedef struct {
+	char *data;
+	size_t len, size;
+} walk_buf_t;
+
+typedef struct {
+	const char *domain;
+	walk_buf_t out;
+	int writing;		/* holds output_lock */
+	unsigned long values, errors;
+} walk_ctx_t;
+
+/* shared by the workers, and covered by claim_lock */
+typedef struct {
+	size_t next_domain;
+	unsigned long values, errors;
+} walk_shared_t;
+
+/* a lock between processes: a pipe holding one byte while it is free */
+typedef struct {
+	int fd[2];
+} walk_lock_t;
+
+static walk_format_t format = WALK_JSONL;
+static char **domains;
+static size_t ndomains;
+static walk_shared_t *shared;
+static walk_lock_t claim_lock, output_lock;
+
+static int
+walk_lock_init(walk_lock_t *l)
+{
+	char token = 0;
+
+	return pipe(l->fd) == 0 && write(l->fd[1], &token, 1) == 1;
+}
+
+static void
+walk_lock(walk_lock_t *l)
+{
+	char token;
+
+	while (read(l->fd[0], &token, 1) < 0 && errno == EINTR)
+		;
+}
+
+static void
+walk_unlock(walk_lock_t *l)
+{
+	char token = 0;
+
+	while (write(l->fd[1], &token, 1) < 0 && errno == EINTR)
+		;
+}
+
+static void
+buf_putc(walk_buf_t *b, char c)
+{
+	if (b->len == b->size)
+	{
+		b->size = b->size ? b->size * 2 : WALK_FLUSH * 2;
+		b->data = realloc(b->data, b->size);
+	}
+
+	b->data[b->len++] = c;
+}
+
+static void
+buf_puts(walk_buf_t *b, const char *str)
+{
+	for (; *str != '\0'; str++)
+		buf_putc(b, *str);
+}
+
+/*
+ * Writes out what a worker has formatted so far. The output is taken
+ * on the first write of a domain and kept until the domain is done.
+ */
+static void
+buf_flush(walk_ctx_t *w)
+{
+	walk_buf_t *b = &w->out;
+	size_t off = 0;
+	ssize_t n;
+
+	if (b->len == 0)
+		return;
+
+	if (!w->writing)
+	{
+		walk_lock(&output_lock);
+		w->writing = 1;
+	}
+
+	while (off < b->len)
+	{
+		if ((n = write(STDOUT_FILENO, b->data + off, b->len - off)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			perror("mcs-walk-config: write");
+			w->errors++;
+			break;
+		}
+
+		off += n;
+	}
+
+	b->len = 0;
+}
+
+/*
+ * Writes a field quoted for the output format: as a JSON string, or
+ * escaped as mcs-dump escapes it.
+ */
+static void
+buf_field(walk_buf_t *b, const char *str, size_t len)
+{
+	char hex[8];
+	size_t i;
+
+	if (format == WALK_JSONL)
+		buf_putc(b, '"');
+
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c = str[i];
+
+		switch (c)
+		{
+		case '\\':
+			buf_puts(b, "\\\\");
+			break;
+		case '\t':
+			buf_puts(b, "\\t");
+			break;
+		case '\r':
+			buf_puts(b, "\\r");
+			break;
+		case '\n':
+			buf_puts(b, "\\n");
+			break;
+		case '"':
+			buf_puts(b, format == WALK_JSONL ? "\\\"" : "\"");
+			break;
+		default:
+			if (c < 0x20 && format == WALK_JSONL)
+			{
+				snprintf(hex, sizeof hex, "\\u%04x", c);
+				buf_puts(b, hex);
+			}
+			else
+				buf_putc(b, c);
+			break;
+		}
+	}
+
+	if (format == WALK_JSONL)
+		buf_putc(b, '"');
+}
+
+static int
+walk_value_cb(const char *section, const char *key, const char *value,
+	      void *ctx)
+{
+	walk_ctx_t *w = ctx;
+	walk_buf_t *b = &w->out;
+
+	if (format == WALK_JSONL)
+	{
+		buf_puts(b, "{\"domain\":");
+		buf_field(b, w->domain, strlen(w->domain));
+		buf_puts(b, ",\"section\":");
+		buf_field(b, section, strlen(section));
+		buf_puts(b, ",\"key\":");
+		buf_field(b, key, strlen(key));
+		buf_puts(b, ",\"value\":");
+		buf_field(b, value, strlen(value));
+		buf_puts(b, "}\n");
+	}
+	else
+	{
+		buf_field(b, w->domain, strlen(w->domain));
+		buf_putc(b, '\t');
+		buf_field(b, section, strlen(section));
+		buf_putc(b, '\t');
+		buf_field(b, key, strlen(key));
+		buf_putc(b, '\t');
+		buf_field(b, value, strlen(value));
+		buf_putc(b, '\n');
+	}
+
+	w->values++;
+
+	if (b->len >= WALK_FLUSH)
+		buf_flush(w);
+
+	return 0;
+}
+
+/*
+ * Returns non-zero if a directory under the configuration root holds a
+ * domain, that is a config file, or a config.d directory or config.*
+ * file of some other backend. Opening a handle would create it instead.
+ */
+static int
+domain_exists(const char *domain)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	DIR *dir;
+	int found = 0;
+
+	mcs_domain_path(path, sizeof path, domain, NULL);
+
+	if ((dir = opendir(path)) == NULL)
+		return 0;
+
+	while (!found && (ent = readdir(dir)) != NULL)
+		found = !strcmp(ent->d_name, "config") || !strncmp(ent->d_name, "config.", 7);
+
+	closedir(dir);
+
+	return found;
+}
+
+static void
+walk_domain(walk_ctx_t *w, const char *domain)
 {
 	mcs_handle_t *h;
-	mowgli_queue_t *groups, *i;
-	int entries = 0, sections = 0, avgentries = 0;
 
-	if (argc < 2)
+	w->domain = domain;
+
+	if (!domain_exists(domain))
 	{
-		printf("usage: %s domain\n", argv[0]);
-		return -1;
+		fprintf(stderr, "%s: no such domain\n", domain);
+		w->errors++;
+		return;
+	}
+
+	if ((h = mcs_new((char *) domain)) == NULL)
+	{
+		fprintf(stderr, "%s: cannot open the domain\n", domain);
+		w->errors++;
+		return;
+	}
+
+	mcs_iterate(h, NULL, walk_value_cb, w);
+	mowgli_object_unref(h);
+}
+
+static void
+walk_worker(void)
+{
+	walk_ctx_t w;
+	size_t i;
+
+	memset(&w, 0, sizeof w);
+
+	for (;;)
+	{
+		walk_lock(&claim_lock);
+
+		shared->values += w.values;
+		shared->errors += w.errors;
+		w.values = w.errors = 0;
+
+		i = shared->next_domain++;
+
+		walk_unlock(&claim_lock);
+
+		if (i >= ndomains)
+			break;
+
+		walk_domain(&w, domains[i]);
+		buf_flush(&w);
+
+		if (w.writing)
+		{
+			walk_unlock(&output_lock);
+			w.writing = 0;
+		}
+	}
+
+	free(w.out.data);
+}
+
+static int
+walk_parallel(int workers)
+{
+	int i, started = 0;
+
+	shared = mmap(NULL, sizeof(walk_shared_t), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (shared == MAP_FAILED)
+	{
+		perror("mcs-walk-config: mmap");
+		return 0;
+	}
+
+	if (!walk_lock_init(&claim_lock) || !walk_lock_init(&output_lock))
+	{
+		perror("mcs-walk-config: pipe");
+		return 0;
+	}
+
+	if (workers > (int) ndomains)
+		workers = (int) ndomains;
+
+	for (i = 0; workers > 1 && i < workers; i++)
+	{
+		pid_t pid = fork();
+
+		if (pid == 0)
+		{
+			walk_worker();
+			_exit(0);
+		}
+
+		if (pid > 0)
+			started++;
+	}
+
+	if (started == 0)
+		walk_worker();
+
+	while (wait(NULL) > 0)
+		;
+
+	return 1;
+}
+
+static void
+add_domain(const char *name)
+{
+	if ((ndomains & (ndomains - 1)) == 0)
+		domains = realloc(domains, (ndomains ? ndomains * 2 : 16) * sizeof(char *));
+
+	domains[ndomains++] = strdup(name);
+}
+
+/*
+ * Finds every domain under the configuration root.
+ */
+static int
+find_domains(void)
+{
+	char root[PATH_MAX];
+	struct dirent *ent;
+	DIR *dir;
+
+	mcs_domain_path(root, sizeof root, "", NULL);
+
+	if ((dir = opendir(root)) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", root, strerror(errno));
+		return 0;
+	}
+
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (ent->d_name[0] == '.')
+			continue;
+
+		if (domain_exists(ent->d_name))
+			add_domain(ent->d_name);
 	}
 
+	closedir(dir);
+
+	return 1;
+}
+
+static int
+walk_tree(const char *domain)
+{
+	mcs_handle_t *h;
+	mowgli_queue_t *groups, *i;
+	int entries = 0, sections = 0, avgentries = 0;
+
 	mcs_init();
 
-	h = mcs_new(argv[1]);
+	h = mcs_new((char *) domain);
 	groups = mcs_get_sections(h);
 
 	for (i = groups; i != NULL; i = i->next)
@@ -81,3 +478,92 @@ main(int argc, char *argv[])
 
 	return 0;
 }
+
+static void
+usage(const char *prog)
+{
+	printf("usage: %s domain\n", prog);
+	printf("       %s [-j workers] -o jsonl|tsv domain...\n", prog);
+	printf("       %s [-j workers] [-o jsonl|tsv] -a\n", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *output = NULL;
+	int all = 0, opt, i;
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "aj:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'a':
+			all = 1;
+			break;
+		case 'j':
+			workers = atol(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (!all && output == NULL)
+	{
+		if (optind != argc - 1)
+		{
+			usage(argv[0]);
+			return -1;
+		}
+
+		return walk_tree(argv[optind]);
+	}
+
+	if (output == NULL || !strcmp(output, "jsonl"))
+		format = WALK_JSONL;
+	else if (!strcmp(output, "tsv"))
+		format = WALK_TSV;
+	else
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (all ? optind != argc : optind == argc)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (workers < 1)
+		workers = 1;
+	if (workers > WALK_MAX_WORKERS)
+		workers = WALK_MAX_WORKERS;
+
+	if (all && !find_domains())
+		return 1;
+
+	for (i = optind; i < argc; i++)
+		add_domain(argv[i]);
+
+	mcs_init();
+
+	if (!walk_parallel((int) workers))
+		return 1;
+
+	mcs_fini();
+
+	fprintf(stderr, "%s: %lu values in %lu domains, %lu errors\n", argv[0],
+		shared->values, (unsigned long) ndomains, shared->errors);
+
+	for (i = 0; i < (int) ndomains; i++)
+		free(domains[i]);
+	free(domains);
+
+	return shared->errors ? 1 : 0;
+}
@@ -0,0 +1,563 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * mcsd keeps one open mcs.handle per domain on behalf of any number of
+ * clients using the daemon backend, so that the configuration is parsed
+ * once rather than by every program which reads it. Changes made by one
+ * client are pushed to the others as invalidations, and a domain is
+ * committed whenever its last client disconnects or asks for it.
+ */
+
+#include "libmcs/mcs.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "backends/daemon/mcsd_proto.h"
+
+typedef struct {
+	char *name;
+	mcs_handle_t *handle;
+	int clients;
+	int dirty;
+} domain_t;
+
+typedef struct {
+	int fd;
+	mcsd_buf_t in;
+	mcsd_buf_t out;
+	domain_t *domain;
+	int subscribed;
+	int dead;
+} client_t;
+
+static const char *backend = "default";
+static mowgli_patricia_t *domains;
+static client_t **clients;
+static size_t nclients;
+static volatile sig_atomic_t quitting;
+
+static void nocanon(char *str) {}
+
+static void
+quit_handler(int sig)
+{
+	quitting = 1;
+}
+
+/* a domain which failed to commit stays dirty, to be retried */
+static mcs_response_t
+domain_commit(domain_t *d)
+{
+	if (!d->dirty)
+		return MCS_OK;
+
+	if (mcs_commit(d->handle) != MCS_OK)
+	{
+		fprintf(stderr, "mcsd: failed to commit domain `%s'\n", d->name);
+		return MCS_FAIL;
+	}
+
+	d->dirty = 0;
+
+	return MCS_OK;
+}
+
+static void
+domain_free_cb(const char *key, void *data, void *privdata)
+{
+	domain_t *d = data;
+
+	domain_commit(d);
+	mowgli_object_unref(d->handle);
+	free(d->name);
+	free(d);
+}
+
+static domain_t *
+domain_open(const char *name)
+{
+	domain_t *d;
+	mcs_handle_t *h;
+
+	if ((d = mowgli_patricia_retrieve(domains, name)) != NULL)
+		return d;
+
+	if ((h = mcs_new_with_backend(backend, (char *) name)) == NULL)
+		return NULL;
+
+	d = calloc(sizeof(domain_t), 1);
+	d->name = strdup(name);
+	d->handle = h;
+	mowgli_patricia_add(domains, name, d);
+
+	return d;
+}
+
+/*
+ * Queues an invalidation for every other subscriber of the domain.
+ */
+static void
+domain_invalidate(domain_t *d, client_t *origin, const char *section,
+		  const char *key)
+{
+	size_t i, start;
+
+	for (i = 0; i < nclients; i++)
+	{
+		client_t *c = clients[i];
+
+		if (c == origin || c->domain != d || !c->subscribed || c->dead)
+			continue;
+
+		start = mcsd_frame_begin(&c->out, 0, MCSD_STATUS_INVALIDATE);
+		mcsd_putstr(&c->out, section);
+		mcsd_putstr(&c->out, key);
+		mcsd_frame_end(&c->out, start);
+	}
+}
+
+static void
+client_add(int fd)
+{
+	client_t *c = calloc(sizeof(client_t), 1);
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c->fd = fd;
+
+	clients = realloc(clients, (nclients + 1) * sizeof(client_t *));
+	clients[nclients++] = c;
+}
+
+static void
+client_free(client_t *c)
+{
+	if (c->domain != NULL && --c->domain->clients == 0)
+		domain_commit(c->domain);
+
+	close(c->fd);
+	free(c->in.data);
+	free(c->out.data);
+	free(c);
+}
+
+static void
+client_flush(client_t *c)
+{
+	while (c->out.len > 0)
+	{
+		ssize_t n = send(c->fd, c->out.data, c->out.len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		if (n <= 0)
+		{
+			c->dead = 1;
+			return;
+		}
+
+		mcsd_buf_consume(&c->out, n);
+	}
+}
+
+static void
+reply_list(client_t *c, mowgli_queue_t *list)
+{
+	mowgli_queue_t *n;
+	uint32_t count = 0;
+	size_t at;
+
+	at = c->out.len;
+	mcsd_put32(&c->out, 0);
+
+	for (n = list; n != NULL; n = n->next, count++)
+	{
+		mcsd_putstr(&c->out, n->data);
+		free(n->data);
+	}
+
+	memcpy(c->out.data + at, &count, 4);
+
+	if (list != NULL)
+		mowgli_queue_destroy(list);
+}
+
+/*
+ * Handles one request frame and queues its reply.
+ */
+static void
+client_request(client_t *c, const unsigned char *frame, size_t len)
+{
+	domain_t *d = c->domain;
+	mcsd_reader_t r;
+	const char *section, *key, *value;
+	mcs_response_t ret = MCS_FAIL;
+	size_t start, at;
+	uint32_t seq, n, i;
+	uint8_t op, flag;
+	char *str;
+
+	mcsd_reader_init(&r, frame, len, &seq, &op);
+	start = mcsd_frame_begin(&c->out, seq, MCSD_STATUS_OK);
+	at = c->out.len;
+
+	if (op != MCSD_OP_OPEN && d == NULL)
+		goto out;
+
+	switch (op)
+	{
+	case MCSD_OP_OPEN:
+		if (d != NULL || !mcsd_getstr(&r, &value) || !mcsd_get8(&r, &flag))
+			break;
+
+		if ((c->domain = domain_open(value)) == NULL)
+			break;
+
+		c->domain->clients++;
+		c->subscribed = flag;
+		ret = MCS_OK;
+		break;
+
+	case MCSD_OP_GET:
+		if (!mcsd_getstr(&r, &section) || !mcsd_getstr(&r, &key))
+			break;
+
+		if ((ret = mcs_get_string(d->handle, section, key, &str)) == MCS_OK)
+		{
+			mcsd_putstr(&c->out, str);
+			free(str);
+		}
+		break;
+
+	case MCSD_OP_MGET:
+		if (!mcsd_get32(&r, &n))
+			break;
+
+		mcsd_put32(&c->out, n);
+
+		for (i = 0; i < n; i++)
+		{
+			if (!mcsd_getstr(&r, &section) || !mcsd_getstr(&r, &key))
+				break;
+
+			if (mcs_get_string(d->handle, section, key, &str) == MCS_OK)
+			{
+				mcsd_put8(&c->out, 1);
+				mcsd_putstr(&c->out, str);
+				free(str);
+			}
+			else
+				mcsd_put8(&c->out, 0);
+		}
+
+		ret = i == n ? MCS_OK : MCS_FAIL;
+		break;
+
+	case MCSD_OP_SET:
+		if (!mcsd_getstr(&r, &section) || !mcsd_getstr(&r, &key) ||
+		    !mcsd_getstr(&r, &value))
+			break;
+
+		if ((ret = mcs_set_string(d->handle, section, key, value)) == MCS_OK)
+		{
+			d->dirty = 1;
+			domain_invalidate(d, c, section, key);
+		}
+		break;
+
+	case MCSD_OP_UNSET:
+		if (!mcsd_getstr(&r, &section) || !mcsd_getstr(&r, &key))
+			break;
+
+		if ((ret = mcs_unset_key(d->handle, section, key)) == MCS_OK)
+		{
+			d->dirty = 1;
+			domain_invalidate(d, c, section, key);
+		}
+		break;
+
+	case MCSD_OP_KEYS:
+		if (!mcsd_getstr(&r, &section))
+			break;
+
+		reply_list(c, mcs_get_keys(d->handle, section));
+		ret = MCS_OK;
+		break;
+
+	case MCSD_OP_SECTIONS:
+		reply_list(c, mcs_get_sections(d->handle));
+		ret = MCS_OK;
+		break;
+
+	case MCSD_OP_COMMIT:
+		d->dirty = 1;
+		ret = domain_commit(d);
+		break;
+	}
+
+out:
+	if (ret != MCS_OK)
+	{
+		c->out.len = at;
+		c->out.data[start + 8] = MCSD_STATUS_FAIL;
+	}
+
+	mcsd_frame_end(&c->out, start);
+}
+
+static void
+client_read(client_t *c)
+{
+	long flen;
+	ssize_t n;
+
+	mcsd_buf_reserve(&c->in, 65536);
+
+	do {
+		n = recv(c->fd, c->in.data + c->in.len, c->in.alloc - c->in.len, MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	if (n <= 0)
+	{
+		c->dead = 1;
+		return;
+	}
+
+	c->in.len += n;
+
+	/* everything already received is answered with a single send */
+	while ((flen = mcsd_frame_complete(&c->in)) > 0)
+	{
+		client_request(c, c->in.data, flen);
+		mcsd_buf_consume(&c->in, flen);
+	}
+
+	if (flen < 0)
+		c->dead = 1;
+}
+
+static int
+backend_exists(const char *name)
+{
+	mowgli_queue_t *l, *n;
+	int found = 0;
+
+	l = mcs_backend_get_list();
+
+	for (n = l; n != NULL; n = n->next)
+	{
+		if (!strcasecmp(((mcs_backend_t *) n->data)->name, name))
+			found = 1;
+	}
+
+	if (l != NULL)
+		mowgli_queue_destroy(l);
+
+	return found;
+}
+
+static int
+listen_on(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+
+	if (mcs_strlcpy(sun.sun_path, path, sizeof sun.sun_path) >= sizeof sun.sun_path)
+	{
+		fprintf(stderr, "mcsd: socket path `%s' is too long\n", path);
+		return -1;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	/* a socket nobody answers on is left over from a previous run */
+	if (connect(fd, (struct sockaddr *) &sun, sizeof sun) == 0)
+	{
+		fprintf(stderr, "mcsd: already running on `%s'\n", path);
+		close(fd);
+		return -1;
+	}
+
+	unlink(path);
+	umask(077);
+
+	if (bind(fd, (struct sockaddr *) &sun, sizeof sun) < 0 || listen(fd, 64) < 0)
+	{
+		fprintf(stderr, "mcsd: cannot listen on `%s': %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[PATH_MAX];
+	struct pollfd *pfd = NULL;
+	struct sigaction sa;
+	size_t i, j;
+	int lfd, opt;
+
+	mcsd_socket_path(path, sizeof path);
+
+	while ((opt = getopt(argc, argv, "b:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			backend = optarg;
+			break;
+		case 's':
+			mcs_strlcpy(path, optarg, sizeof path);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b backend] [-s socket]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* serving a domain through ourselves would never finish */
+	if (!strcasecmp(backend, "daemon"))
+	{
+		fprintf(stderr, "%s: cannot serve the daemon backend\n", argv[0]);
+		return 1;
+	}
+
+	mcs_init();
+
+	if (!backend_exists(backend))
+	{
+		fprintf(stderr, "%s: unknown backend `%s'\n", argv[0], backend);
+		mcs_fini();
+		return 1;
+	}
+
+	if ((lfd = listen_on(path)) < 0)
+	{
+		mcs_fini();
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = quit_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	domains = mowgli_patricia_create(nocanon);
+
+	while (!quitting)
+	{
+		pfd = realloc(pfd, (nclients + 1) * sizeof(struct pollfd));
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+
+		for (i = 0; i < nclients; i++)
+		{
+			pfd[i + 1].fd = clients[i]->fd;
+			pfd[i + 1].events = POLLIN | (clients[i]->out.len ? POLLOUT : 0);
+		}
+
+		if (poll(pfd, nclients + 1, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			perror("mcsd: poll");
+			break;
+		}
+
+		for (i = 0; i < nclients; i++)
+		{
+			if (pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read(clients[i]);
+		}
+
+		/* replies and any invalidations they caused */
+		for (i = 0; i < nclients; i++)
+		{
+			if (!clients[i]->dead)
+				client_flush(clients[i]);
+		}
+
+		for (i = j = 0; i < nclients; i++)
+		{
+			if (clients[i]->dead)
+				client_free(clients[i]);
+			else
+				clients[j++] = clients[i];
+		}
+
+		nclients = j;
+
+		if (pfd[0].revents & POLLIN)
+		{
+			int fd;
+
+			while ((fd = accept(lfd, NULL, NULL)) >= 0)
+				client_add(fd);
+		}
+	}
+
+	for (i = 0; i < nclients; i++)
+		client_free(clients[i]);
+
+	free(clients);
+	free(pfd);
+	close(lfd);
+	unlink(path);
+
+	mowgli_patricia_destroy(domains, domain_free_cb, NULL);
+	mcs_fini();
+
+	return 0;
+}
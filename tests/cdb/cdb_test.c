@@ -0,0 +1,328 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Exercises the cdb backend: compiling a domain and reading it back,
+ * refusing damaged databases, and frozen handles, which serve the same
+ * images built in memory. run-tests.sh runs it in a fresh configuration
+ * root.
+ */
+
+#include <stdint.h>
+
+#include "libmcs/mcs.h"
+
+#define DOMAIN		"cdb-test"
+
+/* offsets into the file, see the layout in src/backends/cdb/cdb.c */
+#define HDR_RECORDS_OFF		32
+#define RECORD_KEY		12
+
+static int failures;
+
+#define check(cond)							\
+	do {								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			failures++;					\
+		}							\
+	} while (0)
+
+static char path[PATH_MAX];
+
+/* returns 1 if section/key currently reads as value, NULL for unset */
+static int
+reads_as(mcs_handle_t *h, const char *section, const char *key, const char *value)
+{
+	char *got;
+	int ret;
+
+	if (mcs_get_string(h, section, key, &got) != MCS_OK)
+		return value == NULL;
+
+	ret = value != NULL && !strcmp(got, value);
+	free(got);
+
+	return ret;
+}
+
+/* consumes q */
+static int
+queue_length(mowgli_queue_t *q)
+{
+	mowgli_queue_t *n;
+	int len = 0;
+
+	for (n = q; n != NULL; n = n->next)
+	{
+		free(n->data);
+		len++;
+	}
+
+	mowgli_queue_destroy(q);
+
+	return len;
+}
+
+static int
+count_cb(const char *section, const char *key, const char *value, void *privdata)
+{
+	return ++*(int *) privdata == 10;
+}
+
+static void
+fill(mcs_handle_t *h)
+{
+	char section[32], key[32];
+	int i;
+
+	for (i = 0; i < 1000; i++)
+	{
+		sprintf(section, "section%d", i % 10);
+		sprintf(key, "key%d", i);
+		mcs_set_int(h, section, key, i);
+	}
+
+	mcs_set_string(h, "types", "string", "hello");
+	mcs_set_bool(h, "types", "bool", 1);
+	mcs_set_double(h, "types", "double", 2.5);
+}
+
+static void
+check_contents(mcs_handle_t *h)
+{
+	char *str = NULL;
+	double d;
+	float f;
+	int i, n, b, bad = 0, seen = 0;
+
+	for (i = 0; i < 1000; i++)
+	{
+		char section[32], key[32];
+
+		sprintf(section, "section%d", i % 10);
+		sprintf(key, "key%d", i);
+
+		bad += mcs_get_int(h, section, key, &n) != MCS_OK || n != i;
+		bad += mcs_get_string(h, section, key, &str) != MCS_OK || atoi(str) != i;
+		if (str != NULL)
+			free(str);
+		str = NULL;
+	}
+	check(bad == 0);
+
+	check(reads_as(h, "types", "string", "hello"));
+	check(mcs_get_bool(h, "types", "bool", &b) == MCS_OK && b == 1);
+	check(mcs_get_double(h, "types", "double", &d) == MCS_OK && d == 2.5);
+	check(mcs_get_float(h, "types", "double", &f) == MCS_OK && f == 2.5f);
+	check(reads_as(h, "types", "missing", NULL));
+	check(reads_as(h, "missing", "string", NULL));
+
+	check(queue_length(mcs_get_sections(h)) == 11);
+	check(queue_length(mcs_get_keys(h, "section3")) == 100);
+	check(mcs_get_keys(h, "missing") == NULL);
+
+	/* a non-zero return stops the walk */
+	check(mcs_iterate(h, NULL, count_cb, &seen) == MCS_OK && seen == 10);
+	check(mcs_iterate(h, "missing", count_cb, &seen) == MCS_FAIL);
+}
+
+static void
+compile(void)
+{
+	mcs_handle_t *src = mcs_new_with_backend("memory", DOMAIN);
+
+	fill(src);
+	check(mcs_cdb_compile(src, path) == MCS_OK);
+	mcs_destroy(src);
+}
+
+/* patches a 32-bit field at offset off, relative to a 64-bit offset at base */
+static void
+patch(long base, long off, uint32_t value)
+{
+	FILE *f = fopen(path, "r+b");
+	uint64_t table = 0;
+
+	check(f != NULL);
+	if (f == NULL)
+		return;
+
+	if (base >= 0)
+	{
+		fseek(f, base, SEEK_SET);
+		check(fread(&table, sizeof table, 1, f) == 1);
+	}
+
+	fseek(f, (long) table + off, SEEK_SET);
+	check(fwrite(&value, sizeof value, 1, f) == 1);
+	fclose(f);
+}
+
+static void
+check_rejected(const char *what)
+{
+	mcs_handle_t *h = mcs_new_with_backend("cdb", DOMAIN);
+
+	if (!reads_as(h, "types", "string", NULL) ||
+	    mcs_get_sections(h) != NULL)
+	{
+		fprintf(stderr, "damaged database accepted: %s\n", what);
+		failures++;
+	}
+
+	mcs_destroy(h);
+}
+
+static void
+test_compile(void)
+{
+	mcs_handle_t *h, *empty;
+
+	compile();
+
+	h = mcs_new_with_backend("cdb", DOMAIN);
+	check_contents(h);
+	check(mcs_set_string(h, "types", "string", "changed") == MCS_FAIL);
+	check(mcs_unset_key(h, "types", "string") == MCS_FAIL);
+	check(reads_as(h, "types", "string", "hello"));
+	mcs_destroy(h);
+
+	/* an empty domain compiles to a valid, empty database */
+	empty = mcs_new_with_backend("memory", DOMAIN);
+	check(mcs_cdb_compile(empty, path) == MCS_OK);
+	mcs_destroy(empty);
+
+	h = mcs_new_with_backend("cdb", DOMAIN);
+	check(reads_as(h, "types", "string", NULL));
+	check(mcs_get_sections(h) == NULL);
+	mcs_destroy(h);
+}
+
+static void
+test_damaged(void)
+{
+	FILE *f;
+	long len = 0;
+
+	compile();
+	patch(-1, 0, 0x12345678);
+	check_rejected("bad magic");
+
+	compile();
+	patch(HDR_RECORDS_OFF, RECORD_KEY, 0x7fffffff);
+	check_rejected("key outside the string table");
+
+	/* the string table is last, so its final NUL ends the file */
+	compile();
+	f = fopen(path, "r+b");
+	check(f != NULL && fseek(f, -1, SEEK_END) == 0 && fputc('x', f) == 'x');
+	fclose(f);
+	check_rejected("unterminated string table");
+
+	compile();
+	f = fopen(path, "r+b");
+	check(f != NULL && fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0);
+	fclose(f);
+	check(truncate(path, len / 2) == 0);
+	check_rejected("truncated");
+}
+
+static void
+test_freeze(void)
+{
+	mcs_handle_t *h = mcs_new_with_backend("default", DOMAIN), *w;
+
+	fill(h);
+	check(mcs_commit(h) == MCS_OK);
+
+	check(mcs_freeze(h) == MCS_OK);
+	check(mcs_handle_is_frozen(h));
+	check_contents(h);
+
+	/* a refresh which finds nothing new keeps the image */
+	check(mcs_refresh(h) == MCS_OK);
+	check(mcs_handle_is_frozen(h));
+
+	/* a write thaws the handle, without losing anything */
+	check(mcs_set_string(h, "types", "string", "thawed") == MCS_OK);
+	check(!mcs_handle_is_frozen(h));
+	check(reads_as(h, "types", "string", "thawed"));
+	check(mcs_set_string(h, "types", "string", "hello") == MCS_OK);
+	check_contents(h);
+
+	/* so does a refresh which picks up another writer's change */
+	check(mcs_commit(h) == MCS_OK);
+	check(mcs_freeze(h) == MCS_OK);
+
+	w = mcs_new_with_backend("default", DOMAIN);
+	check(mcs_set_string(w, "other", "key", "value") == MCS_OK);
+	check(mcs_commit(w) == MCS_OK);
+	mcs_destroy(w);
+
+	check(mcs_refresh(h) == MCS_OK);
+	check(!mcs_handle_is_frozen(h));
+	check(reads_as(h, "other", "key", "value"));
+
+	/* an empty handle freezes too */
+	w = mcs_new_with_backend("memory", NULL);
+	check(mcs_freeze(w) == MCS_OK);
+	check(reads_as(w, "a", "b", NULL));
+	check(mcs_set_string(w, "a", "b", "c") == MCS_OK);
+	check(reads_as(w, "a", "b", "c"));
+	mcs_destroy(w);
+
+	mcs_destroy(h);
+}
+
+int
+main(int argc, char *argv[])
+{
+	mcs_init();
+
+	mcs_domain_path(path, sizeof path, DOMAIN, NULL);
+	mkdir(path, 0755);
+	mcs_domain_path(path, sizeof path, DOMAIN, "config.cdb");
+
+	test_compile();
+	test_damaged();
+	unlink(path);
+	test_freeze();
+
+	mcs_fini();
+
+	printf("cdb: %s\n", failures ? "FAILED" : "ok");
+
+	return failures != 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Exercises the daemon backend against a running mcsd, which
+ * run-daemon-test.sh starts on a private socket. Two handles on the same
+ * domain stand in for two programs.
+ *
+ * With "rw", mcsd serves a writable backend: values written through one
+ * handle must reach the other, including through its cache. With "ro",
+ * mcsd serves the read-only cdb backend, so every write is rejected and
+ * must not show up in the writer's own cache either.
+ */
+
+#include "libmcs/mcs.h"
+
+#define DOMAIN		"mcsd-test"
+
+static int failures;
+
+#define check(cond)							\
+	do {								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			failures++;					\
+		}							\
+	} while (0)
+
+/* returns 1 if section/key currently reads as value, NULL for unset */
+static int
+reads_as(mcs_handle_t *h, const char *section, const char *key, const char *value)
+{
+	char *got;
+	int ret;
+
+	if (mcs_get_string(h, section, key, &got) != MCS_OK)
+		return value == NULL;
+
+	ret = value != NULL && !strcmp(got, value);
+	free(got);
+
+	return ret;
+}
+
+/* invalidations are pushed asynchronously, so give them a moment */
+static int
+eventually_reads_as(mcs_handle_t *h, const char *section, const char *key,
+		    const char *value)
+{
+	int i;
+
+	for (i = 0; i < 100; i++)
+	{
+		if (reads_as(h, section, key, value))
+			return 1;
+
+		usleep(10000);
+	}
+
+	return 0;
+}
+
+/* consumes q */
+static int
+queue_contains(mowgli_queue_t *q, const char *name)
+{
+	mowgli_queue_t *n;
+	int found = 0;
+
+	for (n = q; n != NULL; n = n->next)
+	{
+		if (!strcmp(n->data, name))
+			found = 1;
+
+		free(n->data);
+	}
+
+	mowgli_queue_destroy(q);
+
+	return found;
+}
+
+static void
+test_rw(mcs_handle_t *a, mcs_handle_t *b)
+{
+	const char *sections[] = { "prefetch", "prefetch", "prefetch" };
+	const char *keys[] = { "one", "two", "missing" };
+	int i;
+
+	check(mcs_set_string(a, "general", "name", "first") == MCS_OK);
+	check(mcs_commit(a) == MCS_OK);
+	check(reads_as(a, "general", "name", "first"));
+	check(reads_as(b, "general", "name", "first"));
+
+	/* b has the value cached now; the change must invalidate it */
+	check(mcs_set_string(a, "general", "name", "second") == MCS_OK);
+	check(mcs_commit(a) == MCS_OK);
+	check(eventually_reads_as(b, "general", "name", "second"));
+
+	check(mcs_unset_key(a, "general", "name") == MCS_OK);
+	check(mcs_commit(a) == MCS_OK);
+	check(eventually_reads_as(b, "general", "name", NULL));
+	check(reads_as(a, "general", "name", NULL));
+
+	/* pipelined writes, read back before their replies are collected */
+	for (i = 0; i < 2000; i++)
+		check(mcs_set_int(a, "bulk", "counter", i) == MCS_OK);
+	check(mcs_get_int(a, "bulk", "counter", &i) == MCS_OK && i == 1999);
+
+	check(mcs_set_string(a, "prefetch", "one", "1") == MCS_OK);
+	check(mcs_set_string(a, "prefetch", "two", "2") == MCS_OK);
+	check(mcs_commit(a) == MCS_OK);
+	check(mcs_daemon_prefetch(b, sections, keys, 3) == MCS_OK);
+	check(reads_as(b, "prefetch", "one", "1"));
+	check(reads_as(b, "prefetch", "two", "2"));
+	check(reads_as(b, "prefetch", "missing", NULL));
+
+	check(queue_contains(mcs_get_sections(b), "prefetch"));
+	check(queue_contains(mcs_get_keys(b, "prefetch"), "two"));
+}
+
+static void
+test_ro(mcs_handle_t *a, mcs_handle_t *b)
+{
+	int i;
+
+	/* the write is pipelined, so it is only rejected later */
+	mcs_set_string(a, "general", "name", "rejected");
+	check(reads_as(a, "general", "name", NULL));
+	check(reads_as(b, "general", "name", NULL));
+
+	for (i = 0; i < 100; i++)
+		mcs_set_int(a, "bulk", "counter", i);
+	check(mcs_get_int(a, "bulk", "counter", &i) == MCS_FAIL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	mcs_handle_t *a, *b;
+
+	if (argc != 2 || (strcmp(argv[1], "rw") && strcmp(argv[1], "ro")))
+	{
+		fprintf(stderr, "usage: %s rw|ro\n", argv[0]);
+		return 2;
+	}
+
+	mcs_init();
+
+	a = mcs_new_with_backend("daemon", DOMAIN);
+	b = mcs_new_with_backend("daemon", DOMAIN);
+
+	if (!strcmp(argv[1], "rw"))
+		test_rw(a, b);
+	else
+		test_ro(a, b);
+
+	mcs_destroy(a);
+	mcs_destroy(b);
+	mcs_fini();
+
+	printf("daemon %s: %s\n", argv[1], failures ? "FAILED" : "ok");
+
+	return failures != 0;
+}
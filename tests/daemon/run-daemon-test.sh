@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Runs mcs-daemon-test against a private mcsd, first serving the keyfile
+# backend and then the read-only cdb backend. Nothing outside a fresh
+# temporary directory is touched. Run from the top of the build tree,
+# with the library on LD_LIBRARY_PATH; "make check" does both.
+
+mcsd=src/tools/mcsd/mcsd
+test=tests/daemon/mcs-daemon-test
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/mcsd-test.XXXXXX") || exit 1
+pid=
+
+cleanup() {
+	[ -n "$pid" ] && kill $pid 2>/dev/null && wait $pid 2>/dev/null
+	rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+XDG_CONFIG_HOME="$dir/config"
+MCSD_SOCKET="$dir/mcsd.sock"
+export XDG_CONFIG_HOME MCSD_SOCKET
+mkdir -p "$XDG_CONFIG_HOME"
+
+# run <backend> <mode>
+run() {
+	$mcsd -b "$1" &
+	pid=$!
+
+	i=0
+	while [ ! -S "$MCSD_SOCKET" ]; do
+		i=$((i + 1))
+		if [ $i -gt 100 ] || ! kill -0 $pid 2>/dev/null; then
+			echo "mcsd -b $1 did not start" >&2
+			return 1
+		fi
+		sleep 0.05
+	done
+
+	$test "$2"
+	status=$?
+
+	kill $pid
+	wait $pid
+	pid=
+	rm -f "$MCSD_SOCKET"
+
+	return $status
+}
+
+run default rw && run cdb ro
@@ -0,0 +1,286 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Exercises the keyfile backend with several handles on one domain, as
+ * separate programs would have them: writers merging their changes into
+ * the file, mcs_refresh() picking up another writer's changes, mcs_diff()
+ * and drop-in fragments from config.d. run-tests.sh runs it in a fresh
+ * configuration root.
+ */
+
+#include "libmcs/mcs.h"
+
+#define DOMAIN		"keyfile-test"
+#define LAYERED		"keyfile-layers"
+
+static int failures;
+
+#define check(cond)							\
+	do {								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			failures++;					\
+		}							\
+	} while (0)
+
+/* returns 1 if section/key currently reads as value, NULL for unset */
+static int
+reads_as(mcs_handle_t *h, const char *section, const char *key, const char *value)
+{
+	char *got;
+	int ret;
+
+	if (mcs_get_string(h, section, key, &got) != MCS_OK)
+		return value == NULL;
+
+	ret = value != NULL && !strcmp(got, value);
+	free(got);
+
+	return ret;
+}
+
+/* returns 1 if the file a value comes from ends in suffix */
+static int
+comes_from(mcs_handle_t *h, const char *section, const char *key, const char *suffix)
+{
+	char *origin;
+	size_t len;
+	int ret;
+
+	if (mcs_get_origin(h, section, key, &origin) != MCS_OK)
+		return 0;
+
+	len = strlen(origin);
+	ret = len >= strlen(suffix) && !strcmp(origin + len - strlen(suffix), suffix);
+	free(origin);
+
+	return ret;
+}
+
+static mcs_handle_t *
+open_domain(const char *domain)
+{
+	return mcs_new_with_backend("default", (char *) domain);
+}
+
+static void
+write_file(const char *domain, const char *name, const char *text)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	mcs_domain_path(path, sizeof path, domain, name);
+
+	f = fopen(path, "w");
+	check(f != NULL && fputs(text, f) >= 0);
+	if (f != NULL)
+		fclose(f);
+}
+
+static void
+test_merge(void)
+{
+	mcs_handle_t *a = open_domain(DOMAIN), *b, *c;
+
+	check(mcs_set_string(a, "shared", "base", "0") == MCS_OK);
+	check(mcs_set_string(a, "shared", "gone", "0") == MCS_OK);
+	check(mcs_commit(a) == MCS_OK);
+
+	b = open_domain(DOMAIN);
+
+	/* each writer's changes land on top of the other's */
+	check(mcs_set_string(a, "shared", "from_a", "a") == MCS_OK);
+	check(mcs_set_string(a, "shared", "both", "a") == MCS_OK);
+	check(mcs_commit(a) == MCS_OK);
+
+	check(mcs_set_string(b, "shared", "from_b", "b") == MCS_OK);
+	check(mcs_set_string(b, "shared", "both", "b") == MCS_OK);
+	check(mcs_unset_key(b, "shared", "gone") == MCS_OK);
+	check(mcs_commit(b) == MCS_OK);
+
+	c = open_domain(DOMAIN);
+	check(reads_as(c, "shared", "base", "0"));
+	check(reads_as(c, "shared", "from_a", "a"));
+	check(reads_as(c, "shared", "from_b", "b"));
+	check(reads_as(c, "shared", "both", "b"));
+	check(reads_as(c, "shared", "gone", NULL));
+
+	mcs_destroy(a);
+	mcs_destroy(b);
+	mcs_destroy(c);
+}
+
+typedef struct {
+	int added, removed, changed;
+	int sorted;
+	char last[64];
+} diff_count_t;
+
+static int
+diff_cb(mcs_diff_t change, const char *section, const char *key,
+	const char *old_value, const char *new_value, void *privdata)
+{
+	diff_count_t *d = privdata;
+	char name[64];
+
+	if (key == NULL)
+		return 0;
+
+	snprintf(name, sizeof name, "%s/%s", section, key);
+	if (strcmp(d->last, name) >= 0)
+		d->sorted = 0;
+	mcs_strlcpy(d->last, name, sizeof d->last);
+
+	switch (change)
+	{
+	case MCS_DIFF_ADDED:
+		d->added += old_value == NULL && new_value != NULL;
+		break;
+	case MCS_DIFF_REMOVED:
+		d->removed += old_value != NULL && new_value == NULL;
+		break;
+	case MCS_DIFF_CHANGED:
+		d->changed += old_value != NULL && new_value != NULL;
+		break;
+	}
+
+	return 0;
+}
+
+static void
+test_refresh_and_diff(void)
+{
+	mcs_handle_t *h = open_domain(DOMAIN), *w, *snap;
+	diff_count_t d = { 0, 0, 0, 1, "" };
+	unsigned long gen;
+
+	snap = mcs_snapshot(h);
+
+	/* refreshing an unchanged file changes nothing */
+	gen = mcs_handle_generation(h);
+	check(mcs_refresh(h) == MCS_OK);
+	check(mcs_handle_generation(h) == gen);
+
+	check(mcs_set_string(h, "local", "key", "mine") == MCS_OK);
+
+	w = open_domain(DOMAIN);
+	check(mcs_set_string(w, "shared", "base", "1") == MCS_OK);
+	check(mcs_set_string(w, "remote", "key", "theirs") == MCS_OK);
+	check(mcs_unset_key(w, "shared", "from_a") == MCS_OK);
+	check(mcs_commit(w) == MCS_OK);
+	mcs_destroy(w);
+
+	gen = mcs_handle_generation(h);
+	check(mcs_refresh(h) == MCS_OK);
+	check(mcs_handle_generation(h) != gen);
+	check(reads_as(h, "shared", "base", "1"));
+	check(reads_as(h, "remote", "key", "theirs"));
+	check(reads_as(h, "shared", "from_a", NULL));
+	check(reads_as(h, "local", "key", "mine"));
+
+	/* the snapshot still holds the handle as it was */
+	check(reads_as(snap, "shared", "base", "0"));
+	check(mcs_diff(snap, h, diff_cb, &d) == MCS_OK);
+	check(d.added == 2 && d.removed == 1 && d.changed == 1 && d.sorted);
+
+	mcs_destroy(snap);
+	mcs_destroy(h);
+}
+
+static void
+test_config_d(void)
+{
+	char path[PATH_MAX];
+	mcs_handle_t *h;
+
+	mcs_domain_path(path, sizeof path, LAYERED, NULL);
+	mkdir(path, 0755);
+	mcs_domain_path(path, sizeof path, LAYERED, "config.d");
+	mkdir(path, 0755);
+
+	write_file(LAYERED, "config.d/10-defaults.conf",
+		   "[s]\nfragment=10\nboth=10\nlayered=10\n");
+	write_file(LAYERED, "config.d/50-site.conf", "[s]\nlayered=50\n");
+	write_file(LAYERED, "config.d/README", "[s]\nfragment=ignored\n");
+	write_file(LAYERED, "config", "[s]\nboth=config\nconfig=config\n");
+
+	h = open_domain(LAYERED);
+	check(reads_as(h, "s", "fragment", "10"));
+	check(reads_as(h, "s", "layered", "50"));
+	check(reads_as(h, "s", "both", "config"));
+	check(comes_from(h, "s", "fragment", "10-defaults.conf"));
+	check(comes_from(h, "s", "layered", "50-site.conf"));
+	check(comes_from(h, "s", "both", "/config"));
+
+	/* a value only a fragment sets cannot be unset, only overridden */
+	check(mcs_unset_key(h, "s", "fragment") == MCS_FAIL);
+	check(reads_as(h, "s", "fragment", "10"));
+	check(mcs_set_string(h, "s", "fragment", "mine") == MCS_OK);
+	check(comes_from(h, "s", "fragment", "/config"));
+
+	/* unsetting an override drops it from the config file */
+	check(mcs_unset_key(h, "s", "both") == MCS_OK);
+	check(mcs_unset_key(h, "s", "config") == MCS_OK);
+	check(mcs_commit(h) == MCS_OK);
+	mcs_destroy(h);
+
+	h = open_domain(LAYERED);
+	check(reads_as(h, "s", "fragment", "mine"));
+	check(reads_as(h, "s", "both", "10"));
+	check(reads_as(h, "s", "config", NULL));
+	check(comes_from(h, "s", "both", "10-defaults.conf"));
+
+	/* refresh reads changed fragments again */
+	write_file(LAYERED, "config.d/50-site.conf", "[s]\nlayered=changed\n");
+	check(mcs_refresh(h) == MCS_OK);
+	check(reads_as(h, "s", "layered", "changed"));
+	mcs_destroy(h);
+}
+
+int
+main(int argc, char *argv[])
+{
+	mcs_init();
+
+	test_merge();
+	test_refresh_and_diff();
+	test_config_d();
+
+	mcs_fini();
+
+	printf("keyfile: %s\n", failures ? "FAILED" : "ok");
+
+	return failures != 0;
+}
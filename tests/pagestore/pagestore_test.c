@@ -0,0 +1,301 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Exercises the pagestore B+tree through the public API: inserts,
+ * overwrites and deletes checked against a model after a reopen, a
+ * commit cut short before its meta page reached the disk, reuse of
+ * released pages, and the record size limit. run-tests.sh runs it in a
+ * fresh configuration root.
+ */
+
+#include <sys/stat.h>
+
+#include "libmcs/mcs.h"
+
+#define DOMAIN		"pagestore-test"
+#define NKEYS		20000
+#define NSECTIONS	37
+#define PAGE_SIZE	4096
+
+static int failures;
+
+#define check(cond)							\
+	do {								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			failures++;					\
+		}							\
+	} while (0)
+
+/* the value key i is expected to have, 0 if it is unset */
+static int model[NKEYS];
+
+static void
+key_name(int i, char *section, char *key)
+{
+	sprintf(section, "section%d", i % NSECTIONS);
+	sprintf(key, "key%d", i);
+}
+
+static mcs_handle_t *
+open_domain(void)
+{
+	return mcs_new_with_backend("pagestore", DOMAIN);
+}
+
+static void
+set_key(mcs_handle_t *h, int i, int value)
+{
+	char section[32], key[32];
+
+	key_name(i, section, key);
+
+	if (value == 0)
+		check(mcs_unset_key(h, section, key) == MCS_OK);
+	else
+		check(mcs_set_int(h, section, key, value) == MCS_OK);
+
+	model[i] = value;
+}
+
+static int
+count_cb(const char *section, const char *key, const char *value, void *privdata)
+{
+	(*(int *) privdata)++;
+
+	return 0;
+}
+
+/* returns the number of keys which do not read as the model says */
+static int
+verify(mcs_handle_t *h)
+{
+	char section[32], key[32];
+	int i, value, live = 0, seen = 0, bad = 0;
+
+	for (i = 0; i < NKEYS; i++)
+	{
+		key_name(i, section, key);
+
+		if (model[i] == 0)
+			bad += mcs_get_int(h, section, key, &value) == MCS_OK;
+		else
+		{
+			bad += mcs_get_int(h, section, key, &value) != MCS_OK || value != model[i];
+			live++;
+		}
+	}
+
+	mcs_iterate(h, NULL, count_cb, &seen);
+
+	return bad + (seen != live);
+}
+
+static off_t
+file_size(void)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	mcs_domain_path(path, sizeof path, DOMAIN, "config.pages");
+
+	return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void
+test_tree(void)
+{
+	mcs_handle_t *h = open_domain();
+	mowgli_queue_t *keys, *n;
+	char prev[32] = "";
+	int i, sorted = 1, count = 0;
+
+	for (i = 0; i < NKEYS; i++)
+		set_key(h, i, i + 1);
+	check(verify(h) == 0);
+	check(mcs_commit(h) == MCS_OK);
+
+	/* overwrite every other key, and delete every third */
+	for (i = 0; i < NKEYS; i += 2)
+		set_key(h, i, -i - 1);
+	for (i = 0; i < NKEYS; i += 3)
+		set_key(h, i, 0);
+	check(verify(h) == 0);
+	check(mcs_commit(h) == MCS_OK);
+	mcs_destroy(h);
+
+	h = open_domain();
+	check(verify(h) == 0);
+
+	/* a section is a contiguous, sorted range of the tree */
+	keys = mcs_get_keys(h, "section5");
+	for (n = keys; n != NULL; n = n->next)
+	{
+		if (strcmp(prev, n->data) >= 0)
+			sorted = 0;
+
+		mcs_strlcpy(prev, n->data, sizeof prev);
+		free(n->data);
+		count++;
+	}
+	mowgli_queue_destroy(keys);
+
+	check(sorted);
+	for (i = 5; i < NKEYS; i += NSECTIONS)
+		count -= model[i] != 0;
+	check(count == 0);
+
+	/* deleting everything leaves an empty tree which still works */
+	for (i = 0; i < NKEYS; i++)
+		if (model[i] != 0)
+			set_key(h, i, 0);
+	check(verify(h) == 0);
+	check(mcs_commit(h) == MCS_OK);
+	set_key(h, 7, 7);
+	check(mcs_commit(h) == MCS_OK);
+	mcs_destroy(h);
+
+	h = open_domain();
+	check(verify(h) == 0);
+	mcs_destroy(h);
+}
+
+/*
+ * Commits a change, then puts the meta pages back as they were before
+ * it, as if the machine had gone down after the tree pages were written
+ * but before the meta page was. The change must be gone, and the store
+ * must go on working on top of the pages that commit left behind.
+ */
+static void
+test_interrupted_commit(void)
+{
+	char path[PATH_MAX], meta[2 * PAGE_SIZE];
+	mcs_handle_t *h = open_domain();
+	FILE *f;
+	int i;
+
+	for (i = 0; i < 1000; i++)
+		set_key(h, i, i + 1000);
+	check(mcs_commit(h) == MCS_OK);
+
+	mcs_domain_path(path, sizeof path, DOMAIN, "config.pages");
+	f = fopen(path, "rb");
+	check(f != NULL && fread(meta, PAGE_SIZE, 2, f) == 2);
+	fclose(f);
+
+	for (i = 0; i < 1000; i++)
+		mcs_set_int(h, "lost", "key", i);
+	for (i = 0; i < 500; i++)
+		mcs_unset_key(h, "section1", "key1");
+	check(mcs_commit(h) == MCS_OK);
+	mcs_destroy(h);
+
+	f = fopen(path, "r+b");
+	check(f != NULL && fwrite(meta, PAGE_SIZE, 2, f) == 2);
+	fclose(f);
+
+	h = open_domain();
+	check(verify(h) == 0);
+	check(mcs_get_int(h, "lost", "key", &i) == MCS_FAIL);
+
+	for (i = 1000; i < 2000; i++)
+		set_key(h, i, i);
+	check(mcs_commit(h) == MCS_OK);
+	mcs_destroy(h);
+
+	h = open_domain();
+	check(verify(h) == 0);
+	mcs_destroy(h);
+}
+
+/* rewriting the same keys over and over must not grow the file */
+static void
+test_free_list(void)
+{
+	mcs_handle_t *h = open_domain();
+	off_t settled = 0;
+	int round, i;
+
+	for (round = 0; round < 40; round++)
+	{
+		for (i = 0; i < 2000; i++)
+			set_key(h, i, round * NKEYS + i + 1);
+		check(mcs_commit(h) == MCS_OK);
+
+		if (round == 10)
+			settled = file_size();
+	}
+
+	check(settled > 0 && file_size() == settled);
+	check(verify(h) == 0);
+	mcs_destroy(h);
+}
+
+static void
+test_record_limit(void)
+{
+	mcs_handle_t *h = open_domain();
+	char value[2048];
+
+	/* 1019 bytes of section, key and value in all */
+	memset(value, 'x', sizeof value);
+	value[1019 - 6] = '\0';
+	check(mcs_set_string(h, "big", "key", value) == MCS_OK);
+
+	value[1019 - 6] = 'x';
+	value[1020 - 6] = '\0';
+	check(mcs_set_string(h, "big", "key", value) == MCS_FAIL);
+
+	check(mcs_unset_key(h, "big", "key") == MCS_OK);
+	check(mcs_commit(h) == MCS_OK);
+	mcs_destroy(h);
+}
+
+int
+main(int argc, char *argv[])
+{
+	mcs_init();
+
+	test_tree();
+	test_interrupted_commit();
+	test_free_list();
+	test_record_limit();
+
+	mcs_fini();
+
+	printf("pagestore: %s\n", failures ? "FAILED" : "ok");
+
+	return failures != 0;
+}
@@ -0,0 +1,351 @@
+/*
+ * This is mcs; a modular configuration system.
+ *
+ * Copyright (c) 2011 William Pitcock <nenolod -at- atheme.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that the keyfile backend, with its streaming parser, reads
+ * files exactly as the fgets() based loop it replaced did. That loop is
+ * kept here as the reference. Generated files mix well-formed lines with
+ * the odd ones real files have: CRs, NUL bytes, lines longer than the
+ * old 4096 byte buffer, missing brackets, stray '=' and duplicates. The
+ * large file is parsed on several threads. run-tests.sh runs it in a
+ * fresh configuration root.
+ */
+
+#include "libmcs/mcs.h"
+
+#define DOMAIN		"parser-test"
+
+static int failures;
+
+#define check(cond)							\
+	do {								\
+		if (!(cond))						\
+		{							\
+			fprintf(stderr, "%s:%d: check failed: %s\n",	\
+				__FILE__, __LINE__, #cond);		\
+			failures++;					\
+		}							\
+	} while (0)
+
+static void nocanon(char *str) {}
+
+static unsigned long seed = 1;
+
+static unsigned int
+rnd(unsigned int n)
+{
+	seed = seed * 1103515245 + 12345;
+
+	return (unsigned int) (seed >> 16) % n;
+}
+
+/* ***************************************************************** */
+
+/*
+ * The reference: keyfile_open() as it was before the streaming parser,
+ * building a patricia of sections, each a patricia of values.
+ */
+static mowgli_patricia_t *
+reference_parse(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	mowgli_patricia_t *sections = mowgli_patricia_create(nocanon), *sec = NULL;
+	char buffer[4096], *tmp;
+
+	if (f == NULL)
+		return sections;
+
+	while (fgets(buffer, 4096, f))
+	{
+		if (buffer[0] == '[')
+		{
+			if ((tmp = strchr(buffer, ']')))
+			{
+				*tmp = '\0';
+
+				if ((sec = mowgli_patricia_retrieve(sections, &buffer[1])) == NULL)
+				{
+					sec = mowgli_patricia_create(nocanon);
+					mowgli_patricia_add(sections, &buffer[1], sec);
+				}
+			}
+		}
+		else if (buffer[0] != '#' && sec != NULL)
+		{
+			if ((tmp = strchr(buffer, '=')))
+			{
+				char *tmp = strtok(buffer, "=");
+				char *tmp2 = strtok(NULL, "\n");
+
+				if (tmp2 != NULL && strlen(tmp2) > 0)
+				{
+					if (mowgli_patricia_retrieve(sec, tmp) == NULL)
+						mowgli_patricia_add(sec, tmp, strdup(tmp2));
+				}
+			}
+		}
+	}
+
+	fclose(f);
+
+	return sections;
+}
+
+static void
+reference_value_free_cb(const char *key, void *data, void *privdata)
+{
+	free(data);
+}
+
+static void
+reference_section_free_cb(const char *key, void *data, void *privdata)
+{
+	mowgli_patricia_destroy(data, reference_value_free_cb, NULL);
+}
+
+/* ***************************************************************** */
+
+typedef struct {
+	mowgli_patricia_t *reference;
+	unsigned long values, mismatches;
+} compare_t;
+
+static int
+compare_cb(const char *section, const char *key, const char *value, void *privdata)
+{
+	compare_t *c = privdata;
+	mowgli_patricia_t *sec = mowgli_patricia_retrieve(c->reference, section);
+	const char *want = sec != NULL ? mowgli_patricia_retrieve(sec, key) : NULL;
+
+	if (want == NULL || strcmp(want, value))
+	{
+		if (c->mismatches++ < 5)
+			fprintf(stderr, "[%s] %s: read `%s', expected `%s'\n", section, key,
+				value, want != NULL ? want : "(unset)");
+	}
+
+	c->values++;
+
+	return 0;
+}
+
+static int
+count_values_cb(const char *key, void *data, void *privdata)
+{
+	*(unsigned long *) privdata += mowgli_patricia_size(data);
+
+	return 0;
+}
+
+/* the sections each side has, in the same order */
+static int
+same_sections(mcs_handle_t *h, mowgli_patricia_t *reference)
+{
+	mowgli_queue_t *sections = mcs_get_sections(h), *n;
+	int count = 0, ok = 1;
+
+	for (n = sections; n != NULL; n = n->next)
+	{
+		if (mowgli_patricia_retrieve(reference, n->data) == NULL)
+			ok = 0;
+
+		free(n->data);
+		count++;
+	}
+
+	mowgli_queue_destroy(sections);
+
+	return ok && count == (int) mowgli_patricia_size(reference);
+}
+
+/* ***************************************************************** */
+
+static void
+put_long(FILE *f, size_t len, int with_equals)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		fputc(with_equals && i == len - 10 ? '=' : 'a' + rnd(26), f);
+}
+
+static void
+put_line(FILE *f, int nsections)
+{
+	switch (rnd(24))
+	{
+	case 0:
+		fprintf(f, "[section%u]\n", rnd(nsections));
+		break;
+	case 1:
+		fprintf(f, "[section%u\n", rnd(nsections));
+		break;
+	case 2:
+		fprintf(f, "[section%u]trailing=text\n", rnd(nsections));
+		break;
+	case 3:
+		fputs(rnd(2) ? "[]\n" : " [indented]\n", f);
+		break;
+	case 4:
+		fputs("# comment=with equals\n", f);
+		break;
+	case 5:
+		fputs(rnd(2) ? "\n" : "\r\n", f);
+		break;
+	case 6:
+		fprintf(f, "=leading%u\n", rnd(50));
+		break;
+	case 7:
+		fprintf(f, "==doubled%u=x\n", rnd(50));
+		break;
+	case 8:
+		fprintf(f, "empty%u=\n", rnd(50));
+		break;
+	case 9:
+		fprintf(f, "twice%u==value\n", rnd(50));
+		break;
+	case 10:
+		fprintf(f, "crlf%u=value\r\n", rnd(50));
+		break;
+	case 11:
+		fprintf(f, "novalue%u\n", rnd(50));
+		break;
+	case 12:
+		fprintf(f, " spaced%u = value \n", rnd(50));
+		break;
+	case 13:
+		fprintf(f, "nul%u=before", rnd(50));
+		fputc('\0', f);
+		fputs("after=hidden\n", f);
+		break;
+	case 14:
+		fputs("long=", f);
+		put_long(f, 3000 + rnd(6000), 0);
+		fputc('\n', f);
+		break;
+	case 15:
+		/* the '=' lands in the part past the old 4095 byte buffer */
+		put_long(f, 4090 + rnd(200), 1);
+		fputc('\n', f);
+		break;
+	case 16:
+		fprintf(f, "tab%u\t=\tvalue\n", rnd(50));
+		break;
+	default:
+		fprintf(f, "key%u=value%u\n", rnd(200), rnd(1000));
+		break;
+	}
+}
+
+static void
+generate(const char *path, size_t size, int nsections)
+{
+	FILE *f = fopen(path, "wb");
+
+	check(f != NULL);
+	if (f == NULL)
+		return;
+
+	/* values before the first section are dropped */
+	fputs("orphan=value\n", f);
+
+	while ((size_t) ftell(f) < size)
+		put_line(f, nsections);
+
+	/* and the file need not end in a newline */
+	fputs("[last]\nunterminated=value", f);
+
+	fclose(f);
+}
+
+static void
+compare(const char *what, size_t size, int nsections)
+{
+	char path[PATH_MAX];
+	mowgli_patricia_t *reference;
+	mcs_handle_t *h;
+	compare_t c;
+	unsigned long expected = 0;
+
+	mcs_domain_path(path, sizeof path, DOMAIN, "config");
+	generate(path, size, nsections);
+
+	reference = reference_parse(path);
+	mowgli_patricia_foreach(reference, count_values_cb, &expected);
+
+	h = mcs_new_with_backend("default", DOMAIN);
+
+	memset(&c, 0, sizeof c);
+	c.reference = reference;
+	mcs_iterate(h, NULL, compare_cb, &c);
+
+	if (c.mismatches != 0 || c.values != expected || !same_sections(h, reference))
+	{
+		fprintf(stderr, "%s: %lu of %lu values differ, %lu read, sections %s\n", what,
+			c.mismatches, expected, c.values,
+			same_sections(h, reference) ? "match" : "differ");
+		failures++;
+	}
+
+	/* the handle was only read, so it must not write anything back */
+	mowgli_object_unref(h);
+	mowgli_patricia_destroy(reference, reference_section_free_cb, NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[PATH_MAX];
+	int i;
+
+	if (argc > 1)
+		seed = strtoul(argv[1], NULL, 10);
+
+	mcs_init();
+
+	mcs_domain_path(path, sizeof path, DOMAIN, NULL);
+	mkdir(path, 0755);
+
+	for (i = 0; i < 20; i++)
+		compare("small file", 200 + rnd(20000), 1 + rnd(8));
+
+	/* large enough to be split between threads */
+	setenv("MCS_KEYFILE_THREADS", "4", 1);
+	for (i = 0; i < 3; i++)
+		compare("large file", 3 * 1024 * 1024, 50 + rnd(500));
+
+	mcs_fini();
+
+	printf("parser: %s\n", failures ? "FAILED" : "ok");
+
+	return failures != 0;
+}
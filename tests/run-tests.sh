@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# Runs each test program in a configuration root of its own, then the
+# mcsd test. A test's log output is only shown when it fails, since the
+# library logs every malformed line the parser test feeds it. Run from
+# the top of the build tree, with the library on LD_LIBRARY_PATH; "make
+# check" does both.
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/mcs-test.XXXXXX") || exit 1
+trap 'rm -rf "$dir"' EXIT INT TERM
+
+status=0
+
+for test in pagestore cdb keyfile parser; do
+	XDG_CONFIG_HOME="$dir/$test"
+	export XDG_CONFIG_HOME
+	mkdir -p "$XDG_CONFIG_HOME"
+
+	if ! tests/$test/mcs-$test-test 2>"$dir/$test.log"; then
+		cat "$dir/$test.log" >&2
+		status=1
+	fi
+done
+
+sh tests/daemon/run-daemon-test.sh || status=1
+
+exit $status